@@ -0,0 +1,149 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvclock.c
+
+   Title : Pivotal NST Clock
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Time stamps for event records, log entries and file headers.
+
+            Event records are stamped with the capture time of the packet
+            (pcap_pkthdr.ts) to the microsecond, log entries and headers
+            with the current time to the second. Times are written in the
+            asctime() layout, event times with the microseconds after the
+            seconds:
+
+               Sun Jul  6 21:49:08.123456 2014
+
+            localtime() takes the time zone lock and checks the TZ setting
+            on every call, so each thread keeps the date string of the last
+            second it converted and only converts again when the second
+            changes. Packets arrive in time order, so nearly every event
+            time is a copy of the cached string plus six digits.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "pvcommon.h"
+
+struct pv_clock_cache
+{
+   time_t second;
+   int valid;
+   int date_length;
+   int year_length;
+   char date[24];  /* "Sun Jul  6 21:49:08" */
+   char year[16];  /* " 2014" */
+};
+
+static __thread struct pv_clock_cache clock_cache;
+
+static const char day_names[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char month_names[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/*
+   Function: get_clock_cache
+   Purpose : Returns the thread's date strings for a second, converting
+             the time only if the second is not the cached one.
+   Input   : Time in seconds.
+   Return  : The thread's clock cache.
+*/
+static struct pv_clock_cache *get_clock_cache(time_t second)
+{
+   struct pv_clock_cache *cache = &clock_cache;
+   struct tm loctime;
+
+   if (cache->valid && (cache->second == second))
+      return(cache);
+
+   localtime_r(&second, &loctime);
+
+   cache->date_length = sprintf(cache->date, "%.3s %.3s%3d %.2d:%.2d:%.2d",
+            day_names[loctime.tm_wday], month_names[loctime.tm_mon], loctime.tm_mday,
+            loctime.tm_hour, loctime.tm_min, loctime.tm_sec);
+   cache->year_length = sprintf(cache->year, " %d", loctime.tm_year + 1900);
+   cache->second = second;
+   cache->valid = 1;
+
+   return(cache);
+}
+
+/*
+   Function: format_event_time
+   Purpose : Writes an event time with microseconds.
+   Input   : Packet timestamp, NULL for the current time, and an output
+             string of at least PV_TIME_STR characters.
+   Return  : Length of the time string.
+*/
+int format_event_time(const struct timeval *ts, char *time_str)
+{
+   struct pv_clock_cache *cache;
+   struct timeval now;
+   long usec;
+   int i, len;
+
+   if (ts == NULL)
+   {
+      gettimeofday(&now, NULL);
+      ts = &now;
+   }
+
+   cache = get_clock_cache(ts->tv_sec);
+
+   memcpy(time_str, cache->date, cache->date_length);
+   len = cache->date_length;
+
+   time_str[len] = '.';
+   usec = ts->tv_usec;
+   for (i = 6; i > 0; i--)
+   {
+      time_str[len + i] = '0' + (usec % 10);
+      usec /= 10;
+   }
+   len += 7;
+
+   memcpy(time_str + len, cache->year, cache->year_length + 1);
+   len += cache->year_length;
+
+   return(len);
+}
+
+/*
+   Function: format_log_time
+   Purpose : Writes the current time to the second, as asctime() without
+             the newline.
+   Input   : Output string of at least PV_TIME_STR characters.
+   Return  : Length of the time string.
+*/
+int format_log_time(char *time_str)
+{
+   struct pv_clock_cache *cache = get_clock_cache(time(NULL));
+
+   memcpy(time_str, cache->date, cache->date_length);
+   memcpy(time_str + cache->date_length, cache->year, cache->year_length + 1);
+
+   return(cache->date_length + cache->year_length);
+}
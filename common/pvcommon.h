@@ -38,6 +38,10 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 
 #include "uthash.h"
 
@@ -45,11 +49,42 @@
 
 #define SERVER_PORT_STRING "59888"
 #define PV_SERVER_PORT 59888
+#define PV_GUI_PORT 59889    /* statistics queries of the GUI, see pvgui.c */
 #define PV_PATH_MAX_LENGTH 4096 /* Redefine max path length since limits.h does weird things! FLTK defines this = 2048 */
 #define PV_MAX_INPUT_STR 4096
 #define PV_IP_ADDR_MAX 128
 #define MAX_EVENT_DESC_SIZE 256
 #define MAX_EVENT_ID_SIZE 8
+#define PV_MAX_CAPTURE_WORKERS 32
+#define PV_FLOW_IPV4 4
+#define PV_FLOW_IPV6 6
+#define PV_FLOW_KEY_STR 128 /* longest rendered flow key */
+#define PV_TIME_STR 40      /* longest rendered event or log time */
+#define PV_EVENT_DATA_STR 512 /* event data of one packet or flow event */
+#define PV_EVENT_OVERHEAD 512 /* Fineline record size less the event data */
+#define PV_CACHE_LINE_SIZE 64
+#define PV_FLOW_TABLE_SIZE 65536 /* default number of flows per flow table */
+#define PV_FLOW_BATCH_SIZE 16    /* flow updates probed together */
+#define PV_FLOW_EMPTY   0
+#define PV_FLOW_IN_USE  1
+#define PV_FLOW_DELETED 2
+#define PV_FLOW_REHASH_DELETED 16 /* a table is rehashed when 1/16 of its buckets are deleted markers, see insert_flow() */
+#define PV_FLOW_IDLE_TIMEOUT   60   /* seconds without a packet before a flow expires */
+#define PV_FLOW_ACTIVE_TIMEOUT 1800 /* seconds after the first packet before a flow expires */
+#define PV_FLOW_CAP_ACTIVE 31536000  /* seconds, the packet cap count of a flow only ends on FIN, RST or idle */
+#define PV_FLOW_EXPIRED_IDLE   1
+#define PV_FLOW_EXPIRED_ACTIVE 2
+#define PV_TIMER_LEVELS 3   /* 256 slots of 1, 256 and 65536 seconds */
+#define PV_TIMER_BITS   8
+#define PV_TIMER_SLOTS  (1 << PV_TIMER_BITS)
+#define PV_TIMER_NONE   0xffffffffU
+#define PV_TIMER_MAX_JUMP     86400 /* seconds ahead of the wheel a packet time is believed at once */
+#define PV_TIMER_JUMP_CONFIRM 16    /* packets in a row that confirm a longer jump, e.g. a clock step */
+#define PV_TOP_BYTES    0   /* orders of the top index, see pvtopindex.c */
+#define PV_TOP_PACKETS  1
+#define PV_TOP_ORDERS   2
+#define PV_TOP_INTERVAL  60   /* seconds in an interval of a top window, see pvtopwindow.c */
+#define PV_TOP_INTERVALS 60   /* closed intervals a top window keeps */
 
 #define PV_FILE_OUT       0x01
 #define PV_SERVER_OUT     0x02
@@ -57,6 +92,55 @@
 #define PV_CAPTURE_INPUT  0x08
 #define PV_UNIFIED2_INPUT 0x10
 #define PV_GUI_OUT        0x20
+#define PV_RING_CAPTURE   0x40
+#define PV_PCAP_FILE_INPUT 0x80
+#define PV_QUIET_MODE     0x100
+#define PV_FLOW_SUMMARY   0x200
+#define PV_TEXT_WIRE      0x400
+#define PV_UDP_WIRE       0x800
+#define PV_IP_LOOKUPS     0x1000
+#define PV_CHECK_LOOKUPS  0x2000
+
+#define PV_EVENT_HEAD      0 /* Fineline record fragments, see get_event_fragment() */
+#define PV_EVENT_TAIL      1
+#define PV_EVENT_TAIL_HEAD 2 /* tail of one record and head of the next */
+
+#define PV_FRAME_VERSION     1
+#define PV_FRAME_HEADER_SIZE 8
+#define PV_FRAME_MAX_PAYLOAD (1 << 20) /* longer messages are split into several frames */
+#define PV_FRAME_RING_SIZE   (1 << 16) /* first size of the server receive ring per sensor connection */
+#define PV_FRAME_EVENT   1 /* Fineline event records */
+#define PV_FRAME_CONTROL 2 /* <control> messages, e.g. disconnect */
+#define PV_FRAME_STATS   3 /* <eventstatistics> blocks */
+#define PV_FRAME_ALERT   4 /* intrusion alerts */
+#define PV_FRAME_BINARY  0x0001 /* event frame of binary records, see pvrecord.c */
+#define PV_FRAME_ZLIB    0x0002 /* payload is a zlib stream, see pvcompress.c */
+#define PV_COMPRESS_MIN  256    /* shorter payloads are not compressed */
+#define PV_CONTROL_DISCONNECT "<control>disconnect</control>"
+#define PV_CONTROL_HELLO  "<control>hello"  /* sensor ID and the event encoding wanted */
+#define PV_CONTROL_ACCEPT "<control>accept" /* server reply, the encoding to use */
+#define PV_CONTROL_BINARY "<encoding>binary</encoding>"
+#define PV_CONTROL_TEXT   "<encoding>text</encoding>"
+#define PV_CONTROL_ZLIB   "<compression>zlib</compression>"
+#define PV_CONTROL_QUERY  "<query>"         /* GUI statistics query, see pvgui.c */
+#define PV_HELLO_TIMEOUT  2000 /* milliseconds the sensor waits for the server to accept */
+#define PV_CONNECT_TIMEOUT 2000 /* milliseconds the sensor waits for the server to answer a connect */
+
+#define PV_DATAGRAM_HEADER_SIZE 16    /* sensor number and sequence number, then a frame header */
+#define PV_DATAGRAM_PAYLOAD     1400  /* records per datagram, fits an ethernet MTU */
+#define PV_DATAGRAM_MAX_PAYLOAD 65000 /* a single longer record is cut */
+#define PV_DATAGRAM_MAX_SIZE    65536 /* receive buffer per datagram */
+#define PV_DATAGRAM_BATCH       64    /* datagrams per sendmmsg() or recvmmsg() */
+#define PV_DATAGRAM_REORDER     1024  /* sequence numbers this far back are late datagrams, further back a sensor restart */
+#define PV_UDP_BUFFER_SIZE      (1 << 22) /* socket buffer for the datagrams */
+
+#define PV_ENCODING_TEXT   0 /* Fineline records */
+#define PV_ENCODING_BINARY 1 /* varint records, see pvrecord.c */
+#define PV_RECORD_PACKET   1
+#define PV_RECORD_FLOW     2
+#define PV_RECORD_MAX      160 /* longest binary record */
+#define PV_SENSOR_ID "SENSOR0000"
+#define PV_SENSOR_NUMBER 0 /* number in PV_SENSOR_ID, sent in every UDP datagram */
 
 #define PV_FILE_ACCESS_TIME   0x01
 #define PV_FILE_CREATION_TIME 0x02
@@ -120,27 +204,269 @@ struct pv_url_record
 
 typedef struct pv_url_record pv_url_record_t;
 
+/* Binary 5-tuple, 38 bytes with no padding. Ports are in network byte order. */
+struct pv_flow_key
+{
+   uint8_t family;   /* PV_FLOW_IPV4 or PV_FLOW_IPV6 */
+   uint8_t protocol;
+   uint16_t src_port;
+   uint16_t dst_port;
+   uint8_t src_addr[16]; /* IPv4 uses the first 4 bytes, the rest are zero */
+   uint8_t dst_addr[16];
+};
+
+typedef struct pv_flow_key pv_flow_key_t;
+
+/*
+   Flow table bucket, two cache lines. The hash fingerprint and the hot
+   counters come first so a probe and the counter update touch one line,
+   the flow times and the timer wheel links fill the second line.
+*/
 struct pv_ip_record
-{
-   char key_value[512];
-   long packet_count;
+{
+   uint32_t hash;   /* full flow key hash, compared before the key */
+   uint32_t state;  /* PV_FLOW_EMPTY, PV_FLOW_IN_USE or PV_FLOW_DELETED */
+   long packet_count;
    long data_size;
-   UT_hash_handle hh;
+   pv_flow_key_t key;
+   struct timeval first_seen; /* packet timestamps */
+   struct timeval last_seen;
+   uint32_t timer_next;  /* bucket index of the next record in the timer slot */
+   uint32_t timer_prev;
+   uint32_t timer_slot;  /* wheel slot holding the record or PV_TIMER_NONE */
+   uint8_t tcp_flags;    /* TCP flags seen on the flow, ORed together */
+   uint32_t top_pos[PV_TOP_ORDERS]; /* heap position + 1 in the top index, 0 if not indexed */
+} __attribute__((aligned(PV_CACHE_LINE_SIZE)));
+
+typedef struct pv_ip_record pv_ip_record_t;
+
+struct pv_flow_update
+{
+   pv_flow_key_t key;
+   uint32_t hash;
+   long length;
+   struct timeval ts;
+   uint8_t tcp_flags;
+};
+
+typedef struct pv_flow_update pv_flow_update_t;
+
+typedef void (*pv_flow_expire_func)(void *user, pv_ip_record_t *record, int reason);
+
+/*
+   Hierarchical timing wheel for flow aging, advanced by packet time in
+   one second ticks. Each slot heads a list of records linked by bucket
+   index. Records move when the table rehashes or grows, which links the
+   lists again by the new indexes (see relink_flow_timers()).
+*/
+struct pv_timer_wheel
+{
+   uint32_t slot[PV_TIMER_LEVELS * PV_TIMER_SLOTS]; /* list heads, level 0 first */
+   uint32_t now;             /* packet time in seconds */
+   uint32_t idle_timeout;
+   uint32_t active_timeout;
+   uint32_t jump_count;      /* packets in a row more than PV_TIMER_MAX_JUMP ahead */
+   unsigned long expired_count;
+   unsigned long ignored_count; /* packet times not believed */
+   pv_flow_expire_func expire_func;
+   void *expire_user;
+};
+
+typedef struct pv_timer_wheel pv_timer_wheel_t;
+
+/*
+   The largest records of a flow table by bytes and by packets, one
+   min-heap of bucket indexes per order, rebuilt when the records move
+   (see relink_flow_top()).
+*/
+struct pv_flow_top
+{
+   uint32_t size;                    /* records each order keeps */
+   uint32_t count[PV_TOP_ORDERS];
+   uint32_t *heap[PV_TOP_ORDERS];
 };
 
-typedef struct pv_ip_record pv_ip_record_t;
+typedef struct pv_flow_top pv_flow_top_t;
+
+/*
+   A key and its counts in one closed interval of a top window.
+*/
+struct pv_top_entry
+{
+   pv_flow_key_t key;
+   uint32_t hash;
+   long packet_count;
+   long data_size;
+};
+
+typedef struct pv_top_entry pv_top_entry_t;
+
+struct pv_top_interval
+{
+   uint32_t number;          /* time / PV_TOP_INTERVAL, 0 if the interval is unused */
+   uint32_t count;
+   pv_top_entry_t *entries;  /* the largest keys by bytes, then by packets */
+};
+
+typedef struct pv_top_interval pv_top_interval_t;
+
+/*
+   The largest keys of a flow table in each of the last PV_TOP_INTERVALS
+   intervals, for the top talkers of a time window. The open interval
+   counts its keys in a small table of its own, see pvtopwindow.c.
+*/
+struct pv_top_window
+{
+   struct pv_flow_table *current; /* counts of the open interval, every record in its top index */
+   uint32_t number;             /* interval number of the open interval */
+   uint32_t size;               /* keys a closed interval keeps in each order */
+   unsigned long replaced;      /* keys that gave up their place in a full open interval */
+   pv_top_interval_t interval[PV_TOP_INTERVALS]; /* closed intervals by number % PV_TOP_INTERVALS */
+};
+
+typedef struct pv_top_window pv_top_window_t;
+
+/*
+   Open addressing (linear probing) flow table. A capture table has all
+   its buckets allocated when it is created and never grows, a table
+   made with init_growing_flow_table() doubles its buckets up to
+   max_size. Records move when an insert rehashes the table to clear the
+   deleted markers or grows it, so pointers to records stay valid only
+   until the next insert_flow(). The timer lists and the top index hold
+   bucket indexes and are linked again after a move.
+*/
+struct pv_flow_table
+{
+   pv_ip_record_t *buckets;
+   uint32_t size;       /* number of buckets, a power of two */
+   uint32_t mask;
+   uint32_t max_count;  /* load limit, 3/4 of the buckets */
+   uint32_t max_size;   /* buckets a growing table may double up to, 0 if the size is fixed */
+   uint32_t count;      /* records in use */
+   uint32_t deleted;    /* deleted markers still in probe chains */
+   unsigned long rehash_count; /* rehashes that cleared the deleted markers */
+   unsigned long full_count; /* new flows not recorded because the table was full */
+   pv_timer_wheel_t *timers; /* NULL when the flows do not age */
+   pv_flow_top_t *top;       /* NULL when the table has no top index */
+   pv_top_window_t *window;  /* NULL when the table has no top window */
+   int batch_count;
+   pv_flow_update_t batch[PV_FLOW_BATCH_SIZE];
+};
+
+typedef struct pv_flow_table pv_flow_table_t;
 
+/*
+   Length tracked string, see pvformat.c.
+*/
+struct pv_format_buffer
+{
+   char *data;
+   int length;
+   int size;
+};
+
+typedef struct pv_format_buffer pv_format_buffer_t;
+
+#define PV_APPEND_LITERAL(fb, str) append_string((fb), (str), sizeof(str) - 1)
+
+/*
+   A message received from a sensor, see pvframe.c.
+*/
+struct pv_frame
+{
+   int type;      /* PV_FRAME_EVENT, PV_FRAME_CONTROL, PV_FRAME_STATS or PV_FRAME_ALERT */
+   int flags;
+   uint32_t length;
+   char *payload; /* not NUL terminated */
+};
+
+typedef struct pv_frame pv_frame_t;
+
+/*
+   Receive ring of a sensor connection. head and tail are stream
+   positions, the ring offset is the position masked by the ring size.
+*/
+struct pv_frame_reader
+{
+   unsigned char *ring;
+   uint32_t size;
+   uint32_t mask;
+   uint32_t head;          /* start of the next frame */
+   uint32_t tail;          /* end of the received data */
+   char *scratch;          /* payloads that wrap around the ring end */
+   uint32_t scratch_size;
+   uint32_t max_payload;   /* longest payload accepted, see set_frame_reader_limit() */
+   unsigned long frame_count;
+   unsigned long byte_count;
+};
+
+typedef struct pv_frame_reader pv_frame_reader_t;
+
+/*
+   A sensor connection to the server, see pvreactor.c. The reader and
+   the counts are used by the reactor of the shard that accepted the
+   connection, the log by the shard's worker the connection is given to.
+*/
 struct pv_sensor_connection
 {
    int sockfd;
    int sensor_id;
    int status;
-   unsigned int event_count;
-   unsigned int alert_count;
+   int shard;
+   int worker;
+   unsigned int event_count;  /* event frames, the records are counted in the sensor's connection map */
+   unsigned int alert_count;  /* alert frames */
+   unsigned int invalid_count;
+   pv_frame_reader_t reader;
+   FILE *sensor_log;
+   char *log_pending;        /* records waiting for the worker's batched write, io_uring only */
+   int log_pending_length;
+   int log_pending_size;
+   unsigned long log_batch;  /* the worker's last batch that wrote to the log */
+   struct pv_connection_map *connection_map; /* flow statistics of the sensor, see pvsensormap.c */
+   struct pv_sensor_record *sensor;          /* registered by the hello, see pvregistry.c */
+   struct pv_sensor_connection *sensor_next; /* the sensor's other open connections */
+   struct pv_sensor_connection *sensor_prev;
    UT_hash_handle hh;
 };
 
 typedef struct pv_sensor_connection pv_sensor_connection_t;
+
+/*
+   A packet or flow event in binary form, see pvrecord.c. The addresses
+   and ports in the key are in network byte order, the other fields in
+   host byte order. Only the fields of the event's kind and protocol are
+   set.
+*/
+struct pv_event
+{
+   int kind;            /* PV_RECORD_PACKET or PV_RECORD_FLOW */
+   struct timeval ts;   /* packet time, the last packet of a flow */
+   uint32_t sensor_id;
+   pv_flow_key_t key;
+   uint32_t ip_id;      /* IPv4 ID or IPv6 flow label */
+   uint32_t ip_len;     /* IPv4 datagram length or IPv6 payload length */
+   uint8_t ip_tos;      /* IPv4 TOS or IPv6 traffic class */
+   uint8_t ip_ttl;      /* IPv4 TTL or IPv6 hop limit */
+   uint8_t ip_hlen;     /* IPv4 header length in bytes */
+   uint8_t tcp_flags;   /* flags of the packet, or of the flow ORed together */
+   uint8_t tcp_hlen;
+   uint8_t icmp_type;
+   uint8_t icmp_code;
+   uint16_t tcp_win;
+   uint16_t icmp_echo_id;
+   uint16_t icmp_echo_seq;
+   uint32_t tcp_seq;
+   uint32_t tcp_ack;
+   long packet_count;   /* flow events */
+   long data_size;
+   struct timeval first_seen;
+   char reason[16];
+};
+
+typedef struct pv_event pv_event_t;
+
+typedef void (*pv_event_func)(void *user, const pv_event_t *event);
 
 /* pvutil.c */
 
@@ -161,13 +487,65 @@ char *trim(char *s);
 
 /* pvsocket.c */
 
+int start_client_socket(char *server_ip_address);
+int finish_client_socket(int sockfd);
 int init_client_socket(char *server_ip_address);
+void set_socket_cork(int sockfd, int cork);
+int init_listen_socket(int port_number, int reuse_port);
 int init_server_socket(int port_number, void *(* connector)(void *));
+int init_udp_client_socket(char *server_ip_address);
+int init_udp_server_socket(int port_number, int timeout);
 int send_event(int sockfd, char *event_string);
+int send_event_buffer(int sockfd, char *buffer, int length);
+int send_frame(int sockfd, int type, int flags, const char *payload, int length);
+int send_frame_iov(int sockfd, int type, int flags, struct iovec *iov, int count);
+int send_sensor_hello(int sockfd, int encoding, int compression);
+int accept_server_hello(const char *reply, int encoding, int *compression);
+int negotiate_encoding(int sockfd, int encoding, int *compression);
 char *get_response(int sockfd, char *in_buffer);
 int close_socket(int sockfd);
 void *connection_handler(void *socket_desc);
 
+/* pvformat.c */
+
+void init_format_buffer(pv_format_buffer_t *fb, char *data, int size);
+void append_string(pv_format_buffer_t *fb, const char *str, int len);
+void append_cstring(pv_format_buffer_t *fb, const char *str);
+void append_char(pv_format_buffer_t *fb, char c);
+void append_uint(pv_format_buffer_t *fb, unsigned long value);
+void append_int(pv_format_buffer_t *fb, long value);
+void append_hex(pv_format_buffer_t *fb, unsigned long value);
+void append_ipv4(pv_format_buffer_t *fb, const struct in_addr *addr);
+void append_ipv6(pv_format_buffer_t *fb, const struct in6_addr *addr);
+long write_iov(int fd, struct iovec *iov, int count);
+
+/* pvframe.c */
+
+void set_frame_header(unsigned char *header, int type, int flags, uint32_t length);
+int parse_frame_header(const unsigned char *header, pv_frame_t *frame);
+void set_datagram_header(unsigned char *header, uint32_t sensor, uint32_t sequence, int type, int flags, uint32_t length);
+int parse_datagram(const unsigned char *datagram, int length, uint32_t *sensor, uint32_t *sequence, pv_frame_t *frame);
+int get_frame_split(const char *buffer, int length, int flags);
+int init_frame_reader(pv_frame_reader_t *reader, uint32_t size);
+void set_frame_reader_limit(pv_frame_reader_t *reader, uint32_t max_payload);
+void free_frame_reader(pv_frame_reader_t *reader);
+int read_frames(pv_frame_reader_t *reader, int sockfd);
+uint32_t feed_frames(pv_frame_reader_t *reader, const char *data, uint32_t length);
+int next_frame(pv_frame_reader_t *reader, pv_frame_t *frame);
+
+/* pvcompress.c */
+
+void set_frame_compression(int level);
+int get_frame_compression();
+int compress_frame_iov(struct iovec *iov, int count, int *flags);
+int decompress_frame(pv_frame_t *frame);
+void get_compression_stats(unsigned long *frames, unsigned long *bytes_in, unsigned long *bytes_out, long long *cpu_ns);
+
+/* pvclock.c */
+
+int format_event_time(const struct timeval *ts, char *time_str);
+int format_log_time(char *time_str);
+
 /* pvlog.c */
 
 int open_log_file(char *startup_path);
@@ -184,37 +562,121 @@ int write_fineline_project_header(char *pstr);
 int close_fineline_event_file();
 int dump_statistics();
 int write_event_record(char *event_string);
-int create_event_record(char *event_string, char *data_string);
+int write_event_buffer(char *buffer, int length);
+int write_event_iov(struct iovec *iov, int count);
+
+/* pvrecord.c */
+
+int create_event_record(char *event_string, char *data_string, const struct timeval *ts);
+int format_event_body(char *body, const char *data, int len, const struct timeval *ts);
+struct iovec *get_event_fragment(int fragment);
+void set_flow_event(pv_event_t *event, pv_ip_record_t *record, const char *reason);
+int format_event_data(const pv_event_t *event, char *event_data, int len);
+int encode_event(const pv_event_t *event, unsigned char *record);
+int decode_event(const unsigned char *record, int length, pv_event_t *event);
+int render_event_records(const char *payload, int length, char **buffer, int *size, pv_event_func func, void *user);
+int get_record_split(const char *payload, int length, int max, int flags);
 
 /* pveventlog.c */
 
 FILE *open_sensor_log_file(char *evt_file_name);
 int write_sensor_log_record(FILE *evt_file, char *estr);
+int write_sensor_log_buffer(FILE *evt_file, const char *buffer, int length);
 int write_project_header(FILE *evt_file, char *pstr);
 int close_sensor_log_file(FILE* evt_file);
 
+/* pvflowkey.c */
+
+void set_flow_key(pv_flow_key_t *key, const unsigned char *iphdr, int protocol, uint16_t src_port, uint16_t dst_port);
+uint32_t hash_flow_key(const pv_flow_key_t *key);
+int compare_flow_keys(const pv_flow_key_t *a, const pv_flow_key_t *b);
+int format_flow_key(const pv_flow_key_t *key, char *out_str, int len);
+
+/* pvflowtable.c */
+
+int init_flow_table(pv_flow_table_t *table, uint32_t flows);
+int init_growing_flow_table(pv_flow_table_t *table, uint32_t flows, uint32_t max_flows);
+void free_flow_table(pv_flow_table_t *table);
+void clear_flow_table(pv_flow_table_t *table);
+pv_ip_record_t *find_flow(pv_flow_table_t *table, const pv_flow_key_t *key, uint32_t hash);
+pv_ip_record_t *insert_flow(pv_flow_table_t *table, const pv_flow_key_t *key, uint32_t hash);
+void delete_flow(pv_flow_table_t *table, pv_ip_record_t *record);
+pv_ip_record_t *update_flow(pv_flow_table_t *table, pv_flow_update_t *update);
+pv_ip_record_t *update_flow_event(pv_flow_table_t *table, const pv_event_t *event);
+void queue_flow_update(pv_flow_table_t *table, const pv_flow_key_t *key, long length, struct timeval *ts, uint8_t tcp_flags);
+void flush_flow_updates(pv_flow_table_t *table);
+pv_ip_record_t *get_next_flow(pv_flow_table_t *table, pv_ip_record_t *record);
+pv_ip_record_t *get_prev_flow(pv_flow_table_t *table, pv_ip_record_t *record);
+
+/* pvtimerwheel.c */
+
+int init_flow_timers(pv_flow_table_t *table, uint32_t idle_timeout, uint32_t active_timeout, pv_flow_expire_func func, void *user);
+void free_flow_timers(pv_flow_table_t *table);
+void clear_flow_timers(pv_flow_table_t *table);
+void relink_flow_timers(pv_flow_table_t *table);
+void add_flow_timer(pv_flow_table_t *table, pv_ip_record_t *record);
+void remove_flow_timer(pv_flow_table_t *table, pv_ip_record_t *record);
+uint32_t advance_flow_timers(pv_flow_table_t *table, uint32_t now);
+
+/* pvtopindex.c */
+
+int init_flow_top(pv_flow_table_t *table, uint32_t size);
+void free_flow_top(pv_flow_table_t *table);
+void clear_flow_top(pv_flow_table_t *table);
+void relink_flow_top(pv_flow_table_t *table);
+void update_flow_top(pv_flow_table_t *table, pv_ip_record_t *record);
+void remove_flow_top(pv_flow_table_t *table, pv_ip_record_t *record);
+int get_flow_top(pv_flow_table_t *table, int order, pv_ip_record_t *records, int max);
+int select_top_records(pv_ip_record_t *records, int count, int order, int max);
+
+/* pvtopwindow.c */
+
+int init_flow_window(pv_flow_table_t *table, uint32_t size, uint32_t flows);
+void free_flow_window(pv_flow_table_t *table);
+void clear_flow_window(pv_flow_table_t *table);
+void update_flow_window(pv_flow_table_t *table, const pv_flow_key_t *key, uint32_t hash, uint32_t now, long packets, long bytes);
+int get_flow_window(pv_flow_table_t *table, time_t since, time_t until, pv_flow_table_t *merged);
+
 /* pvipmap.c */
 
-void add_ip(pv_ip_record_t *flip);
-pv_ip_record_t *find_ip(char *lookup_string);
+void set_flow_table_size(unsigned int flows);
+void set_flow_timeouts(unsigned int idle_timeout, unsigned int active_timeout);
+int init_ip_maps(int count, int buffers);
+int start_ip_map_aging(int map_id, pv_flow_expire_func func, void *user);
+pv_ip_record_t *add_ip(int map_id, pv_flow_key_t *key);
+pv_ip_record_t *find_ip(int map_id, pv_flow_key_t *key);
+void set_ip_map_format(int flow_events);
+void update_ip(int map_id, pv_flow_key_t *key, long length, struct timeval *ts, uint8_t tcp_flags);
+int start_ip_map_cap(int map_id);
+long count_ip_map_cap(int map_id, pv_flow_key_t *key, long length, struct timeval *ts, uint8_t tcp_flags);
+int format_flow_record(pv_ip_record_t *record, const char *reason, char *event_data, int len);
+void flush_ip_updates(int map_id);
+void check_ip_map_swap(int map_id);
+int request_ip_map_swap();
+int wait_ip_map_swap(int epoch);
+void cancel_ip_map_swap();
+int export_ip_maps(char **buffer, int *size);
 void write_ip_map(FILE *outfile);
-void send_ip_map(int sock_desc);
+int format_shutdown_ip_map(char **buffer, int *size, int *type);
 void print_ip_map();
-void delete_ip(pv_ip_record_t *ip_record);
+void delete_ip(int map_id, pv_ip_record_t *ip_record);
 void delete_all_ips();
-pv_ip_record_t *get_first_ip_record();
-pv_ip_record_t *get_last_ip_record();
-
-/* pvconnectionmap.c */
-
-void add_connection_ip(pv_ip_record_t *ip_map, pv_ip_record_t *flip);
-pv_ip_record_t *find_connection_ip(pv_ip_record_t *ip_map, char *lookup_string);
-pv_ip_record_t *get_last_connection_record(pv_ip_record_t *ip_map);
-void delete_connection(pv_ip_record_t *ip_map, pv_ip_record_t *ip_record);
-void delete_all_connections(pv_ip_record_t *ip_map);
-void write_connection_map(pv_ip_record_t *ip_map, FILE *outfile);
-void send_connection_map(pv_ip_record_t *ip_map, int sock_desc);
-void print_connnection_map(pv_ip_record_t *ip_map);
+pv_ip_record_t *get_first_ip_record(int map_id);
+pv_ip_record_t *get_next_ip_record(int map_id, pv_ip_record_t *ip_record);
+pv_ip_record_t *get_last_ip_record(int map_id);
+
+/* pvconnectionmap.c */
+
+pv_ip_record_t *add_connection_ip(pv_flow_table_t *ip_map, pv_flow_key_t *key);
+pv_ip_record_t *find_connection_ip(pv_flow_table_t *ip_map, pv_flow_key_t *key);
+pv_ip_record_t *get_first_connection_record(pv_flow_table_t *ip_map);
+pv_ip_record_t *get_next_connection_record(pv_flow_table_t *ip_map, pv_ip_record_t *ip_record);
+pv_ip_record_t *get_last_connection_record(pv_flow_table_t *ip_map);
+void delete_connection(pv_flow_table_t *ip_map, pv_ip_record_t *ip_record);
+void delete_all_connections(pv_flow_table_t *ip_map);
+void write_connection_map(pv_flow_table_t *ip_map, FILE *outfile);
+void send_connection_map(pv_flow_table_t *ip_map, int sock_desc);
+void print_connnection_map(pv_flow_table_t *ip_map);
 
 #endif
 
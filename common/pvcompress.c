@@ -0,0 +1,243 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvcompress.c
+
+   Title : Pivotal NST Frame Compression
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: zlib compression of the frames a sensor sends to the server,
+            for sensors on slow links. The sensor asks for compression in
+            its hello (see negotiate_encoding()), once the server accepts
+            it the payload of every frame longer than PV_COMPRESS_MIN is
+            deflated and the frame is marked PV_FRAME_ZLIB. A payload that
+            does not get smaller is sent as it is.
+
+            Each frame is a complete zlib stream, so frames can be
+            inflated in any order by any thread. The deflate and inflate
+            streams are kept per thread and reset for each frame, the
+            capture workers compress their own batches in parallel before
+            they take the socket lock.
+
+            The sensor counts the bytes before and after compression and
+            the thread CPU time spent in deflate(), so the level of each
+            link can be chosen from the ratio and the cost.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "pvcommon.h"
+
+struct pv_zlib_state
+{
+   z_stream deflate_stream;
+   z_stream inflate_stream;
+   int deflate_ready;
+   int inflate_ready;
+   unsigned char *out;   /* compressed payloads on the sensor, inflated ones on the server */
+   uLong out_size;
+};
+
+static __thread struct pv_zlib_state zlib_state;
+
+int compression_level = 0;
+unsigned long compress_bytes_in = 0;
+unsigned long compress_bytes_out = 0;
+unsigned long compress_frames = 0;
+long long compress_cpu_ns = 0;
+
+/* Compression level of the frames sent, 0 = none, 1 (fastest) to 9 (smallest). */
+void set_frame_compression(int level)
+{
+   compression_level = level;
+}
+
+int get_frame_compression()
+{
+   return(compression_level);
+}
+
+static long long get_thread_cpu_ns()
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+   return((long long)now.tv_sec * 1000000000LL + now.tv_nsec);
+}
+
+/*
+   Function: compress_frame_iov
+   Purpose : Deflates the payload segments of a frame into the thread's
+             compression buffer. The buffer is valid until the thread
+             compresses the next frame.
+   Input   : Segment list with the header segment first, number of
+             segments and the frame flags.
+   Return  : Number of segments, 2 with PV_FRAME_ZLIB added to the flags
+             if the payload was compressed, otherwise count unchanged.
+*/
+int compress_frame_iov(struct iovec *iov, int count, int *flags)
+{
+   struct pv_zlib_state *state = &zlib_state;
+   z_stream *strm = &state->deflate_stream;
+   uLong length = 0;
+   long long start;
+   int i, res;
+
+   if (compression_level <= 0)
+      return(count);
+
+   for (i = 1; i < count; i++)
+      length += iov[i].iov_len;
+
+   if (length < PV_COMPRESS_MIN)
+      return(count);
+
+   start = get_thread_cpu_ns();
+
+   if (!state->deflate_ready)
+   {
+      memset(strm, 0, sizeof(z_stream));
+      if (deflateInit(strm, compression_level) != Z_OK)
+      {
+         print_log_entry("compress_frame_iov() <ERROR> Could not initialise zlib.\n");
+         compression_level = 0;
+         return(count);
+      }
+      state->deflate_ready = 1;
+   }
+   else
+   {
+      deflateReset(strm);
+   }
+
+   if (state->out_size < deflateBound(strm, length))
+   {
+      state->out_size = deflateBound(strm, length);
+      state->out = xrealloc(state->out, state->out_size);
+   }
+
+   strm->next_out = state->out;
+   strm->avail_out = state->out_size;
+
+   for (i = 1, res = Z_OK; (i < count) && (res == Z_OK); i++)
+   {
+      strm->next_in = (Bytef *)iov[i].iov_base;
+      strm->avail_in = iov[i].iov_len;
+      res = deflate(strm, (i == count - 1) ? Z_FINISH : Z_NO_FLUSH);
+   }
+
+   if (res != Z_STREAM_END)
+   {
+      print_log_entry("compress_frame_iov() <ERROR> Compression failed.\n");
+      return(count);
+   }
+
+   __sync_fetch_and_add(&compress_frames, 1);
+   __sync_fetch_and_add(&compress_bytes_in, length);
+   __sync_fetch_and_add(&compress_cpu_ns, get_thread_cpu_ns() - start);
+
+   if (strm->total_out >= length)
+   {
+      __sync_fetch_and_add(&compress_bytes_out, length);
+      return(count);
+   }
+   __sync_fetch_and_add(&compress_bytes_out, strm->total_out);
+
+   iov[1].iov_base = state->out;
+   iov[1].iov_len = strm->total_out;
+   *flags |= PV_FRAME_ZLIB;
+
+   return(2);
+}
+
+/*
+   Function: decompress_frame
+   Purpose : Inflates a PV_FRAME_ZLIB frame into the thread's buffer, the
+             frame then points at the original payload and the flag is
+             cleared. The payload is valid until the thread inflates the
+             next frame.
+   Input   : Frame.
+   Return  : 0 on success, -1 if the payload is corrupt or too long.
+*/
+int decompress_frame(pv_frame_t *frame)
+{
+   struct pv_zlib_state *state = &zlib_state;
+   z_stream *strm = &state->inflate_stream;
+
+   if (!state->inflate_ready)
+   {
+      memset(strm, 0, sizeof(z_stream));
+      if (inflateInit(strm) != Z_OK)
+      {
+         print_log_entry("decompress_frame() <ERROR> Could not initialise zlib.\n");
+         return(-1);
+      }
+      state->inflate_ready = 1;
+   }
+   else
+   {
+      inflateReset(strm);
+   }
+
+   if (state->out_size < PV_FRAME_MAX_PAYLOAD)
+   {
+      state->out_size = PV_FRAME_MAX_PAYLOAD;
+      state->out = xrealloc(state->out, state->out_size);
+   }
+
+   strm->next_in = (Bytef *)frame->payload;
+   strm->avail_in = frame->length;
+   strm->next_out = state->out;
+   strm->avail_out = PV_FRAME_MAX_PAYLOAD;
+
+   if (inflate(strm, Z_FINISH) != Z_STREAM_END)
+   {
+      print_log_entry("decompress_frame() <ERROR> Corrupt compressed frame.\n");
+      return(-1);
+   }
+
+   frame->payload = (char *)state->out;
+   frame->length = strm->total_out;
+   frame->flags &= ~PV_FRAME_ZLIB;
+
+   return(0);
+}
+
+/*
+   Function: get_compression_stats
+   Purpose : Totals of the frames compressed so far.
+   Input   : Pointers that receive the frames compressed, the payload
+             bytes before and after compression and the CPU time spent
+             compressing in nanoseconds.
+*/
+void get_compression_stats(unsigned long *frames, unsigned long *bytes_in, unsigned long *bytes_out, long long *cpu_ns)
+{
+   *frames = compress_frames;
+   *bytes_in = compress_bytes_in;
+   *bytes_out = compress_bytes_out;
+   *cpu_ns = compress_cpu_ns;
+}
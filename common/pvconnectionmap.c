@@ -1,4 +1,3 @@
-
 /*  Copyright 2014 Derek Chadwick
 
     This file is part of the Pivotal Network Security Tools.
@@ -24,107 +23,98 @@
    Author: Derek Chadwick
    Date  : 06/07/2014
 
-   Purpose: A wrapper for uthash, used to store IP addresses and traffic
-            statistics for each remote connection. Used by the server
-            connection threads to maintain statistics on traffic
-            reported by each sensor.
+   Purpose: A wrapper for the flow tables, used to store IP addresses and
+            traffic statistics for each remote connection. Used by the
+            server connection threads to maintain statistics on traffic
+            reported by each sensor. The caller creates the table with
+            init_flow_table().
+
+*/
 
-*/
-
 #include "pvcommon.h"
 
 
-void add_connection_ip(pv_ip_record_t *ip_map, pv_ip_record_t *flip)
+pv_ip_record_t *add_connection_ip(pv_flow_table_t *ip_map, pv_flow_key_t *key)
 {
-    pv_ip_record_t *s;
-
-    HASH_FIND_STR(ip_map, flip->key_value , s);  /* id already in the hash? */
-    if (s == NULL)
-    {
-      HASH_ADD_STR(ip_map, key_value, flip);  /* id: name of key field */
-    }
-
+   return(insert_flow(ip_map, key, hash_flow_key(key)));
 }
 
-pv_ip_record_t *find_connection_ip(pv_ip_record_t *ip_map, char *lookup_string)
+pv_ip_record_t *find_connection_ip(pv_flow_table_t *ip_map, pv_flow_key_t *key)
 {
-    pv_ip_record_t *s;
-
-    HASH_FIND_STR(ip_map, lookup_string, s);  /* s: output pointer */
-    return s;
+   return(find_flow(ip_map, key, hash_flow_key(key)));
 }
 
-pv_ip_record_t *get_first_connection_record(pv_ip_record_t *ip_map)
+pv_ip_record_t *get_first_connection_record(pv_flow_table_t *ip_map)
 {
-   return(ip_map);
+   return(get_next_flow(ip_map, NULL));
 }
 
-pv_ip_record_t *get_last_connection_record(pv_ip_record_t *ip_map)
+pv_ip_record_t *get_next_connection_record(pv_flow_table_t *ip_map, pv_ip_record_t *ip_record)
 {
-   pv_ip_record_t *s = ip_map;
-   if (s != NULL)
-      return((pv_ip_record_t *)s->hh.prev);
-
-   return(NULL);
+   return(get_next_flow(ip_map, ip_record));
 }
 
-void delete_connection(pv_ip_record_t *ip_map, pv_ip_record_t *ip_record)
+pv_ip_record_t *get_last_connection_record(pv_flow_table_t *ip_map)
 {
-   HASH_DEL(ip_map, ip_record);  /* event: pointer to deletee */
-   free(ip_record);
+   return(get_prev_flow(ip_map, NULL));
 }
 
-void delete_all_connections(pv_ip_record_t *ip_map)
+void delete_connection(pv_flow_table_t *ip_map, pv_ip_record_t *ip_record)
 {
-   pv_ip_record_t *current_ip, *tmp;
+   delete_flow(ip_map, ip_record);
+}
 
-   HASH_ITER(hh, ip_map, current_ip, tmp)
-   {
-      HASH_DEL(ip_map,current_ip);  /* delete it (ip_map advances to next) */
-      free(current_ip);              /* free it */
-   }
+void delete_all_connections(pv_flow_table_t *ip_map)
+{
+   clear_flow_table(ip_map);
 }
 
-void write_connection_map(pv_ip_record_t *ip_map, FILE *outfile)
+void write_connection_map(pv_flow_table_t *ip_map, FILE *outfile)
 {
    pv_ip_record_t *s;
-   char out_str[PV_MAX_INPUT_STR];
-
+   char out_str[PV_MAX_INPUT_STR];
+   char key_str[PV_FLOW_KEY_STR];
+
    fputs("<eventstatistics>\n", outfile);
-   for(s=ip_map; s != NULL; s=(pv_ip_record_t *)(s->hh.next))
-   {
-      sprintf(out_str, "%s Packet Count %ld Data Size %ld\n", s->key_value, s->packet_count, s->data_size);
+   for (s = get_next_flow(ip_map, NULL); s != NULL; s = get_next_flow(ip_map, s))
+   {
+      format_flow_key(&s->key, key_str, PV_FLOW_KEY_STR);
+      sprintf(out_str, "%s Packet Count %ld Data Size %ld\n", key_str, s->packet_count, s->data_size);
       fputs(out_str, outfile);
-   }
-   fputs("</eventstatistics>\n", outfile);
-
+   }
+   fputs("</eventstatistics>\n", outfile);
+
    return;
 }
 
-void send_connection_map(pv_ip_record_t *ip_map, int sock_desc)
+void send_connection_map(pv_flow_table_t *ip_map, int sock_desc)
 {
    pv_ip_record_t *s;
+   char key_str[PV_FLOW_KEY_STR];
 
-   for(s=ip_map; s != NULL; s=(pv_ip_record_t *)(s->hh.next))   {
-      send_event(sock_desc, s->key_value);
+   for (s = get_next_flow(ip_map, NULL); s != NULL; s = get_next_flow(ip_map, s))
+   {
+      format_flow_key(&s->key, key_str, PV_FLOW_KEY_STR);
+      send_event(sock_desc, key_str);
         /* TODO: serialize the record as a Fineline event and send to server. */
-   }
-
+   }
+
    return;
 }
 
-void print_connnection_map(pv_ip_record_t *ip_map)
+void print_connnection_map(pv_flow_table_t *ip_map)
 {
    pv_ip_record_t *s;
+   char key_str[PV_FLOW_KEY_STR];
 
-   for(s=ip_map; s != NULL; s=(pv_ip_record_t *)(s->hh.next))
+   for (s = get_next_flow(ip_map, NULL); s != NULL; s = get_next_flow(ip_map, s))
    {
-      printf("Packet Data: %s\n", s->key_value);
-      printf("Packets: %ld\n", s->packet_count);
-      printf("Data Size: %ld\n", s->data_size);
+      format_flow_key(&s->key, key_str, PV_FLOW_KEY_STR);
+      printf("Packet Data: %s\n", key_str);
+      printf("Packets: %ld\n", s->packet_count);
+      printf("Data Size: %ld\n", s->data_size);
       printf("--------------------------------------------------------\n");
-   }
-
+   }
+
    return;
 }
-
@@ -36,8 +36,10 @@
 #include <string.h>
 #include <time.h>
 
-#include "pvcommon.h"
-
+#include <unistd.h>
+
+#include "pvcommon.h"
+
 FILE *evt_file;
 
 /*
@@ -67,28 +69,13 @@ FILE *open_fineline_event_file(char *evt_file_name)
    Purpose : Creates an event string and writes to the fineline event file.
            :
    Input   : Event data string.
-   Output  : Timestamped event record.
+   Output  : Event record stamped with the current time.
 */
 int write_fineline_event_record(char *estr)
 {
-   time_t curtime;
-   struct tm *loctime;
    char event_string[PV_MAX_INPUT_STR];
-   char *time_str;
 
-   /* Get the current time. */
-   curtime = time (NULL);
-   loctime = localtime (&curtime);
-
-   time_str = asctime(loctime);
-   rtrim(time_str);
-
-   /* TODO: add the actual sensor ID number in the id field. */
-   strcpy(event_string, "<event><id>SENSOR0000</id><evidencenumber>NONE</evidencenumber><time>");
-   strcat(event_string, time_str);
-   strcat(event_string, "</time><type>1</type><summary>Pivot Sensor Packet Event</summary><data>");
-   strncat(event_string, estr, strlen(estr));
-   strcat(event_string, "</data><hiddenevent>0</hiddenevent><hiddentext>0</hiddentext><marked>0</marked><pinned>0</pinned><ypos>0</ypos></event>\n");
+   create_event_record(event_string, estr, NULL);
 
    fputs (event_string, evt_file);
 
@@ -105,19 +92,15 @@ int write_fineline_event_record(char *estr)
 */
 int write_fineline_project_header(char *pstr)
 {
-   time_t curtime;
-   struct tm *loctime;
    int slen = strlen(pstr) + PV_MAX_INPUT_STR;
    char *hdr = (char *) xcalloc(slen);
-   char *time_str;
+   char time_str[PV_TIME_STR];
 
    /* Get the current time. */
-   curtime = time (NULL);
-   loctime = localtime (&curtime);
-   time_str = asctime(loctime);
+   format_log_time(time_str);
 
    strcpy(hdr, "<project><name>FineLine Project ");
-   strncat(hdr, time_str, strlen(time_str) - 1);
+   strcat(hdr, time_str);
    strcat(hdr, "</name><investigator>NONE</investigator><summary>NONE</summary><startdate>NONE</startdate><enddate>NONE</enddate><description>");
    strncat(hdr, pstr, slen);
    strcat(hdr, "</description></project>\n");
@@ -148,46 +131,60 @@ int dump_statistics()
 }
 
 /*
-   Function: create_event_record()
+   Function: write_event_record()
 
-   Purpose : Creates a Fineline event string from the input data string.
+   Purpose : writes a Fineline event string to the event file.
            :
    Input   : Event data string.
    Output  : Timestamped event record.
 */
-int create_event_record(char *event_string, char *data_string)
+int write_event_record(char *event_string)
 {
-   time_t curtime;
-   struct tm *loctime;
-   char *time_str;
-
-   /* Get the current time. */
-   curtime = time (NULL);
-   loctime = localtime (&curtime);
-
-   time_str = asctime(loctime);
-   rtrim(time_str);
-
-   /* TODO: put an actual sensor id in the id field. */
-   strcpy(event_string, "<event><id>SENSOR0000</id><evidencenumber>NONE</evidencenumber><time>");
-   strcat(event_string, time_str);
-   strcat(event_string, "</time><type>1</type><summary>Pivot Sensor Packet Event</summary><data>");
-   strncat(event_string, data_string, strlen(data_string));
-   strcat(event_string, "</data><hiddenevent>0</hiddenevent><hiddentext>0</hiddentext><marked>0</marked><pinned>0</pinned><ypos>0</ypos></event>\n");
-
+   fputs(event_string, evt_file);
    return(0);
 }
-
+
 /*
-   Function: write_event_record()
+   Function: write_event_buffer()
 
-   Purpose : writes a Fineline event string to the event file.
-           :
-   Input   : Event data string.
-   Output  : Timestamped event record.
+   Purpose : writes a buffer of queued Fineline event strings to the event
+           : file in one call, the stream lock keeps buffers from different
+           : capture workers whole.
+   Input   : Event buffer and length.
+   Output  : Returns 0 on success, -1 on error.
 */
-int write_event_record(char *event_string)
+int write_event_buffer(char *buffer, int length)
 {
-   fputs(event_string, evt_file);
+   if (fwrite(buffer, 1, length, evt_file) != (size_t)length)
+   {
+      print_log_entry("write_event_buffer() <ERROR> File write error.\n");
+      return(-1);
+   }
    return(0);
 }
+
+/*
+   Function: write_event_iov()
+
+   Purpose : writes a scatter-gather list of Fineline record fragments to
+           : the event file with writev(). Anything buffered in the stream
+           : is flushed first and the stream lock is held, so the records
+           : stay in order and whole.
+   Input   : Segment list and number of segments.
+   Output  : Returns 0 on success, -1 on error.
+*/
+int write_event_iov(struct iovec *iov, int count)
+{
+   int retval = 0;
+
+   flockfile(evt_file);
+   fflush(evt_file);
+   if (write_iov(fileno(evt_file), iov, count) < 0)
+   {
+      print_log_entry("write_event_iov() <ERROR> File write error.\n");
+      retval = -1;
+   }
+   funlockfile(evt_file);
+
+   return(retval);
+}
@@ -75,9 +75,27 @@ FILE *open_sensor_log_file(char *evt_file_name)
 int write_sensor_log_record(FILE *evt_file, char *estr)
 {
    if (fputs (estr, evt_file) < 0)
-   {
-      print_log_entry("close_fineline_event_file() <ERROR> File write error.\n");
-      return(-1);
+   {
+      print_log_entry("close_fineline_event_file() <ERROR> File write error.\n");
+      return(-1);
+   }
+   return(0);
+}
+
+/*
+   Function: write_sensor_log_buffer()
+
+   Purpose : Writes a frame payload of records to the log file.
+           :
+   Input   : File pointer, buffer and length.
+   Output  : Returns 0 on success, -1 on error.
+*/
+int write_sensor_log_buffer(FILE *evt_file, const char *buffer, int length)
+{
+   if (fwrite(buffer, 1, length, evt_file) != (size_t)length)
+   {
+      print_log_entry("write_sensor_log_buffer() <ERROR> File write error.\n");
+      return(-1);
    }
    return(0);
 }
@@ -92,19 +110,15 @@ int write_sensor_log_record(FILE *evt_file, char *estr)
 */
 int write_project_header(FILE *evt_file, char *pstr)
 {
-   time_t curtime;
-   struct tm *loctime;
    int slen = strlen(pstr) + PV_MAX_INPUT_STR;
    char *hdr = (char *) xcalloc(slen);
-   char *time_str;
+   char time_str[PV_TIME_STR];
 
    /* Get the current time. */
-   curtime = time (NULL);
-   loctime = localtime (&curtime);
-   time_str = asctime(loctime);
+   format_log_time(time_str);
 
    strcpy(hdr, "<project><name>Pivotal Project ");
-   strncat(hdr, time_str, strlen(time_str) - 1);
+   strcat(hdr, time_str);
    strcat(hdr, "</name><investigator>NONE</investigator><summary>NONE</summary><startdate>NONE</startdate><enddate>NONE</enddate><description>");
    strncat(hdr, pstr, slen);
    strcat(hdr, "</description></project>\n");
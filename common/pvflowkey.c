@@ -0,0 +1,192 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvflowkey.c
+
+   Title : Pivotal NST Flow Keys
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Binary 5-tuple flow keys (protocol, addresses and ports) for
+            IPv4 and IPv6 traffic. A key is built straight from the packet
+            headers, hashed with a fixed width hash and compared without
+            any string handling. Keys are only rendered as text when the
+            statistics maps are written or printed.
+
+            IPv4 addresses use the first 4 bytes of the address fields,
+            the rest of the key is always zero so keys can be hashed and
+            compared as plain memory.
+
+*/
+
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pvcommon.h"
+
+#define FLOW_HASH_SEED 0x9e3779b9U
+
+/* 32 bit finaliser from MurmurHash3, every input bit affects every output bit. */
+static uint32_t flow_hash_mix(uint32_t h)
+{
+   h ^= h >> 16;
+   h *= 0x85ebca6bU;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35U;
+   h ^= h >> 16;
+   return(h);
+}
+
+static uint32_t flow_hash_word(uint32_t h, const unsigned char *p)
+{
+   uint32_t w;
+
+   memcpy(&w, p, sizeof(w));
+   h ^= flow_hash_mix(w + FLOW_HASH_SEED);
+   return((h << 13) | (h >> 19));
+}
+
+/*
+   Function: set_flow_key
+   Purpose : Builds a flow key from an IPv4 or IPv6 header, the IP
+             version is read from the header itself.
+   Input   : Key to fill, IP header, transport protocol and the source
+             and destination ports in network byte order.
+*/
+void set_flow_key(pv_flow_key_t *key, const unsigned char *iphdr, int protocol, uint16_t src_port, uint16_t dst_port)
+{
+   memset(key, 0, sizeof(pv_flow_key_t));
+
+   key->protocol = (uint8_t)protocol;
+   key->src_port = src_port;
+   key->dst_port = dst_port;
+
+   if ((iphdr[0] >> 4) == 6)
+   {
+      key->family = PV_FLOW_IPV6;
+      memcpy(key->src_addr, iphdr + 8, 16);  /* ip6_src */
+      memcpy(key->dst_addr, iphdr + 24, 16); /* ip6_dst */
+   }
+   else
+   {
+      key->family = PV_FLOW_IPV4;
+      memcpy(key->src_addr, iphdr + 12, 4);  /* ip_src */
+      memcpy(key->dst_addr, iphdr + 16, 4);  /* ip_dst */
+   }
+}
+
+/*
+   Function: hash_flow_key
+   Purpose : Fixed width hash of a flow key, IPv4 keys hash 3 words and
+             IPv6 keys hash 9 words.
+   Input   : Flow key.
+   Return  : 32 bit hash value.
+*/
+uint32_t hash_flow_key(const pv_flow_key_t *key)
+{
+   uint32_t h = FLOW_HASH_SEED ^ ((uint32_t)key->family << 8) ^ key->protocol;
+   int i;
+
+   h = flow_hash_word(h, (const unsigned char *)&key->src_port); /* both ports */
+
+   if (key->family == PV_FLOW_IPV6)
+   {
+      for (i = 0; i < 16; i += 4)
+      {
+         h = flow_hash_word(h, key->src_addr + i);
+         h = flow_hash_word(h, key->dst_addr + i);
+      }
+   }
+   else
+   {
+      h = flow_hash_word(h, key->src_addr);
+      h = flow_hash_word(h, key->dst_addr);
+   }
+
+   return(flow_hash_mix(h));
+}
+
+/*
+   Function: compare_flow_keys
+   Purpose : Compares two flow keys, only the address bytes used by the
+             address family are compared.
+   Return  : 0 if the keys are equal, non zero otherwise.
+*/
+int compare_flow_keys(const pv_flow_key_t *a, const pv_flow_key_t *b)
+{
+   int addr_len;
+
+   if ((a->family != b->family) || (a->protocol != b->protocol) ||
+       (a->src_port != b->src_port) || (a->dst_port != b->dst_port))
+      return(1);
+
+   addr_len = (a->family == PV_FLOW_IPV6) ? 16 : 4;
+
+   return(memcmp(a->src_addr, b->src_addr, addr_len) | memcmp(a->dst_addr, b->dst_addr, addr_len));
+}
+
+/*
+   Function: format_flow_key
+   Purpose : Renders a flow key as text in the same layout as the packet
+             event records, e.g. "TCP  10.1.1.1:80 -> 10.1.1.2:3345 ".
+   Input   : Flow key, output string and length.
+   Return  : Length of the string.
+*/
+int format_flow_key(const pv_flow_key_t *key, char *out_str, int len)
+{
+   char srcip[INET6_ADDRSTRLEN + 2], dstip[INET6_ADDRSTRLEN + 2];
+   int n;
+
+   if (key->family == PV_FLOW_IPV6)
+   {
+      /* Bracket IPv6 addresses so the port stays readable, [::1]:80 */
+      srcip[0] = dstip[0] = '[';
+      inet_ntop(AF_INET6, key->src_addr, srcip + 1, INET6_ADDRSTRLEN);
+      inet_ntop(AF_INET6, key->dst_addr, dstip + 1, INET6_ADDRSTRLEN);
+      strcat(srcip, "]");
+      strcat(dstip, "]");
+   }
+   else
+   {
+      inet_ntop(AF_INET, key->src_addr, srcip, sizeof(srcip));
+      inet_ntop(AF_INET, key->dst_addr, dstip, sizeof(dstip));
+   }
+
+   switch (key->protocol)
+   {
+   case IPPROTO_TCP:
+      n = snprintf(out_str, len, "TCP  %s:%d -> %s:%d ", srcip, ntohs(key->src_port), dstip, ntohs(key->dst_port));
+      break;
+
+   case IPPROTO_UDP:
+      n = snprintf(out_str, len, "UDP  %s:%d -> %s:%d ", srcip, ntohs(key->src_port), dstip, ntohs(key->dst_port));
+      break;
+
+   case IPPROTO_ICMP:
+   case IPPROTO_ICMPV6:
+      n = snprintf(out_str, len, "ICMP %s -> %s ", srcip, dstip);
+      break;
+
+   default:
+      n = snprintf(out_str, len, "Src: %s Dst: %s Proto: %d ", srcip, dstip, key->protocol);
+   }
+
+   return((n < len) ? n : len - 1);
+}
@@ -0,0 +1,579 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvflowtable.c
+
+   Title : Pivotal NST Flow Table
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Open addressing hash table for flow records.
+
+            A capture table is sized once at startup and every bucket is
+            allocated and touched before capture starts, so adding a flow
+            on the capture path never calls the allocator and never
+            rehashes. Buckets are cache line aligned records, the hash
+            fingerprint and the packet and byte counters sit in front of
+            the key so a probe and the counter update share one cache
+            line. The flow times and timer links are on the second line.
+
+            Collisions are resolved by linear probing. Deleted records are
+            marked and reused by later inserts, a run of deleted markers
+            that ends at an empty bucket is cleared straight away. The
+            table accepts flows up to 3/4 of the buckets, after that new
+            flows are counted in full_count and not recorded.
+
+            Under steady churn, e.g. flow aging, the deleted markers that
+            are not cleared would take the place of the empty buckets
+            that end the probe chains, and a miss would walk the whole
+            table. When the flows and markers reach the load limit and
+            the markers are PV_FLOW_REHASH_DELETED of the buckets, the
+            next insert rehashes the table in place, without allocating,
+            and the markers are gone. Records move in a rehash, a record
+            pointer is only valid until the next insert_flow().
+
+            A table off the capture path, e.g. the server's statistics,
+            can be made with init_growing_flow_table() instead. It starts
+            small and doubles its buckets when the flows reach the load
+            limit, up to a maximum, so a table that only ever sees a few
+            flows costs a few buckets. Records also move when the table
+            grows.
+
+            Packet updates can be queued with queue_flow_update(), the
+            queue is applied in batches: the home buckets of the whole
+            batch are prefetched first, then the batch is probed, so the
+            cache misses of the batch overlap instead of stalling one
+            packet at a time. When the table ages its flows the packet
+            timestamps of the batch also drive the timer wheel.
+
+            A table can also keep a top index of its largest records (see
+            pvtopindex.c) and a top window of its largest keys in each
+            recent interval (see pvtopwindow.c), both are kept up to date
+            by update_flow() and update_flow_event().
+
+            A table has one writer, there is no locking.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pvcommon.h"
+
+#define PV_FLOW_REHASH 3 /* in use, not yet moved by rehash_flow_table() */
+
+/* The bucket count for a number of flows, a power of two with at least 1/4 of the buckets left empty. */
+static uint32_t get_flow_table_size(uint32_t flows)
+{
+   uint32_t size = 64;
+
+   while ((size < 0x80000000U) && ((size / 4) * 3 < flows))
+      size <<= 1;
+
+   return(size);
+}
+
+/*
+   Function: init_flow_table
+   Purpose : Allocates the buckets for a table holding up to the given
+             number of flows. The bucket count is rounded up to a power
+             of two with at least 1/4 of the buckets left empty.
+   Input   : Table and maximum number of flows.
+   Return  : 0 on success, -1 on error.
+*/
+int init_flow_table(pv_flow_table_t *table, uint32_t flows)
+{
+   uint32_t size = get_flow_table_size(flows);
+   void *buckets;
+
+   memset(table, 0, sizeof(pv_flow_table_t));
+
+   if (posix_memalign(&buckets, PV_CACHE_LINE_SIZE, (size_t)size * sizeof(pv_ip_record_t)) != 0)
+   {
+      iprint_log_entry("init_flow_table() <ERROR> Could not allocate flow table buckets", size);
+      return(-1);
+   }
+
+   /* Touch every page now rather than on the capture path. */
+   memset(buckets, 0, (size_t)size * sizeof(pv_ip_record_t));
+
+   table->buckets = (pv_ip_record_t *)buckets;
+   table->size = size;
+   table->mask = size - 1;
+   table->max_count = (size / 4) * 3;
+
+   return(0);
+}
+
+/*
+   Function: init_growing_flow_table
+   Purpose : Allocates a table with room for a few flows that grows as
+             the flows arrive, see grow_flow_table().
+   Input   : Table, number of flows to start with and maximum number of
+             flows.
+   Return  : 0 on success, -1 on error.
+*/
+int init_growing_flow_table(pv_flow_table_t *table, uint32_t flows, uint32_t max_flows)
+{
+   if (init_flow_table(table, flows) < 0)
+      return(-1);
+
+   table->max_size = get_flow_table_size(max_flows);
+
+   return(0);
+}
+
+void free_flow_table(pv_flow_table_t *table)
+{
+   free_flow_timers(table);
+   free_flow_top(table);
+   free_flow_window(table);
+   free(table->buckets);
+   memset(table, 0, sizeof(pv_flow_table_t));
+}
+
+/* Removes every record, the buckets stay allocated. */
+void clear_flow_table(pv_flow_table_t *table)
+{
+   if (table->buckets != NULL)
+      memset(table->buckets, 0, (size_t)table->size * sizeof(pv_ip_record_t));
+   table->count = 0;
+   table->deleted = 0;
+   table->batch_count = 0;
+   clear_flow_timers(table);
+   clear_flow_top(table);
+   clear_flow_window(table);
+}
+
+/*
+   Function: probe_flow
+   Purpose : Walks the probe chain of a key until the key or an empty
+             bucket is found.
+   Input   : Table, key, key hash and a pointer that receives the first
+             free bucket of the chain (may be NULL).
+   Return  : The record holding the key or NULL.
+*/
+static pv_ip_record_t *probe_flow(pv_flow_table_t *table, const pv_flow_key_t *key, uint32_t hash, pv_ip_record_t **free_bucket)
+{
+   pv_ip_record_t *bucket;
+   uint32_t i = hash & table->mask;
+   uint32_t n;
+
+   for (n = 0; n < table->size; n++)
+   {
+      bucket = &table->buckets[i];
+
+      if (bucket->state == PV_FLOW_EMPTY)
+      {
+         if ((free_bucket != NULL) && (*free_bucket == NULL))
+            *free_bucket = bucket;
+         return(NULL);
+      }
+
+      if (bucket->state == PV_FLOW_DELETED)
+      {
+         if ((free_bucket != NULL) && (*free_bucket == NULL))
+            *free_bucket = bucket;
+      }
+      else if ((bucket->hash == hash) && (compare_flow_keys(&bucket->key, key) == 0))
+      {
+         return(bucket);
+      }
+
+      i = (i + 1) & table->mask;
+   }
+
+   return(NULL);
+}
+
+pv_ip_record_t *find_flow(pv_flow_table_t *table, const pv_flow_key_t *key, uint32_t hash)
+{
+   return(probe_flow(table, key, hash, NULL));
+}
+
+/*
+   Function: grow_flow_table
+   Purpose : Doubles the buckets of a growing table, putting every record
+             at the first empty bucket of its probe chain in the new
+             buckets. The deleted markers stay behind. The timer wheel
+             lists and the top index are linked again afterwards. A
+             table that cannot get the memory stops growing.
+   Input   : Table.
+   Return  : 0 on success, -1 on error.
+*/
+static int grow_flow_table(pv_flow_table_t *table)
+{
+   uint32_t size = table->size << 1;
+   uint32_t mask = size - 1;
+   pv_ip_record_t *buckets;
+   void *memory;
+   uint32_t i, j;
+
+   if (posix_memalign(&memory, PV_CACHE_LINE_SIZE, (size_t)size * sizeof(pv_ip_record_t)) != 0)
+   {
+      iprint_log_entry("grow_flow_table() <WARNING> Could not grow flow table buckets", size);
+      table->max_size = table->size;
+      return(-1);
+   }
+   buckets = (pv_ip_record_t *)memory;
+   memset(buckets, 0, (size_t)size * sizeof(pv_ip_record_t));
+
+   for (i = 0; i < table->size; i++)
+   {
+      if (table->buckets[i].state != PV_FLOW_IN_USE)
+         continue;
+      for (j = table->buckets[i].hash & mask; buckets[j].state != PV_FLOW_EMPTY; j = (j + 1) & mask)
+         ;
+      buckets[j] = table->buckets[i];
+   }
+
+   free(table->buckets);
+   table->buckets = buckets;
+   table->size = size;
+   table->mask = mask;
+   table->max_count = (size / 4) * 3;
+   table->deleted = 0;
+
+   relink_flow_timers(table);
+   relink_flow_top(table);
+
+   return(0);
+}
+
+/*
+   Function: rehash_flow_table
+   Purpose : Drops the deleted markers by putting every record back at
+             the first free bucket of its probe chain, in place. Records
+             already placed never move again, a record whose place holds
+             a record not yet placed swaps with it and the swapped record
+             is placed next. The timer wheel lists and the top index are
+             linked again afterwards.
+   Input   : Table.
+*/
+static void rehash_flow_table(pv_flow_table_t *table)
+{
+   pv_ip_record_t *buckets = table->buckets;
+   pv_ip_record_t temp;
+   uint32_t i, j;
+
+   for (i = 0; i < table->size; i++)
+   {
+      if (buckets[i].state == PV_FLOW_IN_USE)
+         buckets[i].state = PV_FLOW_REHASH;
+      else
+         buckets[i].state = PV_FLOW_EMPTY;
+   }
+
+   for (i = 0; i < table->size; i++)
+   {
+      while (buckets[i].state == PV_FLOW_REHASH)
+      {
+         j = buckets[i].hash & table->mask;
+         while (buckets[j].state == PV_FLOW_IN_USE)
+            j = (j + 1) & table->mask;
+
+         if (j == i)
+         {
+            buckets[i].state = PV_FLOW_IN_USE;
+         }
+         else if (buckets[j].state == PV_FLOW_EMPTY)
+         {
+            buckets[j] = buckets[i];
+            buckets[j].state = PV_FLOW_IN_USE;
+            buckets[i].state = PV_FLOW_EMPTY;
+         }
+         else
+         {
+            temp = buckets[j];
+            buckets[j] = buckets[i];
+            buckets[j].state = PV_FLOW_IN_USE;
+            buckets[i] = temp;
+         }
+      }
+   }
+
+   table->deleted = 0;
+   table->rehash_count++;
+
+   relink_flow_timers(table);
+   relink_flow_top(table);
+}
+
+/*
+   Function: insert_flow
+   Purpose : Finds the record for a key, adding a record with zero
+             counters if the key is not in the table.
+   Input   : Table, key and key hash.
+   Return  : The record, or NULL if the key is new and the table is full.
+*/
+pv_ip_record_t *insert_flow(pv_flow_table_t *table, const pv_flow_key_t *key, uint32_t hash)
+{
+   pv_ip_record_t *free_bucket = NULL;
+   pv_ip_record_t *record;
+
+   if ((record = probe_flow(table, key, hash, &free_bucket)) != NULL)
+      return(record);
+
+   if ((table->count < table->max_count) && (table->count + table->deleted >= table->max_count) &&
+       (table->deleted >= table->size / PV_FLOW_REHASH_DELETED))
+   {
+      rehash_flow_table(table);
+      free_bucket = NULL;
+      probe_flow(table, key, hash, &free_bucket);
+   }
+   else if ((table->count >= table->max_count) && (table->size < table->max_size) && (grow_flow_table(table) == 0))
+   {
+      free_bucket = NULL;
+      probe_flow(table, key, hash, &free_bucket);
+   }
+
+   if ((table->count >= table->max_count) || (free_bucket == NULL))
+   {
+      table->full_count++;
+      return(NULL);
+   }
+
+   if (free_bucket->state == PV_FLOW_DELETED)
+      table->deleted--;
+
+   memset(free_bucket, 0, sizeof(pv_ip_record_t));
+   free_bucket->hash = hash;
+   free_bucket->state = PV_FLOW_IN_USE;
+   free_bucket->key = *key;
+   free_bucket->timer_slot = PV_TIMER_NONE;
+   table->count++;
+
+   return(free_bucket);
+}
+
+/*
+   Function: delete_flow
+   Purpose : Removes a record. If the next bucket is empty no probe chain
+             runs through this bucket, so it and any deleted markers
+             before it become empty again.
+   Input   : Table and record.
+*/
+void delete_flow(pv_flow_table_t *table, pv_ip_record_t *record)
+{
+   uint32_t i = (uint32_t)(record - table->buckets);
+
+   if (record->state != PV_FLOW_IN_USE)
+      return;
+
+   remove_flow_timer(table, record);
+   remove_flow_top(table, record);
+   record->state = PV_FLOW_DELETED;
+   table->count--;
+   table->deleted++;
+
+   if (table->buckets[(i + 1) & table->mask].state != PV_FLOW_EMPTY)
+      return;
+
+   while (table->buckets[i].state == PV_FLOW_DELETED)
+   {
+      table->buckets[i].state = PV_FLOW_EMPTY;
+      table->deleted--;
+      i = (i - 1) & table->mask;
+   }
+}
+
+/*
+   Function: queue_flow_update
+   Purpose : Queues a packet for the flow counters, the queue is applied
+             when it holds PV_FLOW_BATCH_SIZE packets.
+   Input   : Table, flow key, packet length, packet timestamp and TCP
+             flags (0 for other protocols).
+*/
+void queue_flow_update(pv_flow_table_t *table, const pv_flow_key_t *key, long length, struct timeval *ts, uint8_t tcp_flags)
+{
+   pv_flow_update_t *update = &table->batch[table->batch_count];
+
+   update->key = *key;
+   update->length = length;
+   update->ts = *ts;
+   update->tcp_flags = tcp_flags;
+
+   if (++table->batch_count == PV_FLOW_BATCH_SIZE)
+      flush_flow_updates(table);
+}
+
+/*
+   Function: update_flow
+   Purpose : Applies one packet to its flow record, new flows are put on
+             the timer wheel, which is moved on to the packet's time first.
+             A packet time the wheel does not believe is taken as the
+             wheel time, so a corrupt timestamp cannot keep a flow alive.
+   Input   : Table and the packet update with its key hash set.
+   Return  : The flow record, or NULL if the flow is new and the table is
+             full.
+*/
+pv_ip_record_t *update_flow(pv_flow_table_t *table, pv_flow_update_t *update)
+{
+   pv_ip_record_t *record;
+   uint32_t now;
+
+   if ((now = advance_flow_timers(table, (uint32_t)update->ts.tv_sec)) < (uint32_t)update->ts.tv_sec)
+   {
+      update->ts.tv_sec = now;
+      update->ts.tv_usec = 0;
+   }
+   update_flow_window(table, &update->key, update->hash, (uint32_t)update->ts.tv_sec, 1, update->length);
+
+   if ((record = insert_flow(table, &update->key, update->hash)) == NULL)
+      return(NULL);
+
+   if (record->packet_count == 0)
+   {
+      record->first_seen = update->ts;
+      record->last_seen = update->ts;
+      add_flow_timer(table, record);
+   }
+   else if (timercmp(&update->ts, &record->last_seen, >))
+   {
+      record->last_seen = update->ts;
+   }
+   record->packet_count++;
+   record->data_size += update->length;
+   record->tcp_flags |= update->tcp_flags;
+   update_flow_top(table, record);
+
+   return(record);
+}
+
+/*
+   Function: update_flow_event
+   Purpose : Adds a packet or flow event received from a sensor to its
+             flow record. A flow event carries the counts of the flow
+             since the sensor last exported it. When the table ages its
+             flows the event times drive the timer wheel.
+   Input   : Table and decoded event.
+   Return  : The flow record, or NULL if the flow is new and the table is
+             full.
+*/
+pv_ip_record_t *update_flow_event(pv_flow_table_t *table, const pv_event_t *event)
+{
+   pv_ip_record_t *record;
+   const struct timeval *first = (event->kind == PV_RECORD_FLOW) ? &event->first_seen : &event->ts;
+   uint32_t hash = hash_flow_key(&event->key);
+   uint32_t now;
+   int created;
+
+   now = advance_flow_timers(table, (uint32_t)event->ts.tv_sec);
+   if (now > (uint32_t)event->ts.tv_sec)
+      now = (uint32_t)event->ts.tv_sec;
+   if (event->kind == PV_RECORD_FLOW)
+      update_flow_window(table, &event->key, hash, now, event->packet_count, event->data_size);
+   else
+      update_flow_window(table, &event->key, hash, now, 1, event->ip_len);
+
+   if ((record = insert_flow(table, &event->key, hash)) == NULL)
+      return(NULL);
+
+   created = (record->packet_count == 0);
+   if (created || timercmp(first, &record->first_seen, <))
+      record->first_seen = *first;
+   if (timercmp(&event->ts, &record->last_seen, >))
+      record->last_seen = event->ts;
+   if (created)
+      add_flow_timer(table, record);
+
+   if (event->kind == PV_RECORD_FLOW)
+   {
+      record->packet_count += event->packet_count;
+      record->data_size += event->data_size;
+   }
+   else
+   {
+      record->packet_count++;
+      record->data_size += event->ip_len;
+   }
+   record->tcp_flags |= event->tcp_flags;
+   update_flow_top(table, record);
+
+   return(record);
+}
+
+/*
+   Function: flush_flow_updates
+   Purpose : Applies the queued packets to the flow counters. The hashes
+             are computed and the home buckets prefetched for the whole
+             batch before any bucket is probed.
+   Input   : Table.
+*/
+void flush_flow_updates(pv_flow_table_t *table)
+{
+   pv_flow_update_t *update;
+   pv_ip_record_t *record;
+   int i;
+
+   for (i = 0; i < table->batch_count; i++)
+   {
+      update = &table->batch[i];
+      update->hash = hash_flow_key(&update->key);
+      record = &table->buckets[update->hash & table->mask];
+      __builtin_prefetch(record, 1, 3);
+      __builtin_prefetch(&record->first_seen, 1, 3);
+   }
+
+   for (i = 0; i < table->batch_count; i++)
+   {
+      update_flow(table, &table->batch[i]);
+   }
+
+   table->batch_count = 0;
+}
+
+/*
+   Function: get_next_flow
+   Purpose : Iterates over the records in bucket order.
+   Input   : Table and the current record, NULL for the first record.
+   Return  : The next record or NULL at the end of the table.
+*/
+pv_ip_record_t *get_next_flow(pv_flow_table_t *table, pv_ip_record_t *record)
+{
+   uint32_t i = (record == NULL) ? 0 : (uint32_t)(record - table->buckets) + 1;
+
+   if (table->buckets == NULL)
+      return(NULL);
+
+   for (; i < table->size; i++)
+   {
+      if (table->buckets[i].state == PV_FLOW_IN_USE)
+         return(&table->buckets[i]);
+   }
+
+   return(NULL);
+}
+
+/* Reverse of get_next_flow(), NULL starts from the last record. */
+pv_ip_record_t *get_prev_flow(pv_flow_table_t *table, pv_ip_record_t *record)
+{
+   uint32_t i = (record == NULL) ? table->size : (uint32_t)(record - table->buckets);
+
+   if (table->buckets == NULL)
+      return(NULL);
+
+   while (i-- > 0)
+   {
+      if (table->buckets[i].state == PV_FLOW_IN_USE)
+         return(&table->buckets[i]);
+   }
+
+   return(NULL);
+}
@@ -0,0 +1,230 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvformat.c
+
+   Title : Pivotal NST Event Formatting
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Builds event text without strcat() or sprintf().
+
+            A format buffer tracks its own length, so each append copies
+            only the new characters instead of scanning the string built
+            so far. Fixed text is appended with PV_APPEND_LITERAL(), which
+            takes the length from the string literal at compile time.
+            Numbers and IPv4 addresses are written straight into the
+            buffer, two digits at a time from a lookup table.
+
+            Appends past the end of the buffer are cut short, the buffer
+            is always NUL terminated so it can still be printed.
+
+            write_iov() writes a scatter-gather list in as few writev()
+            calls as possible, the output queues use it to write records
+            made of static fragments and formatted text without copying
+            them into one buffer first.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pvcommon.h"
+
+static const char digit_pairs[201] =
+   "00010203040506070809"
+   "10111213141516171819"
+   "20212223242526272829"
+   "30313233343536373839"
+   "40414243444546474849"
+   "50515253545556575859"
+   "60616263646566676869"
+   "70717273747576777879"
+   "80818283848586878889"
+   "90919293949596979899";
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+   Function: init_format_buffer
+   Purpose : Sets up a format buffer over caller storage.
+   Input   : Format buffer, storage and storage size.
+*/
+void init_format_buffer(pv_format_buffer_t *fb, char *data, int size)
+{
+   fb->data = data;
+   fb->size = size;
+   fb->length = 0;
+   data[0] = 0;
+}
+
+void append_string(pv_format_buffer_t *fb, const char *str, int len)
+{
+   if (fb->length + len >= fb->size)
+      len = fb->size - fb->length - 1;
+
+   memcpy(fb->data + fb->length, str, len);
+   fb->length += len;
+   fb->data[fb->length] = 0;
+}
+
+void append_cstring(pv_format_buffer_t *fb, const char *str)
+{
+   append_string(fb, str, strlen(str));
+}
+
+void append_char(pv_format_buffer_t *fb, char c)
+{
+   if (fb->length + 1 >= fb->size)
+      return;
+
+   fb->data[fb->length++] = c;
+   fb->data[fb->length] = 0;
+}
+
+/*
+   Function: append_uint
+   Purpose : Appends an unsigned decimal number, two digits per division.
+   Input   : Format buffer and number.
+*/
+void append_uint(pv_format_buffer_t *fb, unsigned long value)
+{
+   char digits[24];
+   int i = sizeof(digits);
+   int pair;
+
+   while (value >= 100)
+   {
+      pair = (int)(value % 100) * 2;
+      value /= 100;
+      digits[--i] = digit_pairs[pair + 1];
+      digits[--i] = digit_pairs[pair];
+   }
+
+   if (value >= 10)
+   {
+      pair = (int)value * 2;
+      digits[--i] = digit_pairs[pair + 1];
+      digits[--i] = digit_pairs[pair];
+   }
+   else
+   {
+      digits[--i] = '0' + (char)value;
+   }
+
+   append_string(fb, digits + i, sizeof(digits) - i);
+}
+
+void append_int(pv_format_buffer_t *fb, long value)
+{
+   if (value < 0)
+   {
+      append_char(fb, '-');
+      append_uint(fb, 0UL - (unsigned long)value);
+   }
+   else
+   {
+      append_uint(fb, (unsigned long)value);
+   }
+}
+
+/* Appends a lower case hexadecimal number without a 0x prefix. */
+void append_hex(pv_format_buffer_t *fb, unsigned long value)
+{
+   char digits[24];
+   int i = sizeof(digits);
+
+   do
+   {
+      digits[--i] = hex_digits[value & 0xf];
+      value >>= 4;
+   } while (value != 0);
+
+   append_string(fb, digits + i, sizeof(digits) - i);
+}
+
+/* Appends an IPv4 address in dotted decimal, replaces inet_ntoa(). */
+void append_ipv4(pv_format_buffer_t *fb, const struct in_addr *addr)
+{
+   const unsigned char *octet = (const unsigned char *)&addr->s_addr;
+
+   append_uint(fb, octet[0]);
+   append_char(fb, '.');
+   append_uint(fb, octet[1]);
+   append_char(fb, '.');
+   append_uint(fb, octet[2]);
+   append_char(fb, '.');
+   append_uint(fb, octet[3]);
+}
+
+/* Appends an IPv6 address, formatted by inet_ntop() straight into the buffer. */
+void append_ipv6(pv_format_buffer_t *fb, const struct in6_addr *addr)
+{
+   if (fb->size - fb->length < INET6_ADDRSTRLEN)
+      return;
+
+   if (inet_ntop(AF_INET6, addr, fb->data + fb->length, INET6_ADDRSTRLEN) != NULL)
+      fb->length += strlen(fb->data + fb->length);
+}
+
+/*
+   Function: write_iov
+   Purpose : Writes a scatter-gather list, IOV_MAX segments per writev()
+             call, carrying on after partial writes. The list is modified
+             as it is written.
+   Input   : File descriptor, segment list and number of segments.
+   Return  : Bytes written or -1 on error.
+*/
+long write_iov(int fd, struct iovec *iov, int count)
+{
+   long total = 0;
+   ssize_t k;
+
+   while (count > 0)
+   {
+      k = writev(fd, iov, (count < IOV_MAX) ? count : IOV_MAX);
+      if (k < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return(-1);
+      }
+      total += k;
+
+      while ((count > 0) && ((size_t)k >= iov->iov_len))
+      {
+         k -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (count > 0)
+      {
+         iov->iov_base = (char *)iov->iov_base + k;
+         iov->iov_len -= k;
+      }
+   }
+
+   return(total);
+}
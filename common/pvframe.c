@@ -0,0 +1,420 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvframe.c
+
+   Title : Pivotal NST Sensor Protocol Framing
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Frames the messages sent from the sensors to the server.
+
+            Every message starts with an 8 byte header:
+
+               byte 0    protocol version, PV_FRAME_VERSION
+               byte 1    message type, event, control, stats or alert
+               byte 2-3  flags, network byte order
+               byte 4-7  payload length, network byte order
+
+            followed by the payload. A frame can carry any number of
+            records, so the sensor sends a whole output queue as one frame
+            and the server never depends on how TCP splits or joins the
+            writes. Payloads are limited to PV_FRAME_MAX_PAYLOAD, longer
+            buffers are sent as several frames split at record ends.
+
+            The receiver reads the socket into a ring buffer and takes the
+            complete frames out of it. A payload that is contiguous in the
+            ring is used in place, only a payload that wraps around the end
+            of the ring is copied. The ring starts at the size the
+            connection asks for and doubles whenever a frame longer than
+            the ring arrives, so thousands of idle sensor connections do
+            not each hold room for the largest frame.
+
+            Over UDP each datagram carries one frame of whole records,
+            after the number of the sensor and the datagram's sequence
+            number. The server counts the gaps in the sequence instead
+            of asking for the lost datagrams again.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "pvcommon.h"
+
+/* Writes a frame header. */
+void set_frame_header(unsigned char *header, int type, int flags, uint32_t length)
+{
+   uint16_t nflags = htons((uint16_t)flags);
+   uint32_t nlength = htonl(length);
+
+   header[0] = PV_FRAME_VERSION;
+   header[1] = (unsigned char)type;
+   memcpy(header + 2, &nflags, 2);
+   memcpy(header + 4, &nlength, 4);
+}
+
+/*
+   Function: parse_frame_header
+   Purpose : Reads and checks a frame header.
+   Input   : Header bytes and the frame that receives the type, flags
+             and payload length.
+   Return  : 0 on success, -1 if the header is not valid.
+*/
+int parse_frame_header(const unsigned char *header, pv_frame_t *frame)
+{
+   uint16_t nflags;
+   uint32_t nlength;
+
+   if (header[0] != PV_FRAME_VERSION)
+   {
+      iprint_log_entry("parse_frame_header() <ERROR> Unsupported protocol version", header[0]);
+      return(-1);
+   }
+
+   if ((header[1] < PV_FRAME_EVENT) || (header[1] > PV_FRAME_ALERT))
+   {
+      iprint_log_entry("parse_frame_header() <ERROR> Unknown message type", header[1]);
+      return(-1);
+   }
+
+   memcpy(&nflags, header + 2, 2);
+   memcpy(&nlength, header + 4, 4);
+
+   frame->type = header[1];
+   frame->flags = ntohs(nflags);
+   frame->length = ntohl(nlength);
+
+   if (frame->length > PV_FRAME_MAX_PAYLOAD)
+   {
+      print_log_entry("parse_frame_header() <ERROR> Frame payload too long.\n");
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+   Function: get_frame_split
+   Purpose : Finds where to end the next frame of a long buffer, after the
+             last record that fits. Binary records (PV_FRAME_BINARY) are
+             walked by their length prefix with get_record_split(), text
+             records end with a newline.
+   Input   : Buffer, length and the frame flags.
+   Return  : Payload length of the next frame, -1 if no record end fits
+             in PV_FRAME_MAX_PAYLOAD.
+*/
+int get_frame_split(const char *buffer, int length, int flags)
+{
+   int i;
+
+   if (length <= PV_FRAME_MAX_PAYLOAD)
+      return(length);
+
+   if (flags & PV_FRAME_BINARY)
+   {
+      i = get_record_split(buffer, length, PV_FRAME_MAX_PAYLOAD, flags);
+      return((i > PV_FRAME_MAX_PAYLOAD) ? -1 : i);
+   }
+
+   for (i = PV_FRAME_MAX_PAYLOAD; i > 0; i--)
+   {
+      if (buffer[i - 1] == '\n')
+         return(i);
+   }
+
+   return(-1);
+}
+
+/*
+   Function: init_frame_reader
+   Purpose : Allocates the receive ring of a connection, the size is
+             rounded up to a power of two. See next_frame() for how the
+             ring grows.
+   Input   : Reader and ring size.
+   Return  : 0 on success, -1 on error.
+*/
+int init_frame_reader(pv_frame_reader_t *reader, uint32_t size)
+{
+   uint32_t ring_size = 4096;
+
+   memset(reader, 0, sizeof(pv_frame_reader_t));
+
+   while (ring_size < size)
+      ring_size <<= 1;
+
+   if ((reader->ring = malloc(ring_size)) == NULL)
+   {
+      iprint_log_entry("init_frame_reader() <ERROR> Could not allocate receive ring", ring_size);
+      return(-1);
+   }
+   reader->size = ring_size;
+   reader->mask = ring_size - 1;
+   reader->max_payload = PV_FRAME_MAX_PAYLOAD;
+
+   return(0);
+}
+
+/* Lowers the longest payload a reader accepts, a longer frame is taken as a corrupt stream before the ring grows for it. */
+void set_frame_reader_limit(pv_frame_reader_t *reader, uint32_t max_payload)
+{
+   if (max_payload < PV_FRAME_MAX_PAYLOAD)
+      reader->max_payload = max_payload;
+}
+
+void free_frame_reader(pv_frame_reader_t *reader)
+{
+   free(reader->ring);
+   free(reader->scratch);
+   memset(reader, 0, sizeof(pv_frame_reader_t));
+}
+
+/* Copies bytes out of the ring starting at a stream position. */
+static void copy_from_ring(pv_frame_reader_t *reader, uint32_t position, char *out, uint32_t length)
+{
+   uint32_t start = position & reader->mask;
+   uint32_t first = reader->size - start;
+
+   if (first >= length)
+   {
+      memcpy(out, reader->ring + start, length);
+   }
+   else
+   {
+      memcpy(out, reader->ring + start, first);
+      memcpy(out + first, reader->ring, length - first);
+   }
+}
+
+/*
+   Function: grow_frame_reader
+   Purpose : Moves the received data into a ring big enough for a frame,
+             at least double the size of the old ring.
+   Input   : Reader and the bytes the ring must hold.
+   Return  : 0 on success, -1 on error.
+*/
+static int grow_frame_reader(pv_frame_reader_t *reader, uint32_t needed)
+{
+   uint32_t used = reader->tail - reader->head;
+   uint32_t ring_size = reader->size << 1;
+   unsigned char *ring;
+
+   while (ring_size < needed)
+      ring_size <<= 1;
+
+   if ((ring = malloc(ring_size)) == NULL)
+   {
+      iprint_log_entry("grow_frame_reader() <ERROR> Could not allocate receive ring", ring_size);
+      return(-1);
+   }
+
+   copy_from_ring(reader, reader->head, (char *)ring, used);
+   free(reader->ring);
+   reader->ring = ring;
+   reader->size = ring_size;
+   reader->mask = ring_size - 1;
+   reader->head = 0;
+   reader->tail = used;
+
+   return(0);
+}
+
+/*
+   Function: read_frames
+   Purpose : Reads whatever the socket has into the free space of the
+             ring, with one readv() when the free space wraps.
+   Input   : Reader and socket.
+   Return  : Bytes read, 0 when the peer has closed, -1 on error.
+*/
+int read_frames(pv_frame_reader_t *reader, int sockfd)
+{
+   struct iovec iov[2];
+   uint32_t space = reader->size - (reader->tail - reader->head);
+   uint32_t start = reader->tail & reader->mask;
+   uint32_t first = reader->size - start;
+   ssize_t n;
+
+   if (space == 0)
+   {
+      print_log_entry("read_frames() <ERROR> Receive ring full.\n");
+      return(-1);
+   }
+
+   if (first > space)
+      first = space;
+
+   iov[0].iov_base = reader->ring + start;
+   iov[0].iov_len = first;
+   iov[1].iov_base = reader->ring;
+   iov[1].iov_len = space - first;
+
+   do
+   {
+      n = readv(sockfd, iov, (space > first) ? 2 : 1);
+   } while ((n < 0) && (errno == EINTR));
+
+   if (n > 0)
+   {
+      reader->tail += n;
+      reader->byte_count += n;
+   }
+
+   return((int)n);
+}
+
+/*
+   Function: feed_frames
+   Purpose : Copies received data into the free space of the ring, for
+             data that was not read by read_frames(), e.g. from an
+             io_uring receive buffer.
+   Input   : Reader, data and length.
+   Return  : Bytes copied, less than length if the ring is full. Take
+             the complete frames out with next_frame() and feed the rest.
+*/
+uint32_t feed_frames(pv_frame_reader_t *reader, const char *data, uint32_t length)
+{
+   uint32_t space = reader->size - (reader->tail - reader->head);
+   uint32_t start = reader->tail & reader->mask;
+   uint32_t first = reader->size - start;
+
+   if (length > space)
+      length = space;
+   if (first > length)
+      first = length;
+
+   memcpy(reader->ring + start, data, first);
+   memcpy(reader->ring, data + first, length - first);
+   reader->tail += length;
+   reader->byte_count += length;
+
+   return(length);
+}
+
+/*
+   Function: next_frame
+   Purpose : Takes the next complete frame out of the ring. The payload
+             points into the ring or the reader's scratch buffer and is
+             valid until the next call to read_frames() or next_frame().
+             The payload is not NUL terminated.
+   Input   : Reader and the frame to fill in.
+             A frame longer than the ring grows the ring before the rest
+             of it is read.
+   Return  : 1 for a frame, 0 if no complete frame has arrived yet, -1 if
+             the stream is corrupt.
+*/
+int next_frame(pv_frame_reader_t *reader, pv_frame_t *frame)
+{
+   unsigned char header[PV_FRAME_HEADER_SIZE];
+   uint32_t used = reader->tail - reader->head;
+   uint32_t start;
+
+   if (used < PV_FRAME_HEADER_SIZE)
+      return(0);
+
+   copy_from_ring(reader, reader->head, (char *)header, PV_FRAME_HEADER_SIZE);
+   if (parse_frame_header(header, frame) < 0)
+      return(-1);
+   if (frame->length > reader->max_payload)
+   {
+      iprint_log_entry("next_frame() <ERROR> Frame payload over the reader limit", (int)frame->length);
+      return(-1);
+   }
+
+   if (used < PV_FRAME_HEADER_SIZE + frame->length)
+   {
+      if ((PV_FRAME_HEADER_SIZE + frame->length > reader->size) && (grow_frame_reader(reader, PV_FRAME_HEADER_SIZE + frame->length) < 0))
+         return(-1);
+      return(0);
+   }
+
+   start = (reader->head + PV_FRAME_HEADER_SIZE) & reader->mask;
+   if (start + frame->length <= reader->size)
+   {
+      frame->payload = (char *)reader->ring + start;
+   }
+   else
+   {
+      if (reader->scratch_size < frame->length)
+      {
+         reader->scratch = xrealloc(reader->scratch, frame->length);
+         reader->scratch_size = frame->length;
+      }
+      copy_from_ring(reader, reader->head + PV_FRAME_HEADER_SIZE, reader->scratch, frame->length);
+      frame->payload = reader->scratch;
+   }
+
+   reader->head += PV_FRAME_HEADER_SIZE + frame->length;
+   reader->frame_count++;
+
+   return(1);
+}
+
+/*
+   Function: set_datagram_header
+   Purpose : Writes the header of a UDP datagram, the sensor number and
+             sequence number followed by the frame header.
+   Input   : Header of PV_DATAGRAM_HEADER_SIZE bytes, sensor number,
+             sequence number, message type, flags and payload length.
+*/
+void set_datagram_header(unsigned char *header, uint32_t sensor, uint32_t sequence, int type, int flags, uint32_t length)
+{
+   uint32_t nsensor = htonl(sensor);
+   uint32_t nsequence = htonl(sequence);
+
+   memcpy(header, &nsensor, 4);
+   memcpy(header + 4, &nsequence, 4);
+   set_frame_header(header + 8, type, flags, length);
+}
+
+/*
+   Function: parse_datagram
+   Purpose : Reads and checks a datagram from a sensor, the frame
+             payload points into the datagram.
+   Input   : Datagram, length and pointers that receive the sensor
+             number, sequence number and the frame.
+   Return  : 0 on success, -1 if the datagram is not valid.
+*/
+int parse_datagram(const unsigned char *datagram, int length, uint32_t *sensor, uint32_t *sequence, pv_frame_t *frame)
+{
+   uint32_t nsensor, nsequence;
+
+   if (length < PV_DATAGRAM_HEADER_SIZE)
+      return(-1);
+
+   if (parse_frame_header(datagram + 8, frame) < 0)
+      return(-1);
+
+   if (frame->length != (uint32_t)(length - PV_DATAGRAM_HEADER_SIZE))
+   {
+      print_log_entry("parse_datagram() <ERROR> Datagram length does not match the frame.\n");
+      return(-1);
+   }
+
+   memcpy(&nsensor, datagram, 4);
+   memcpy(&nsequence, datagram + 4, 4);
+   *sensor = ntohl(nsensor);
+   *sequence = ntohl(nsequence);
+   frame->payload = (char *)datagram + PV_DATAGRAM_HEADER_SIZE;
+
+   return(0);
+}
@@ -1,4 +1,3 @@
-
 /*  Copyright 2014 Derek Chadwick
 
     This file is part of the Pivotal Network Security Tools.
@@ -24,106 +23,625 @@
    Author: Derek Chadwick
    Date  : 06/07/2014
 
-   Purpose: A wrapper for uthash, used to store IP addresses extracted from
-            packet captures.
+   Purpose: A wrapper for the flow tables, used to store IP addresses
+            extracted from packet captures.
+
+            Each capture worker thread owns its flow tables (selected by
+            the map_id, which is the worker id) so the capture path never
+            takes a lock. The tables are preallocated by init_ip_maps()
+            before capture starts. When aging is on, flows that time out
+            are exported and removed by the flow table timer wheel, so the
+            maps only hold the active flows.
+
+            For periodic export each worker has two tables, the active
+            table and the standby table. The exporter thread bumps the
+            map epoch with request_ip_map_swap(), each worker notices the
+            new epoch at its next block boundary in check_ip_map_swap()
+            and starts using its standby table. Once every worker has
+            swapped the exporter owns the old tables: export_ip_maps()
+            merges and renders them, then clears them ready to be the
+            standby tables for the next interval. The only cost to the
+            capture path is one read of the epoch per block, a worker
+            that swaps wakes the exporter sleeping in wait_ip_map_swap().
+            A swap starts
+            every flow afresh, so an active timeout as long as the export
+            interval never fires.
+
+            The packet cap of flow summary mode (-k) counts the packets of
+            each flow in a third table per worker (start_ip_map_cap()),
+            which the swaps leave alone.
+
+            write_ip_map(), format_shutdown_ip_map() and print_ip_map()
+            merge every table and must be called once the capture workers
+            and the exporter have stopped.
+
+            The maps are exported either as an <eventstatistics> block or,
+            in flow summary mode, as one Fineline FLOW event per flow.
+
+*/
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-*/
-
 #include "pvcommon.h"
 
-pv_ip_record_t *ip_map = NULL; /* the hash map head record */
+pv_flow_table_t ip_tables[PV_MAX_CAPTURE_WORKERS][2]; /* active and standby tables of each worker */
+pv_flow_table_t *ip_map[PV_MAX_CAPTURE_WORKERS];      /* the active table of each worker */
+pv_flow_table_t cap_tables[PV_MAX_CAPTURE_WORKERS];   /* packets of each flow for the packet cap, kept over the swaps */
+int ip_map_count = 1;
+int ip_map_buffers = 1;
+volatile int ip_map_epoch = 0;                         /* written by the exporter */
+volatile int ip_map_swapped[PV_MAX_CAPTURE_WORKERS];   /* epoch each worker is on, written by the worker */
+pthread_mutex_t ip_swap_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ip_swap_cond = PTHREAD_COND_INITIALIZER;  /* signalled when a worker swaps or the wait is cancelled */
+int ip_swap_cancelled = 0;
+unsigned int flow_table_size = PV_FLOW_TABLE_SIZE;
+unsigned int flow_idle_timeout = PV_FLOW_IDLE_TIMEOUT;
+unsigned int flow_active_timeout = PV_FLOW_ACTIVE_TIMEOUT;
+int ip_map_flow_events = 0;
+
+/* Number of flows each worker table can hold, call before init_ip_maps(). */
+void set_flow_table_size(unsigned int flows)
+{
+   if (flows > 0)
+      flow_table_size = flows;
+}
+
+/* Flow aging timeouts in seconds, an idle timeout of 0 turns aging off. */
+void set_flow_timeouts(unsigned int idle_timeout, unsigned int active_timeout)
+{
+   flow_idle_timeout = idle_timeout;
+   flow_active_timeout = active_timeout;
+}
+
+/* Non zero exports the maps as Fineline FLOW events instead of statistics. */
+void set_ip_map_format(int flow_events)
+{
+   ip_map_flow_events = flow_events;
+}
+
+/*
+   Function: init_ip_maps
+   Purpose : Allocates the flow tables for each capture worker.
+   Input   : Number of maps, number of tables per map (2 for periodic
+             export, 1 otherwise).
+   Return  : 0 on success, -1 on error.
+*/
+int init_ip_maps(int count, int buffers)
+{
+   int i, j;
+
+   if ((count < 1) || (count > PV_MAX_CAPTURE_WORKERS) || (buffers < 1) || (buffers > 2))
+   {
+      iprint_log_entry("init_ip_maps() <ERROR> Invalid map count", count);
+      return(-1);
+   }
+
+   for (i = 0; i < count; i++)
+   {
+      for (j = 0; j < buffers; j++)
+      {
+         if (init_flow_table(&ip_tables[i][j], flow_table_size) < 0)
+         {
+            while (j-- > 0)
+               free_flow_table(&ip_tables[i][j]);
+            while (i-- > 0)
+            {
+               for (j = 0; j < buffers; j++)
+                  free_flow_table(&ip_tables[i][j]);
+            }
+            return(-1);
+         }
+      }
+      ip_map[i] = &ip_tables[i][0];
+      ip_map_swapped[i] = ip_map_epoch;
+   }
+   ip_map_count = count;
+   ip_map_buffers = buffers;
+
+   iprint_log_entry("init_ip_maps() <INFO> Flow table buckets per worker", ip_tables[0][0].size);
+
+   return(0);
+}
+
+/*
+   Function: start_ip_map_aging
+   Purpose : Turns on flow aging for a map with the configured timeouts,
+             expired flows are passed to the expire function and then
+             removed from the map.
+   Input   : Map id, expire function and its user data.
+   Return  : 0 on success, -1 on error.
+*/
+int start_ip_map_aging(int map_id, pv_flow_expire_func func, void *user)
+{
+   int j;
+
+   if (flow_idle_timeout == 0)
+      return(0);
+
+   for (j = 0; j < ip_map_buffers; j++)
+   {
+      if (init_flow_timers(&ip_tables[map_id][j], flow_idle_timeout, flow_active_timeout, func, user) < 0)
+         return(-1);
+   }
+
+   return(0);
+}
+
+pv_ip_record_t *add_ip(int map_id, pv_flow_key_t *key)
+{
+   return(insert_flow(ip_map[map_id], key, hash_flow_key(key)));
+}
+
+pv_ip_record_t *find_ip(int map_id, pv_flow_key_t *key)
+{
+   return(find_flow(ip_map[map_id], key, hash_flow_key(key)));
+}
+
+/* Counts a packet against its flow, the update is applied in a batch. */
+void update_ip(int map_id, pv_flow_key_t *key, long length, struct timeval *ts, uint8_t tcp_flags)
+{
+   queue_flow_update(ip_map[map_id], key, length, ts, tcp_flags);
+}
+
+/* Packet cap counts of idle flows just leave the table. */
+static void expire_ip_map_cap(void *user, pv_ip_record_t *record, int reason)
+{
+}
+
+/*
+   Function: start_ip_map_cap
+   Purpose : Counts the packets of each flow of a map for the packet cap
+             (-k) in a table of its own. The export swaps and the active
+             timeout do not touch it, so a flow's count only ends when a
+             FIN or RST closes the flow or the flow goes idle.
+   Input   : Map id.
+   Return  : 0 on success, -1 on error.
+*/
+int start_ip_map_cap(int map_id)
+{
+   pv_flow_table_t *table = &cap_tables[map_id];
+
+   if (init_flow_table(table, flow_table_size) < 0)
+      return(-1);
+
+   if ((flow_idle_timeout > 0) && (init_flow_timers(table, flow_idle_timeout, PV_FLOW_CAP_ACTIVE, expire_ip_map_cap, NULL) < 0))
+   {
+      free_flow_table(table);
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+   Function: count_ip_map_cap
+   Purpose : Counts a packet against its flow for the packet cap, see
+             start_ip_map_cap(). A FIN or RST ends the count after the
+             packet.
+   Input   : Map id, flow key, packet length, packet timestamp and TCP
+             flags.
+   Return  : Packets of the flow so far, 0 if the flow is new and the
+             table is full.
+*/
+long count_ip_map_cap(int map_id, pv_flow_key_t *key, long length, struct timeval *ts, uint8_t tcp_flags)
+{
+   pv_flow_table_t *table = &cap_tables[map_id];
+   pv_flow_update_t update;
+   pv_ip_record_t *record;
+   long packets;
+
+   update.key = *key;
+   update.hash = hash_flow_key(key);
+   update.length = length;
+   update.ts = *ts;
+   update.tcp_flags = tcp_flags;
+
+   if ((record = update_flow(table, &update)) == NULL)
+      return(0);
+
+   packets = record->packet_count;
+   if (tcp_flags & (TH_FIN | TH_RST))
+      delete_flow(table, record);
 
-void add_ip(pv_ip_record_t *flip)
+   return(packets);
+}
+
+void flush_ip_updates(int map_id)
+{
+   flush_flow_updates(ip_map[map_id]);
+}
+
+/*
+   Function: check_ip_map_swap
+   Purpose : Called by the worker that owns the map between packets. If
+             the exporter has asked for a swap the queued updates are
+             applied to the old table and the worker moves on to its
+             standby table.
+   Input   : Map id.
+*/
+void check_ip_map_swap(int map_id)
 {
-    pv_ip_record_t *s;
+   int epoch = ip_map_epoch;
+
+   if (ip_map_swapped[map_id] == epoch)
+      return;
+
+   flush_flow_updates(ip_map[map_id]);
+   ip_map[map_id] = (ip_map[map_id] == &ip_tables[map_id][0]) ? &ip_tables[map_id][1] : &ip_tables[map_id][0];
 
-    HASH_FIND_STR(ip_map, flip->key_value , s);  /* id already in the hash? */
-    if (s == NULL)
-    {
-      HASH_ADD_STR(ip_map, key_value, flip);  /* id: name of key field */
-    }
+   __sync_synchronize(); /* The old table is complete before the exporter sees the epoch. */
+   ip_map_swapped[map_id] = epoch;
 
+   pthread_mutex_lock(&ip_swap_lock);
+   pthread_cond_signal(&ip_swap_cond);
+   pthread_mutex_unlock(&ip_swap_lock);
 }
 
-pv_ip_record_t *find_ip(char *lookup_string)
+/* Exporter side, asks every worker to swap tables. Returns the new epoch. */
+int request_ip_map_swap()
 {
-    pv_ip_record_t *s;
+   if (ip_map_buffers < 2)
+      return(ip_map_epoch);
+
+   return(__sync_add_and_fetch(&ip_map_epoch, 1));
+}
+
+/* Returns 1 once every worker has swapped to the epoch. */
+static int ip_maps_swapped(int epoch)
+{
+   int i;
+
+   for (i = 0; i < ip_map_count; i++)
+   {
+      if (ip_map_swapped[i] != epoch)
+         return(0);
+   }
+   __sync_synchronize();
+
+   return(1);
+}
+
+/*
+   Function: wait_ip_map_swap
+   Purpose : Exporter side, sleeps until every worker has moved to its
+             standby table. Workers check between ring blocks and on each
+             poll timeout so the wait is normally a few milliseconds.
+   Input   : Epoch returned by request_ip_map_swap().
+   Return  : 1 once every worker has swapped, 0 if the wait was
+             cancelled first.
+*/
+int wait_ip_map_swap(int epoch)
+{
+   int swapped;
+
+   pthread_mutex_lock(&ip_swap_lock);
+   while (!(swapped = ip_maps_swapped(epoch)) && !ip_swap_cancelled)
+      pthread_cond_wait(&ip_swap_cond, &ip_swap_lock);
+   pthread_mutex_unlock(&ip_swap_lock);
 
-    HASH_FIND_STR(ip_map, lookup_string, s);  /* s: output pointer */
-    return s;
+   return(swapped);
 }
 
-pv_ip_record_t *get_first_ip_record()
+/* Wakes the exporter from wait_ip_map_swap() for good, used when it is stopped. */
+void cancel_ip_map_swap()
 {
-   return(ip_map);
+   pthread_mutex_lock(&ip_swap_lock);
+   ip_swap_cancelled = 1;
+   pthread_cond_signal(&ip_swap_cond);
+   pthread_mutex_unlock(&ip_swap_lock);
 }
 
-pv_ip_record_t *get_last_ip_record()
+pv_ip_record_t *get_first_ip_record(int map_id)
 {
-   pv_ip_record_t *s = get_first_ip_record();
-   if (s != NULL)
-      return((pv_ip_record_t *)s->hh.prev);
+   return(get_next_flow(ip_map[map_id], NULL));
+}
+
+pv_ip_record_t *get_next_ip_record(int map_id, pv_ip_record_t *ip_record)
+{
+   return(get_next_flow(ip_map[map_id], ip_record));
+}
 
-   return(NULL);
+pv_ip_record_t *get_last_ip_record(int map_id)
+{
+   return(get_prev_flow(ip_map[map_id], NULL));
 }
 
-void delete_ip(pv_ip_record_t *ip_record)
+void delete_ip(int map_id, pv_ip_record_t *ip_record)
 {
-   HASH_DEL(ip_map, ip_record);  /* event: pointer to deletee */
-   free(ip_record);
+   delete_flow(ip_map[map_id], ip_record);
 }
 
 void delete_all_ips()
 {
-   pv_ip_record_t *current_ip, *tmp;
+   int i, j;
 
-   HASH_ITER(hh, ip_map, current_ip, tmp)
+   for (i = 0; i < ip_map_count; i++)
    {
-      HASH_DEL(ip_map,current_ip);  /* delete it (ip_map advances to next) */
-      free(current_ip);              /* free it */
+      for (j = 0; j < ip_map_buffers; j++)
+         clear_flow_table(&ip_tables[i][j]);
    }
 }
 
-void write_ip_map(FILE *outfile)
+/* The standby table of a map, owned by the exporter once the map has swapped. */
+static pv_flow_table_t *get_standby_table(int map_id)
 {
-   pv_ip_record_t *s;
-   char out_str[PV_MAX_INPUT_STR];
-
-   fputs("<eventstatistics>\n", outfile);
-   for(s=ip_map; s != NULL; s=(pv_ip_record_t *)(s->hh.next))
-   {
-      sprintf(out_str, "%s Packet Count %ld Data Size %ld\n", s->key_value, s->packet_count, s->data_size);
-      fputs(out_str, outfile);
-   }
-   fputs("</eventstatistics>\n", outfile);
-
-   return;
+   return((ip_map[map_id] == &ip_tables[map_id][0]) ? &ip_tables[map_id][1] : &ip_tables[map_id][0]);
+}
+
+/*
+   Function: merge_ip_maps
+   Purpose : Combines the maps into a single temporary table, records
+             for the same key have their counters summed. Either only the
+             standby tables (periodic export) or every table (final
+             export) are merged. The final export does not apply queued
+             updates, the workers flush them first so the flows they
+             expire are written while the outputs are open. With one
+             table the table is returned as is.
+   Input   : Non zero to merge only the standby tables.
+   Return  : Merged table, release with free_merged_map().
+*/
+static pv_flow_table_t *merge_ip_maps(int standby_only)
+{
+   pv_flow_table_t *tables[PV_MAX_CAPTURE_WORKERS * 2];
+   pv_flow_table_t *merged;
+   pv_ip_record_t *s, *m;
+   uint32_t total = 0;
+   int i, j, n = 0;
+
+   for (i = 0; i < ip_map_count; i++)
+   {
+      if (standby_only)
+      {
+         tables[n++] = get_standby_table(i);
+         continue;
+      }
+      for (j = 0; j < ip_map_buffers; j++)
+         tables[n++] = &ip_tables[i][j];
+   }
+
+   if (n == 1)
+      return(tables[0]);
+
+   for (i = 0; i < n; i++)
+      total += tables[i]->count;
+
+   merged = xcalloc(sizeof(pv_flow_table_t));
+   if (init_flow_table(merged, total) < 0)
+   {
+      free(merged);
+      return(NULL);
+   }
+
+   for (i = 0; i < n; i++)
+   {
+      for (s = get_next_flow(tables[i], NULL); s != NULL; s = get_next_flow(tables[i], s))
+      {
+         if ((m = insert_flow(merged, &s->key, s->hash)) != NULL)
+         {
+            if ((m->packet_count == 0) || timercmp(&s->first_seen, &m->first_seen, <))
+               m->first_seen = s->first_seen;
+            if (timercmp(&s->last_seen, &m->last_seen, >))
+               m->last_seen = s->last_seen;
+            m->packet_count += s->packet_count;
+            m->data_size += s->data_size;
+            m->tcp_flags |= s->tcp_flags;
+         }
+      }
+      merged->full_count += tables[i]->full_count;
+   }
+
+   return(merged);
+}
+
+static void free_merged_map(pv_flow_table_t *merged)
+{
+   int i, j;
+
+   if (merged == NULL)
+      return;
+
+   for (i = 0; i < ip_map_count; i++)
+   {
+      for (j = 0; j < ip_map_buffers; j++)
+      {
+         if (merged == &ip_tables[i][j])
+            return;
+      }
+   }
+
+   free_flow_table(merged);
+   free(merged);
 }
 
-void send_ip_map(int sock_desc)
+/*
+   Function: format_flow_record
+   Purpose : Renders the summary of a flow as Fineline event data: the
+             flow key, packet and byte counts, first and last packet
+             times, the TCP flags seen and why the record was written.
+   Input   : Flow record, reason string, output string and length.
+   Return  : Length of the string.
+*/
+int format_flow_record(pv_ip_record_t *record, const char *reason, char *event_data, int len)
+{
+   pv_event_t event;
+
+   set_flow_event(&event, record, reason);
+
+   return(format_event_data(&event, event_data, len));
+}
+
+/*
+   Function: format_ip_map
+   Purpose : Renders a table as an <eventstatistics> block, one line per
+             flow, or as one Fineline FLOW event per flow, growing the
+             buffer as needed.
+   Input   : Table, reason written in FLOW events, buffer pointer and
+             buffer size pointer.
+   Return  : Length of the rendered block.
+*/
+static int format_ip_map(pv_flow_table_t *table, const char *reason, char **buffer, int *size)
 {
    pv_ip_record_t *s;
+   char key_str[PV_FLOW_KEY_STR];
+   char event_data[PV_EVENT_DATA_STR];
+   int length = 0;
+
+   if (*size < 2 * PV_MAX_INPUT_STR)
+   {
+      *buffer = xrealloc(*buffer, 2 * PV_MAX_INPUT_STR);
+      *size = 2 * PV_MAX_INPUT_STR;
+   }
+   (*buffer)[0] = 0;
+
+   if (!ip_map_flow_events)
+   {
+      strcpy(*buffer, "<eventstatistics>\n");
+      length = strlen(*buffer);
+   }
+
+   for (s = get_next_flow(table, NULL); s != NULL; s = get_next_flow(table, s))
+   {
+      if (length + PV_MAX_INPUT_STR > *size)
+      {
+         *size *= 2;
+         *buffer = xrealloc(*buffer, *size);
+      }
+      if (ip_map_flow_events)
+      {
+         format_flow_record(s, reason, event_data, sizeof(event_data));
+         length += create_event_record(*buffer + length, event_data, &s->last_seen);
+      }
+      else
+      {
+         format_flow_key(&s->key, key_str, PV_FLOW_KEY_STR);
+         length += sprintf(*buffer + length, "%s Packet Count %ld Data Size %ld\n", key_str, s->packet_count, s->data_size);
+      }
+   }
+
+   if (!ip_map_flow_events)
+   {
+      strcpy(*buffer + length, "</eventstatistics>\n");
+      length += strlen(*buffer + length);
+   }
+
+   return(length);
+}
+
+/*
+   Function: export_ip_maps
+   Purpose : Exporter side, renders the standby tables once every worker
+             has swapped, then clears them for the next interval.
+   Input   : Buffer pointer and buffer size pointer, the buffer is
+             reused between calls.
+   Return  : Length of the rendered block, -1 on error.
+*/
+int export_ip_maps(char **buffer, int *size)
+{
+   pv_flow_table_t *merged;
+   int length, i;
+
+   if (ip_map_buffers < 2)
+      return(-1);
+
+   if ((merged = merge_ip_maps(1)) == NULL)
+      return(-1);
+
+   length = format_ip_map(merged, "interval", buffer, size);
+   free_merged_map(merged);
+
+   for (i = 0; i < ip_map_count; i++)
+   {
+      clear_flow_table(get_standby_table(i));
+   }
+
+   return(length);
+}
+
+void write_ip_map(FILE *outfile)
+{
+   pv_flow_table_t *merged = merge_ip_maps(0);
+   char *buffer = NULL;
+   int size = 0;
+   int length;
+
+   if (merged == NULL)
+      return;
+
+   length = format_ip_map(merged, "shutdown", &buffer, &size);
+   fwrite(buffer, 1, length, outfile);
+
+   free(buffer);
+   free_merged_map(merged);
 
-   for(s=ip_map; s != NULL; s=(pv_ip_record_t *)(s->hh.next))   {
-      send_event(sock_desc, s->key_value);
-        /* TODO: serialize the record as a Fineline event and send to server. */
-   }
-
    return;
 }
 
+/*
+   Function: format_shutdown_ip_map
+   Purpose : Renders the merged maps for the server at shutdown.
+   Input   : Pointers to the buffer and its size, grown as needed, and
+             a pointer that receives the frame type.
+   Return  : Length of the rendered map, 0 if there are no maps.
+*/
+int format_shutdown_ip_map(char **buffer, int *size, int *type)
+{
+   pv_flow_table_t *merged = merge_ip_maps(0);
+   int length;
+
+   if (merged == NULL)
+      return(0);
+
+   length = format_ip_map(merged, "shutdown", buffer, size);
+   *type = ip_map_flow_events ? PV_FRAME_EVENT : PV_FRAME_STATS;
+
+   free_merged_map(merged);
+
+   return(length);
+}
+
 void print_ip_map()
 {
+   pv_flow_table_t *merged = merge_ip_maps(0);
    pv_ip_record_t *s;
+   char key_str[PV_FLOW_KEY_STR];
+   unsigned long expired = 0;
+   unsigned long ignored = 0;
+   int i, j;
+
+   if (merged == NULL)
+      return;
 
-   for(s=ip_map; s != NULL; s=(pv_ip_record_t *)(s->hh.next))
+   for (s = get_next_flow(merged, NULL); s != NULL; s = get_next_flow(merged, s))
    {
-      printf("Packet Data: %s\n", s->key_value);
-      printf("Packets: %ld\n", s->packet_count);
-      printf("Data Size: %ld\n", s->data_size);
+      format_flow_key(&s->key, key_str, PV_FLOW_KEY_STR);
+      printf("Packet Data: %s\n", key_str);
+      printf("Packets: %ld\n", s->packet_count);
+      printf("Data Size: %ld\n", s->data_size);
       printf("--------------------------------------------------------\n");
-   }
-
+   }
+
+   if (merged->full_count > 0)
+      printf("Flow table full: %lu new flows not recorded\n", merged->full_count);
+
+   for (i = 0; i < ip_map_count; i++)
+   {
+      for (j = 0; j < ip_map_buffers; j++)
+      {
+         if (ip_tables[i][j].timers != NULL)
+         {
+            expired += ip_tables[i][j].timers->expired_count;
+            ignored += ip_tables[i][j].timers->ignored_count;
+         }
+      }
+   }
+   if (expired > 0)
+      printf("Flows expired and exported: %lu\n", expired);
+   if (ignored > 0)
+      printf("Packet times too far ahead, not believed: %lu\n", ignored);
+
+   free_merged_map(merged);
+
    return;
 }
-
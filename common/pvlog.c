@@ -69,18 +69,13 @@ int open_log_file(char *startup_path)
 */
 int print_log_entry(char *estr)
 {
-   time_t curtime;
-   struct tm *loctime;
    int slen = strlen(estr);
    char *log_entry = (char *)xcalloc(slen + 100);
-   char *time_str;
+   int tlen;
 
    /* Get the current time. */
-   curtime = time (NULL);
-   loctime = localtime (&curtime);
-   time_str = asctime(loctime);
-   strncpy(log_entry, time_str, strlen(time_str) - 1);
-   strncat(log_entry, " ", 1);
+   tlen = format_log_time(log_entry);
+   log_entry[tlen] = ' ';
    strncat(log_entry, estr, slen);
    fputs (log_entry, log_file);
    printf("%s", log_entry);
@@ -92,16 +87,12 @@ int print_log_entry(char *estr)
 
 int sprint_log_entry(char *estr, char *eval)
 {
-   time_t curtime;
-   struct tm *loctime;
    int slen = strlen(estr) + strlen(eval) + 100;
    char *log_entry = (char *)xcalloc(slen);
-   char *time_str;
+   char time_str[PV_TIME_STR];
 
    /* Get the current time. */
-   curtime = time (NULL);
-   loctime = localtime (&curtime);
-   time_str = asctime(loctime);
+   format_log_time(time_str);
    sprintf(log_entry, "%s %s : %s\n", time_str, estr, eval);
    fputs (log_entry, log_file);
    printf("%s", log_entry);
@@ -113,16 +104,12 @@ int sprint_log_entry(char *estr, char *eval)
 
 int iprint_log_entry(char *estr, int ival)
 {
-   time_t curtime;
-   struct tm *loctime;
    int slen = strlen(estr) + 100;
    char *log_entry = (char *)xcalloc(slen);
-   char *time_str;
+   char time_str[PV_TIME_STR];
 
    /* Get the current time. */
-   curtime = time (NULL);
-   loctime = localtime (&curtime);
-   time_str = asctime(loctime);
+   format_log_time(time_str);
    sprintf(log_entry, "%s %s: %d\n", time_str, estr, ival);
    fputs (log_entry, log_file);
    printf("%s", log_entry);
@@ -0,0 +1,665 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvrecord.c
+
+   Title : Pivotal NST Event Records
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: The two forms of a packet or flow event: the Fineline text
+            record written to .fle files, and the compact binary record a
+            sensor sends to the server once the server has accepted the
+            binary encoding in reply to the sensor's hello.
+
+            A binary record is a varint length followed by:
+
+               byte    record kind, PV_RECORD_PACKET or PV_RECORD_FLOW
+               varint  time seconds, time microseconds, sensor number
+               byte    address family (4 or 6), IP protocol
+               4/16    source address, destination address
+               varint  source port, destination port (TCP and UDP only)
+
+            then for a packet:
+
+               varint  IPv4 ID or IPv6 flow label
+               byte    TOS or traffic class, TTL or hop limit
+               byte    header length (IPv4 only)
+               varint  datagram length or IPv6 payload length
+               TCP     byte flags, varint seq, ack and window, byte header length
+               ICMP    byte type and code, varint ID and sequence
+
+            and for a flow:
+
+               varint  packets, bytes, start seconds, start microseconds
+               byte    TCP flags (TCP only)
+               byte    reason length, then the reason text
+
+            Varints are little endian base 128, 7 bits per byte with the
+            top bit set on every byte but the last. A TCP packet over IPv4
+            takes about 40 bytes instead of the 400 of its Fineline record.
+            The length prefix lets a reader skip record kinds it does not
+            know.
+
+            The server turns binary records back into Fineline text with
+            the same formatting code the sensor uses, so a .fle log is the
+            same whichever encoding the sensor sent.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include "pvcommon.h"
+
+/* TODO: put an actual sensor id in the id field. */
+#define EVENT_HEAD   "<event><id>" PV_SENSOR_ID "</id><evidencenumber>NONE</evidencenumber><time>"
+#define EVENT_MIDDLE "</time><type>1</type><summary>Pivot Sensor Packet Event</summary><data>"
+#define EVENT_TAIL   "</data><hiddenevent>0</hiddenevent><hiddentext>0</hiddentext><marked>0</marked><pinned>0</pinned><ypos>0</ypos></event>\n"
+
+/* Static record fragments, indexed by PV_EVENT_HEAD, PV_EVENT_TAIL and PV_EVENT_TAIL_HEAD. */
+struct iovec event_fragments[3] =
+{
+   { EVENT_HEAD, sizeof(EVENT_HEAD) - 1 },
+   { EVENT_TAIL, sizeof(EVENT_TAIL) - 1 },
+   { EVENT_TAIL EVENT_HEAD, sizeof(EVENT_TAIL EVENT_HEAD) - 1 }
+};
+
+/*
+   Function: create_event_record
+   Purpose : Creates a Fineline event string from the input data string.
+             The string must hold the data plus PV_EVENT_OVERHEAD.
+   Input   : Event data string and event time, the packet capture time or
+             NULL for the current time.
+   Return  : Record length.
+*/
+int create_event_record(char *event_string, char *data_string, const struct timeval *ts)
+{
+   int len = sizeof(EVENT_HEAD) - 1;
+
+   memcpy(event_string, EVENT_HEAD, len);
+   len += format_event_body(event_string + len, data_string, strlen(data_string), ts);
+   memcpy(event_string + len, EVENT_TAIL, sizeof(EVENT_TAIL));
+
+   return(len + sizeof(EVENT_TAIL) - 1);
+}
+
+/*
+   Function: format_event_body
+   Purpose : Writes the variable part of a Fineline record, from the time
+             to the end of the event data. The record is the PV_EVENT_HEAD
+             fragment, the body and the PV_EVENT_TAIL fragment, the output
+             queues send the fragments as they are and copy only the body.
+   Input   : Body string of at least len + PV_EVENT_OVERHEAD characters,
+             event data and length, event time or NULL for the current time.
+   Return  : Body length, the body is not NUL terminated.
+*/
+int format_event_body(char *body, const char *data, int len, const struct timeval *ts)
+{
+   int n = format_event_time(ts, body);
+
+   memcpy(body + n, EVENT_MIDDLE, sizeof(EVENT_MIDDLE) - 1);
+   n += sizeof(EVENT_MIDDLE) - 1;
+   memcpy(body + n, data, len);
+
+   return(n + len);
+}
+
+struct iovec *get_event_fragment(int fragment)
+{
+   return(&event_fragments[fragment]);
+}
+
+/*
+   Function: set_flow_event
+   Purpose : Fills in a flow event from a flow table record.
+   Input   : Event, flow record and the reason the flow is reported.
+*/
+void set_flow_event(pv_event_t *event, pv_ip_record_t *record, const char *reason)
+{
+   event->kind = PV_RECORD_FLOW;
+   event->ts = record->last_seen;
+   event->sensor_id = 0; /* PV_SENSOR_ID */
+   event->key = record->key;
+   event->tcp_flags = record->tcp_flags;
+   event->packet_count = record->packet_count;
+   event->data_size = record->data_size;
+   event->first_seen = record->first_seen;
+   strncpy(event->reason, reason, sizeof(event->reason) - 1);
+   event->reason[sizeof(event->reason) - 1] = 0;
+}
+
+/* Appends an event address, IPv6 addresses are bracketed so a port can follow. */
+static void append_event_address(pv_format_buffer_t *fb, const pv_flow_key_t *key, int source)
+{
+   struct in_addr addr;
+   struct in6_addr addr6;
+
+   if (key->family == PV_FLOW_IPV6)
+   {
+      memcpy(&addr6, source ? key->src_addr : key->dst_addr, 16);
+      append_char(fb, '[');
+      append_ipv6(fb, &addr6);
+      append_char(fb, ']');
+   }
+   else
+   {
+      memcpy(&addr, source ? key->src_addr : key->dst_addr, 4);
+      append_ipv4(fb, &addr);
+   }
+}
+
+/* Appends "src:port -> dst:port " for a TCP or UDP event. */
+static void append_event_ports(pv_format_buffer_t *fb, const pv_flow_key_t *key)
+{
+   append_event_address(fb, key, 1);
+   append_char(fb, ':');
+   append_uint(fb, ntohs(key->src_port));
+   PV_APPEND_LITERAL(fb, " -> ");
+   append_event_address(fb, key, 0);
+   append_char(fb, ':');
+   append_uint(fb, ntohs(key->dst_port));
+   append_char(fb, ' ');
+}
+
+/* Appends the IP header fields of a packet event. */
+static void append_event_header(pv_format_buffer_t *fb, const pv_event_t *event)
+{
+   if (event->key.family == PV_FLOW_IPV6)
+   {
+      PV_APPEND_LITERAL(fb, "Flow:0x");
+      append_hex(fb, event->ip_id);
+      PV_APPEND_LITERAL(fb, " TC:0x");
+      append_hex(fb, event->ip_tos);
+      PV_APPEND_LITERAL(fb, " HopLimit:");
+      append_uint(fb, event->ip_ttl);
+      PV_APPEND_LITERAL(fb, " PayloadLen:");
+      append_uint(fb, event->ip_len);
+   }
+   else
+   {
+      PV_APPEND_LITERAL(fb, "ID:");
+      append_uint(fb, event->ip_id);
+      PV_APPEND_LITERAL(fb, " TOS:0x");
+      append_hex(fb, event->ip_tos);
+      PV_APPEND_LITERAL(fb, " TTL:");
+      append_uint(fb, event->ip_ttl);
+      PV_APPEND_LITERAL(fb, " IpLen:");
+      append_uint(fb, event->ip_hlen);
+      PV_APPEND_LITERAL(fb, " DgLen:");
+      append_uint(fb, event->ip_len);
+   }
+   append_char(fb, ' ');
+}
+
+/* Appends the TCP flags as UAPRSF, with * for each flag not set. */
+static void append_tcp_flags(pv_format_buffer_t *fb, uint8_t flags)
+{
+   append_char(fb, ((flags & 0x20) ? 'U' : '*'));
+   append_char(fb, ((flags & 0x10) ? 'A' : '*'));
+   append_char(fb, ((flags & 0x08) ? 'P' : '*'));
+   append_char(fb, ((flags & 0x04) ? 'R' : '*'));
+   append_char(fb, ((flags & 0x02) ? 'S' : '*'));
+   append_char(fb, ((flags & 0x01) ? 'F' : '*'));
+}
+
+/* Appends a packet time as seconds.microseconds. */
+static void append_flow_time(pv_format_buffer_t *fb, const struct timeval *tv)
+{
+   long usec = tv->tv_usec;
+   char digits[6];
+   int i;
+
+   append_int(fb, (long)tv->tv_sec);
+   append_char(fb, '.');
+   for (i = 5; i >= 0; i--)
+   {
+      digits[i] = '0' + (usec % 10);
+      usec /= 10;
+   }
+   append_string(fb, digits, 6);
+}
+
+/* Appends the event data of a packet event. */
+static void append_packet_data(pv_format_buffer_t *fb, const pv_event_t *event)
+{
+   switch (event->key.protocol)
+   {
+   case IPPROTO_TCP:
+      PV_APPEND_LITERAL(fb, "TCP  ");
+      append_event_ports(fb, &event->key);
+      append_event_header(fb, event);
+      append_tcp_flags(fb, event->tcp_flags);
+      PV_APPEND_LITERAL(fb, " Seq: 0x");
+      append_hex(fb, event->tcp_seq);
+      PV_APPEND_LITERAL(fb, " Ack: 0x");
+      append_hex(fb, event->tcp_ack);
+      PV_APPEND_LITERAL(fb, " Win: 0x");
+      append_hex(fb, event->tcp_win);
+      PV_APPEND_LITERAL(fb, " TcpLen: ");
+      append_uint(fb, event->tcp_hlen);
+      append_char(fb, ' ');
+      break;
+
+   case IPPROTO_UDP:
+      PV_APPEND_LITERAL(fb, "UDP  ");
+      append_event_ports(fb, &event->key);
+      append_event_header(fb, event);
+      break;
+
+   case IPPROTO_ICMP:
+   case IPPROTO_ICMPV6:
+      PV_APPEND_LITERAL(fb, "ICMP ");
+      append_event_address(fb, &event->key, 1);
+      PV_APPEND_LITERAL(fb, " -> ");
+      append_event_address(fb, &event->key, 0);
+      append_char(fb, ' ');
+      append_event_header(fb, event);
+      PV_APPEND_LITERAL(fb, "Type:");
+      append_uint(fb, event->icmp_type);
+      PV_APPEND_LITERAL(fb, " Code:");
+      append_uint(fb, event->icmp_code);
+      PV_APPEND_LITERAL(fb, " ID:");
+      append_uint(fb, event->icmp_echo_id);
+      PV_APPEND_LITERAL(fb, " Seq:");
+      append_uint(fb, event->icmp_echo_seq);
+      append_char(fb, ' ');
+      break;
+
+   default:
+      PV_APPEND_LITERAL(fb, "Src: ");
+      append_event_address(fb, &event->key, 1);
+      PV_APPEND_LITERAL(fb, " Dst: ");
+      append_event_address(fb, &event->key, 0);
+      PV_APPEND_LITERAL(fb, " Hdr: ");
+      append_event_header(fb, event);
+   }
+}
+
+/* Appends the event data of a flow event. */
+static void append_flow_data(pv_format_buffer_t *fb, const pv_event_t *event)
+{
+   char key_str[PV_FLOW_KEY_STR];
+
+   PV_APPEND_LITERAL(fb, "FLOW ");
+   append_string(fb, key_str, format_flow_key(&event->key, key_str, PV_FLOW_KEY_STR));
+   PV_APPEND_LITERAL(fb, "Packets:");
+   append_int(fb, event->packet_count);
+   PV_APPEND_LITERAL(fb, " Bytes:");
+   append_int(fb, event->data_size);
+   PV_APPEND_LITERAL(fb, " Start:");
+   append_flow_time(fb, &event->first_seen);
+   PV_APPEND_LITERAL(fb, " End:");
+   append_flow_time(fb, &event->ts);
+   append_char(fb, ' ');
+
+   if (event->key.protocol == IPPROTO_TCP)
+   {
+      PV_APPEND_LITERAL(fb, "Flags:");
+      append_tcp_flags(fb, event->tcp_flags);
+      append_char(fb, ' ');
+   }
+
+   PV_APPEND_LITERAL(fb, "Reason:");
+   append_cstring(fb, event->reason);
+   append_char(fb, ' ');
+}
+
+/*
+   Function: format_event_data
+   Purpose : Writes the Fineline event data of a packet or flow event.
+   Input   : Event, output string and its size.
+   Return  : Length of the event data.
+*/
+int format_event_data(const pv_event_t *event, char *event_data, int len)
+{
+   pv_format_buffer_t fb;
+
+   init_format_buffer(&fb, event_data, len);
+
+   if (event->kind == PV_RECORD_FLOW)
+      append_flow_data(&fb, event);
+   else
+      append_packet_data(&fb, event);
+
+   return(fb.length);
+}
+
+static int put_varint(unsigned char *out, unsigned long value)
+{
+   int n = 0;
+
+   while (value >= 0x80)
+   {
+      out[n++] = (unsigned char)(value | 0x80);
+      value >>= 7;
+   }
+   out[n++] = (unsigned char)value;
+
+   return(n);
+}
+
+/* Reads a varint, moving the input on. Returns 0 or -1 if the varint runs past the end. */
+static int get_varint(const unsigned char **in, const unsigned char *end, unsigned long *value)
+{
+   const unsigned char *p = *in;
+   unsigned long v = 0;
+   int shift = 0;
+
+   while ((p < end) && (shift < (int)(8 * sizeof(unsigned long))))
+   {
+      v |= (unsigned long)(*p & 0x7f) << shift;
+      if ((*p++ & 0x80) == 0)
+      {
+         *in = p;
+         *value = v;
+         return(0);
+      }
+      shift += 7;
+   }
+
+   return(-1);
+}
+
+/* Reads n bytes, moving the input on. Returns 0 or -1 if they run past the end. */
+static int get_bytes(const unsigned char **in, const unsigned char *end, void *out, int n)
+{
+   if (end - *in < n)
+      return(-1);
+
+   memcpy(out, *in, n);
+   *in += n;
+
+   return(0);
+}
+
+/*
+   Function: encode_event
+   Purpose : Writes the binary record of an event.
+   Input   : Event and an output buffer of at least PV_RECORD_MAX bytes.
+   Return  : Record length.
+*/
+int encode_event(const pv_event_t *event, unsigned char *record)
+{
+   unsigned char body[PV_RECORD_MAX];
+   int addr_len = (event->key.family == PV_FLOW_IPV6) ? 16 : 4;
+   int protocol = event->key.protocol;
+   int reason_len;
+   int n = 0;
+
+   body[n++] = (unsigned char)event->kind;
+   n += put_varint(body + n, (unsigned long)event->ts.tv_sec);
+   n += put_varint(body + n, (unsigned long)event->ts.tv_usec);
+   n += put_varint(body + n, event->sensor_id);
+   body[n++] = event->key.family;
+   body[n++] = event->key.protocol;
+   memcpy(body + n, event->key.src_addr, addr_len);
+   n += addr_len;
+   memcpy(body + n, event->key.dst_addr, addr_len);
+   n += addr_len;
+
+   if ((protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP))
+   {
+      n += put_varint(body + n, ntohs(event->key.src_port));
+      n += put_varint(body + n, ntohs(event->key.dst_port));
+   }
+
+   if (event->kind == PV_RECORD_FLOW)
+   {
+      n += put_varint(body + n, (unsigned long)event->packet_count);
+      n += put_varint(body + n, (unsigned long)event->data_size);
+      n += put_varint(body + n, (unsigned long)event->first_seen.tv_sec);
+      n += put_varint(body + n, (unsigned long)event->first_seen.tv_usec);
+      if (protocol == IPPROTO_TCP)
+         body[n++] = event->tcp_flags;
+      reason_len = strlen(event->reason);
+      body[n++] = (unsigned char)reason_len;
+      memcpy(body + n, event->reason, reason_len);
+      n += reason_len;
+   }
+   else
+   {
+      n += put_varint(body + n, event->ip_id);
+      body[n++] = event->ip_tos;
+      body[n++] = event->ip_ttl;
+      if (event->key.family != PV_FLOW_IPV6)
+         body[n++] = event->ip_hlen;
+      n += put_varint(body + n, event->ip_len);
+
+      if (protocol == IPPROTO_TCP)
+      {
+         body[n++] = event->tcp_flags;
+         n += put_varint(body + n, event->tcp_seq);
+         n += put_varint(body + n, event->tcp_ack);
+         n += put_varint(body + n, event->tcp_win);
+         body[n++] = event->tcp_hlen;
+      }
+      else if ((protocol == IPPROTO_ICMP) || (protocol == IPPROTO_ICMPV6))
+      {
+         body[n++] = event->icmp_type;
+         body[n++] = event->icmp_code;
+         n += put_varint(body + n, event->icmp_echo_id);
+         n += put_varint(body + n, event->icmp_echo_seq);
+      }
+   }
+
+   addr_len = put_varint(record, n);
+   memcpy(record + addr_len, body, n);
+
+   return(addr_len + n);
+}
+
+/*
+   Function: decode_event
+   Purpose : Reads the next binary record. A record of a kind this
+             version does not know is skipped, its kind is set and no
+             other field is.
+   Input   : Record bytes, bytes left in the buffer and the event to fill in.
+   Return  : Bytes used or -1 if the record is corrupt.
+*/
+int decode_event(const unsigned char *record, int length, pv_event_t *event)
+{
+   const unsigned char *p = record;
+   const unsigned char *end;
+   unsigned long v[4];
+   unsigned char b[3];
+   int addr_len;
+
+   if ((get_varint(&p, record + length, &v[0]) < 0) || (v[0] == 0) || (v[0] > (unsigned long)(record + length - p)))
+      return(-1);
+   end = p + v[0];
+
+   event->kind = *p++;
+   if ((event->kind != PV_RECORD_PACKET) && (event->kind != PV_RECORD_FLOW))
+      return((int)(end - record));
+
+   memset(&event->key, 0, sizeof(pv_flow_key_t));
+   if ((get_varint(&p, end, &v[0]) < 0) || (get_varint(&p, end, &v[1]) < 0) || (get_varint(&p, end, &v[2]) < 0) ||
+       (get_bytes(&p, end, b, 2) < 0))
+      return(-1);
+   event->ts.tv_sec = (time_t)v[0];
+   event->ts.tv_usec = (long)v[1];
+   event->sensor_id = (uint32_t)v[2];
+   event->key.family = b[0];
+   event->key.protocol = b[1];
+
+   addr_len = (event->key.family == PV_FLOW_IPV6) ? 16 : 4;
+   if ((get_bytes(&p, end, event->key.src_addr, addr_len) < 0) || (get_bytes(&p, end, event->key.dst_addr, addr_len) < 0))
+      return(-1);
+
+   if ((b[1] == IPPROTO_TCP) || (b[1] == IPPROTO_UDP))
+   {
+      if ((get_varint(&p, end, &v[0]) < 0) || (get_varint(&p, end, &v[1]) < 0))
+         return(-1);
+      event->key.src_port = htons((uint16_t)v[0]);
+      event->key.dst_port = htons((uint16_t)v[1]);
+   }
+
+   if (event->kind == PV_RECORD_FLOW)
+   {
+      if ((get_varint(&p, end, &v[0]) < 0) || (get_varint(&p, end, &v[1]) < 0) ||
+          (get_varint(&p, end, &v[2]) < 0) || (get_varint(&p, end, &v[3]) < 0))
+         return(-1);
+      event->packet_count = (long)v[0];
+      event->data_size = (long)v[1];
+      event->first_seen.tv_sec = (time_t)v[2];
+      event->first_seen.tv_usec = (long)v[3];
+      event->tcp_flags = 0;
+      if ((b[1] == IPPROTO_TCP) && (get_bytes(&p, end, &event->tcp_flags, 1) < 0))
+         return(-1);
+      if ((get_bytes(&p, end, b, 1) < 0) || (b[0] >= sizeof(event->reason)) || (get_bytes(&p, end, event->reason, b[0]) < 0))
+         return(-1);
+      event->reason[b[0]] = 0;
+   }
+   else
+   {
+      if ((get_varint(&p, end, &v[0]) < 0) || (get_bytes(&p, end, b, (event->key.family == PV_FLOW_IPV6) ? 2 : 3) < 0) ||
+          (get_varint(&p, end, &v[1]) < 0))
+         return(-1);
+      event->ip_id = (uint32_t)v[0];
+      event->ip_tos = b[0];
+      event->ip_ttl = b[1];
+      event->ip_hlen = (event->key.family == PV_FLOW_IPV6) ? 0 : b[2];
+      event->ip_len = (uint32_t)v[1];
+
+      if (event->key.protocol == IPPROTO_TCP)
+      {
+         if ((get_bytes(&p, end, &event->tcp_flags, 1) < 0) || (get_varint(&p, end, &v[0]) < 0) ||
+             (get_varint(&p, end, &v[1]) < 0) || (get_varint(&p, end, &v[2]) < 0) || (get_bytes(&p, end, &event->tcp_hlen, 1) < 0))
+            return(-1);
+         event->tcp_seq = (uint32_t)v[0];
+         event->tcp_ack = (uint32_t)v[1];
+         event->tcp_win = (uint16_t)v[2];
+      }
+      else if ((event->key.protocol == IPPROTO_ICMP) || (event->key.protocol == IPPROTO_ICMPV6))
+      {
+         if ((get_bytes(&p, end, b, 2) < 0) || (get_varint(&p, end, &v[0]) < 0) || (get_varint(&p, end, &v[1]) < 0))
+            return(-1);
+         event->icmp_type = b[0];
+         event->icmp_code = b[1];
+         event->icmp_echo_id = (uint16_t)v[0];
+         event->icmp_echo_seq = (uint16_t)v[1];
+      }
+   }
+
+   return((int)(end - record));
+}
+
+/*
+   Function: render_event_records
+   Purpose : Turns a frame of binary records into Fineline event records.
+             Each decoded event is also passed to a function, so the
+             statistics are kept without parsing the text again.
+   Input   : Frame payload and length, buffer pointer and buffer size
+             pointer, the buffer grows as needed and is reused between
+             calls, and the function for the events and its argument,
+             NULL for none.
+   Return  : Length of the Fineline text, -1 if a record is corrupt.
+*/
+int render_event_records(const char *payload, int length, char **buffer, int *size, pv_event_func func, void *user)
+{
+   pv_event_t event;
+   char event_data[PV_EVENT_DATA_STR];
+   int used = 0;
+   int out = 0;
+   int n, len;
+
+   while (used < length)
+   {
+      if ((n = decode_event((const unsigned char *)payload + used, length - used, &event)) < 0)
+      {
+         print_log_entry("render_event_records() <ERROR> Corrupt binary event record.\n");
+         return(-1);
+      }
+      used += n;
+
+      if ((event.kind != PV_RECORD_PACKET) && (event.kind != PV_RECORD_FLOW))
+         continue;
+
+      if (func != NULL)
+         func(user, &event);
+
+      len = format_event_data(&event, event_data, sizeof(event_data));
+
+      while (out + len + PV_EVENT_OVERHEAD > *size)
+      {
+         *size = (*size > 0) ? *size * 2 : PV_FRAME_MAX_PAYLOAD;
+         *buffer = xrealloc(*buffer, *size);
+      }
+
+      memcpy(*buffer + out, EVENT_HEAD, sizeof(EVENT_HEAD) - 1);
+      out += sizeof(EVENT_HEAD) - 1;
+      out += format_event_body(*buffer + out, event_data, len, &event.ts);
+      memcpy(*buffer + out, EVENT_TAIL, sizeof(EVENT_TAIL) - 1);
+      out += sizeof(EVENT_TAIL) - 1;
+   }
+
+   return(out);
+}
+
+/*
+   Function: get_record_split
+   Purpose : Finds where to cut a payload into datagrams, after the last
+             whole record that fits. Binary records are walked by their
+             length prefix, Fineline records end with a newline. A record
+             longer than the limit is returned whole, up to
+             PV_DATAGRAM_MAX_PAYLOAD.
+   Input   : Payload, length, byte limit and the frame flags.
+   Return  : Bytes of whole records from the start of the payload.
+*/
+int get_record_split(const char *payload, int length, int max, int flags)
+{
+   const unsigned char *p = (const unsigned char *)payload;
+   const unsigned char *end = p + length;
+   unsigned long n;
+   int used = 0;
+   int i;
+
+   if (length <= max)
+      return(length);
+
+   if (flags & PV_FRAME_BINARY)
+   {
+      while (used < length)
+      {
+         p = (const unsigned char *)payload + used;
+         if ((get_varint(&p, end, &n) < 0) || (n > (unsigned long)(end - p)))
+            return((used > 0) ? used : ((length < PV_DATAGRAM_MAX_PAYLOAD) ? length : PV_DATAGRAM_MAX_PAYLOAD));
+         if ((used > 0) && ((p - (const unsigned char *)payload) + (int)n > max))
+            break;
+         used = (p - (const unsigned char *)payload) + n;
+      }
+      return(used);
+   }
+
+   for (i = max; i > 0; i--)
+   {
+      if (payload[i - 1] == '\n')
+         return(i);
+   }
+   for (i = max; (i < length) && (i < PV_DATAGRAM_MAX_PAYLOAD); i++)
+   {
+      if (payload[i - 1] == '\n')
+         return(i);
+   }
+
+   return(i);
+}
@@ -28,8 +28,6 @@
    Purpose: Wrapper functions for network client and server sockets for TCP and UDP
             communications.
 
-   TODO: Implement udp socket functions.
-
 */
 
 
@@ -38,25 +36,31 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #include "pvcommon.h"
 
 
 /*
-   Function: init_client_socket
-   Purpose : initialises a Linux/BSD socket.
-   Input   : string containing the GUI IP address.
-   Return  : A valid socket = success, -1 = fail.
+   Function: start_client_socket
+   Purpose : Starts a non-blocking connect to the server. The socket is
+             writable once the connect has ended, finish_client_socket()
+             then tells if it worked.
+   Input   : string containing the server IP address.
+   Return  : A connecting socket = success, -1 = fail.
 */
-int init_client_socket(char *server_ip_address)
+int start_client_socket(char *server_ip_address)
 {
    int sockfd;
+   int nodelay = 1;
    struct sockaddr_in serv_addr;
 
    if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
@@ -73,94 +77,511 @@ int init_client_socket(char *server_ip_address)
    if(inet_pton(AF_INET, server_ip_address, &serv_addr.sin_addr)<=0)
    {
       print_log_entry("init_socket() <ERROR> inet_pton error occurred.\n");
+      close(sockfd);
       return(-1);
    }
 
-   if(connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+   /*
+      Events are batched by the sensor and each batch is written in one
+      call, so Nagle's algorithm only holds a batch back waiting for the
+      ACK of the one before. Sequences of writes that belong together
+      are corked instead, see set_socket_cork().
+   */
+   if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0)
+   {
+      print_log_entry("init_socket() <WARNING> Could not set TCP_NODELAY.\n");
+   }
+
+   fcntl(sockfd, F_SETFL, O_NONBLOCK);
+   if ((connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) && (errno != EINPROGRESS))
    {
       printf("init_socket() <ERROR> Connect Failed.\n");
+      close(sockfd);
       return(-1);
    }
+
+   return(sockfd);
+}
+
+/* Checks that a connect started by start_client_socket() worked, the socket is left non-blocking. */
+int finish_client_socket(int sockfd)
+{
+   int error = 0;
+   socklen_t error_len = sizeof(error);
+
+   if ((getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) || (error != 0))
+   {
+      printf("init_socket() <ERROR> Connect Failed.\n");
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+   Function: init_client_socket
+   Purpose : initialises a Linux/BSD socket. The connect gives up after
+             PV_CONNECT_TIMEOUT so the sensor does not hang on a host that
+             does not answer.
+   Input   : string containing the GUI IP address.
+   Return  : A valid socket = success, -1 = fail.
+*/
+int init_client_socket(char *server_ip_address)
+{
+   int sockfd;
+   struct pollfd pfd;
+
+   if ((sockfd = start_client_socket(server_ip_address)) < 0)
+      return(-1);
+
+   pfd.fd = sockfd;
+   pfd.events = POLLOUT;
+   if (poll(&pfd, 1, PV_CONNECT_TIMEOUT) <= 0)
+   {
+      printf("init_socket() <ERROR> Connect Failed.\n");
+      close(sockfd);
+      return(-1);
+   }
+   if (finish_client_socket(sockfd) < 0)
+   {
+      close(sockfd);
+      return(-1);
+   }
+   fcntl(sockfd, F_SETFL, 0);
+
+   return(sockfd);
+}
+
+/*
+   Function: set_socket_cork
+   Purpose : Corks a TCP socket so the following writes go out as full
+             segments, uncorking sends whatever is left at once.
+   Input   : Socket and 1 to cork, 0 to uncork.
+*/
+void set_socket_cork(int sockfd, int cork)
+{
+   setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+/*
+   Function: init_listen_socket
+   Purpose : initialises a non-blocking TCP socket listening on a port on
+             all addresses, with the largest backlog the system allows so
+             a burst of sensors connecting at once is not refused. With
+             SO_REUSEPORT several sockets listen on the same port and the
+             kernel spreads the connections over them.
+   Input   : TCP port number, 1 to share the port with SO_REUSEPORT.
+   Return  : A valid socket = success, -1 = fail.
+*/
+int init_listen_socket(int port_number, int reuse_port)
+{
+   int sockfd;
+   int reuse = 1;
+   struct sockaddr_in server_addr;
+
+   if((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+   {
+      print_log_entry("init_listen_socket() <ERROR> Could not create socket.\n");
+      return(-1);
+   }
+
+   setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+   if (reuse_port && (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0))
+   {
+      print_log_entry("init_listen_socket() <ERROR> Could not set SO_REUSEPORT.\n");
+      close(sockfd);
+      return(-1);
+   }
+
+   memset(&server_addr, 0, sizeof(server_addr));
+
+   server_addr.sin_family = AF_INET;
+   server_addr.sin_addr.s_addr = INADDR_ANY;
+   server_addr.sin_port = htons(port_number);
+
+   if(bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+   {
+      print_log_entry("init_listen_socket() <ERROR> Could not bind socket.\n");
+      close(sockfd);
+      return(-1);
+   }
+
+   if(listen(sockfd, SOMAXCONN) < 0)
+   {
+      print_log_entry("init_listen_socket() <ERROR> Could not listen on socket.\n");
+      close(sockfd);
+      return(-1);
+   }
+
    return(sockfd);
 }
 
 /*
    Function: init_server_socket
-   Purpose : initialises a server TCP socket and spawns a thread to handle
-             each new connection.
+   Purpose : initialises a server TCP socket and spawns a detached thread
+             to handle each new connection. The Pivotal Server uses the
+             epoll reactor shards instead, see pvreactor.c.
    Input   : TCP port number, handler function.
    Return  : 0 = success, -1 = fail.
 */
 int init_server_socket(int port_number, void *(* connector)(void *))
 {
    int sockfd, new_sock, sock_size, *new_sock_p;
-   struct sockaddr_in server_addr, client_addr;
+   struct sockaddr_in client_addr;
    pthread_t server_thread;
-   char message[PV_MAX_INPUT_STR];
 
-   if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+   if((sockfd = init_listen_socket(port_number, 0)) < 0)
    {
-      print_log_entry("init_server_socket() <ERROR> Could not create socket.\n");
       return(-1);
    }
+   fcntl(sockfd, F_SETFL, 0);
 
    sock_size = sizeof(struct sockaddr_in);
-   memset(&server_addr, '0', sock_size);
-   memset(&client_addr, '0', sock_size);
+   memset(&client_addr, 0, sock_size);
+
+   print_log_entry("init_server_socket() <INFO> Waiting for incoming connections...\n");
+
+   while((new_sock = accept(sockfd, (struct sockaddr *)&client_addr, (socklen_t*)&sock_size)) >= 0)
+   {
+      print_log_entry("init_server_socket() <INFO> Connection accepted.\n");
+
+      new_sock_p = xmalloc(sizeof(int));
+      *new_sock_p = new_sock;
+
+      if(pthread_create(&server_thread, NULL, connector, (void*)new_sock_p) != 0)
+      {
+         print_log_entry("init_server_socket() <ERROR> Could not create thread.\n");
+         close(new_sock);
+         free(new_sock_p);
+         continue;
+      }
+      /* Nothing joins the handlers, let each thread free itself when it ends. */
+      pthread_detach(server_thread);
+
+      memset(&client_addr, 0, sock_size);
+   }
+
+   if (new_sock < 0)
+   {
+      perror("accept failed");
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+   Function: init_udp_client_socket
+   Purpose : initialises a UDP socket connected to the server, so the
+             datagrams can be sent with send() and sendmmsg() without an
+             address and errors reported by the server host come back.
+   Input   : string containing the server IP address.
+   Return  : A valid socket = success, -1 = fail.
+*/
+int init_udp_client_socket(char *server_ip_address)
+{
+   int sockfd;
+   int buffer_size = PV_UDP_BUFFER_SIZE;
+   struct sockaddr_in serv_addr;
+
+   if((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+   {
+      print_log_entry("init_udp_client_socket() <ERROR> Could not create socket.\n");
+      return(-1);
+   }
+
+   memset(&serv_addr, 0, sizeof(serv_addr));
+
+   serv_addr.sin_family = AF_INET;
+   serv_addr.sin_port = htons(PV_SERVER_PORT);
+
+   if(inet_pton(AF_INET, server_ip_address, &serv_addr.sin_addr)<=0)
+   {
+      print_log_entry("init_udp_client_socket() <ERROR> inet_pton error occurred.\n");
+      close(sockfd);
+      return(-1);
+   }
+
+   if(connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+   {
+      print_log_entry("init_udp_client_socket() <ERROR> Connect Failed.\n");
+      close(sockfd);
+      return(-1);
+   }
+
+   if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size)) < 0)
+   {
+      print_log_entry("init_udp_client_socket() <WARNING> Could not set SO_SNDBUF.\n");
+   }
+
+   return(sockfd);
+}
+
+/*
+   Function: init_udp_server_socket
+   Purpose : initialises a UDP socket bound to a port on all addresses,
+             with a large receive buffer to ride out bursts from the
+             sensors and a receive timeout so the reader can do its
+             housekeeping when the sensors are quiet.
+   Input   : UDP port number, receive timeout in milliseconds.
+   Return  : A valid socket = success, -1 = fail.
+*/
+int init_udp_server_socket(int port_number, int timeout)
+{
+   int sockfd;
+   int buffer_size = PV_UDP_BUFFER_SIZE;
+   struct sockaddr_in server_addr;
+   struct timeval tv;
+
+   if((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+   {
+      print_log_entry("init_udp_server_socket() <ERROR> Could not create socket.\n");
+      return(-1);
+   }
+
+   memset(&server_addr, 0, sizeof(server_addr));
 
    server_addr.sin_family = AF_INET;
    server_addr.sin_addr.s_addr = INADDR_ANY;
-   server_addr.sin_port = htons(PV_SERVER_PORT);
+   server_addr.sin_port = htons(port_number);
+
+   if(bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+   {
+      print_log_entry("init_udp_server_socket() <ERROR> Could not bind socket.\n");
+      close(sockfd);
+      return(-1);
+   }
 
-   if(bind(sockfd, (struct sockaddr *)&server_addr, sock_size) < 0)
+   if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size)) < 0)
    {
-      print_log_entry("init_server_socket() <ERROR> Could not bind socket.\n");
-      return 1;
+      print_log_entry("init_udp_server_socket() <WARNING> Could not set SO_RCVBUF.\n");
    }
 
-   listen(sockfd , 3);
+   tv.tv_sec = timeout / 1000;
+   tv.tv_usec = (timeout % 1000) * 1000;
+   setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-   print_log_entry("init_server_socket() <INFO> Waiting for incoming connections...\n");
+   return(sockfd);
+}
 
-   while((new_sock = accept(sockfd, (struct sockaddr *)&client_addr, (socklen_t*)&sock_size)))
+/*
+   Function: send_frame
+   Purpose : Sends a message to the server as one frame, or as several
+             frames split at record ends if it is longer than
+             PV_FRAME_MAX_PAYLOAD, see get_frame_split(). Each frame is
+             compressed if the server has accepted compression. The
+             header and payload go out in one write, looping on partial
+             sends.
+   Input   : Socket, message type, frame flags, payload and length.
+   Return  : Payload bytes sent or -1 on error, the message stops at a
+             record too long for one frame.
+*/
+int send_frame(int sockfd, int type, int frame_flags, const char *payload, int length)
+{
+   unsigned char header[PV_FRAME_HEADER_SIZE];
+   struct iovec iov[2];
+   int part, flags;
+   int sent = 0;
+   int corked = (length > PV_FRAME_MAX_PAYLOAD);
+
+   /* Send the frames of a split message as full segments. */
+   if (corked)
+      set_socket_cork(sockfd, 1);
+
+   do
    {
-      print_log_entry("init_server_socket() <INFO> Connection accepted.\n");
+      if ((part = get_frame_split(payload + sent, length - sent, frame_flags)) < 0)
+      {
+         print_log_entry("send_frame() <ERROR> Record too long for a frame.\n");
+         sent = -1;
+         break;
+      }
+      iov[1].iov_base = (char *)payload + sent;
+      iov[1].iov_len = part;
+      flags = frame_flags;
+      compress_frame_iov(iov, 2, &flags);
+      set_frame_header(header, type, flags, iov[1].iov_len);
+      iov[0].iov_base = header;
+      iov[0].iov_len = PV_FRAME_HEADER_SIZE;
+      if (write_iov(sockfd, iov, 2) < 0)
+      {
+         print_log_entry("send_frame() <ERROR> Cannot write to server!\n");
+         sent = -1;
+         break;
+      }
+      sent += part;
+   } while (sent < length);
 
-      /* DEBUG */
-      strcpy(message, "Hello Client , I have received your connection. And now I will assign a handler for you.");
-      write(new_sock, message, strlen(message));
+   if (corked)
+      set_socket_cork(sockfd, 0);
 
-      new_sock_p = malloc(1);
-      *new_sock_p = new_sock;
+   return(sent);
+}
+
+/*
+   Function: send_frame_iov
+   Purpose : Sends a scatter-gather list as one frame, the segments are
+             not copied. The first segment is left free by the caller and
+             receives the frame header. The payload is sent as it is, a
+             caller that compresses calls compress_frame_iov() first.
+   Input   : Socket, message type, frame flags, segment list and number
+             of segments including the header segment.
+   Return  : Payload bytes sent or -1 on error.
+*/
+int send_frame_iov(int sockfd, int type, int flags, struct iovec *iov, int count)
+{
+   unsigned char header[PV_FRAME_HEADER_SIZE];
+   size_t length = 0;
+   int i;
 
-      if(pthread_create(&server_thread, NULL, connector, (void*)new_sock_p) < 0)
+   for (i = 1; i < count; i++)
+      length += iov[i].iov_len;
+
+   if (length > PV_FRAME_MAX_PAYLOAD)
+   {
+      print_log_entry("send_frame_iov() <ERROR> Frame payload too long.\n");
+      return(-1);
+   }
+
+   set_frame_header(header, type, flags, (uint32_t)length);
+   iov[0].iov_base = header;
+   iov[0].iov_len = PV_FRAME_HEADER_SIZE;
+
+   if (write_iov(sockfd, iov, count) < 0)
+   {
+      print_log_entry("send_frame_iov() <ERROR> Cannot write to server!\n");
+      return(-1);
+   }
+
+   return((int)length);
+}
+
+/* Reads exactly length bytes, giving up if the peer is silent for timeout milliseconds. */
+static int recv_timed(int sockfd, void *buffer, int length, int timeout)
+{
+   struct pollfd pfd;
+   int received = 0;
+   int n;
+
+   pfd.fd = sockfd;
+   pfd.events = POLLIN;
+
+   while (received < length)
+   {
+      if ((n = poll(&pfd, 1, timeout)) < 0)
       {
-         print_log_entry("init_server_socket() <ERROR> Could not create thread.\n");
+         if (errno == EINTR)
+            continue;
          return(-1);
       }
+      if (n == 0)
+         return(-1);
 
-      memset(&client_addr, '0', sock_size);
+      if ((n = recv(sockfd, (char *)buffer + received, length - received, 0)) <= 0)
+      {
+         if ((n < 0) && (errno == EINTR))
+            continue;
+         return(-1);
+      }
+      received += n;
    }
 
-   if (new_sock < 0)
+   return(received);
+}
+
+/*
+   Function: send_sensor_hello
+   Purpose : Sends the sensor hello with the event encoding the sensor
+             wants and whether it wants to compress.
+   Input   : Socket, PV_ENCODING_BINARY or PV_ENCODING_TEXT and the
+             compression level wanted.
+   Return  : 0 on success, -1 on error.
+*/
+int send_sensor_hello(int sockfd, int encoding, int compression)
+{
+   char hello[PV_MAX_INPUT_STR];
+   int len;
+
+   len = sprintf(hello, "%s<id>%s</id>%s%s</control>", PV_CONTROL_HELLO, PV_SENSOR_ID,
+                 (encoding == PV_ENCODING_BINARY) ? PV_CONTROL_BINARY : PV_CONTROL_TEXT,
+                 (compression > 0) ? PV_CONTROL_ZLIB : "");
+
+   return((send_frame(sockfd, PV_FRAME_CONTROL, 0, hello, len) < 0) ? -1 : 0);
+}
+
+/*
+   Function: accept_server_hello
+   Purpose : Reads the encoding and compression out of the server's
+             answer to the hello.
+   Input   : Answer string, the encoding wanted and the compression level
+             wanted, set to 0 if the server does not accept compression.
+   Return  : The encoding to send events in.
+*/
+int accept_server_hello(const char *reply, int encoding, int *compression)
+{
+   if ((*compression > 0) && (strstr(reply, PV_CONTROL_ZLIB) == NULL))
    {
-      perror("accept failed");
-      return(-1);
+      print_log_entry("negotiate_encoding() <WARNING> Server does not accept compression.\n");
+      *compression = 0;
    }
 
-   return(0);
+   if ((encoding == PV_ENCODING_BINARY) && (strncmp(reply, PV_CONTROL_ACCEPT, sizeof(PV_CONTROL_ACCEPT) - 1) == 0) &&
+       (strstr(reply, PV_CONTROL_BINARY) != NULL))
+   {
+      print_log_entry("negotiate_encoding() <INFO> Server accepted binary event records.\n");
+      return(PV_ENCODING_BINARY);
+   }
+
+   return(PV_ENCODING_TEXT);
 }
 
-int send_event(int sockfd, char *event_string)
+/*
+   Function: negotiate_encoding
+   Purpose : Sends the sensor hello, then waits for the server to accept
+             an encoding. A server that does not answer within
+             PV_HELLO_TIMEOUT, or does not know the binary records, gets
+             Fineline text. Compression is only used if the server
+             accepts it.
+   Input   : Socket, PV_ENCODING_BINARY or PV_ENCODING_TEXT and the
+             compression level wanted, set to 0 if the server does not
+             accept compression.
+   Return  : The encoding to send events in.
+*/
+int negotiate_encoding(int sockfd, int encoding, int *compression)
 {
-   int k;
-   k = send(sockfd, event_string, strlen(event_string), 0);
-   if (k == -1)
+   char reply[PV_MAX_INPUT_STR];
+   unsigned char header[PV_FRAME_HEADER_SIZE];
+   pv_frame_t frame;
+
+   if (send_sensor_hello(sockfd, encoding, *compression) < 0)
    {
-      print_log_entry("send_event() <ERROR> Cannot write to server!\n");
+      *compression = 0;
+      return(PV_ENCODING_TEXT);
    }
 
-   return(k);
+   if ((recv_timed(sockfd, header, PV_FRAME_HEADER_SIZE, PV_HELLO_TIMEOUT) < 0) ||
+       (parse_frame_header(header, &frame) < 0) || (frame.type != PV_FRAME_CONTROL) || (frame.length >= sizeof(reply)) ||
+       (recv_timed(sockfd, reply, frame.length, PV_HELLO_TIMEOUT) < 0))
+   {
+      print_log_entry("negotiate_encoding() <WARNING> No answer from the server, sending Fineline text.\n");
+      *compression = 0;
+      return(PV_ENCODING_TEXT);
+   }
+   reply[frame.length] = 0;
+
+   return(accept_server_hello(reply, encoding, compression));
+}
+
+/* Sends an event string as an event frame. */
+int send_event(int sockfd, char *event_string)
+{
+   return(send_frame(sockfd, PV_FRAME_EVENT, 0, event_string, strlen(event_string)));
+}
+
+/* Sends a buffer of queued event records as event frames. */
+int send_event_buffer(int sockfd, char *buffer, int length)
+{
+   return(send_frame(sockfd, PV_FRAME_EVENT, 0, buffer, length));
 }
 
 /* TODO: protocol not fully specified yet */
@@ -0,0 +1,324 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvtimerwheel.c
+
+   Title : Pivotal NST Flow Timer Wheel
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Ages the records of a flow table with a hierarchical timing
+            wheel. A flow expires when it has been idle for the idle
+            timeout or has been open for the active timeout, whichever
+            comes first. Expired flows are handed to the expire function,
+            which exports the final record, then deleted from the table,
+            so the table only holds the flows that are still active.
+
+            The wheel has three levels of 256 slots: 1 second slots for
+            the next 256 seconds, 256 second slots for the next 18 hours
+            and 65536 second slots beyond that. Time is packet time, the
+            wheel is advanced one tick at a time by the packet timestamps
+            and the higher levels cascade down as their slots come due.
+
+            A flow is scheduled once, when it is created. Packets only
+            move last_seen, when the slot fires the real deadline is
+            worked out from the flow times and the flow is either expired
+            or scheduled again. The per packet cost of aging is nothing.
+
+            A jump in packet time, a gap in a pcap file or a clock step,
+            does not cost a tick per second: empty slots are skipped up
+            to the next cascade, and a jump of the idle timeout or more
+            expires every flow in one pass of the slots. A packet time
+            more than PV_TIMER_MAX_JUMP ahead, e.g. a corrupt timestamp,
+            is ignored unless PV_TIMER_JUMP_CONFIRM packets in a row
+            agree, so one bad packet cannot move the wheel into the
+            future.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pvcommon.h"
+
+#define TIMER_MASK        (PV_TIMER_SLOTS - 1)
+#define TIMER_LEVEL1_SPAN (1U << (2 * PV_TIMER_BITS))
+#define TIMER_MAX_SPAN    (1U << (3 * PV_TIMER_BITS))
+
+/*
+   Function: init_flow_timers
+   Purpose : Enables aging on a flow table.
+   Input   : Table, idle and active timeouts in seconds, the expire
+             function and its user data.
+   Return  : 0 on success, -1 on error.
+*/
+int init_flow_timers(pv_flow_table_t *table, uint32_t idle_timeout, uint32_t active_timeout, pv_flow_expire_func func, void *user)
+{
+   pv_timer_wheel_t *wheel;
+
+   if ((idle_timeout == 0) || (active_timeout == 0) || (func == NULL))
+   {
+      print_log_entry("init_flow_timers() <ERROR> Invalid flow timeouts.\n");
+      return(-1);
+   }
+
+   wheel = xcalloc(sizeof(pv_timer_wheel_t));
+   wheel->idle_timeout = idle_timeout;
+   wheel->active_timeout = active_timeout;
+   wheel->expire_func = func;
+   wheel->expire_user = user;
+   table->timers = wheel;
+
+   clear_flow_timers(table);
+
+   return(0);
+}
+
+void free_flow_timers(pv_flow_table_t *table)
+{
+   free(table->timers);
+   table->timers = NULL;
+}
+
+/* Empties the wheel, used when the table is cleared. */
+void clear_flow_timers(pv_flow_table_t *table)
+{
+   if (table->timers == NULL)
+      return;
+
+   memset(table->timers->slot, 0xff, sizeof(table->timers->slot)); /* PV_TIMER_NONE */
+   table->timers->now = 0;
+}
+
+/* Links every scheduled record into its slot again after the table has moved its records, see rehash_flow_table(). */
+void relink_flow_timers(pv_flow_table_t *table)
+{
+   pv_timer_wheel_t *wheel = table->timers;
+   pv_ip_record_t *record;
+   uint32_t i;
+
+   if (wheel == NULL)
+      return;
+
+   memset(wheel->slot, 0xff, sizeof(wheel->slot)); /* PV_TIMER_NONE */
+
+   for (i = 0; i < table->size; i++)
+   {
+      record = &table->buckets[i];
+      if ((record->state != PV_FLOW_IN_USE) || (record->timer_slot == PV_TIMER_NONE))
+         continue;
+      record->timer_prev = PV_TIMER_NONE;
+      record->timer_next = wheel->slot[record->timer_slot];
+      if (record->timer_next != PV_TIMER_NONE)
+         table->buckets[record->timer_next].timer_prev = i;
+      wheel->slot[record->timer_slot] = i;
+   }
+}
+
+/* The earlier of the idle and the active deadline of a flow. */
+static uint32_t flow_deadline(pv_timer_wheel_t *wheel, pv_ip_record_t *record)
+{
+   uint32_t idle = (uint32_t)record->last_seen.tv_sec + wheel->idle_timeout;
+   uint32_t active = (uint32_t)record->first_seen.tv_sec + wheel->active_timeout;
+
+   return((idle < active) ? idle : active);
+}
+
+/*
+   Function: link_flow_timer
+   Purpose : Puts a record in the wheel slot for its deadline. Deadlines
+             that have passed fire on the next tick, deadlines past the
+             last level are parked in the last level and rescheduled when
+             that slot comes due.
+   Input   : Table, record and deadline in seconds.
+*/
+static void link_flow_timer(pv_flow_table_t *table, pv_ip_record_t *record, uint32_t deadline)
+{
+   pv_timer_wheel_t *wheel = table->timers;
+   uint32_t index = (uint32_t)(record - table->buckets);
+   uint32_t delta, slot;
+
+   if (deadline <= wheel->now)
+      deadline = wheel->now + 1;
+
+   delta = deadline - wheel->now;
+
+   if (delta < PV_TIMER_SLOTS)
+   {
+      slot = deadline & TIMER_MASK;
+   }
+   else if (delta < TIMER_LEVEL1_SPAN)
+   {
+      slot = PV_TIMER_SLOTS + ((deadline >> PV_TIMER_BITS) & TIMER_MASK);
+   }
+   else
+   {
+      if (delta >= TIMER_MAX_SPAN)
+         deadline = wheel->now + TIMER_MAX_SPAN - 1;
+      slot = (2 * PV_TIMER_SLOTS) + ((deadline >> (2 * PV_TIMER_BITS)) & TIMER_MASK);
+   }
+
+   record->timer_slot = slot;
+   record->timer_prev = PV_TIMER_NONE;
+   record->timer_next = wheel->slot[slot];
+   if (record->timer_next != PV_TIMER_NONE)
+      table->buckets[record->timer_next].timer_prev = index;
+   wheel->slot[slot] = index;
+}
+
+/* Schedules a new flow, call once first_seen and last_seen are set. */
+void add_flow_timer(pv_flow_table_t *table, pv_ip_record_t *record)
+{
+   if (table->timers != NULL)
+      link_flow_timer(table, record, flow_deadline(table->timers, record));
+}
+
+void remove_flow_timer(pv_flow_table_t *table, pv_ip_record_t *record)
+{
+   pv_timer_wheel_t *wheel = table->timers;
+
+   if ((wheel == NULL) || (record->timer_slot == PV_TIMER_NONE))
+      return;
+
+   if (record->timer_prev == PV_TIMER_NONE)
+      wheel->slot[record->timer_slot] = record->timer_next;
+   else
+      table->buckets[record->timer_prev].timer_next = record->timer_next;
+
+   if (record->timer_next != PV_TIMER_NONE)
+      table->buckets[record->timer_next].timer_prev = record->timer_prev;
+
+   record->timer_slot = PV_TIMER_NONE;
+}
+
+/*
+   Function: run_timer_slot
+   Purpose : Takes every record out of a wheel slot. Records that are due
+             are expired, the rest are scheduled again, which moves
+             records down a level when a higher level slot cascades.
+   Input   : Table and slot.
+*/
+static void run_timer_slot(pv_flow_table_t *table, uint32_t slot)
+{
+   pv_timer_wheel_t *wheel = table->timers;
+   pv_ip_record_t *record;
+   uint32_t index = wheel->slot[slot];
+   uint32_t deadline;
+
+   wheel->slot[slot] = PV_TIMER_NONE;
+
+   while (index != PV_TIMER_NONE)
+   {
+      record = &table->buckets[index];
+      index = record->timer_next;
+      record->timer_slot = PV_TIMER_NONE;
+
+      deadline = flow_deadline(wheel, record);
+      if (deadline <= wheel->now)
+      {
+         wheel->expired_count++;
+         wheel->expire_func(wheel->expire_user, record,
+            (((uint32_t)record->last_seen.tv_sec + wheel->idle_timeout) <= wheel->now) ? PV_FLOW_EXPIRED_IDLE : PV_FLOW_EXPIRED_ACTIVE);
+         delete_flow(table, record);
+      }
+      else
+      {
+         link_flow_timer(table, record, deadline);
+      }
+   }
+}
+
+/*
+   Function: expire_flow_timers
+   Purpose : Moves the wheel to a time at least the idle timeout ahead,
+             when every flow is due, running each slot once.
+   Input   : Table and the new time.
+*/
+static void expire_flow_timers(pv_flow_table_t *table, uint32_t now)
+{
+   uint32_t slot;
+
+   table->timers->now = now;
+
+   for (slot = 0; slot < PV_TIMER_LEVELS * PV_TIMER_SLOTS; slot++)
+      run_timer_slot(table, slot);
+}
+
+/*
+   Function: advance_flow_timers
+   Purpose : Moves the wheel forward to the packet time, expiring the
+             flows that come due. The empty slots before the next
+             cascade are skipped. Time never moves backwards, an empty
+             table jumps straight to the new time.
+   Input   : Table and packet time in seconds.
+   Return  : The wheel time, before the packet time if the packet time
+             was not believed.
+*/
+uint32_t advance_flow_timers(pv_flow_table_t *table, uint32_t now)
+{
+   pv_timer_wheel_t *wheel = table->timers;
+   uint32_t tick, limit;
+
+   if ((wheel == NULL) || (now <= wheel->now))
+      return((wheel == NULL) ? now : wheel->now);
+
+   if ((wheel->now > 0) && (now - wheel->now > PV_TIMER_MAX_JUMP) && (++wheel->jump_count < PV_TIMER_JUMP_CONFIRM))
+   {
+      wheel->ignored_count++;
+      return(wheel->now);
+   }
+   wheel->jump_count = 0;
+
+   while (wheel->now < now)
+   {
+      if (table->count == 0)
+      {
+         wheel->now = now;
+         break;
+      }
+
+      if (now - wheel->now >= wheel->idle_timeout)
+      {
+         expire_flow_timers(table, now);
+         break;
+      }
+
+      tick = wheel->now + 1;
+      if ((tick & TIMER_MASK) != 0)
+      {
+         limit = ((tick | TIMER_MASK) < now) ? (tick | TIMER_MASK) : now;
+         while ((tick < limit) && (wheel->slot[tick & TIMER_MASK] == PV_TIMER_NONE))
+            tick++;
+      }
+      wheel->now = tick;
+
+      if ((tick & TIMER_MASK) == 0)
+      {
+         if ((tick & (TIMER_LEVEL1_SPAN - 1)) == 0)
+            run_timer_slot(table, (2 * PV_TIMER_SLOTS) + ((tick >> (2 * PV_TIMER_BITS)) & TIMER_MASK));
+         run_timer_slot(table, PV_TIMER_SLOTS + ((tick >> PV_TIMER_BITS) & TIMER_MASK));
+      }
+
+      run_timer_slot(table, tick & TIMER_MASK);
+   }
+
+   return(wheel->now);
+}
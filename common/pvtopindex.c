@@ -0,0 +1,294 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvtopindex.c
+
+   Title : Pivotal NST Flow Top Index
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Keeps the records of a flow table with the most bytes and
+            the most packets, so the top talkers can be read without
+            walking the table. Each order (PV_TOP_BYTES, PV_TOP_PACKETS)
+            is a min-heap of bucket indexes holding the largest records
+            seen, the smallest at the root.
+
+            The counts of a record only grow, so an update either moves
+            an indexed record down the heap, or compares an unindexed
+            record with the root and takes its place if it is larger.
+            The per packet cost is one compare per order unless the
+            record is in the index. Each record keeps its heap position,
+            so a deleted record leaves the index at once.
+
+            Records only enter the index when they are updated, a record
+            that falls out of a full index comes back when it overtakes
+            the root again.
+
+            The counts are those of the life of the records, the counts
+            of a time window are kept by pvtopwindow.c.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pvcommon.h"
+
+/* The count a heap is ordered by. */
+static long get_top_value(const pv_ip_record_t *record, int order)
+{
+   return((order == PV_TOP_PACKETS) ? record->packet_count : record->data_size);
+}
+
+/* Puts a bucket index at a heap position and records the position in the record. */
+static void set_top_entry(pv_flow_table_t *table, int order, uint32_t pos, uint32_t bucket)
+{
+   table->top->heap[order][pos] = bucket;
+   table->buckets[bucket].top_pos[order] = pos + 1;
+}
+
+static long get_top_entry_value(pv_flow_table_t *table, int order, uint32_t pos)
+{
+   return(get_top_value(&table->buckets[table->top->heap[order][pos]], order));
+}
+
+static void sift_top_up(pv_flow_table_t *table, int order, uint32_t pos)
+{
+   uint32_t bucket = table->top->heap[order][pos];
+   long value = get_top_value(&table->buckets[bucket], order);
+   uint32_t parent;
+
+   while (pos > 0)
+   {
+      parent = (pos - 1) / 2;
+      if (get_top_entry_value(table, order, parent) <= value)
+         break;
+      set_top_entry(table, order, pos, table->top->heap[order][parent]);
+      pos = parent;
+   }
+   set_top_entry(table, order, pos, bucket);
+}
+
+static void sift_top_down(pv_flow_table_t *table, int order, uint32_t pos)
+{
+   uint32_t bucket = table->top->heap[order][pos];
+   uint32_t count = table->top->count[order];
+   long value = get_top_value(&table->buckets[bucket], order);
+   uint32_t child;
+
+   while ((child = pos * 2 + 1) < count)
+   {
+      if ((child + 1 < count) && (get_top_entry_value(table, order, child + 1) < get_top_entry_value(table, order, child)))
+         child++;
+      if (get_top_entry_value(table, order, child) >= value)
+         break;
+      set_top_entry(table, order, pos, table->top->heap[order][child]);
+      pos = child;
+   }
+   set_top_entry(table, order, pos, bucket);
+}
+
+/*
+   Function: init_flow_top
+   Purpose : Enables the top index on a flow table.
+   Input   : Table and the number of records each order keeps.
+   Return  : 0 on success, -1 on error.
+*/
+int init_flow_top(pv_flow_table_t *table, uint32_t size)
+{
+   pv_flow_top_t *top;
+   int order;
+
+   if (size == 0)
+   {
+      print_log_entry("init_flow_top() <ERROR> Invalid top index size.\n");
+      return(-1);
+   }
+
+   top = xcalloc(sizeof(pv_flow_top_t));
+   top->size = size;
+   for (order = 0; order < PV_TOP_ORDERS; order++)
+      top->heap[order] = xcalloc(size * sizeof(uint32_t));
+   table->top = top;
+
+   return(0);
+}
+
+void free_flow_top(pv_flow_table_t *table)
+{
+   int order;
+
+   if (table->top == NULL)
+      return;
+
+   for (order = 0; order < PV_TOP_ORDERS; order++)
+      free(table->top->heap[order]);
+   free(table->top);
+   table->top = NULL;
+}
+
+/* Empties the index, used when the table is cleared. */
+void clear_flow_top(pv_flow_table_t *table)
+{
+   if (table->top == NULL)
+      return;
+
+   memset(table->top->count, 0, sizeof(table->top->count));
+}
+
+/* Points the heaps at the records again after the table has moved its records, the records keep their heap positions. */
+void relink_flow_top(pv_flow_table_t *table)
+{
+   pv_ip_record_t *record;
+   uint32_t i;
+   int order;
+
+   if (table->top == NULL)
+      return;
+
+   for (i = 0; i < table->size; i++)
+   {
+      record = &table->buckets[i];
+      if (record->state != PV_FLOW_IN_USE)
+         continue;
+      for (order = 0; order < PV_TOP_ORDERS; order++)
+      {
+         if (record->top_pos[order] != 0)
+            table->top->heap[order][record->top_pos[order] - 1] = i;
+      }
+   }
+}
+
+/*
+   Function: update_flow_top
+   Purpose : Moves a record whose counts have grown to its place in the
+             index, or into the index if it is now larger than the root.
+   Input   : Table and record.
+*/
+void update_flow_top(pv_flow_table_t *table, pv_ip_record_t *record)
+{
+   pv_flow_top_t *top = table->top;
+   uint32_t bucket;
+   int order;
+
+   if (top == NULL)
+      return;
+
+   bucket = (uint32_t)(record - table->buckets);
+
+   for (order = 0; order < PV_TOP_ORDERS; order++)
+   {
+      if (record->top_pos[order] != 0)
+      {
+         sift_top_down(table, order, record->top_pos[order] - 1);
+      }
+      else if (top->count[order] < top->size)
+      {
+         set_top_entry(table, order, top->count[order]++, bucket);
+         sift_top_up(table, order, top->count[order] - 1);
+      }
+      else if (get_top_value(record, order) > get_top_entry_value(table, order, 0))
+      {
+         table->buckets[top->heap[order][0]].top_pos[order] = 0;
+         set_top_entry(table, order, 0, bucket);
+         sift_top_down(table, order, 0);
+      }
+   }
+}
+
+/* Takes a record that is being deleted out of the index. */
+void remove_flow_top(pv_flow_table_t *table, pv_ip_record_t *record)
+{
+   pv_flow_top_t *top = table->top;
+   uint32_t pos;
+   int order;
+
+   if (top == NULL)
+      return;
+
+   for (order = 0; order < PV_TOP_ORDERS; order++)
+   {
+      if (record->top_pos[order] == 0)
+         continue;
+
+      pos = record->top_pos[order] - 1;
+      record->top_pos[order] = 0;
+      if (pos == --top->count[order])
+         continue;
+
+      set_top_entry(table, order, pos, top->heap[order][top->count[order]]);
+      if ((pos > 0) && (get_top_entry_value(table, order, (pos - 1) / 2) > get_top_entry_value(table, order, pos)))
+         sift_top_up(table, order, pos);
+      else
+         sift_top_down(table, order, pos);
+   }
+}
+
+/*
+   Function: get_flow_top
+   Purpose : Copies the indexed records of one order, unsorted.
+   Input   : Table, order, array for the records and its length.
+   Return  : Number of records copied, -1 if the table has no index.
+*/
+int get_flow_top(pv_flow_table_t *table, int order, pv_ip_record_t *records, int max)
+{
+   uint32_t i;
+   int count = 0;
+
+   if (table->top == NULL)
+      return(-1);
+
+   for (i = 0; (i < table->top->count[order]) && (count < max); i++)
+      records[count++] = table->buckets[table->top->heap[order][i]];
+
+   return(count);
+}
+
+static int compare_top_bytes(const void *a, const void *b)
+{
+   long x = ((const pv_ip_record_t *)a)->data_size;
+   long y = ((const pv_ip_record_t *)b)->data_size;
+
+   return((x < y) ? 1 : ((x > y) ? -1 : 0));
+}
+
+static int compare_top_packets(const void *a, const void *b)
+{
+   long x = ((const pv_ip_record_t *)a)->packet_count;
+   long y = ((const pv_ip_record_t *)b)->packet_count;
+
+   return((x < y) ? 1 : ((x > y) ? -1 : 0));
+}
+
+/*
+   Function: select_top_records
+   Purpose : Sorts records largest first.
+   Input   : Records, their number, order and the number of records
+             wanted.
+   Return  : Number of records kept, at most max, at the start of the
+             array.
+*/
+int select_top_records(pv_ip_record_t *records, int count, int order, int max)
+{
+   qsort(records, count, sizeof(pv_ip_record_t), (order == PV_TOP_PACKETS) ? compare_top_packets : compare_top_bytes);
+
+   return((count < max) ? count : max);
+}
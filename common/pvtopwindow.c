@@ -0,0 +1,291 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvtopwindow.c
+
+   Title : Pivotal NST Flow Top Window
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Keeps the largest keys of a flow table in each interval of
+            PV_TOP_INTERVAL seconds, for the last PV_TOP_INTERVALS
+            intervals, so the top talkers of a time window are counted
+            in that window and not over the life of the records (see
+            pvtopindex.c for those).
+
+            The open interval counts its keys in a small fixed table of
+            its own, with a top index that holds every record. When the
+            table is full a new key takes the place of the key with the
+            fewest bytes and starts from its counts (Space-Saving), so a
+            key that is large in the interval is never lost, but its
+            counts can be too high by the counts it took over. When the
+            time moves on to the next interval, the largest keys by bytes
+            and by packets are kept and the table is emptied.
+
+            A query adds up the counts of the intervals that overlap the
+            window, so the window is rounded out to whole intervals and
+            reaches back PV_TOP_INTERVALS intervals at most. A key that
+            was not among the largest of an interval misses the counts of
+            that interval.
+
+            The time is the packet time the table's timer wheel believes
+            (see advance_flow_timers()), it never moves backwards, so a
+            late event counts in the open interval.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pvcommon.h"
+
+/*
+   Function: init_flow_window
+   Purpose : Enables the top window on a flow table.
+   Input   : Table, the number of keys a closed interval keeps in each
+             order and the number of keys the open interval counts.
+   Return  : 0 on success, -1 on error.
+*/
+int init_flow_window(pv_flow_table_t *table, uint32_t size, uint32_t flows)
+{
+   pv_top_window_t *window;
+   pv_top_entry_t *entries;
+   int i;
+
+   if ((size == 0) || (flows < size))
+   {
+      print_log_entry("init_flow_window() <ERROR> Invalid top window size.\n");
+      return(-1);
+   }
+
+   window = xcalloc(sizeof(pv_top_window_t));
+   window->current = xcalloc(sizeof(pv_flow_table_t));
+   if ((init_flow_table(window->current, flows) < 0) || (init_flow_top(window->current, window->current->max_count) < 0))
+   {
+      free_flow_table(window->current);
+      free(window->current);
+      free(window);
+      return(-1);
+   }
+   window->size = size;
+
+   entries = xmalloc((size_t)PV_TOP_INTERVALS * PV_TOP_ORDERS * size * sizeof(pv_top_entry_t));
+   for (i = 0; i < PV_TOP_INTERVALS; i++)
+      window->interval[i].entries = entries + (size_t)i * PV_TOP_ORDERS * size;
+   table->window = window;
+
+   return(0);
+}
+
+void free_flow_window(pv_flow_table_t *table)
+{
+   if (table->window == NULL)
+      return;
+
+   free_flow_table(table->window->current);
+   free(table->window->current);
+   free(table->window->interval[0].entries);
+   free(table->window);
+   table->window = NULL;
+}
+
+/* Empties the window, used when the table is cleared. */
+void clear_flow_window(pv_flow_table_t *table)
+{
+   int i;
+
+   if (table->window == NULL)
+      return;
+
+   clear_flow_table(table->window->current);
+   table->window->number = 0;
+   for (i = 0; i < PV_TOP_INTERVALS; i++)
+   {
+      table->window->interval[i].number = 0;
+      table->window->interval[i].count = 0;
+   }
+}
+
+/*
+   Function: close_flow_window
+   Purpose : Keeps the largest keys of the open interval, by bytes then
+             by packets, in its closed interval and empties the open
+             interval.
+   Input   : Window.
+*/
+static void close_flow_window(pv_top_window_t *window)
+{
+   pv_flow_table_t *current = window->current;
+   pv_top_interval_t *interval = &window->interval[window->number % PV_TOP_INTERVALS];
+   pv_ip_record_t *records, *record;
+   pv_top_entry_t *entry;
+   int count = 0, kept, i;
+
+   interval->number = window->number;
+   interval->count = 0;
+
+   if (current->count == 0)
+      return;
+
+   records = xmalloc(current->count * sizeof(pv_ip_record_t));
+   for (record = get_next_flow(current, NULL); record != NULL; record = get_next_flow(current, record))
+      records[count++] = *record;
+
+   kept = select_top_records(records, count, PV_TOP_BYTES, window->size);
+   kept += select_top_records(records + kept, count - kept, PV_TOP_PACKETS, window->size);
+
+   for (i = 0; i < kept; i++)
+   {
+      entry = &interval->entries[i];
+      entry->key = records[i].key;
+      entry->hash = records[i].hash;
+      entry->packet_count = records[i].packet_count;
+      entry->data_size = records[i].data_size;
+   }
+   interval->count = kept;
+
+   free(records);
+   clear_flow_table(current);
+}
+
+/*
+   Function: update_flow_window
+   Purpose : Adds the counts of an update to its key in the open
+             interval, closing the open interval first if the time has
+             moved past it.
+   Input   : Table, key, key hash, time in seconds and the packets and
+             bytes to add.
+*/
+void update_flow_window(pv_flow_table_t *table, const pv_flow_key_t *key, uint32_t hash, uint32_t now, long packets, long bytes)
+{
+   pv_top_window_t *window = table->window;
+   pv_flow_table_t *current;
+   pv_ip_record_t *record, *smallest;
+   long taken_packets, taken_bytes;
+   uint32_t number = now / PV_TOP_INTERVAL;
+
+   if (window == NULL)
+      return;
+
+   current = window->current;
+
+   if (number > window->number)
+   {
+      if (window->number != 0)
+         close_flow_window(window);
+      window->number = number;
+   }
+
+   if ((record = insert_flow(current, key, hash)) == NULL)
+   {
+      /* Full, the key with the fewest bytes gives up its place and its counts. */
+      if (current->top->count[PV_TOP_BYTES] == 0)
+         return;
+      smallest = &current->buckets[current->top->heap[PV_TOP_BYTES][0]];
+      taken_packets = smallest->packet_count;
+      taken_bytes = smallest->data_size;
+      delete_flow(current, smallest);
+      window->replaced++;
+
+      if ((record = insert_flow(current, key, hash)) == NULL)
+         return;
+      record->packet_count = taken_packets;
+      record->data_size = taken_bytes;
+   }
+
+   record->packet_count += packets;
+   record->data_size += bytes;
+   update_flow_top(current, record);
+}
+
+/* The interval overlaps the window, a limit of 0 is no limit. */
+static int in_flow_window(uint32_t number, time_t since, time_t until)
+{
+   time_t start = (time_t)number * PV_TOP_INTERVAL;
+
+   return(((since <= 0) || (start + PV_TOP_INTERVAL > since)) && ((until <= 0) || (start <= until)));
+}
+
+/* Adds the counts of a key in an interval to its merged record, the record's times span the intervals it was counted in. */
+static void add_window_counts(pv_flow_table_t *merged, const pv_flow_key_t *key, uint32_t hash, uint32_t number, long packets, long bytes)
+{
+   pv_ip_record_t *record;
+   time_t start = (time_t)number * PV_TOP_INTERVAL;
+
+   if ((record = insert_flow(merged, key, hash)) == NULL)
+      return;
+
+   if ((record->packet_count == 0) || (start < record->first_seen.tv_sec))
+      record->first_seen.tv_sec = start;
+   if (start + PV_TOP_INTERVAL - 1 > record->last_seen.tv_sec)
+      record->last_seen.tv_sec = start + PV_TOP_INTERVAL - 1;
+   record->packet_count += packets;
+   record->data_size += bytes;
+}
+
+/*
+   Function: get_flow_window
+   Purpose : Adds the counts of the intervals that overlap a time window
+             to a table, so the windows of several tables can be merged.
+   Input   : Table, window in seconds (0 for no limit) and the table to
+             add the counts to.
+   Return  : Number of intervals added, -1 if the table has no window.
+*/
+int get_flow_window(pv_flow_table_t *table, time_t since, time_t until, pv_flow_table_t *merged)
+{
+   pv_top_window_t *window = table->window;
+   pv_top_interval_t *interval;
+   pv_top_entry_t *entry;
+   pv_ip_record_t *record;
+   uint32_t i;
+   int added = 0;
+
+   if (window == NULL)
+      return(-1);
+
+   if (window->number == 0)
+      return(0);
+
+   for (interval = window->interval; interval < window->interval + PV_TOP_INTERVALS; interval++)
+   {
+      /* Unused, or closed so long ago that its slot was not used again. */
+      if ((interval->number == 0) || (interval->number + PV_TOP_INTERVALS <= window->number) ||
+          !in_flow_window(interval->number, since, until))
+      {
+         continue;
+      }
+      for (i = 0; i < interval->count; i++)
+      {
+         entry = &interval->entries[i];
+         add_window_counts(merged, &entry->key, entry->hash, interval->number, entry->packet_count, entry->data_size);
+      }
+      added++;
+   }
+
+   if (in_flow_window(window->number, since, until))
+   {
+      for (record = get_next_flow(window->current, NULL); record != NULL; record = get_next_flow(window->current, record))
+         add_window_counts(merged, &record->key, record->hash, window->number, record->packet_count, record->data_size);
+      added++;
+   }
+
+   return(added);
+}
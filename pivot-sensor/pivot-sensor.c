@@ -43,6 +43,16 @@ int main(int argc, char *argv[])
    char capture_device[PV_PATH_MAX_LENGTH];
    char bpf_string[PV_PATH_MAX_LENGTH];
    int mode;
+   int workers = 1;
+   double replay_speed = 0.0;
+   unsigned int flow_table_size = PV_FLOW_TABLE_SIZE;
+   unsigned int flow_timeouts[2] = { PV_FLOW_IDLE_TIMEOUT, PV_FLOW_ACTIVE_TIMEOUT };
+   unsigned int export_interval = PV_EXPORT_INTERVAL;
+   unsigned int flow_packet_cap = 0;
+   unsigned int batching[2] = { PV_BATCH_BYTES, PV_BATCH_DEADLINE };
+   unsigned int compression = 0;
+   char spool_file[PV_PATH_MAX_LENGTH];
+   unsigned int spooling[2] = { PV_SPOOL_SIZE, PV_SPOOL_DRAIN_RATE };
    int res = open_log_file(argv[0]);
 
    if (res < 0)
@@ -52,11 +62,11 @@ int main(int argc, char *argv[])
    }
    print_log_entry("pivot-sensor.c main() <INFO> Starting Pivotal Sensor 1.0\n");
 
-   mode = parse_command_line_args(argc, argv, capture_device, pv_out_file, server_ip_address, filter_file);
+   mode = parse_command_line_args(argc, argv, capture_device, pv_out_file, server_ip_address, filter_file, &workers, &replay_speed, &flow_table_size, flow_timeouts, &export_interval, &flow_packet_cap, batching, &compression, spool_file, spooling);
    if (mode > 0)
    {
 
-      if (mode & PV_CAPTURE_INPUT)
+      if (mode & (PV_CAPTURE_INPUT | PV_PCAP_FILE_INPUT))
       {
          if (mode & PV_FILTER_ON)
          {
@@ -76,7 +86,20 @@ int main(int argc, char *argv[])
                strncpy(bpf_string, "ip", 2); /* Not sending to server, so just filter on layer 3 packets. */
             }
          }
-         start_capture(capture_device, bpf_string, pv_out_file, server_ip_address, mode);
+         set_replay_speed(replay_speed);
+         set_flow_table_size(flow_table_size);
+         set_flow_timeouts(flow_timeouts[0], flow_timeouts[1]);
+         /* Each export swap starts the flows afresh in the standby table, so only an active timeout shorter than the interval can fire. */
+         if ((flow_timeouts[0] > 0) && (export_interval > 0) && (flow_timeouts[1] >= export_interval))
+         {
+            iprint_log_entry("pivot-sensor.c main() <INFO> Active flow timeout never fires, flows start afresh at each export, export interval", (int)export_interval);
+         }
+         set_export_interval(export_interval);
+         set_flow_packet_cap(flow_packet_cap);
+         set_output_batching(batching[0], batching[1]);
+         set_frame_compression(compression);
+         set_spool_options(spool_file, spooling[0], spooling[1]);
+         start_capture(capture_device, bpf_string, pv_out_file, server_ip_address, mode, workers);
       }
       else if (mode & PV_UNIFIED2_INPUT)
       {
@@ -103,10 +126,14 @@ int main(int argc, char *argv[])
 /*
    Function: parse_command_line_args
    Purpose : Validates command line arguments.
-   Input   : argc, argv, capture interface, server ip and filter file strings.
+   Input   : argc, argv, capture interface (or pcap file), server ip and
+             filter file strings, number of capture workers, replay speed,
+             flows per flow table, idle and active flow timeouts, flow
+             statistics export interval, flow packet cap, output batching,
+             compression level, spool file and spool size and drain rate.
    Return  : returns -1 on error, mode of operation on success.
 */
-int parse_command_line_args(int argc, char *argv[], char *capture_device, char *pv_event_filename, char *server_ip_address, char *filter_file)
+int parse_command_line_args(int argc, char *argv[], char *capture_device, char *pv_event_filename, char *server_ip_address, char *filter_file, int *worker_count, double *replay_speed, unsigned int *flow_table_size, unsigned int *flow_timeouts, unsigned int *export_interval, unsigned int *flow_packet_cap, unsigned int *batching, unsigned int *compression, char *spool_file, unsigned int *spooling)
 {
    int retval = 0;
    char timestr[100];
@@ -118,6 +145,7 @@ int parse_command_line_args(int argc, char *argv[], char *capture_device, char *
    memset(pv_event_filename, 0, PV_PATH_MAX_LENGTH);
    memset(server_ip_address, 0, PV_PATH_MAX_LENGTH);
    memset(filter_file, 0, PV_PATH_MAX_LENGTH);
+   memset(spool_file, 0, PV_PATH_MAX_LENGTH);
    strncpy(pv_event_filename, EVENT_FILE, strlen(EVENT_FILE)); /* the default event file name */
    strncpy(capture_device, "eth0", 4);
    strncpy(server_ip_address, "127.0.0.1", 9); /* Default server on the local machine */
@@ -146,7 +174,222 @@ int parse_command_line_args(int argc, char *argv[], char *capture_device, char *
          {
             retval = retval | PV_CAPTURE_INPUT; /* Capture packets on a network interface */
          }
-         if (strncmp(argv[i], "-t", 2) == 0)
+         if (strncmp(argv[i], "-m", 2) == 0)
+         {
+            retval = retval | PV_CAPTURE_INPUT | PV_RING_CAPTURE; /* Capture packets with the TPACKET_V3 mmap ring */
+         }
+         else if (strncmp(argv[i], "-n", 2) == 0)
+         {
+            /* Number of capture worker threads, uses the mmap ring with PACKET_FANOUT */
+            if ((i+1) < argc)
+            {
+               *worker_count = atoi(argv[i+1]);
+               if ((*worker_count < 1) || (*worker_count > PV_MAX_CAPTURE_WORKERS))
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid number of capture workers.\n");
+                  return(-1);
+               }
+               printf("parse_command_line_args() <INFO> Capture workers: %d\n", *worker_count);
+               retval = retval | PV_CAPTURE_INPUT | PV_RING_CAPTURE;
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing number of capture workers.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-r", 2) == 0)
+         {
+            /* Replay packets from a pcap file instead of a network interface */
+            if ((i+1) < argc)
+            {
+               printf("parse_command_line_args() <INFO> Pcap replay file: %s\n", argv[i+1]);
+               memset(capture_device, 0, PV_PATH_MAX_LENGTH);
+               strncpy(capture_device, argv[i+1], PV_PATH_MAX_LENGTH - 1);
+               retval = retval | PV_PCAP_FILE_INPUT;
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing pcap file name.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-x", 2) == 0)
+         {
+            /* Replay speed multiplier, 0 = as fast as possible */
+            if ((i+1) < argc)
+            {
+               *replay_speed = atof(argv[i+1]);
+               if (*replay_speed < 0.0)
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid replay speed.\n");
+                  return(-1);
+               }
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing replay speed.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-e", 2) == 0)
+         {
+            /* Flows per worker flow table, the tables are allocated at startup and never grow */
+            if ((i+1) < argc)
+            {
+               if (atoi(argv[i+1]) < 1)
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid flow table size.\n");
+                  return(-1);
+               }
+               *flow_table_size = atoi(argv[i+1]);
+               printf("parse_command_line_args() <INFO> Flow table size: %u\n", *flow_table_size);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing flow table size.\n");
+               return(-1);
+            }
+         }
+         else if ((strncmp(argv[i], "-I", 2) == 0) || (strncmp(argv[i], "-A", 2) == 0))
+         {
+            /* Idle (-I) and active (-A) flow timeouts in seconds, -I 0 turns flow aging off */
+            if ((i+1) < argc)
+            {
+               if ((atoi(argv[i+1]) < 0) || ((argv[i][1] == 'A') && (atoi(argv[i+1]) < 1)))
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid flow timeout.\n");
+                  return(-1);
+               }
+               flow_timeouts[(argv[i][1] == 'I') ? 0 : 1] = atoi(argv[i+1]);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing flow timeout.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-p", 2) == 0)
+         {
+            /* Flow statistics export period in seconds, 0 = only at shutdown */
+            if ((i+1) < argc)
+            {
+               if (atoi(argv[i+1]) < 0)
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid export interval.\n");
+                  return(-1);
+               }
+               *export_interval = atoi(argv[i+1]);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing export interval.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-F", 2) == 0)
+         {
+            retval = retval | PV_FLOW_SUMMARY; /* One event per flow instead of per packet */
+         }
+         else if (strncmp(argv[i], "-k", 2) == 0)
+         {
+            /* Packets of each flow to send in full in flow summary mode */
+            if ((i+1) < argc)
+            {
+               if (atoi(argv[i+1]) < 0)
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid flow packet count.\n");
+                  return(-1);
+               }
+               *flow_packet_cap = atoi(argv[i+1]);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing flow packet count.\n");
+               return(-1);
+            }
+         }
+         else if ((strncmp(argv[i], "-B", 2) == 0) || (strncmp(argv[i], "-L", 2) == 0))
+         {
+            /* Output batch size in bytes (-B) or batch deadline in milliseconds (-L) */
+            if ((i+1) < argc)
+            {
+               if (atoi(argv[i+1]) < 0)
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid output batching.\n");
+                  return(-1);
+               }
+               batching[(argv[i][1] == 'B') ? 0 : 1] = atoi(argv[i+1]);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing output batching.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-z", 2) == 0)
+         {
+            /* zlib level of the frames sent to the server, 0 = no compression */
+            if ((i+1) < argc)
+            {
+               if ((atoi(argv[i+1]) < 0) || (atoi(argv[i+1]) > 9))
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid compression level.\n");
+                  return(-1);
+               }
+               *compression = atoi(argv[i+1]);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing compression level.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-S", 2) == 0)
+         {
+            /* Spool file for the events sent while the server is down */
+            if ((i+1) < argc)
+            {
+               printf("parse_command_line_args() <INFO> Spool file: %s\n", argv[i+1]);
+               strncpy(spool_file, argv[i+1], PV_PATH_MAX_LENGTH - 1);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing spool file name.\n");
+               return(-1);
+            }
+         }
+         else if ((strncmp(argv[i], "-M", 2) == 0) || (strncmp(argv[i], "-R", 2) == 0))
+         {
+            /* Spool size in megabytes (-M) or spool drain rate in kilobytes per second (-R) */
+            if ((i+1) < argc)
+            {
+               if ((atoi(argv[i+1]) < 0) || ((argv[i][1] == 'M') && (atoi(argv[i+1]) < 1)))
+               {
+                  print_log_entry("parse_command_line_args() <ERROR> Invalid spool option.\n");
+                  return(-1);
+               }
+               spooling[(argv[i][1] == 'M') ? 0 : 1] = atoi(argv[i+1]);
+            }
+            else
+            {
+               print_log_entry("parse_command_line_args() <ERROR> Missing spool option.\n");
+               return(-1);
+            }
+         }
+         else if (strncmp(argv[i], "-T", 2) == 0)
+         {
+            retval = retval | PV_TEXT_WIRE; /* Send Fineline text to the server, not binary records */
+         }
+         else if (strncmp(argv[i], "-U", 2) == 0)
+         {
+            retval = retval | PV_UDP_WIRE; /* Send to the server in UDP datagrams */
+         }
+         else if (strncmp(argv[i], "-q", 2) == 0)
+         {
+            retval = retval | PV_QUIET_MODE; /* Do not print each packet to stdout */
+         }
+         else if (strncmp(argv[i], "-t", 2) == 0)
          {
             retval = retval | PV_UNIFIED2_INPUT; /* Tail Unified2 log files */
          }
@@ -238,9 +481,28 @@ int show_sensor_help()
    printf("\nPivotal NST Sensor 1.0\n\n");
    printf("Command: pivotal-sensor <options>\n\n");
    printf("Capture packets from an interface                 : -c\n");
+   printf("Capture packets with the mmap ring (TPACKET_V3)   : -m\n");
+   printf("Capture with N worker threads (PACKET_FANOUT)     : -n N\n");
+   printf("Replay packets from a pcap file                   : -r FILENAME\n");
+   printf("Replay speed multiplier (0 = maximum speed)       : -x 1.0\n");
+   printf("Flows per capture worker flow table               : -e 65536\n");
+   printf("Flow idle timeout in seconds (0 = no aging)       : -I 60\n");
+   printf("Flow active timeout in seconds (below -p to fire) : -A 1800\n");
+   printf("Flow statistics export interval (0 = at shutdown) : -p 60\n");
+   printf("Flow summary events instead of packet events      : -F\n");
+   printf("First N packets of each flow in full (with -F)    : -k 0\n");
+   printf("Output batch size in bytes                        : -B 32768\n");
+   printf("Output batch deadline in ms (0 = every buffer)    : -L 5\n");
+   printf("Quiet, do not print each packet                   : -q\n");
    printf("Tail a Unified2 event log                         : -t\n");
    printf("Output to a fineline event file                   : -w\n");
    printf("Send events to server                             : -s\n");
+   printf("Send Fineline text to the server, not binary      : -T\n");
+   printf("Send to the server in UDP datagrams, not TCP      : -U\n");
+   printf("Compress frames to the server, zlib level 1-9     : -z 0\n");
+   printf("Spool events to a file while the server is down   : -S FILENAME\n");
+   printf("Spool file size in megabytes                      : -M 256\n");
+   printf("Spool drain rate in KB/s (0 = no limit)           : -R 1024\n");
    printf("Specify fineline output filename                  : -o FILENAME\n");
    printf("Specify network interface                         : -i INTERFACE\n");
    printf("Specify a server IP address                       : -a 192.168.1.10\n");
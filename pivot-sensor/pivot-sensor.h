@@ -46,25 +46,195 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <netinet/ip_icmp.h>
 #include <ifaddrs.h>
 #include <pcap.h>
+#include <pthread.h>
+
+/* TPACKET_V3 receive ring geometry: 64 x 4MB blocks of 2KB frames. */
+#define PV_RING_BLOCK_SIZE    (1 << 22)
+#define PV_RING_BLOCK_COUNT   64
+#define PV_RING_FRAME_SIZE    2048
+#define PV_RING_BLOCK_TIMEOUT 60  /* milliseconds before the kernel retires a partly filled block */
+#define PV_RING_POLL_TIMEOUT  100 /* milliseconds */
+#define PV_RING_MIN_BLOCKS    8   /* per worker when the blocks are shared out */
+#define PV_OUTPUT_QUEUE_SIZE  65536
+#define PV_OUTPUT_QUEUE_IOV   1024 /* segments per queue, one writev() */
+#define PV_BATCH_BYTES        32768 /* queued bytes that trigger a flush */
+#define PV_BATCH_DEADLINE     5     /* milliseconds a queued record may wait, 0 = flush at every check */
+#define PV_REPLAY_CHECK_PACKETS 64  /* packets between batch deadline checks of a replay at maximum speed */
+#define PV_PCAP_READ_TIMEOUT  100 /* milliseconds, without a batch deadline */
+#define PV_EXPORT_INTERVAL    60  /* seconds between flow statistics exports */
+#define PV_SEND_RING_SIZE     (1 << 22) /* bytes of frames each worker can have waiting for the server */
+#define PV_SENDER_IDLE_TIMEOUT 100 /* milliseconds */
+#define PV_SEND_TIMEOUT       5000  /* milliseconds a server write may stall before the connection is given up */
+#define PV_RECONNECT_MIN      1000  /* milliseconds before the first reconnect, doubled after each failure */
+#define PV_RECONNECT_MAX      60000
+#define PV_SPOOL_SIZE         256   /* megabytes */
+#define PV_SPOOL_DRAIN_RATE   1024  /* kilobytes per second sent from the spool, 0 = no limit */
+#define PV_SPOOL_DRAIN_INTERVAL 10  /* milliseconds between spool sends */
+#define PV_SPOOL_HEADER_SIZE  4096
+#define PV_SPOOL_MAGIC        "PVSPOOL1"
+
+/*
+DATA STRUCTURES
+*/
+
+struct pv_packet_ring
+{
+   int sockfd;
+   u_char *map;
+   size_t map_size;
+   unsigned int block_size;
+   unsigned int block_count;
+   unsigned int current_block;
+   unsigned long packet_count;
+   unsigned int kernel_packets;
+   unsigned int kernel_drops;
+};
+
+typedef struct pv_packet_ring pv_packet_ring_t;
+
+/*
+   Frames waiting for the sender thread, written by one capture worker
+   and read by the sender. Positions are free running byte counts.
+*/
+struct pv_send_ring
+{
+   unsigned char *buffer;
+   uint32_t size;  /* power of two */
+   uint32_t mask;
+   volatile uint32_t tail __attribute__((aligned(PV_CACHE_LINE_SIZE))); /* written by the worker */
+   uint32_t cached_head;         /* the worker's copy of head */
+   unsigned long frame_count;
+   unsigned long overflow_count; /* frames dropped because the ring was full */
+   unsigned long long overflow_bytes;
+   volatile uint32_t head __attribute__((aligned(PV_CACHE_LINE_SIZE))); /* written by the sender */
+};
+
+typedef struct pv_send_ring pv_send_ring_t;
+
+struct pv_output_queue
+{
+   char *buffer;       /* formatted text or binary records of the queued records */
+   int length;
+   int size;
+   struct iovec *iov;  /* queued segments, static record fragments and text in the buffer */
+   int iov_count;
+   long long first_ns; /* monotonic time the oldest queued record was added */
+   unsigned long record_count;
+   unsigned long batch_count;
+   int batch_records;
+   unsigned long dropped_count; /* records in batches the send ring had no room for */
+   int destination; /* PV_FILE_OUT or PV_SERVER_OUT */
+   pv_send_ring_t *send_ring; /* server queues only */
+   int encoding;    /* PV_ENCODING_TEXT or PV_ENCODING_BINARY */
+};
+
+typedef struct pv_output_queue pv_output_queue_t;
+
+struct pv_capture_worker
+{
+   int worker_id;  /* also the id of the worker's flow table */
+   pthread_t thread;
+   pv_packet_ring_t ring;
+   pv_output_queue_t event_queue;  /* Fineline records for the event file */
+   pv_output_queue_t server_queue; /* Fineline records for the Pivotal server */
+   pv_send_ring_t send_ring;       /* server frames waiting for the sender thread */
+};
+
+typedef struct pv_capture_worker pv_capture_worker_t;
 
 
 /* pivot-sensor.c */
 
-int parse_command_line_args(int argc, char *argv[], char *capture_device, char *pv_event_filename, char *server_ip_address, char *filter_file);
+int parse_command_line_args(int argc, char *argv[], char *capture_device, char *pv_event_filename, char *server_ip_address, char *filter_file, int *worker_count, double *replay_speed, unsigned int *flow_table_size, unsigned int *flow_timeouts, unsigned int *export_interval, unsigned int *flow_packet_cap, unsigned int *batching, unsigned int *compression, char *spool_file, unsigned int *spooling);
 int show_sensor_help();
 
 /* pvsniffer.c */
 
+void set_flow_packet_cap(unsigned int packets);
 pcap_t* open_pcap_socket(char* device, const char* bpfstr);
 void start_capture_loop(int packets, pcap_handler func);
 void process_packet(u_char *user, struct pcap_pkthdr *packethdr, u_char *packetptr);
+void export_flow_record(void *user, pv_ip_record_t *record, int reason);
 void terminate_capture(int signal_number);
-int start_capture(char *interface, const char *bpf_string, char *event_file, char *server_address, int mode);
+void stop_capture(int signal_number);
+int start_capture(char *interface, const char *bpf_string, char *event_file, char *server_address, int mode, int workers);
+int set_link_header_length(int link_type);
+
+/* pvring.c */
+
+int open_ring_socket(pv_packet_ring_t *ring, char *device, const char *bpfstr, int block_count);
+int join_ring_fanout(pv_packet_ring_t *ring, int group_id);
+void start_ring_loop(pv_packet_ring_t *ring, pcap_handler func, u_char *user, void (*block_func)(u_char *));
+void stop_ring_loop();
+void set_ring_timeout(unsigned int timeout);
+int get_ring_stats(pv_packet_ring_t *ring, unsigned int *received, unsigned int *dropped);
+void close_ring_socket(pv_packet_ring_t *ring);
+
+/* pvreplay.c */
+
+void set_replay_speed(double speed);
+void stop_replay();
+int start_replay(char *pcap_file, const char *bpf_string, pcap_handler func);
+
+/* pvworker.c */
+
+int init_capture_workers(int count, int mode);
+pv_capture_worker_t *get_capture_worker(int worker_id);
+int get_capture_worker_count();
+int start_capture_workers(char *interface, const char *bpf_string, pcap_handler func);
+void join_capture_workers();
+int get_capture_worker_stats(unsigned int *received, unsigned int *dropped);
+void close_capture_workers();
+void queue_event(pv_output_queue_t *queue, char *event_string);
+void queue_event_record(pv_output_queue_t *queue, const struct timeval *ts, const char *data, int len);
+void queue_binary_event(pv_output_queue_t *queue, const pv_event_t *event);
+int flush_output_queue(pv_output_queue_t *queue);
+void flush_worker_output(pv_capture_worker_t *worker);
+void check_worker_output(pv_capture_worker_t *worker);
+void set_output_batching(unsigned int bytes, unsigned int deadline);
+unsigned int get_batch_deadline();
+void set_server_encoding(int encoding);
+int get_server_encoding();
+void get_output_queue_stats(int destination, unsigned long *records, unsigned long *batches, unsigned long *dropped);
+
+/* pvsender.c */
+
+int init_send_ring(pv_send_ring_t *ring, uint32_t size);
+int push_send_frame(pv_send_ring_t *ring, int type, int flags, struct iovec *iov, int count);
+int send_server_buffer(int type, int flags, char *buffer, int length);
+void set_sender_datagrams(uint32_t sensor_number);
+int start_server_sender(char *server_address, int sockfd);
+int stop_server_sender();
+void get_send_ring_stats(unsigned long *frames, unsigned long *overflows, unsigned long long *overflow_bytes, unsigned long long *lost_bytes, unsigned long *writes, unsigned long long *bytes);
+void get_datagram_stats(unsigned long *sent, unsigned long *lost);
+void get_server_connection_stats(unsigned long *disconnects, unsigned long *reconnects);
+
+/* pvspool.c */
+
+void set_spool_options(char *file_name, unsigned int size, unsigned int drain_rate);
+int is_spool_configured();
+int is_spool_open();
+unsigned long get_spool_drain_rate();
+int open_spool();
+void close_spool();
+uint64_t get_spool_used();
+int spool_frames(struct iovec *iov, int count);
+int next_spool_frames(struct iovec *iov, uint64_t budget);
+void release_spool(uint64_t length);
+void get_spool_stats(unsigned long long *bytes_in, unsigned long long *bytes_out, unsigned long long *bytes_waiting);
+
+/* pvexport.c */
+
+void set_export_interval(unsigned int seconds);
+unsigned int get_export_interval();
+int start_flow_export(int mode);
+void stop_flow_export();
 
 /* pvfilter.c */
 
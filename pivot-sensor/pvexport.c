@@ -0,0 +1,176 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvexport.c
+
+   Title : Pivotal NST Sensor Flow Statistics Export
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Exports the flow statistics every export interval from a
+            background thread. At each interval the capture workers are
+            asked to swap their active flow table for the standby table
+            (see pvipmap.c), the exporter then renders the old tables as
+            an <eventstatistics> block, writes it to the event file and
+            sends it to the Pivotal Server, and clears the old tables for
+            the next interval. The capture workers never wait for the
+            exporter, they only take a lock to wake it once per swap.
+
+            Each block holds the traffic seen during one interval, the
+            statistics left at shutdown are written by terminate_capture().
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <time.h>
+#include <errno.h>
+
+#include "pvcommon.h"
+#include "pivot-sensor.h"
+
+static pthread_t export_thread;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+static int export_running = 0;
+static int export_started = 0;
+static unsigned int export_interval = PV_EXPORT_INTERVAL;
+static int export_mode;
+
+/* Export interval in seconds, 0 turns periodic export off. */
+void set_export_interval(unsigned int seconds)
+{
+   export_interval = seconds;
+}
+
+unsigned int get_export_interval()
+{
+   return(export_interval);
+}
+
+/*
+   Function: wait_export_interval
+   Purpose : Sleeps until the next export time or until the exporter is
+             stopped.
+   Input   : Absolute time of the next export, moved on by one interval.
+   Return  : 1 if it is time to export, 0 if the exporter was stopped.
+*/
+static int wait_export_interval(struct timespec *next_export)
+{
+   int running;
+
+   next_export->tv_sec += export_interval;
+
+   pthread_mutex_lock(&export_lock);
+   while (export_running)
+   {
+      if (pthread_cond_timedwait(&export_cond, &export_lock, next_export) == ETIMEDOUT)
+         break;
+   }
+   running = export_running;
+   pthread_mutex_unlock(&export_lock);
+
+   return(running);
+}
+
+static void *flow_export_thread(void *arg)
+{
+   struct timespec next_export, start, end;
+   char *buffer = NULL;
+   int size = 0;
+   int length;
+   sigset_t sigmask;
+
+   /* Leave the stop signals to the capture thread. */
+   sigfillset(&sigmask);
+   pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+   clock_gettime(CLOCK_REALTIME, &next_export);
+
+   while (wait_export_interval(&next_export))
+   {
+      if (!wait_ip_map_swap(request_ip_map_swap()))
+         break;
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      if ((length = export_ip_maps(&buffer, &size)) < 0)
+         continue;
+
+      if (export_mode & PV_FILE_OUT)
+         write_event_buffer(buffer, length);
+
+      if (export_mode & PV_SERVER_OUT)
+         send_server_buffer((export_mode & PV_FLOW_SUMMARY) ? PV_FRAME_EVENT : PV_FRAME_STATS, 0, buffer, length);
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      if (!(export_mode & PV_QUIET_MODE))
+      {
+         printf("flow_export_thread() <INFO> Exported %d bytes of flow statistics in %ld us\n", length,
+                (long)((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000L));
+      }
+   }
+
+   free(buffer);
+
+   return(NULL);
+}
+
+/*
+   Function: start_flow_export
+   Purpose : Starts the exporter thread if an export interval is set.
+   Input   : Output mode.
+   Return  : 0 on success, -1 on error.
+*/
+int start_flow_export(int mode)
+{
+   if (export_interval == 0)
+      return(0);
+
+   export_mode = mode;
+   export_running = 1;
+
+   if (pthread_create(&export_thread, NULL, flow_export_thread, NULL) != 0)
+   {
+      print_log_entry("start_flow_export() <ERROR> Could not create export thread.\n");
+      export_running = 0;
+      return(-1);
+   }
+   export_started = 1;
+
+   iprint_log_entry("start_flow_export() <INFO> Flow statistics export interval", export_interval);
+
+   return(0);
+}
+
+/* Stops the exporter thread, call from normal context before the final export. */
+void stop_flow_export()
+{
+   if (!export_started)
+      return;
+
+   pthread_mutex_lock(&export_lock);
+   export_running = 0;
+   pthread_cond_signal(&export_cond);
+   pthread_mutex_unlock(&export_lock);
+   cancel_ip_map_swap();
+
+   pthread_join(export_thread, NULL);
+   export_started = 0;
+}
@@ -0,0 +1,209 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvreplay.c
+
+   Title : Pivotal NST Sensor Pcap Replay
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Reads a pcap file recorded with tcpdump/wireshark and drives
+            the packets through process_packet() exactly like a live
+            capture. Two speeds are offered:
+
+            speed 0   : as fast as possible, for benchmarking the sensor.
+            speed > 0 : paced to the original packet timestamps, divided
+                        by the speed multiplier (2.0 = twice as fast).
+
+            When the replay finishes the packet count, elapsed time,
+            packets per second and nanoseconds per packet are reported,
+            giving reproducible numbers from recorded production traces.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <time.h>
+
+#include "pvcommon.h"
+#include "pivot-sensor.h"
+
+static volatile sig_atomic_t replay_running;
+static double replay_speed = 0.0;
+
+void set_replay_speed(double speed)
+{
+   replay_speed = speed;
+}
+
+/* Signal safe, makes start_replay() return after the current packet. */
+void stop_replay()
+{
+   replay_running = 0;
+}
+
+static long long timespec_to_ns(struct timespec *ts)
+{
+   return((long long)ts->tv_sec * 1000000000LL + ts->tv_nsec);
+}
+
+static long long timeval_to_ns(struct timeval *tv)
+{
+   return((long long)tv->tv_sec * 1000000000LL + (long long)tv->tv_usec * 1000LL);
+}
+
+/*
+   Function: wait_for_packet_time
+   Purpose : Sleeps until the replay clock reaches the packet's original
+             offset from the first packet, scaled by the speed multiplier.
+             The worker's output is flushed first if the wait is longer
+             than the batch deadline, otherwise only the queues that are
+             due are flushed, so closely spaced packets still share
+             batches.
+   Input   : Capture worker, replay start time, offset of the packet in
+             nanoseconds.
+*/
+static void wait_for_packet_time(pv_capture_worker_t *worker, long long start_ns, long long offset_ns)
+{
+   struct timespec target, now;
+   long long target_ns = start_ns + (long long)(offset_ns / replay_speed);
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if (target_ns - timespec_to_ns(&now) > (long long)get_batch_deadline() * 1000000LL)
+      flush_worker_output(worker);
+   else
+      check_worker_output(worker);
+
+   target.tv_sec = target_ns / 1000000000LL;
+   target.tv_nsec = target_ns % 1000000000LL;
+
+   while ((clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) != 0) && replay_running)
+      ;
+}
+
+/*
+   Function: print_replay_stats
+   Purpose : Reports the replay throughput to stdout and the log file.
+*/
+static void print_replay_stats(unsigned long packets, unsigned long long bytes, long long elapsed_ns)
+{
+   char log_str[PV_MAX_INPUT_STR];
+   double seconds = (double)elapsed_ns / 1000000000.0;
+   double pps = (seconds > 0.0) ? (double)packets / seconds : 0.0;
+   double ns_per_packet = (packets > 0) ? (double)elapsed_ns / (double)packets : 0.0;
+   double mbps = (seconds > 0.0) ? ((double)bytes * 8.0) / (seconds * 1000000.0) : 0.0;
+
+   sprintf(log_str, "start_replay() <INFO> Replayed %lu packets (%llu bytes) in %.6f seconds: %.0f pps %.1f ns/packet %.2f Mbit/s\n",
+           packets, bytes, seconds, pps, ns_per_packet, mbps);
+   print_log_entry(log_str);
+}
+
+/*
+   Function: start_replay
+   Purpose : Opens the pcap file, applies the BPF filter and feeds every
+             packet to the packet handler on capture worker 0, then
+             reports the replay statistics.
+   Input   : Pcap file name, BPF filter string and packet handler.
+   Return  : Number of packets replayed, -1 on error.
+*/
+int start_replay(char *pcap_file, const char *bpf_string, pcap_handler func)
+{
+   char error_buffer[PCAP_ERRBUF_SIZE];
+   pcap_t *pfile;
+   struct bpf_program bpfp;
+   struct pcap_pkthdr *packethdr;
+   const u_char *packetptr;
+   struct timespec start_time, end_time;
+   pv_capture_worker_t *worker = get_capture_worker(0);
+   long long start_ns, first_packet_ns = -1;
+   unsigned long packets = 0;
+   unsigned long long bytes = 0;
+   int res;
+
+   if ((pfile = pcap_open_offline(pcap_file, error_buffer)) == NULL)
+   {
+      sprint_log_entry("start_replay()", error_buffer);
+      return(-1);
+   }
+
+   if (pcap_compile(pfile, &bpfp, (char*)bpf_string, 1, PCAP_NETMASK_UNKNOWN) < 0)
+   {
+      sprint_log_entry("start_replay()", pcap_geterr(pfile));
+      pcap_close(pfile);
+      return(-1);
+   }
+   if (pcap_setfilter(pfile, &bpfp) < 0)
+   {
+      sprint_log_entry("start_replay()", pcap_geterr(pfile));
+      pcap_freecode(&bpfp);
+      pcap_close(pfile);
+      return(-1);
+   }
+   pcap_freecode(&bpfp);
+
+   if (set_link_header_length(pcap_datalink(pfile)) < 0)
+   {
+      pcap_close(pfile);
+      return(-1);
+   }
+
+   if (replay_speed > 0.0)
+      printf("start_replay() <INFO> Replaying %s at %.2fx original speed\n", pcap_file, replay_speed);
+   else
+      printf("start_replay() <INFO> Replaying %s at maximum speed\n", pcap_file);
+
+   replay_running = 1;
+   clock_gettime(CLOCK_MONOTONIC, &start_time);
+   start_ns = timespec_to_ns(&start_time);
+
+   while (replay_running && ((res = pcap_next_ex(pfile, &packethdr, &packetptr)) >= 0))
+   {
+      if (res == 0)
+         continue;
+
+      if (replay_speed > 0.0)
+      {
+         if (first_packet_ns < 0)
+            first_packet_ns = timeval_to_ns(&packethdr->ts);
+         wait_for_packet_time(worker, start_ns, timeval_to_ns(&packethdr->ts) - first_packet_ns);
+      }
+
+      func((u_char *)worker, packethdr, packetptr);
+      packets++;
+      if ((replay_speed <= 0.0) && ((packets % PV_REPLAY_CHECK_PACKETS) == 0))
+         check_worker_output(worker); /* The batch deadline still holds at maximum speed. */
+      else
+         check_ip_map_swap(worker->worker_id);
+      bytes += packethdr->len;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end_time);
+   flush_worker_output(worker);
+
+   if (replay_running && (res == -1))
+   {
+      sprint_log_entry("start_replay()", pcap_geterr(pfile));
+   }
+
+   print_replay_stats(packets, bytes, timespec_to_ns(&end_time) - start_ns);
+
+   pcap_close(pfile);
+
+   return(packets);
+}
@@ -0,0 +1,373 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvring.c
+
+   Title : Pivotal NST Sensor Packet Ring
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Alternative capture engine for high rate links. Uses a Linux
+            AF_PACKET socket with a TPACKET_V3 memory mapped receive ring.
+            The kernel fills whole blocks of frames and hands each block
+            over to the sensor, which walks the frames in place and passes
+            them to the same packet handler used by libpcap (process_packet).
+            The block is then returned to the kernel. No copies and no
+            syscalls are made per packet, a poll() is only needed when
+            the ring is empty.
+
+            The BPF filter string is compiled with libpcap and attached to
+            the socket with SO_ATTACH_FILTER, so the filter files work the
+            same way in both capture modes.
+
+   Note   : Only ethernet (and loopback) interfaces are supported, the
+            handler is called with the frame starting at the MAC header.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "pvcommon.h"
+#include "pivot-sensor.h"
+
+static volatile sig_atomic_t ring_running;
+static unsigned int ring_block_timeout = PV_RING_BLOCK_TIMEOUT;
+static unsigned int ring_poll_timeout = PV_RING_POLL_TIMEOUT;
+
+/*
+   Block retire and poll timeout in milliseconds, call before the rings
+   are opened. A partly filled block only reaches the sensor when it is
+   retired, so this bounds how long a packet can wait to be processed
+   on a quiet link.
+*/
+void set_ring_timeout(unsigned int timeout)
+{
+   if (timeout == 0)
+      return;
+
+   if (timeout < ring_block_timeout)
+      ring_block_timeout = timeout;
+   if (timeout < ring_poll_timeout)
+      ring_poll_timeout = timeout;
+}
+
+/*
+   Function: attach_ring_filter
+   Purpose : Compiles the BPF filter string with libpcap and attaches
+             the filter program to the ring socket.
+   Input   : Socket descriptor, BPF filter string.
+   Return  : 0 on success, -1 on error.
+*/
+static int attach_ring_filter(int sockfd, const char *bpfstr)
+{
+   pcap_t *pdead;
+   struct bpf_program bpfp;
+   struct sock_fprog fprog;
+   int retval = 0;
+
+   if ((bpfstr == NULL) || (strlen(bpfstr) == 0))
+      return(0);
+
+   if ((pdead = pcap_open_dead(DLT_EN10MB, PV_RING_FRAME_SIZE)) == NULL)
+   {
+      print_log_entry("attach_ring_filter() <ERROR> Could not open pcap compiler handle.\n");
+      return(-1);
+   }
+
+   if (pcap_compile(pdead, &bpfp, (char*)bpfstr, 1, PCAP_NETMASK_UNKNOWN) < 0)
+   {
+      sprint_log_entry("attach_ring_filter()", pcap_geterr(pdead));
+      pcap_close(pdead);
+      return(-1);
+   }
+
+   /* struct bpf_insn and struct sock_filter share the same layout. */
+   fprog.len = bpfp.bf_len;
+   fprog.filter = (struct sock_filter *)bpfp.bf_insns;
+
+   if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+   {
+      print_log_entry("attach_ring_filter() <ERROR> Could not attach packet filter.\n");
+      retval = -1;
+   }
+
+   pcap_freecode(&bpfp);
+   pcap_close(pdead);
+
+   return(retval);
+}
+
+/*
+   Function: open_ring_socket
+   Purpose : Creates the AF_PACKET socket, attaches the BPF filter, maps
+             the TPACKET_V3 receive ring and binds to the network device.
+   Input   : Ring structure, device name, BPF filter string and number
+             of ring blocks.
+   Return  : 0 on success, -1 on error.
+*/
+int open_ring_socket(pv_packet_ring_t *ring, char *device, const char *bpfstr, int block_count)
+{
+   struct tpacket_req3 req;
+   struct sockaddr_ll sll;
+   struct packet_mreq mreq;
+   int version = TPACKET_V3;
+   unsigned int ifindex;
+
+   memset(ring, 0, sizeof(pv_packet_ring_t));
+   ring->sockfd = -1;
+
+   if ((ifindex = if_nametoindex(device)) == 0)
+   {
+      sprint_log_entry("open_ring_socket() <ERROR> Unknown network interface", device);
+      return(-1);
+   }
+
+   if ((ring->sockfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
+   {
+      print_log_entry("open_ring_socket() <ERROR> Could not create packet socket.\n");
+      return(-1);
+   }
+
+   if (setsockopt(ring->sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+   {
+      print_log_entry("open_ring_socket() <ERROR> TPACKET_V3 not supported.\n");
+      close_ring_socket(ring);
+      return(-1);
+   }
+
+   /* Filter before the ring is live so unwanted packets never reach it. */
+   if (attach_ring_filter(ring->sockfd, bpfstr) < 0)
+   {
+      close_ring_socket(ring);
+      return(-1);
+   }
+
+   memset(&req, 0, sizeof(req));
+   req.tp_block_size = PV_RING_BLOCK_SIZE;
+   req.tp_block_nr = block_count;
+   req.tp_frame_size = PV_RING_FRAME_SIZE;
+   req.tp_frame_nr = (PV_RING_BLOCK_SIZE / PV_RING_FRAME_SIZE) * block_count;
+   req.tp_retire_blk_tov = ring_block_timeout;
+   req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+   if (setsockopt(ring->sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+   {
+      print_log_entry("open_ring_socket() <ERROR> Could not allocate receive ring.\n");
+      close_ring_socket(ring);
+      return(-1);
+   }
+
+   ring->block_size = req.tp_block_size;
+   ring->block_count = req.tp_block_nr;
+   ring->map_size = (size_t)req.tp_block_size * req.tp_block_nr;
+   ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->sockfd, 0);
+   if (ring->map == MAP_FAILED)
+   {
+      ring->map = NULL;
+      print_log_entry("open_ring_socket() <ERROR> Could not map receive ring.\n");
+      close_ring_socket(ring);
+      return(-1);
+   }
+
+   memset(&sll, 0, sizeof(sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons(ETH_P_ALL);
+   sll.sll_ifindex = ifindex;
+
+   if (bind(ring->sockfd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+   {
+      print_log_entry("open_ring_socket() <ERROR> Could not bind packet socket.\n");
+      close_ring_socket(ring);
+      return(-1);
+   }
+
+   /* Promiscuous mode, same as pcap_open_live(). */
+   memset(&mreq, 0, sizeof(mreq));
+   mreq.mr_ifindex = ifindex;
+   mreq.mr_type = PACKET_MR_PROMISC;
+   if (setsockopt(ring->sockfd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+   {
+      print_log_entry("open_ring_socket() <WARNING> Could not set promiscuous mode.\n");
+   }
+
+   printf("open_ring_socket() <INFO> TPACKET_V3 ring: %u blocks of %u bytes on %s\n", ring->block_count, ring->block_size, device);
+
+   return(0);
+}
+
+/*
+   Function: join_ring_fanout
+   Purpose : Adds the ring socket to a PACKET_FANOUT group in hash mode.
+             The kernel then spreads the packets of one interface over
+             all sockets in the group, every packet of a flow lands on the
+             same socket. Fragments are reassembled before hashing so they
+             follow their flow.
+   Input   : Ring structure, fanout group id (shared by all sockets).
+   Return  : 0 on success, -1 on error.
+*/
+int join_ring_fanout(pv_packet_ring_t *ring, int group_id)
+{
+   int fanout_arg = (group_id & 0xffff) | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+   if (setsockopt(ring->sockfd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0)
+   {
+      print_log_entry("join_ring_fanout() <ERROR> Could not join fanout group.\n");
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+   Function: process_ring_block
+   Purpose : Walks every frame in a block the kernel has handed to user
+             space and calls the packet handler on each one in place.
+   Input   : Block descriptor, packet handler and user data pointer.
+   Return  : Number of packets processed.
+*/
+static int process_ring_block(struct tpacket_block_desc *block, pcap_handler func, u_char *user)
+{
+   struct tpacket3_hdr *ppd;
+   struct pcap_pkthdr packethdr;
+   unsigned int i, num_pkts;
+
+   num_pkts = block->hdr.bh1.num_pkts;
+   ppd = (struct tpacket3_hdr *)((u_char *)block + block->hdr.bh1.offset_to_first_pkt);
+
+   for (i = 0; i < num_pkts; i++)
+   {
+      packethdr.ts.tv_sec = ppd->tp_sec;
+      packethdr.ts.tv_usec = ppd->tp_nsec / 1000;
+      packethdr.caplen = ppd->tp_snaplen;
+      packethdr.len = ppd->tp_len;
+
+      func(user, &packethdr, (u_char *)ppd + ppd->tp_mac);
+
+      ppd = (struct tpacket3_hdr *)((u_char *)ppd + ppd->tp_next_offset);
+   }
+
+   return(num_pkts);
+}
+
+/*
+   Function: start_ring_loop
+   Purpose : Consumes blocks from the receive ring until stop_ring_loop()
+             is called. Blocks are visited in ring order, when the next
+             block still belongs to the kernel we poll() the socket.
+             The optional block handler is called after each block and
+             each poll timeout, the capture workers use it to check their
+             output queue deadlines.
+   Input   : Ring structure, packet handler, user data pointer and
+             block handler (may be NULL).
+*/
+void start_ring_loop(pv_packet_ring_t *ring, pcap_handler func, u_char *user, void (*block_func)(u_char *))
+{
+   struct tpacket_block_desc *block;
+   struct pollfd pfd;
+
+   memset(&pfd, 0, sizeof(pfd));
+   pfd.fd = ring->sockfd;
+   pfd.events = POLLIN | POLLERR;
+
+   ring_running = 1;
+
+   while (ring_running)
+   {
+      block = (struct tpacket_block_desc *)(ring->map + ((size_t)ring->current_block * ring->block_size));
+
+      if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+      {
+         if ((poll(&pfd, 1, ring_poll_timeout) < 0) && (errno != EINTR))
+         {
+            print_log_entry("start_ring_loop() <ERROR> poll failed.\n");
+            break;
+         }
+         if (block_func != NULL)
+            block_func(user);
+         continue;
+      }
+
+      __sync_synchronize(); /* Read the frames only after seeing the block status. */
+
+      ring->packet_count += process_ring_block(block, func, user);
+
+      __sync_synchronize();
+      block->hdr.bh1.block_status = TP_STATUS_KERNEL; /* Hand the block back to the kernel. */
+
+      ring->current_block = (ring->current_block + 1) % ring->block_count;
+
+      if (block_func != NULL)
+         block_func(user);
+   }
+}
+
+/* Signal safe, makes start_ring_loop() return after the current block. */
+void stop_ring_loop()
+{
+   ring_running = 0;
+}
+
+/*
+   Function: get_ring_stats
+   Purpose : Reads the kernel packet and drop counters for the socket.
+             The kernel resets the counters on each read so the values
+             are accumulated in the ring structure.
+   Input   : Ring structure, received and dropped counter pointers.
+   Return  : 0 on success, -1 on error.
+*/
+int get_ring_stats(pv_packet_ring_t *ring, unsigned int *received, unsigned int *dropped)
+{
+   struct tpacket_stats_v3 stats;
+   socklen_t len = sizeof(stats);
+
+   if (getsockopt(ring->sockfd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) < 0)
+   {
+      print_log_entry("get_ring_stats() <ERROR> Could not read ring statistics.\n");
+      return(-1);
+   }
+
+   ring->kernel_packets += stats.tp_packets;
+   ring->kernel_drops += stats.tp_drops;
+   *received = ring->kernel_packets;
+   *dropped = ring->kernel_drops;
+
+   return(0);
+}
+
+void close_ring_socket(pv_packet_ring_t *ring)
+{
+   if (ring->map != NULL)
+   {
+      munmap(ring->map, ring->map_size);
+      ring->map = NULL;
+   }
+   if (ring->sockfd >= 0)
+   {
+      close(ring->sockfd);
+      ring->sockfd = -1;
+   }
+}
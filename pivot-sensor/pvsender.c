@@ -0,0 +1,977 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvsender.c
+
+   Title : Pivotal NST Sensor Server Sender
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Moves the socket writes to the Pivotal Server off the capture
+            path. Each capture worker owns a send ring, a lock free single
+            producer, single consumer byte ring. When a server queue is
+            flushed the worker compresses the batch, writes it into its
+            ring as a complete frame and publishes the new tail. One sender
+            thread drains the rings of all the workers to the socket.
+
+            The worker never waits for the server. If the ring does not
+            have room for the frame, the batch is dropped and counted, so
+            a slow or stalled server costs events instead of packets.
+
+            Only the worker writes the tail and only the sender writes the
+            head, each on its own cache line. The worker keeps a copy of
+            the head and only reads the sender's head when the copy says
+            the ring is full. Frames are published whole, so the sender
+            can write everything between head and tail without looking at
+            the frames. A wrapped range goes out in one writev().
+
+            The sender sleeps on an eventfd when every ring is empty. A
+            worker only writes to the eventfd when the sender has said it
+            is going to sleep, so a busy sender costs the workers no
+            syscalls.
+
+            The sender owns the server connection. The flow exporter hands
+            its frames over through a ring of its own and waits for room
+            instead of dropping them. If a write fails or stalls for longer
+            than PV_SEND_TIMEOUT, or the server could not be reached at
+            startup, the sender closes the socket and tries to connect
+            again after 1 second, doubling the wait up to
+            PV_RECONNECT_MAX. Until then everything drained from the rings
+            goes to the disk spool (see pvspool.c), if one is configured.
+            The connect and the hello of a reconnect are non-blocking and
+            moved on by the sender loop, so the rings keep draining into
+            the spool while the server is slow to answer.
+            Once the server is back, live frames are sent as they come and
+            the spool is sent between them at the spool drain rate, cut at
+            frame ends.
+
+            With -U the frames go to the server as UDP datagrams instead
+            (see pvframe.c). The sender cuts each frame drained from the
+            rings into datagrams of whole records and sends up to
+            PV_DATAGRAM_BATCH of them in one sendmmsg(). There is no
+            connection to lose, so nothing is spooled. A datagram the
+            kernel refuses is counted as lost, the server counts the ones
+            lost on the way from the gaps in the sequence numbers.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "pvcommon.h"
+#include "pivot-sensor.h"
+
+#define PV_CONNECT_IDLE    0
+#define PV_CONNECT_PENDING 1 /* waiting for the connect to end */
+#define PV_CONNECT_HELLO   2 /* waiting for the server to answer the hello */
+
+static pthread_t sender_thread;
+static int sender_started = 0;
+static int sender_sockfd = -1;
+static int sender_event_fd = -1;
+static volatile int sender_running = 0;
+static volatile int sender_sleeping = 0;
+static char sender_address[PV_IP_ADDR_MAX];
+static long long next_connect_ms = 0;
+static unsigned int connect_backoff = PV_RECONNECT_MIN;
+static int connect_sockfd = -1;
+static int connect_state = PV_CONNECT_IDLE;
+static long long connect_deadline_ms = 0;
+static unsigned char connect_reply[PV_FRAME_HEADER_SIZE + PV_MAX_INPUT_STR];
+static int connect_received = 0;
+static long long spool_tokens = 0;
+static long long spool_refill_ms = 0;
+static pv_send_ring_t export_ring;
+static unsigned long sender_writes = 0;
+static unsigned long long sender_bytes = 0;
+static unsigned long long sender_lost_bytes = 0;
+static unsigned long server_disconnects = 0;
+static unsigned long server_reconnects = 0;
+static int sender_datagrams = 0;
+static uint32_t datagram_sensor = 0;
+static uint32_t datagram_sequence = 0;
+static struct mmsghdr datagram_batch[PV_DATAGRAM_BATCH];
+static struct iovec datagram_iov[PV_DATAGRAM_BATCH][2];
+static unsigned char datagram_headers[PV_DATAGRAM_BATCH][PV_DATAGRAM_HEADER_SIZE];
+static int datagram_count = 0;
+static char *datagram_scratch = NULL; /* payloads that wrap around the end of a ring */
+static unsigned long datagrams_sent = 0;
+static unsigned long datagrams_lost = 0;
+
+/*
+   Function: init_send_ring
+   Purpose : Allocates a send ring, the size must be a power of two.
+   Input   : Send ring and size in bytes.
+   Return  : 0 on success, -1 on error.
+*/
+int init_send_ring(pv_send_ring_t *ring, uint32_t size)
+{
+   memset(ring, 0, sizeof(pv_send_ring_t));
+
+   if ((ring->buffer = malloc(size)) == NULL)
+   {
+      iprint_log_entry("init_send_ring() <ERROR> Could not allocate send ring", size);
+      return(-1);
+   }
+   ring->size = size;
+   ring->mask = size - 1;
+
+   return(0);
+}
+
+/* Copies bytes into the ring starting at a stream position. */
+static void copy_to_ring(pv_send_ring_t *ring, uint32_t position, const void *data, uint32_t length)
+{
+   uint32_t start = position & ring->mask;
+   uint32_t first = ring->size - start;
+
+   if (first >= length)
+   {
+      memcpy(ring->buffer + start, data, length);
+   }
+   else
+   {
+      memcpy(ring->buffer + start, data, first);
+      memcpy(ring->buffer, (const char *)data + first, length - first);
+   }
+}
+
+static void wake_sender()
+{
+   uint64_t one = 1;
+
+   if (write(sender_event_fd, &one, sizeof(one)) < 0)
+      print_log_entry("wake_sender() <ERROR> Could not wake sender.\n");
+}
+
+/*
+   Function: push_send_frame
+   Purpose : Compresses a batch of record segments and adds it to the
+             worker's send ring as one frame, then wakes the sender if it
+             is asleep. Called by the worker that owns the ring, never
+             blocks.
+   Input   : Send ring, frame type, frame flags, segment list with the
+             first segment free for the header and number of segments.
+   Return  : 0 on success, -1 if the ring is full and the frame was
+             dropped.
+*/
+int push_send_frame(pv_send_ring_t *ring, int type, int flags, struct iovec *iov, int count)
+{
+   unsigned char header[PV_FRAME_HEADER_SIZE];
+   uint32_t length = 0;
+   uint32_t tail = ring->tail;
+   int i;
+
+   count = compress_frame_iov(iov, count, &flags);
+
+   for (i = 1; i < count; i++)
+      length += iov[i].iov_len;
+
+   if (ring->size - (tail - ring->cached_head) < PV_FRAME_HEADER_SIZE + length)
+   {
+      ring->cached_head = ring->head;
+      if (ring->size - (tail - ring->cached_head) < PV_FRAME_HEADER_SIZE + length)
+      {
+         ring->overflow_count++;
+         ring->overflow_bytes += PV_FRAME_HEADER_SIZE + length;
+         return(-1);
+      }
+   }
+
+   set_frame_header(header, type, flags, length);
+   copy_to_ring(ring, tail, header, PV_FRAME_HEADER_SIZE);
+   tail += PV_FRAME_HEADER_SIZE;
+   for (i = 1; i < count; i++)
+   {
+      copy_to_ring(ring, tail, iov[i].iov_base, iov[i].iov_len);
+      tail += iov[i].iov_len;
+   }
+
+   __sync_synchronize(); /* The frame is in the ring before the sender sees the tail. */
+   ring->tail = tail;
+   ring->frame_count++;
+
+   __sync_synchronize(); /* Publish the tail before checking if the sender sleeps. */
+   if (sender_sleeping)
+      wake_sender();
+
+   return(0);
+}
+
+/*
+   Function: send_server_buffer
+   Purpose : Hands a buffer of records to the sender as event or stats
+             frames, split at record ends (see get_frame_split()). Used by
+             the flow exporter, which is not on the capture path, so it
+             waits for room in its ring instead of dropping frames.
+   Input   : Message type, frame flags, buffer and length.
+   Return  : 0 on success, -1 if the sender is not running or a record
+             is too long for a frame.
+*/
+int send_server_buffer(int type, int flags, char *buffer, int length)
+{
+   struct iovec iov[2];
+   struct timespec delay;
+   int part;
+   int sent = 0;
+
+   delay.tv_sec = 0;
+   delay.tv_nsec = 1000000; /* 1 millisecond */
+
+   while (sent < length)
+   {
+      if ((part = get_frame_split(buffer + sent, length - sent, flags)) < 0)
+      {
+         print_log_entry("send_server_buffer() <ERROR> Record too long for a frame.\n");
+         return(-1);
+      }
+
+      /* A compressed frame is never longer than the original. */
+      while (export_ring.size - (export_ring.tail - export_ring.head) < (uint32_t)(PV_FRAME_HEADER_SIZE + part))
+      {
+         if (!sender_running)
+            return(-1);
+         nanosleep(&delay, NULL);
+      }
+
+      iov[1].iov_base = buffer + sent;
+      iov[1].iov_len = part;
+      if (push_send_frame(&export_ring, type, flags, iov, 2) < 0)
+         return(-1);
+      sent += part;
+   }
+
+   return(0);
+}
+
+static long long get_sender_clock()
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return((long long)now.tv_sec * 1000LL + now.tv_nsec / 1000000L);
+}
+
+/* Bounds the writes to a connected server, a server that stops reading fails the write instead of stalling the sender. */
+static void set_send_timeout(int sockfd)
+{
+   struct timeval tv;
+
+   tv.tv_sec = PV_SEND_TIMEOUT / 1000;
+   tv.tv_usec = (PV_SEND_TIMEOUT % 1000) * 1000;
+   if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+      print_log_entry("set_send_timeout() <WARNING> Could not set SO_SNDTIMEO.\n");
+}
+
+/* Closes a failed connection and schedules the first reconnect. */
+static void close_server_connection()
+{
+   close_socket(sender_sockfd);
+   sender_sockfd = -1;
+   server_disconnects++;
+   connect_backoff = PV_RECONNECT_MIN;
+   next_connect_ms = get_sender_clock() + connect_backoff;
+   print_log_entry("close_server_connection() <WARNING> Lost the server connection, spooling events.\n");
+}
+
+/* Gives up a reconnect, a failed attempt doubles the wait before the next one. */
+static void fail_connect(long long now)
+{
+   if (connect_sockfd >= 0)
+      close_socket(connect_sockfd);
+   connect_sockfd = -1;
+   connect_state = PV_CONNECT_IDLE;
+
+   connect_backoff = (connect_backoff < PV_RECONNECT_MAX / 2) ? connect_backoff * 2 : PV_RECONNECT_MAX;
+   next_connect_ms = now + connect_backoff;
+}
+
+/* Starts a reconnect, check_connect() moves it on. */
+static void start_connect(long long now)
+{
+   if ((connect_sockfd = start_client_socket(sender_address)) < 0)
+   {
+      fail_connect(now);
+      return;
+   }
+
+   connect_state = PV_CONNECT_PENDING;
+   connect_deadline_ms = now + PV_CONNECT_TIMEOUT;
+   connect_received = 0;
+}
+
+/*
+   Function: finish_connect
+   Purpose : Takes the server's answer to the hello. The server has to
+             accept the encoding and compression the frames in the rings
+             and the spool were made with, otherwise the attempt fails.
+   Input   : Current time in milliseconds and the answer length.
+*/
+static void finish_connect(long long now, uint32_t length)
+{
+   char *reply = (char *)connect_reply + PV_FRAME_HEADER_SIZE;
+   int compression = get_frame_compression();
+
+   reply[length] = 0;
+   if ((accept_server_hello(reply, get_server_encoding(), &compression) != get_server_encoding()) ||
+       (compression != get_frame_compression()))
+   {
+      print_log_entry("connect_server() <ERROR> Server does not accept the spooled encoding.\n");
+      fail_connect(now);
+      return;
+   }
+
+   fcntl(connect_sockfd, F_SETFL, 0);
+   set_send_timeout(connect_sockfd);
+   sender_sockfd = connect_sockfd;
+   connect_sockfd = -1;
+   connect_state = PV_CONNECT_IDLE;
+   server_reconnects++;
+   connect_backoff = PV_RECONNECT_MIN;
+   spool_tokens = 0;
+   spool_refill_ms = now;
+   print_log_entry("connect_server() <INFO> Reconnected to the server.\n");
+}
+
+/*
+   Function: check_connect
+   Purpose : Moves a reconnect on without waiting, sends the hello once
+             the connect has ended and reads the answer as it comes. An
+             attempt that takes longer than PV_CONNECT_TIMEOUT to connect
+             or PV_HELLO_TIMEOUT to answer fails.
+   Input   : Current time in milliseconds.
+*/
+static void check_connect(long long now)
+{
+   struct pollfd pfd;
+   pv_frame_t frame;
+   int wanted, n;
+
+   if (connect_state == PV_CONNECT_PENDING)
+   {
+      pfd.fd = connect_sockfd;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, 0) <= 0)
+      {
+         if (now >= connect_deadline_ms)
+         {
+            print_log_entry("connect_server() <WARNING> Server does not answer the connect.\n");
+            fail_connect(now);
+         }
+         return;
+      }
+      if ((finish_client_socket(connect_sockfd) < 0) ||
+          (send_sensor_hello(connect_sockfd, get_server_encoding(), get_frame_compression()) < 0))
+      {
+         fail_connect(now);
+         return;
+      }
+      connect_state = PV_CONNECT_HELLO;
+      connect_deadline_ms = now + PV_HELLO_TIMEOUT;
+   }
+
+   for (;;)
+   {
+      wanted = PV_FRAME_HEADER_SIZE;
+      if (connect_received >= PV_FRAME_HEADER_SIZE)
+      {
+         if ((parse_frame_header(connect_reply, &frame) < 0) || (frame.type != PV_FRAME_CONTROL) ||
+             (frame.length >= PV_MAX_INPUT_STR))
+         {
+            print_log_entry("connect_server() <ERROR> Invalid answer from the server.\n");
+            fail_connect(now);
+            return;
+         }
+         wanted += frame.length;
+         if (connect_received == wanted)
+         {
+            finish_connect(now, frame.length);
+            return;
+         }
+      }
+
+      n = recv(connect_sockfd, connect_reply + connect_received, wanted - connect_received, MSG_DONTWAIT);
+      if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+      {
+         if (now >= connect_deadline_ms)
+         {
+            print_log_entry("connect_server() <WARNING> No answer from the server.\n");
+            fail_connect(now);
+         }
+         return;
+      }
+      if (n <= 0)
+      {
+         fail_connect(now);
+         return;
+      }
+      connect_received += n;
+   }
+}
+
+/*
+   Function: is_server_closed
+   Purpose : Checks if the server has closed the connection. The server
+             sends nothing after the hello, so a readable socket means the
+             connection has ended. Writing to it would not fail until the
+             server's reset came back, and those frames would be lost.
+   Return  : 1 if the connection has ended, 0 if not.
+*/
+static int is_server_closed()
+{
+   struct pollfd pfd;
+   char c;
+
+   pfd.fd = sender_sockfd;
+   pfd.events = POLLIN;
+
+   if (poll(&pfd, 1, 0) <= 0)
+      return(0);
+
+   return(recv(sender_sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0);
+}
+
+/*
+   Function: send_datagram_batch
+   Purpose : Sends the queued datagrams with as few sendmmsg() calls as
+             the kernel allows. A datagram that cannot be sent is counted
+             as lost and skipped, so a refused datagram (e.g. the ICMP
+             error of a server that is not listening yet) does not hold
+             back the rest of the batch.
+*/
+static void send_datagram_batch()
+{
+   int i, j, sent;
+
+   for (i = 0; i < datagram_count; i += sent)
+   {
+      sent = sendmmsg(sender_sockfd, datagram_batch + i, datagram_count - i, 0);
+      if (sent < 0)
+      {
+         if (errno == EINTR)
+         {
+            sent = 0;
+            continue;
+         }
+         datagrams_lost++;
+         sender_lost_bytes += datagram_iov[i][0].iov_len + datagram_iov[i][1].iov_len;
+         sent = 1;
+         continue;
+      }
+      for (j = i; j < i + sent; j++)
+         sender_bytes += datagram_batch[j].msg_len;
+      sender_writes++;
+      datagrams_sent += sent;
+   }
+
+   datagram_count = 0;
+}
+
+/* Queues one datagram of whole records, sends the batch when it is full. */
+static void queue_datagram(int type, int flags, char *payload, int length)
+{
+   struct msghdr *msg;
+
+   if (datagram_count == PV_DATAGRAM_BATCH)
+      send_datagram_batch();
+
+   set_datagram_header(datagram_headers[datagram_count], datagram_sensor, datagram_sequence++, type, flags, length);
+   datagram_iov[datagram_count][0].iov_base = datagram_headers[datagram_count];
+   datagram_iov[datagram_count][0].iov_len = PV_DATAGRAM_HEADER_SIZE;
+   datagram_iov[datagram_count][1].iov_base = payload;
+   datagram_iov[datagram_count][1].iov_len = length;
+
+   msg = &datagram_batch[datagram_count].msg_hdr;
+   memset(msg, 0, sizeof(struct msghdr));
+   msg->msg_iov = datagram_iov[datagram_count];
+   msg->msg_iovlen = 2;
+
+   datagram_count++;
+}
+
+/* Copies bytes starting at an offset into a range of ring segments. */
+static void copy_from_iov(struct iovec *iov, int count, size_t offset, char *out, size_t length)
+{
+   size_t part;
+   int i;
+
+   for (i = 0; (i < count) && (length > 0); i++)
+   {
+      if (offset >= iov[i].iov_len)
+      {
+         offset -= iov[i].iov_len;
+         continue;
+      }
+      part = iov[i].iov_len - offset;
+      if (part > length)
+         part = length;
+      memcpy(out, (char *)iov[i].iov_base + offset, part);
+      out += part;
+      length -= part;
+      offset = 0;
+   }
+}
+
+/*
+   Function: send_frame_datagrams
+   Purpose : Cuts the frames drained from a ring into datagrams and sends
+             them in batches. A payload is sent from the ring where it
+             is, unless it wraps around the end of the ring, then it is
+             copied out first.
+   Input   : Segment list holding whole frames and number of segments.
+*/
+static void send_frame_datagrams(struct iovec *iov, int count)
+{
+   unsigned char header[PV_FRAME_HEADER_SIZE];
+   pv_frame_t frame;
+   size_t offset = 0;
+   size_t total = iov[0].iov_len + ((count > 1) ? iov[1].iov_len : 0);
+   uint32_t sent;
+   int part;
+   char *payload;
+
+   while (offset + PV_FRAME_HEADER_SIZE <= total)
+   {
+      copy_from_iov(iov, count, offset, (char *)header, PV_FRAME_HEADER_SIZE);
+      if (parse_frame_header(header, &frame) < 0)
+         break;
+      offset += PV_FRAME_HEADER_SIZE;
+
+      if (offset + frame.length <= iov[0].iov_len)
+      {
+         payload = (char *)iov[0].iov_base + offset;
+      }
+      else if (offset >= iov[0].iov_len)
+      {
+         payload = (char *)iov[1].iov_base + (offset - iov[0].iov_len);
+      }
+      else
+      {
+         /* The queued datagrams may still point at the last wrapped payload. */
+         send_datagram_batch();
+         copy_from_iov(iov, count, offset, datagram_scratch, frame.length);
+         payload = datagram_scratch;
+      }
+
+      for (sent = 0; sent < frame.length; sent += part)
+      {
+         part = get_record_split(payload + sent, frame.length - sent, PV_DATAGRAM_PAYLOAD, frame.flags);
+         queue_datagram(frame.type, frame.flags, payload + sent, part);
+      }
+      offset += frame.length;
+   }
+
+   /* The ring space is given back once this returns. */
+   send_datagram_batch();
+}
+
+/*
+   Function: send_or_spool
+   Purpose : Writes whole frames to the server, or to the spool while the
+             server is down. A write that fails or stalls for longer than
+             PV_SEND_TIMEOUT drops the connection and the frames go to the
+             spool. Frames that neither takes are counted as lost.
+   Input   : Segment list and number of segments, the list is not
+             changed.
+   Return  : 0 if the frames were written to the server, -1 if not.
+*/
+static int send_or_spool(struct iovec *iov, int count)
+{
+   struct iovec out[2];
+   size_t length = 0;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      out[i] = iov[i];
+      length += iov[i].iov_len;
+   }
+
+   if (sender_datagrams)
+   {
+      send_frame_datagrams(iov, count);
+      return(0);
+   }
+
+   if ((sender_sockfd >= 0) && is_server_closed())
+      close_server_connection();
+
+   if (sender_sockfd >= 0)
+   {
+      if (write_iov(sender_sockfd, out, count) >= 0)
+      {
+         sender_writes++;
+         sender_bytes += length;
+         return(0);
+      }
+      close_server_connection();
+   }
+
+   if (spool_frames(iov, count) < 0)
+      sender_lost_bytes += length;
+
+   return(-1);
+}
+
+/*
+   Function: drain_send_ring
+   Purpose : Sends everything published in a send ring, the space is
+             given back to the worker once the frames are written or
+             spooled.
+   Input   : Send ring.
+   Return  : Bytes drained.
+*/
+static uint32_t drain_send_ring(pv_send_ring_t *ring)
+{
+   struct iovec iov[2];
+   uint32_t head = ring->head;
+   uint32_t tail = ring->tail;
+   uint32_t used, start, first;
+
+   if (tail == head)
+      return(0);
+
+   __sync_synchronize(); /* Read the frames only after seeing the tail. */
+
+   used = tail - head;
+   start = head & ring->mask;
+   first = ring->size - start;
+   if (first > used)
+      first = used;
+
+   iov[0].iov_base = ring->buffer + start;
+   iov[0].iov_len = first;
+   iov[1].iov_base = ring->buffer;
+   iov[1].iov_len = used - first;
+
+   send_or_spool(iov, (used > first) ? 2 : 1);
+
+   __sync_synchronize(); /* The frames are written before the worker reuses the space. */
+   ring->head = tail;
+
+   return(used);
+}
+
+/* Drains the export ring and the send ring of every worker once, returns the bytes drained. */
+static uint32_t drain_send_rings()
+{
+   pv_capture_worker_t *worker;
+   uint32_t drained;
+   int i;
+
+   drained = drain_send_ring(&export_ring);
+   for (i = 0; i < get_capture_worker_count(); i++)
+   {
+      worker = get_capture_worker(i);
+      if (worker->send_ring.buffer != NULL)
+         drained += drain_send_ring(&worker->send_ring);
+   }
+
+   return(drained);
+}
+
+/*
+   Function: drain_spool
+   Purpose : Sends spooled frames while the server is up, no faster than
+             the drain rate. The rate is a token bucket refilled by the
+             elapsed time and holding at most one second of tokens.
+   Input   : Current time in milliseconds.
+   Return  : Bytes sent.
+*/
+static uint32_t drain_spool(long long now)
+{
+   struct iovec iov[2];
+   unsigned long rate = get_spool_drain_rate();
+   uint64_t budget = PV_FRAME_MAX_PAYLOAD;
+   uint64_t length;
+   int count;
+
+   if ((sender_sockfd < 0) || (get_spool_used() == 0))
+      return(0);
+
+   if (rate > 0)
+   {
+      spool_tokens += (now - spool_refill_ms) * (long long)rate / 1000LL;
+      if (spool_tokens > (long long)rate)
+         spool_tokens = rate;
+      spool_refill_ms = now;
+      if (spool_tokens <= 0)
+         return(0);
+      if ((uint64_t)spool_tokens < budget)
+         budget = spool_tokens;
+   }
+
+   if ((count = next_spool_frames(iov, budget)) == 0)
+      return(0);
+
+   length = iov[0].iov_len + ((count > 1) ? iov[1].iov_len : 0);
+   if (is_server_closed() || (write_iov(sender_sockfd, iov, count) < 0))
+   {
+      close_server_connection();
+      return(0);
+   }
+
+   release_spool(length);
+   spool_tokens -= length;
+   sender_writes++;
+   sender_bytes += length;
+
+   return((uint32_t)length);
+}
+
+/*
+   Function: get_sender_timeout
+   Purpose : How long the sender may sleep, the idle timeout, the spool
+             drain interval while the spool is being sent, or the time
+             left to the next reconnect or to the end of the current one.
+   Input   : Current time in milliseconds.
+   Return  : Timeout in milliseconds.
+*/
+static int get_sender_timeout(long long now)
+{
+   int timeout = PV_SENDER_IDLE_TIMEOUT;
+
+   if (sender_sockfd >= 0)
+   {
+      if (get_spool_used() > 0)
+         timeout = PV_SPOOL_DRAIN_INTERVAL;
+   }
+   else if (connect_sockfd >= 0)
+   {
+      if (connect_deadline_ms - now < timeout)
+         timeout = (connect_deadline_ms > now) ? (int)(connect_deadline_ms - now) : 0;
+   }
+   else if (sender_address[0] != 0)
+   {
+      if (next_connect_ms - now < timeout)
+         timeout = (next_connect_ms > now) ? (int)(next_connect_ms - now) : 0;
+   }
+
+   return(timeout);
+}
+
+/*
+   Function: wait_send_rings
+   Purpose : Sleeps until a worker publishes a frame, a reconnect can
+             move on, the sender is stopped or the timeout ends. The
+             sleeping flag is set before the rings are checked again, so a
+             frame published in between either is seen here or wakes the
+             eventfd.
+   Input   : Timeout in milliseconds.
+*/
+static void wait_send_rings(int timeout)
+{
+   struct pollfd pfd[2];
+   uint64_t count;
+   int nfds = 1;
+
+   sender_sleeping = 1;
+   __sync_synchronize();
+
+   if ((drain_send_rings() == 0) && sender_running && (timeout > 0))
+   {
+      pfd[0].fd = sender_event_fd;
+      pfd[0].events = POLLIN;
+      pfd[0].revents = 0;
+      if (connect_sockfd >= 0)
+      {
+         pfd[1].fd = connect_sockfd;
+         pfd[1].events = (connect_state == PV_CONNECT_PENDING) ? POLLOUT : POLLIN;
+         nfds = 2;
+      }
+      if ((poll(pfd, nfds, timeout) > 0) && (pfd[0].revents & POLLIN))
+      {
+         if (read(sender_event_fd, &count, sizeof(count)) < 0)
+            print_log_entry("wait_send_rings() <ERROR> Could not read sender event.\n");
+      }
+   }
+
+   sender_sleeping = 0;
+}
+
+static void *server_sender_thread(void *arg)
+{
+   sigset_t sigmask;
+   long long now;
+
+   /* Leave the stop signals to the capture thread. */
+   sigfillset(&sigmask);
+   pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+   while (sender_running)
+   {
+      now = get_sender_clock();
+      if (connect_sockfd >= 0)
+         check_connect(now);
+      else if ((sender_sockfd < 0) && (sender_address[0] != 0) && (now >= next_connect_ms))
+         start_connect(now);
+
+      if (drain_send_rings() + drain_spool(now) == 0)
+         wait_send_rings(get_sender_timeout(now));
+   }
+
+   /* The workers have stopped, send or spool what they left in the rings. */
+   while (drain_send_rings() > 0)
+      ;
+
+   if (connect_sockfd >= 0)
+   {
+      close_socket(connect_sockfd);
+      connect_sockfd = -1;
+      connect_state = PV_CONNECT_IDLE;
+   }
+
+   return(NULL);
+}
+
+/*
+   Function: set_sender_datagrams
+   Purpose : Sends the frames as UDP datagrams, call before the sender
+             is started with a connected UDP socket.
+   Input   : Sensor number put in every datagram.
+*/
+void set_sender_datagrams(uint32_t sensor_number)
+{
+   sender_datagrams = 1;
+   datagram_sensor = sensor_number;
+}
+
+/*
+   Function: start_server_sender
+   Purpose : Opens the spool if one is configured and starts the sender
+             thread, call after init_capture_workers().
+   Input   : Server address and the connected socket, -1 if the server
+             could not be reached. The sender then starts reconnecting.
+   Return  : 0 on success, -1 on error.
+*/
+int start_server_sender(char *server_address, int sockfd)
+{
+   if (sender_datagrams)
+      datagram_scratch = xmalloc(PV_FRAME_MAX_PAYLOAD);
+   else if (is_spool_configured() && (open_spool() < 0))
+      return(-1);
+
+   if (init_send_ring(&export_ring, PV_SEND_RING_SIZE) < 0)
+      return(-1);
+
+   if ((sender_event_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+   {
+      print_log_entry("start_server_sender() <ERROR> Could not create sender event.\n");
+      return(-1);
+   }
+
+   memset(sender_address, 0, PV_IP_ADDR_MAX);
+   strncpy(sender_address, server_address, PV_IP_ADDR_MAX - 1);
+   sender_sockfd = sockfd;
+   if ((sockfd >= 0) && !sender_datagrams)
+      set_send_timeout(sockfd);
+   connect_backoff = PV_RECONNECT_MIN;
+   next_connect_ms = get_sender_clock() + connect_backoff;
+   spool_refill_ms = get_sender_clock();
+   sender_running = 1;
+
+   if (pthread_create(&sender_thread, NULL, server_sender_thread, NULL) != 0)
+   {
+      print_log_entry("start_server_sender() <ERROR> Could not create sender thread.\n");
+      sender_running = 0;
+      close(sender_event_fd);
+      sender_event_fd = -1;
+      return(-1);
+   }
+   sender_started = 1;
+
+   return(0);
+}
+
+/*
+   Function: stop_server_sender
+   Purpose : Stops the sender thread once it has sent or spooled
+             everything in the rings, and closes the spool. Frames left
+             in the spool are sent by the next run. Call after the
+             workers and the exporter have stopped.
+   Return  : The server socket for the final messages, -1 if the server
+             is down.
+*/
+int stop_server_sender()
+{
+   if (!sender_started)
+      return(sender_sockfd);
+
+   sender_running = 0;
+   __sync_synchronize();
+   wake_sender();
+
+   pthread_join(sender_thread, NULL);
+   close(sender_event_fd);
+   sender_event_fd = -1;
+   sender_started = 0;
+   close_spool();
+
+   return(sender_sockfd);
+}
+
+/*
+   Function: get_send_ring_stats
+   Purpose : Totals the frames of all the workers' send rings.
+   Input   : Pointers that receive the frames queued, the frames and
+             bytes dropped because a ring was full, the bytes lost while
+             the server was down and the spool was full or not
+             configured, and the writes and bytes sent.
+*/
+void get_send_ring_stats(unsigned long *frames, unsigned long *overflows, unsigned long long *overflow_bytes, unsigned long long *lost_bytes, unsigned long *writes, unsigned long long *bytes)
+{
+   pv_capture_worker_t *worker;
+   int i;
+
+   *frames = 0;
+   *overflows = 0;
+   *overflow_bytes = 0;
+   for (i = 0; i < get_capture_worker_count(); i++)
+   {
+      worker = get_capture_worker(i);
+      *frames += worker->send_ring.frame_count;
+      *overflows += worker->send_ring.overflow_count;
+      *overflow_bytes += worker->send_ring.overflow_bytes;
+   }
+   *lost_bytes = sender_lost_bytes;
+   *writes = sender_writes;
+   *bytes = sender_bytes;
+}
+
+/* Datagrams sent and datagrams the kernel would not send. */
+void get_datagram_stats(unsigned long *sent, unsigned long *lost)
+{
+   *sent = datagrams_sent;
+   *lost = datagrams_lost;
+}
+
+/* Times the server connection was lost and made again. */
+void get_server_connection_stats(unsigned long *disconnects, unsigned long *reconnects)
+{
+   *disconnects = server_disconnects;
+   *reconnects = server_reconnects;
+}
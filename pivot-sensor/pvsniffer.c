@@ -33,8 +33,9 @@
 
             For each packet processed, the source and destination ip is stored
             in a hashmap and the packet count and data size is accumulated for
-            traffic between the src and dst. These records are then sent to the
-            Pivotal Server every 60 seconds.
+            traffic between the src and dst. These records are then written to the
+            event file and sent to the Pivotal Server every export interval
+            (60 seconds by default, see pvexport.c).
 
    Note   : The default filter is (ip and not src localhost). The negative condition
             is required since we will be sending event packets to the Pivot Server,
@@ -55,7 +56,13 @@ int socket_desc;
 int options;
 struct in_addr server_ipv4_addr;
 unsigned int server_ipv4_port;
-/* TODO: add ipv6 support. */
+unsigned int flow_packet_cap;
+
+/* Packets of each flow sent in full in flow summary mode, 0 for none. */
+void set_flow_packet_cap(unsigned int packets)
+{
+   flow_packet_cap = packets;
+}
 
 pcap_t* open_pcap_socket(char* device, const char* bpfstr)
 {
@@ -75,7 +82,8 @@ pcap_t* open_pcap_socket(char* device, const char* bpfstr)
    }
 */
 
-   if ((pdev = pcap_open_live(device, BUFSIZ, 1, 0, error_buffer)) == NULL)
+   /* The read timeout bounds how long queued events wait on a quiet link. */
+   if ((pdev = pcap_open_live(device, BUFSIZ, 1, (get_batch_deadline() > 0) ? get_batch_deadline() : PV_PCAP_READ_TIMEOUT, error_buffer)) == NULL)
    {
       sprint_log_entry("open_pcap_socket()", error_buffer);
       return NULL;
@@ -105,18 +113,14 @@ pcap_t* open_pcap_socket(char* device, const char* bpfstr)
    return pdev;
 }
 
-void start_capture_loop(int packets, pcap_handler func)
+/*
+   Function: set_link_header_length
+   Purpose : Sets the datalink layer header size for a libpcap link type.
+   Input   : Link type from pcap_datalink().
+   Return  : 0 on success, -1 for unsupported link types.
+*/
+int set_link_header_length(int link_type)
 {
-   int link_type;
-
-    /* Determine the datalink layer type. */
-   if ((link_type = pcap_datalink(pcap_device)) < 0)
-   {
-      sprint_log_entry("capture_loop()", pcap_geterr(pcap_device));
-      return;
-   }
-
-    /* Set the datalink layer header size. */
    switch (link_type)
    {
    case DLT_NULL:
@@ -133,118 +137,206 @@ void start_capture_loop(int packets, pcap_handler func)
       break;
 
    default:
-      iprint_log_entry("capture_loop() <ERROR> Unsupported datalink", link_type);
+      iprint_log_entry("set_link_header_length() <ERROR> Unsupported datalink", link_type);
+      return(-1);
+   }
+
+   return(0);
+}
+
+void start_capture_loop(int packets, pcap_handler func)
+{
+   int link_type;
+   int res;
+   int count = 0;
+   pv_capture_worker_t *worker;
+
+    /* Determine the datalink layer type. */
+   if ((link_type = pcap_datalink(pcap_device)) < 0)
+   {
+      sprint_log_entry("capture_loop()", pcap_geterr(pcap_device));
+      return;
+   }
+
+    /* Set the datalink layer header size. */
+   if (set_link_header_length(link_type) < 0)
+   {
       return;
    }
 
-    /* Start capturing packets. */
-   if (pcap_loop(pcap_device, packets, func, 0) < 0)
+   /* Start capturing packets, libpcap capture runs on worker 0 and  */
+   /* the output deadline is checked after each buffer of packets.   */
+   worker = get_capture_worker(0);
+   while ((res = pcap_dispatch(pcap_device, -1, func, (u_char *)worker)) >= 0)
+   {
+      check_worker_output(worker);
+      count += res;
+      if ((packets > 0) && (count >= packets))
+         break;
+   }
+   if (res == -1)
    {
-      sprint_log_entry("pcap_loop() <ERROR>", pcap_geterr(pcap_device));
+      sprint_log_entry("pcap_dispatch() <ERROR>", pcap_geterr(pcap_device));
    }
 }
 
 
+/*
+   Function: set_packet_event
+   Purpose : Fills in a packet event from the packet headers.
+   Input   : Event, flow key, packet time, IPv4 header, IPv6 header (NULL
+             for IPv4) and the transport layer header.
+*/
+static void set_packet_event(pv_event_t *event, pv_flow_key_t *flow_key, struct timeval *ts, struct ip *iphdr, struct ip6_hdr *ip6hdr, u_char *transport)
+{
+   struct tcphdr* tcphdr;
+   unsigned short id, seq;
+   uint32_t flow;
+
+   event->kind = PV_RECORD_PACKET;
+   event->ts = *ts;
+   event->sensor_id = 0; /* PV_SENSOR_ID */
+   event->key = *flow_key;
+
+   if (ip6hdr != NULL)
+   {
+      flow = ntohl(ip6hdr->ip6_flow);
+      event->ip_id = flow & 0xfffff;
+      event->ip_tos = (flow >> 20) & 0xff;
+      event->ip_ttl = ip6hdr->ip6_hlim;
+      event->ip_hlen = 0;
+      event->ip_len = ntohs(ip6hdr->ip6_plen);
+   }
+   else
+   {
+      event->ip_id = ntohs(iphdr->ip_id);
+      event->ip_tos = iphdr->ip_tos;
+      event->ip_ttl = iphdr->ip_ttl;
+      event->ip_hlen = 4*iphdr->ip_hl;
+      event->ip_len = ntohs(iphdr->ip_len);
+   }
+
+   switch (flow_key->protocol)
+   {
+   case IPPROTO_TCP:
+      tcphdr = (struct tcphdr*)transport;
+      event->tcp_flags = transport[13]; /* th_flags */
+      event->tcp_seq = ntohl(tcphdr->seq);
+      event->tcp_ack = ntohl(tcphdr->ack_seq);
+      event->tcp_win = ntohs(tcphdr->window);
+      event->tcp_hlen = 4*tcphdr->doff;
+      break;
+
+   case IPPROTO_ICMP:
+   case IPPROTO_ICMPV6:
+      memcpy(&id, transport+4, 2);
+      memcpy(&seq, transport+6, 2);
+      event->icmp_type = transport[0];
+      event->icmp_code = transport[1];
+      event->icmp_echo_id = ntohs(id);
+      event->icmp_echo_seq = ntohs(seq);
+      break;
+   }
+}
+
 /*
    Function: process_packet
    Purpose : Called by libpcap to process each packet.
              Parses the ip packet header, tcp/udp headers and
-             creates a fineline event record, then sends the
-             record to the Pivotal Server or writes it to an
-             event file.
-   Input   : user data pointer is either a socket or file pointer.
+             updates the flow table, then creates a fineline
+             event record and sends the record to the Pivotal
+             Server or writes it to an event file. In flow
+             summary mode only the first packets of each flow
+             (the flow packet cap) get an event record, the
+             flows are reported as FLOW events instead.
+             The header fields are copied into a pv_event_t, a
+             server that accepted binary records gets the event
+             encoded as a binary record, the Fineline text is
+             only formatted when the event file, the console or a
+             text server needs it.
+   Input   : user data pointer is the capture worker that owns the
+             ip map and output queues, NULL selects worker 0.
 */
 void process_packet(u_char *user, struct pcap_pkthdr *packethdr, u_char *packetptr)
 {
+   pv_capture_worker_t *worker = (user != NULL) ? (pv_capture_worker_t *)user : get_capture_worker(0);
    struct ip* iphdr;
-   struct icmphdr* icmphdr;
-   struct tcphdr* tcphdr;
-   struct udphdr* udphdr;
-   char ip_header_info[256], srcip[256], dstip[256], event_data[512], temp_data[256], key_value[512];
-   unsigned short id, seq;
-   pv_ip_record_t *ip_record;
-   char fl_event_string[PV_MAX_INPUT_STR];
-
-   /* CLEAR THE BUFFERS */
-   memset(event_data, 0, 512);
-   memset(key_value, 0, 512);
-   memset(temp_data, 0, 256);
-   memset(fl_event_string, 0, PV_MAX_INPUT_STR);
+   struct ip6_hdr* ip6hdr = NULL;
+   struct tcphdr* tcphdr = NULL;
+   struct udphdr* udphdr = NULL;
+   char event_data[PV_EVENT_DATA_STR];
+   int protocol, ip_len;
+   int len = 0;
+   uint8_t tcp_flags = 0;
+   pv_flow_key_t flow_key;
+   long flow_packets;
+   pv_event_t event;
 
    /* Skip the datalink layer header and get the IP header fields. */
    packetptr += link_header_length;
    iphdr = (struct ip*)packetptr;
-   strcpy(srcip, inet_ntoa(iphdr->ip_src));
-   strcpy(dstip, inet_ntoa(iphdr->ip_dst));
-   sprintf(ip_header_info, "ID:%d TOS:0x%x TTL:%d IpLen:%d DgLen:%d ",ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl, 4*iphdr->ip_hl, ntohs(iphdr->ip_len));
+   if (iphdr->ip_v == 6)
+   {
+      ip6hdr = (struct ip6_hdr*)packetptr;
+      protocol = ip6hdr->ip6_nxt; /* Extension headers are not followed. */
+      ip_len = ntohs(ip6hdr->ip6_plen) + sizeof(struct ip6_hdr);
+      packetptr += sizeof(struct ip6_hdr);
+   }
+   else
+   {
+      protocol = iphdr->ip_p;
+      ip_len = ntohs(iphdr->ip_len);
+      packetptr += 4*iphdr->ip_hl;
+   }
 
-   /* Advance to the transport layer header then parse and display the fields based on the type of hearder: tcp, udp or icmp. */
-   packetptr += 4*iphdr->ip_hl;
-   switch (iphdr->ip_p)
+   /* Find the transport layer header and build the flow key. */
+   switch (protocol)
    {
    case IPPROTO_TCP:
       tcphdr = (struct tcphdr*)packetptr;
-      sprintf(event_data, "TCP  %s:%d -> %s:%d ", srcip, ntohs(tcphdr->source), dstip, ntohs(tcphdr->dest));
-      strncpy(key_value, event_data, strlen(event_data));
-      sprintf(temp_data, "%c%c%c%c%c%c Seq: 0x%x Ack: 0x%x Win: 0x%x TcpLen: %d ",
-               (tcphdr->urg ? 'U' : '*'),
-               (tcphdr->ack ? 'A' : '*'),
-               (tcphdr->psh ? 'P' : '*'),
-               (tcphdr->rst ? 'R' : '*'),
-               (tcphdr->syn ? 'S' : '*'),
-               (tcphdr->fin ? 'F' : '*'),
-               ntohl(tcphdr->seq), ntohl(tcphdr->ack_seq),
-               ntohs(tcphdr->window), 4*tcphdr->doff);
-      strncat(event_data, ip_header_info, strlen(ip_header_info));
-      strncat(event_data, temp_data, strlen(temp_data));
+      tcp_flags = packetptr[13]; /* th_flags */
+      set_flow_key(&flow_key, (u_char*)iphdr, protocol, tcphdr->source, tcphdr->dest);
       break;
 
    case IPPROTO_UDP:
       udphdr = (struct udphdr*)packetptr;
-      sprintf(event_data, "UDP  %s:%d -> %s:%d ", srcip, ntohs(udphdr->source), dstip, ntohs(udphdr->dest));
-      strncpy(key_value, event_data, strlen(event_data));
-      strncat(event_data, ip_header_info, strlen(ip_header_info));
-      break;
-
-   case IPPROTO_ICMP:
-      icmphdr = (struct icmphdr*)packetptr;
-      sprintf(event_data, "ICMP %s -> %s ", srcip, dstip);
-      strncpy(key_value, event_data, strlen(event_data));
-      memcpy(&id, (u_char*)icmphdr+4, 2);
-      memcpy(&seq, (u_char*)icmphdr+6, 2);
-      sprintf(temp_data, "Type:%d Code:%d ID:%d Seq:%d ", icmphdr->type, icmphdr->code, ntohs(id), ntohs(seq));
-      strncat(event_data, ip_header_info, strlen(ip_header_info));
-      strncat(event_data, temp_data, strlen(temp_data));
+      set_flow_key(&flow_key, (u_char*)iphdr, protocol, udphdr->source, udphdr->dest);
       break;
 
-      default:
-         sprintf(event_data, "Src: %s Dst: %s Hdr: %s", srcip, dstip, ip_header_info);
-         strncpy(key_value, event_data, strlen(event_data));
-
+   default:
+      set_flow_key(&flow_key, (u_char*)iphdr, protocol, 0, 0);
    }
 
-   /* Update the hashmap stats */
-   if ((ip_record = find_ip(key_value)) != NULL)
+   /* Update the flow table stats, applied in batches by the flow table. */
+   if (!(options & PV_FLOW_SUMMARY))
+   {
+      update_ip(worker->worker_id, &flow_key, ip_len, &packethdr->ts, tcp_flags);
+   }
+   else if (flow_packet_cap == 0)
    {
-      ip_record->packet_count++;
-      ip_record->data_size += ntohs(iphdr->ip_len);
+      update_ip(worker->worker_id, &flow_key, ip_len, &packethdr->ts, tcp_flags);
+      return;
    }
    else
    {
-      ip_record = xcalloc(sizeof(pv_ip_record_t));
-      strncpy(ip_record->key_value, key_value, strlen((key_value)));
-      ip_record->data_size = ntohs(iphdr->ip_len);
-      ip_record->packet_count = 1;
-      add_ip(ip_record);
+      /* The cap counts the flow over the export swaps and the active timeout, see count_ip_map_cap(). */
+      update_ip(worker->worker_id, &flow_key, ip_len, &packethdr->ts, tcp_flags);
+      flow_packets = count_ip_map_cap(worker->worker_id, &flow_key, ip_len, &packethdr->ts, tcp_flags);
+      if ((flow_packets == 0) || (flow_packets > flow_packet_cap))
+         return;
    }
 
-   /* Create a Fineline event record string */
-   create_event_record(fl_event_string, event_data);
+   set_packet_event(&event, &flow_key, &packethdr->ts, iphdr, ip6hdr, packetptr);
+
+   if ((options & PV_FILE_OUT) || !(options & PV_QUIET_MODE) || (worker->server_queue.encoding == PV_ENCODING_TEXT))
+   {
+      len = format_event_data(&event, event_data, sizeof(event_data));
+   }
 
-   /* Now write a Fineline event record. */
+   /* Now queue a Fineline event record. */
    if (options & PV_FILE_OUT)
    {
-      write_event_record(fl_event_string);
+      queue_event_record(&worker->event_queue, &packethdr->ts, event_data, len);
    }
 
    /*
@@ -256,29 +348,115 @@ void process_packet(u_char *user, struct pcap_pkthdr *packethdr, u_char *packetp
    */
    if (options & PV_SERVER_OUT)
    {
-      if (!((iphdr->ip_p == IPPROTO_TCP) && (iphdr->ip_dst.s_addr == server_ipv4_addr.s_addr) && (tcphdr->dest == server_ipv4_port)))
+      if (!((iphdr->ip_v == 4) && (protocol == IPPROTO_TCP) && (iphdr->ip_dst.s_addr == server_ipv4_addr.s_addr) && (tcphdr->dest == server_ipv4_port)))
       {
-         send_event(socket_desc, fl_event_string);
+         if (worker->server_queue.encoding == PV_ENCODING_BINARY)
+            queue_binary_event(&worker->server_queue, &event);
+         else
+            queue_event_record(&worker->server_queue, &packethdr->ts, event_data, len);
       }
    }
 
-   printf("%s\n", event_data);
-   printf("------------------------------------------------------------\n\n");
+   if (!(options & PV_QUIET_MODE))
+   {
+      printf("%s\n", event_data);
+      printf("------------------------------------------------------------\n\n");
+   }
 
    return;
 }
 
+/*
+   Function: export_flow_record
+   Purpose : Flow table expire function, writes the final record of an
+             expired flow as a Fineline event to the worker's output
+             queues. The flow is deleted from the table afterwards.
+   Input   : Capture worker, flow record and expiry reason.
+*/
+void export_flow_record(void *user, pv_ip_record_t *record, int reason)
+{
+   pv_capture_worker_t *worker = (pv_capture_worker_t *)user;
+   char event_data[PV_EVENT_DATA_STR];
+   pv_event_t event;
+   int len;
+
+   set_flow_event(&event, record, (reason == PV_FLOW_EXPIRED_IDLE) ? "idle" : "active");
+   len = format_event_data(&event, event_data, sizeof(event_data));
+
+   if (options & PV_FILE_OUT)
+   {
+      queue_event_record(&worker->event_queue, &record->last_seen, event_data, len);
+   }
+   if (options & PV_SERVER_OUT)
+   {
+      if (worker->server_queue.encoding == PV_ENCODING_BINARY)
+         queue_binary_event(&worker->server_queue, &event);
+      else
+         queue_event_record(&worker->server_queue, &record->last_seen, event_data, len);
+   }
+}
+
+/* Hands the final flow statistics to the sender, which must still be running. */
+static void send_shutdown_ip_map()
+{
+   char *buffer = NULL;
+   int size = 0;
+   int length, type;
+
+   if ((length = format_shutdown_ip_map(&buffer, &size, &type)) > 0)
+      send_server_buffer(type, 0, buffer, length);
+
+   free(buffer);
+}
 
 void terminate_capture(int signal_number)
 {
    struct pcap_stat stats;
-
-   if (pcap_stats(pcap_device, &stats) >= 0)
+   unsigned int received, dropped;
+   unsigned long records, batches, events_dropped;
+   unsigned long frames, bytes_in, bytes_out;
+   unsigned long ring_frames, overflows, writes, disconnects, reconnects;
+   unsigned long datagrams, datagrams_lost;
+   unsigned long long overflow_bytes, lost_bytes, bytes_sent;
+   unsigned long long spool_in, spool_out, spool_waiting;
+   long long cpu_ns;
+   int i;
+
+   stop_flow_export();
+
+   if (options & PV_RING_CAPTURE)
+   {
+      if (get_capture_worker_stats(&received, &dropped) >= 0)
+      {
+         printf("%u packets received\n", received);
+         printf("%u packets dropped\n\n", dropped);
+      }
+      close_capture_workers();
+   }
+   else if (options & PV_PCAP_FILE_INPUT)
    {
-      printf("%d packets received\n", stats.ps_recv);
-      printf("%d packets dropped\n\n", stats.ps_drop);
+      /* start_replay() has already flushed and reported the replay statistics. */
    }
-   pcap_close(pcap_device);
+   else
+   {
+      if (pcap_stats(pcap_device, &stats) >= 0)
+      {
+         printf("%d packets received\n", stats.ps_recv);
+         printf("%d packets dropped\n\n", stats.ps_drop);
+      }
+      pcap_close(pcap_device);
+   }
+
+   /* Apply the last flow updates and write the flows they expire while the event file and the sender are still open. */
+   for (i = 0; i < get_capture_worker_count(); i++)
+      flush_worker_output(get_capture_worker(i));
+
+   /* The final flow statistics go through the sender like any other frame, so they are spooled if the server is down. */
+   if (options & PV_SERVER_OUT)
+      send_shutdown_ip_map();
+
+   /* The workers have flushed their queues, let the sender empty the rings. */
+   socket_desc = stop_server_sender();
 
    if (options & PV_FILE_OUT)
    {
@@ -288,8 +466,43 @@ void terminate_capture(int signal_number)
 
    if (options & PV_SERVER_OUT)
    {
-      send_event(socket_desc, "<control>disconnect</control>"); /* Tell server we are disconnecting. */
-      close_socket(socket_desc);
+      get_output_queue_stats(PV_SERVER_OUT, &records, &batches, &events_dropped);
+      get_send_ring_stats(&ring_frames, &overflows, &overflow_bytes, &lost_bytes, &writes, &bytes_sent);
+      get_server_connection_stats(&disconnects, &reconnects);
+      printf("%lu events sent to the server in %lu batches, %llu bytes in %lu writes\n", records - events_dropped, batches - overflows, bytes_sent, writes);
+      printf("%lu events in %lu batches (%llu bytes) dropped, send ring full\n", events_dropped, overflows, overflow_bytes);
+      if (options & PV_UDP_WIRE)
+      {
+         get_datagram_stats(&datagrams, &datagrams_lost);
+         printf("%lu datagrams sent, %lu datagrams could not be sent\n", datagrams, datagrams_lost);
+      }
+      if (disconnects + reconnects > 0)
+         printf("Server connection lost %lu times, reconnected %lu times\n", disconnects, reconnects);
+      if (is_spool_configured())
+      {
+         get_spool_stats(&spool_in, &spool_out, &spool_waiting);
+         printf("Spool: %llu bytes spooled, %llu bytes sent, %llu bytes left for the next run\n", spool_in, spool_out, spool_waiting);
+      }
+      if (lost_bytes > 0)
+         printf("%llu bytes lost while the server was down\n", lost_bytes);
+      printf("\n");
+      if (get_frame_compression() > 0)
+      {
+         get_compression_stats(&frames, &bytes_in, &bytes_out, &cpu_ns);
+         printf("Compression level %d: %lu frames, %lu bytes to %lu bytes, ratio %.2f\n", get_frame_compression(), frames, bytes_in, bytes_out,
+                (bytes_out > 0) ? (double)bytes_in / bytes_out : 0.0);
+         printf("Compression CPU time %.3f ms, %.1f MB/s\n\n", cpu_ns / 1000000.0,
+                (cpu_ns > 0) ? (bytes_in / 1048576.0) / (cpu_ns / 1000000000.0) : 0.0);
+      }
+      if ((socket_desc >= 0) && (options & PV_UDP_WIRE))
+      {
+         close_socket(socket_desc);
+      }
+      else if (socket_desc >= 0)
+      {
+         send_frame(socket_desc, PV_FRAME_CONTROL, 0, PV_CONTROL_DISCONNECT, sizeof(PV_CONTROL_DISCONNECT) - 1); /* Tell server we are disconnecting. */
+         close_socket(socket_desc);
+      }
    }
 
    print_ip_map();
@@ -297,24 +510,46 @@ void terminate_capture(int signal_number)
    exit(0);
 }
 
+/*
+   Function: stop_capture
+   Purpose : Signal handler for all capture modes, stops the worker
+             ring loops, the replay or the libpcap loop so start_capture()
+             can stop the exporter and clean up in normal context.
+*/
+void stop_capture(int signal_number)
+{
+   stop_ring_loop();
+   stop_replay();
+   if (pcap_device != NULL)
+      pcap_breakloop(pcap_device);
+}
+
 /*
    Function: start_capture
-   Purpose : Opens the pcap socket, sets interrupt signals then calls
-             capture_loop() to start packet processing. Also opens the
+   Purpose : Opens the pcap socket (or the TPACKET_V3 ring if requested),
+             sets interrupt signals then calls capture_loop() to start
+             packet processing. In replay mode the interface is the pcap
+             file to read instead. Also opens the
              event file if logging, opens the tcp socket if sending
              events to the Pivotal Server.
-   Input   : Interface and filter strings, event file name, server ip address.
+   Input   : Interface and filter strings, event file name, server ip address,
+             mode and number of capture workers.
    Output  : Returns -1 on error.
 */
-int start_capture(char *interface, const char *bpf_string, char *event_file, char *server_address, int mode)
+int start_capture(char *interface, const char *bpf_string, char *event_file, char *server_address, int mode, int workers)
 {
    char local_ip_address[PV_IP_ADDR_MAX];
    int packets = 0;
+   int compression, i;
 
    options = mode;
-   memset(local_ip_address, 0, PV_IP_ADDR_MAX);
-   get_ip_address(interface, local_ip_address);
-   printf("start_capture() Interface: %s IP Address: %s\n", interface, local_ip_address);
+   set_ip_map_format(options & PV_FLOW_SUMMARY);
+   if (!(options & PV_PCAP_FILE_INPUT))
+   {
+      memset(local_ip_address, 0, PV_IP_ADDR_MAX);
+      get_ip_address(interface, local_ip_address);
+      printf("start_capture() Interface: %s IP Address: %s\n", interface, local_ip_address);
+   }
 
    if (inet_aton(server_address, &server_ipv4_addr) == 0)
    {
@@ -333,20 +568,96 @@ int start_capture(char *interface, const char *bpf_string, char *event_file, cha
       write_fineline_project_header("Pivot Sensor Packet Capture Log");
    }
 
-   if (options & PV_SERVER_OUT)
+   if ((options & PV_SERVER_OUT) && (options & PV_UDP_WIRE))
+   {
+      /* Each datagram stands alone, there is no hello to agree on compression. */
+      if (get_frame_compression() > 0)
+         print_log_entry("start_capture() <WARNING> Frames are not compressed over UDP.\n");
+      if (is_spool_configured())
+         print_log_entry("start_capture() <WARNING> Events are not spooled over UDP.\n");
+      set_frame_compression(0);
+      set_server_encoding((options & PV_TEXT_WIRE) ? PV_ENCODING_TEXT : PV_ENCODING_BINARY);
+      if ((socket_desc = init_udp_client_socket(server_address)) < 0)
+      {
+         print_log_entry("start_capture() <ERROR> Could not init socket.\n");
+         return(-1);
+      }
+      set_sender_datagrams(PV_SENSOR_NUMBER);
+   }
+   else if (options & PV_SERVER_OUT)
    {
-      if ((socket_desc = init_client_socket(server_address)) == -1)
+      if ((socket_desc = init_client_socket(server_address)) >= 0)
+      {
+         /* Frames are only compressed once the server has accepted it. */
+         compression = get_frame_compression();
+         set_frame_compression(0);
+         set_server_encoding(negotiate_encoding(socket_desc, (options & PV_TEXT_WIRE) ? PV_ENCODING_TEXT : PV_ENCODING_BINARY, &compression));
+         set_frame_compression(compression);
+      }
+      else if (is_spool_configured())
+      {
+         /* Spool in the encoding asked for, the server has to accept it when it comes up. */
+         print_log_entry("start_capture() <WARNING> Server unreachable, spooling events until it comes up.\n");
+         set_server_encoding((options & PV_TEXT_WIRE) ? PV_ENCODING_TEXT : PV_ENCODING_BINARY);
+      }
+      else
       {
          print_log_entry("start_capture() <ERROR> Could not init socket.\n");
          return(-1);
       }
    }
 
-   if ((pcap_device = open_pcap_socket(interface, bpf_string)) != NULL)
+   if (init_capture_workers(workers, options) < 0)
+   {
+      return(-1);
+   }
+
+   if ((options & PV_FLOW_SUMMARY) && (flow_packet_cap > 0))
+   {
+      for (i = 0; i < get_capture_worker_count(); i++)
+      {
+         if (start_ip_map_cap(i) < 0)
+            return(-1);
+      }
+   }
+
+   if ((options & PV_SERVER_OUT) && (start_server_sender(server_address, socket_desc) < 0))
+   {
+      return(-1);
+   }
+
+   if (start_flow_export(options) < 0)
+   {
+      return(-1);
+   }
+
+   if (options & PV_PCAP_FILE_INPUT)
+   {
+      signal(SIGINT, stop_capture);
+      signal(SIGTERM, stop_capture);
+      signal(SIGQUIT, stop_capture);
+      if (start_replay(interface, bpf_string, (pcap_handler)process_packet) >= 0)
+      {
+         terminate_capture(0);
+      }
+   }
+   else if (options & PV_RING_CAPTURE)
+   {
+      link_header_length = 14; /* Frames start at the ethernet header. */
+      signal(SIGINT, stop_capture);
+      signal(SIGTERM, stop_capture);
+      signal(SIGQUIT, stop_capture);
+      if (start_capture_workers(interface, bpf_string, (pcap_handler)process_packet) == 0)
+      {
+         join_capture_workers();
+         terminate_capture(0);
+      }
+   }
+   else if ((pcap_device = open_pcap_socket(interface, bpf_string)) != NULL)
    {
-      signal(SIGINT, terminate_capture);
-      signal(SIGTERM, terminate_capture);
-      signal(SIGQUIT, terminate_capture);
+      signal(SIGINT, stop_capture);
+      signal(SIGTERM, stop_capture);
+      signal(SIGQUIT, stop_capture);
       start_capture_loop(packets, (pcap_handler)process_packet);
       terminate_capture(0);
    }
@@ -0,0 +1,308 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvspool.c
+
+   Title : Pivotal NST Sensor Spool
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Keeps the frames for the Pivotal Server on disk while the
+            server cannot be reached. The spool is a file of a fixed size,
+            allocated on disk when it is opened and mapped into memory.
+            The sender thread (see pvsender.c) appends whole frames at the
+            tail and, once the server is back, sends them from the head.
+            The data area is used as a ring, a frame can wrap around the
+            end of it.
+
+            The first page of the file holds the head and tail, so frames
+            left in the spool when the sensor stops are sent by the next
+            sensor that opens it. When the spool is full new frames are
+            dropped and counted, the frames already spooled are kept.
+
+            Only the sender thread uses the spool.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pvcommon.h"
+#include "pivot-sensor.h"
+
+struct pv_spool_header
+{
+   char magic[8];
+   uint64_t size;  /* bytes in the data area */
+   uint64_t head;  /* free running byte positions */
+   uint64_t tail;
+};
+
+typedef struct pv_spool_header pv_spool_header_t;
+
+static char spool_file_name[PV_PATH_MAX_LENGTH];
+static uint64_t spool_size = (uint64_t)PV_SPOOL_SIZE << 20;
+static unsigned int spool_drain_rate = PV_SPOOL_DRAIN_RATE;
+static int spool_fd = -1;
+static unsigned char *spool_map = NULL;
+static size_t spool_map_size = 0;
+static pv_spool_header_t *spool_header = NULL;
+static unsigned char *spool_data = NULL;
+static unsigned long long spool_bytes_in = 0;
+static unsigned long long spool_bytes_out = 0;
+
+/*
+   Spool file, size in megabytes and drain rate in kilobytes per second,
+   call before the sender is started. No file name, no spool.
+*/
+void set_spool_options(char *file_name, unsigned int size, unsigned int drain_rate)
+{
+   memset(spool_file_name, 0, PV_PATH_MAX_LENGTH);
+   if (file_name != NULL)
+      strncpy(spool_file_name, file_name, PV_PATH_MAX_LENGTH - 1);
+   if (size > 0)
+      spool_size = (uint64_t)size << 20;
+   spool_drain_rate = drain_rate;
+}
+
+int is_spool_configured()
+{
+   return(spool_file_name[0] != 0);
+}
+
+int is_spool_open()
+{
+   return(spool_map != NULL);
+}
+
+/* Drain rate in bytes per second, 0 = as fast as the server takes them. */
+unsigned long get_spool_drain_rate()
+{
+   return((unsigned long)spool_drain_rate * 1024UL);
+}
+
+/*
+   Function: open_spool
+   Purpose : Opens or creates the spool file, allocates its blocks on
+             disk and maps it. A spool left by an earlier run is kept if
+             it has the same size, otherwise it is emptied.
+   Return  : 0 on success, -1 on error.
+*/
+int open_spool()
+{
+   int res;
+
+   if (!is_spool_configured())
+      return(-1);
+
+   if ((spool_fd = open(spool_file_name, O_RDWR | O_CREAT, 0600)) < 0)
+   {
+      sprint_log_entry("open_spool() <ERROR> Could not open spool file", spool_file_name);
+      return(-1);
+   }
+
+   spool_map_size = PV_SPOOL_HEADER_SIZE + spool_size;
+
+   /* Allocate the blocks now, a full disk would otherwise fault the mapping. */
+   if ((res = posix_fallocate(spool_fd, 0, spool_map_size)) != 0)
+   {
+      iprint_log_entry("open_spool() <ERROR> Could not allocate spool file", res);
+      close(spool_fd);
+      spool_fd = -1;
+      return(-1);
+   }
+
+   spool_map = mmap(NULL, spool_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, spool_fd, 0);
+   if (spool_map == MAP_FAILED)
+   {
+      print_log_entry("open_spool() <ERROR> Could not map spool file.\n");
+      spool_map = NULL;
+      close(spool_fd);
+      spool_fd = -1;
+      return(-1);
+   }
+
+   spool_header = (pv_spool_header_t *)spool_map;
+   spool_data = spool_map + PV_SPOOL_HEADER_SIZE;
+
+   if ((memcmp(spool_header->magic, PV_SPOOL_MAGIC, 8) != 0) || (spool_header->size != spool_size) ||
+       (spool_header->tail < spool_header->head) || (spool_header->tail - spool_header->head > spool_size))
+   {
+      memcpy(spool_header->magic, PV_SPOOL_MAGIC, 8);
+      spool_header->size = spool_size;
+      spool_header->head = 0;
+      spool_header->tail = 0;
+   }
+   else if (spool_header->tail > spool_header->head)
+   {
+      iprint_log_entry("open_spool() <INFO> Kilobytes spooled by an earlier run", (int)((spool_header->tail - spool_header->head) >> 10));
+   }
+
+   return(0);
+}
+
+void close_spool()
+{
+   if (spool_map == NULL)
+      return;
+
+   msync(spool_map, spool_map_size, MS_SYNC);
+   munmap(spool_map, spool_map_size);
+   close(spool_fd);
+   spool_map = NULL;
+   spool_header = NULL;
+   spool_data = NULL;
+   spool_fd = -1;
+}
+
+/* Bytes waiting in the spool. */
+uint64_t get_spool_used()
+{
+   if (spool_map == NULL)
+      return(0);
+
+   return(spool_header->tail - spool_header->head);
+}
+
+/* Copies bytes into or out of the data area starting at a position. */
+static void copy_spool(uint64_t position, unsigned char *buffer, size_t length, int into_spool)
+{
+   size_t start = (size_t)(position % spool_size);
+   size_t first = spool_size - start;
+
+   if (first > length)
+      first = length;
+
+   if (into_spool)
+   {
+      memcpy(spool_data + start, buffer, first);
+      memcpy(spool_data, buffer + first, length - first);
+   }
+   else
+   {
+      memcpy(buffer, spool_data + start, first);
+      memcpy(buffer + first, spool_data, length - first);
+   }
+}
+
+/*
+   Function: spool_frames
+   Purpose : Appends whole frames to the spool, all of them or none.
+   Input   : Segment list holding the frames and number of segments.
+   Return  : 0 on success, -1 if the spool is not open or full.
+*/
+int spool_frames(struct iovec *iov, int count)
+{
+   uint64_t tail;
+   size_t length = 0;
+   int i;
+
+   for (i = 0; i < count; i++)
+      length += iov[i].iov_len;
+
+   if ((spool_map == NULL) || (spool_size - get_spool_used() < length))
+      return(-1);
+
+   tail = spool_header->tail;
+   for (i = 0; i < count; i++)
+   {
+      copy_spool(tail, (unsigned char *)iov[i].iov_base, iov[i].iov_len, 1);
+      tail += iov[i].iov_len;
+   }
+   spool_header->tail = tail;
+   spool_bytes_in += length;
+
+   return(0);
+}
+
+/*
+   Function: next_spool_frames
+   Purpose : Finds the whole frames at the head of the spool that fit in
+             a byte budget, always at least one frame. The frames stay in
+             the spool until release_spool() is called.
+   Input   : Two segments that receive the frames and the byte budget.
+   Return  : Number of segments, 0 if the spool is empty.
+*/
+int next_spool_frames(struct iovec *iov, uint64_t budget)
+{
+   unsigned char header[PV_FRAME_HEADER_SIZE];
+   pv_frame_t frame;
+   uint64_t head, used, length = 0;
+   size_t start, first;
+
+   if ((used = get_spool_used()) == 0)
+      return(0);
+
+   head = spool_header->head;
+   while (length + PV_FRAME_HEADER_SIZE <= used)
+   {
+      copy_spool(head + length, header, PV_FRAME_HEADER_SIZE, 0);
+      if (parse_frame_header(header, &frame) < 0)
+      {
+         /* Cannot happen unless the file was damaged, send nothing more from it. */
+         print_log_entry("next_spool_frames() <ERROR> Corrupt spool, discarding it.\n");
+         spool_header->head = spool_header->tail;
+         return(0);
+      }
+      if ((length > 0) && (length + PV_FRAME_HEADER_SIZE + frame.length > budget))
+         break;
+      length += PV_FRAME_HEADER_SIZE + frame.length;
+   }
+
+   if ((length == 0) || (length > used))
+   {
+      print_log_entry("next_spool_frames() <ERROR> Corrupt spool, discarding it.\n");
+      spool_header->head = spool_header->tail;
+      return(0);
+   }
+
+   start = (size_t)(head % spool_size);
+   first = spool_size - start;
+   if (first > length)
+      first = length;
+
+   iov[0].iov_base = spool_data + start;
+   iov[0].iov_len = first;
+   iov[1].iov_base = spool_data;
+   iov[1].iov_len = length - first;
+
+   return((length > first) ? 2 : 1);
+}
+
+/* Removes frames returned by next_spool_frames() once they have been sent. */
+void release_spool(uint64_t length)
+{
+   spool_header->head += length;
+   spool_bytes_out += length;
+}
+
+/*
+   Function: get_spool_stats
+   Purpose : Bytes spooled, sent from the spool and still waiting.
+*/
+void get_spool_stats(unsigned long long *bytes_in, unsigned long long *bytes_out, unsigned long long *bytes_waiting)
+{
+   *bytes_in = spool_bytes_in;
+   *bytes_out = spool_bytes_out;
+   *bytes_waiting = get_spool_used();
+}
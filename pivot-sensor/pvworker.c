@@ -0,0 +1,495 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvworker.c
+
+   Title : Pivotal NST Sensor Capture Workers
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Runs N capture worker threads on one network interface. Each
+            worker opens its own TPACKET_V3 ring and joins a PACKET_FANOUT
+            group in hash mode, so the kernel steers every packet of a
+            flow to the same worker. Each worker owns a flow table (the map id
+            is the worker id) and a pair of output queues, so the capture
+            path shares nothing with the other workers. The output queues
+            collect Fineline records into batches. A batch is flushed to
+            the event file or the Pivotal Server in one write when it
+            holds batch_bytes, or when its oldest record has waited for the
+            batch deadline. The deadline is checked after each ring block
+            or libpcap buffer and on every poll timeout, and the ring and
+            libpcap timeouts are cut to the deadline so a quiet link still
+            flushes on time.
+
+            A queue holds a list of segments for writev(). The fixed parts
+            of a record are segments pointing at static fragments, only the
+            time and event data are copied into the queue buffer, and the
+            tail of one record and the head of the next share a fragment.
+            A server queue is sent as one event frame (see pvframe.c), the
+            frame is copied into the worker's send ring and written to the
+            socket by the sender thread (see pvsender.c), so the worker
+            never waits for the server. When the
+            server has accepted binary records the server queue holds
+            binary records (see pvrecord.c) instead of Fineline text, they
+            are written straight into the queue buffer and the whole batch
+            is one segment.
+
+            Worker 0 is also used by the single threaded libpcap capture.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <time.h>
+
+#include "pvcommon.h"
+#include "pivot-sensor.h"
+
+pv_capture_worker_t capture_workers[PV_MAX_CAPTURE_WORKERS];
+int capture_worker_count = 1;
+unsigned int batch_bytes = PV_BATCH_BYTES;
+unsigned int batch_deadline = PV_BATCH_DEADLINE;
+int server_encoding = PV_ENCODING_TEXT;
+
+/* Batch size in bytes and deadline in milliseconds, call before init_capture_workers(). */
+void set_output_batching(unsigned int bytes, unsigned int deadline)
+{
+   if (bytes > 0)
+      batch_bytes = (bytes < PV_OUTPUT_QUEUE_SIZE) ? bytes : PV_OUTPUT_QUEUE_SIZE;
+   batch_deadline = deadline;
+   set_ring_timeout(deadline);
+}
+
+unsigned int get_batch_deadline()
+{
+   return(batch_deadline);
+}
+
+/* Encoding the server accepted, call before init_capture_workers(). */
+void set_server_encoding(int encoding)
+{
+   server_encoding = encoding;
+}
+
+int get_server_encoding()
+{
+   return(server_encoding);
+}
+
+static long long get_queue_clock()
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return((long long)now.tv_sec * 1000000000LL + now.tv_nsec);
+}
+
+static void init_output_queue(pv_output_queue_t *queue, int destination, pv_send_ring_t *send_ring)
+{
+   queue->buffer = xcalloc(PV_OUTPUT_QUEUE_SIZE);
+   queue->size = PV_OUTPUT_QUEUE_SIZE;
+   queue->length = 0;
+   queue->iov = (struct iovec *)xcalloc((PV_OUTPUT_QUEUE_IOV + 1) * sizeof(struct iovec)) + 1;
+   queue->iov_count = 0;
+   queue->destination = destination;
+   queue->send_ring = send_ring;
+   queue->encoding = (destination == PV_SERVER_OUT) ? server_encoding : PV_ENCODING_TEXT;
+}
+
+/*
+   Function: init_capture_workers
+   Purpose : Sets up the worker structures, output queues, send rings and
+             ip maps, expired flows are exported through the worker's
+             queues.
+   Input   : Number of workers and output mode.
+   Return  : 0 on success, -1 on error.
+*/
+int init_capture_workers(int count, int mode)
+{
+   int i;
+
+   if ((count < 1) || (count > PV_MAX_CAPTURE_WORKERS))
+   {
+      iprint_log_entry("init_capture_workers() <ERROR> Invalid worker count", count);
+      return(-1);
+   }
+
+   if (init_ip_maps(count, (get_export_interval() > 0) ? 2 : 1) < 0)
+      return(-1);
+   capture_worker_count = count;
+
+   for (i = 0; i < count; i++)
+   {
+      memset(&capture_workers[i], 0, sizeof(pv_capture_worker_t));
+      capture_workers[i].worker_id = i;
+      capture_workers[i].ring.sockfd = -1;
+      if (mode & PV_FILE_OUT)
+         init_output_queue(&capture_workers[i].event_queue, PV_FILE_OUT, NULL);
+      if (mode & PV_SERVER_OUT)
+      {
+         if (init_send_ring(&capture_workers[i].send_ring, PV_SEND_RING_SIZE) < 0)
+            return(-1);
+         init_output_queue(&capture_workers[i].server_queue, PV_SERVER_OUT, &capture_workers[i].send_ring);
+      }
+      if (start_ip_map_aging(i, export_flow_record, &capture_workers[i]) < 0)
+         return(-1);
+   }
+
+   return(0);
+}
+
+pv_capture_worker_t *get_capture_worker(int worker_id)
+{
+   return(&capture_workers[worker_id]);
+}
+
+int get_capture_worker_count()
+{
+   return(capture_worker_count);
+}
+
+/*
+   Function: flush_output_queue
+   Purpose : Writes the queued records to the queue destination and
+             empties the queue. Server batches go to the worker's send
+             ring, a batch the ring has no room for is dropped and its
+             records counted.
+   Input   : Output queue.
+   Return  : 0 on success, -1 on error.
+*/
+int flush_output_queue(pv_output_queue_t *queue)
+{
+   int retval = 0;
+
+   if ((queue->buffer == NULL) || (queue->iov_count == 0))
+      return(0);
+
+   if (queue->destination == PV_FILE_OUT)
+   {
+      retval = write_event_iov(queue->iov, queue->iov_count);
+   }
+   else
+   {
+      retval = push_send_frame(queue->send_ring, PV_FRAME_EVENT, (queue->encoding == PV_ENCODING_BINARY) ? PV_FRAME_BINARY : 0, queue->iov - 1, queue->iov_count + 1);
+      if (retval < 0)
+         queue->dropped_count += queue->batch_records;
+   }
+
+   queue->length = 0;
+   queue->iov_count = 0;
+   queue->batch_records = 0;
+   queue->batch_count++;
+
+   return(retval);
+}
+
+/* Adds a segment, text that follows on from the last segment extends it. */
+static void queue_segment(pv_output_queue_t *queue, void *data, int len)
+{
+   struct iovec *last;
+
+   if (queue->iov_count > 0)
+   {
+      last = &queue->iov[queue->iov_count - 1];
+      if ((char *)last->iov_base + last->iov_len == (char *)data)
+      {
+         last->iov_len += len;
+         return;
+      }
+   }
+
+   queue->iov[queue->iov_count].iov_base = data;
+   queue->iov[queue->iov_count].iov_len = len;
+   queue->iov_count++;
+}
+
+/*
+   Function: queue_event
+   Purpose : Appends a Fineline record to an output queue, flushing the
+             queue first if the record does not fit.
+   Input   : Output queue and event string.
+*/
+void queue_event(pv_output_queue_t *queue, char *event_string)
+{
+   int len = strlen(event_string);
+
+   if ((queue->length + len > queue->size) || (queue->iov_count == PV_OUTPUT_QUEUE_IOV))
+   {
+      flush_output_queue(queue);
+   }
+
+   if (queue->iov_count == 0)
+      queue->first_ns = get_queue_clock();
+
+   memcpy(queue->buffer + queue->length, event_string, len);
+   queue_segment(queue, queue->buffer + queue->length, len);
+   queue->length += len;
+   queue->record_count++;
+   queue->batch_records++;
+
+   if (queue->length >= (int)batch_bytes)
+      flush_output_queue(queue);
+}
+
+/*
+   Function: queue_event_record
+   Purpose : Appends a Fineline record built from event data to an output
+             queue. Only the record body is copied into the queue, the
+             head and tail are static fragments, so a record is two
+             segments and a full queue is written with one writev().
+   Input   : Output queue, event time, event data and length.
+*/
+void queue_event_record(pv_output_queue_t *queue, const struct timeval *ts, const char *data, int len)
+{
+   struct iovec *fragment;
+
+   if ((queue->length + len + PV_EVENT_OVERHEAD > queue->size) || (queue->iov_count + 3 > PV_OUTPUT_QUEUE_IOV))
+   {
+      flush_output_queue(queue);
+   }
+
+   if (queue->iov_count == 0)
+      queue->first_ns = get_queue_clock();
+
+   if ((queue->iov_count > 0) && (queue->iov[queue->iov_count - 1].iov_base == get_event_fragment(PV_EVENT_TAIL)->iov_base))
+   {
+      queue->iov[queue->iov_count - 1] = *get_event_fragment(PV_EVENT_TAIL_HEAD);
+   }
+   else
+   {
+      fragment = get_event_fragment(PV_EVENT_HEAD);
+      queue_segment(queue, fragment->iov_base, fragment->iov_len);
+   }
+
+   len = format_event_body(queue->buffer + queue->length, data, len, ts);
+   queue_segment(queue, queue->buffer + queue->length, len);
+   queue->length += len;
+
+   fragment = get_event_fragment(PV_EVENT_TAIL);
+   queue_segment(queue, fragment->iov_base, fragment->iov_len);
+   queue->record_count++;
+   queue->batch_records++;
+
+   if (queue->length >= (int)batch_bytes)
+      flush_output_queue(queue);
+}
+
+/*
+   Function: queue_binary_event
+   Purpose : Appends the binary record of an event to a server queue that
+             sends binary records. The record is encoded in place, so it
+             joins the segment of the records before it.
+   Input   : Output queue and event.
+*/
+void queue_binary_event(pv_output_queue_t *queue, const pv_event_t *event)
+{
+   int len;
+
+   if ((queue->length + PV_RECORD_MAX > queue->size) || (queue->iov_count == PV_OUTPUT_QUEUE_IOV))
+   {
+      flush_output_queue(queue);
+   }
+
+   if (queue->iov_count == 0)
+      queue->first_ns = get_queue_clock();
+
+   len = encode_event(event, (unsigned char *)queue->buffer + queue->length);
+   queue_segment(queue, queue->buffer + queue->length, len);
+   queue->length += len;
+   queue->record_count++;
+   queue->batch_records++;
+
+   if (queue->length >= (int)batch_bytes)
+      flush_output_queue(queue);
+}
+
+/* Flushes everything the worker has queued. */
+void flush_worker_output(pv_capture_worker_t *worker)
+{
+   check_ip_map_swap(worker->worker_id);
+   flush_ip_updates(worker->worker_id);
+   flush_output_queue(&worker->event_queue);
+   flush_output_queue(&worker->server_queue);
+}
+
+/* Flushes a queue whose oldest record has reached the batch deadline. */
+static void check_output_queue(pv_output_queue_t *queue, long long now)
+{
+   if ((queue->iov_count > 0) && (now - queue->first_ns >= (long long)batch_deadline * 1000000LL))
+      flush_output_queue(queue);
+}
+
+/*
+   Function: check_worker_output
+   Purpose : Applies the worker's pending flow updates and flushes the
+             output queues that are due, called between packet buffers.
+   Input   : Capture worker.
+*/
+void check_worker_output(pv_capture_worker_t *worker)
+{
+   long long now;
+
+   check_ip_map_swap(worker->worker_id);
+   flush_ip_updates(worker->worker_id);
+
+   if ((worker->event_queue.iov_count == 0) && (worker->server_queue.iov_count == 0))
+      return;
+
+   now = get_queue_clock();
+   check_output_queue(&worker->event_queue, now);
+   check_output_queue(&worker->server_queue, now);
+}
+
+/*
+   Function: get_output_queue_stats
+   Purpose : Totals the records and batches written by the workers, and
+             the records dropped because a send ring was full.
+   Input   : PV_FILE_OUT or PV_SERVER_OUT and the totals.
+*/
+void get_output_queue_stats(int destination, unsigned long *records, unsigned long *batches, unsigned long *dropped)
+{
+   pv_output_queue_t *queue;
+   int i;
+
+   *records = 0;
+   *batches = 0;
+   *dropped = 0;
+   for (i = 0; i < capture_worker_count; i++)
+   {
+      queue = (destination == PV_FILE_OUT) ? &capture_workers[i].event_queue : &capture_workers[i].server_queue;
+      *records += queue->record_count;
+      *batches += queue->batch_count;
+      *dropped += queue->dropped_count;
+   }
+}
+
+/* Block handler for start_ring_loop(), user data is the worker. */
+static void check_worker_block(u_char *user)
+{
+   check_worker_output((pv_capture_worker_t *)user);
+}
+
+static pcap_handler worker_packet_handler;
+
+static void *capture_worker_thread(void *arg)
+{
+   pv_capture_worker_t *worker = (pv_capture_worker_t *)arg;
+
+   start_ring_loop(&worker->ring, worker_packet_handler, (u_char *)worker, check_worker_block);
+   flush_worker_output(worker);
+
+   return(NULL);
+}
+
+/*
+   Function: start_capture_workers
+   Purpose : Opens a ring for each worker, joins the rings to a fanout
+             group when there is more than one worker, then starts the
+             worker threads. The ring blocks are shared out between the
+             workers to keep the total ring memory the same.
+   Input   : Interface, BPF filter string and packet handler.
+   Return  : 0 on success, -1 on error.
+*/
+int start_capture_workers(char *interface, const char *bpf_string, pcap_handler func)
+{
+   int i;
+   int block_count = PV_RING_BLOCK_COUNT / capture_worker_count;
+   int fanout_group = getpid() & 0xffff;
+
+   if (block_count < PV_RING_MIN_BLOCKS)
+      block_count = PV_RING_MIN_BLOCKS;
+
+   worker_packet_handler = func;
+
+   for (i = 0; i < capture_worker_count; i++)
+   {
+      if (open_ring_socket(&capture_workers[i].ring, interface, bpf_string, block_count) < 0)
+      {
+         close_capture_workers();
+         return(-1);
+      }
+      if ((capture_worker_count > 1) && (join_ring_fanout(&capture_workers[i].ring, fanout_group) < 0))
+      {
+         close_capture_workers();
+         return(-1);
+      }
+   }
+
+   for (i = 0; i < capture_worker_count; i++)
+   {
+      if (pthread_create(&capture_workers[i].thread, NULL, capture_worker_thread, &capture_workers[i]) != 0)
+      {
+         print_log_entry("start_capture_workers() <ERROR> Could not create worker thread.\n");
+         stop_ring_loop();
+         capture_worker_count = i;
+         join_capture_workers();
+         return(-1);
+      }
+   }
+
+   iprint_log_entry("start_capture_workers() <INFO> Capture workers started", capture_worker_count);
+
+   return(0);
+}
+
+void join_capture_workers()
+{
+   int i;
+
+   for (i = 0; i < capture_worker_count; i++)
+   {
+      pthread_join(capture_workers[i].thread, NULL);
+   }
+}
+
+/*
+   Function: get_capture_worker_stats
+   Purpose : Sums the kernel packet and drop counters of all worker rings.
+   Input   : Received and dropped counter pointers.
+   Return  : 0 on success, -1 on error.
+*/
+int get_capture_worker_stats(unsigned int *received, unsigned int *dropped)
+{
+   unsigned int r, d;
+   int i;
+
+   *received = 0;
+   *dropped = 0;
+
+   for (i = 0; i < capture_worker_count; i++)
+   {
+      if (get_ring_stats(&capture_workers[i].ring, &r, &d) < 0)
+         return(-1);
+      *received += r;
+      *dropped += d;
+   }
+
+   return(0);
+}
+
+void close_capture_workers()
+{
+   int i;
+
+   for (i = 0; i < capture_worker_count; i++)
+   {
+      close_ring_socket(&capture_workers[i].ring);
+   }
+}
@@ -25,14 +25,14 @@
 
    Purpose: Pivotal Server Main Function. Processes command line options
             and opens a socket to listen for events from the sensors or
-            data requests from the GUI. For each connection from a sensor
-            a posix thread is spawned to process event packets sent by
-            the sensor.
+            data requests from the GUI. One epoll reactor per core serves
+            the sensor connections and hands the event packets to its
+            log worker, see pvreactor.c.
 
             Functions:
             1. Receives event data from the sensor(s).
             2. Maintains a hashmap of src <-> dst ip connections.
-            3. Does whois lookups of each remote ip address.
+            3. Does whois lookups of each remote ip address (-l).
             4. Maintains a hashmap of remote ip <-> domain owner data.
             5. Maintains traffic statistics for each remote ip.
             6. Receives data requests from the GUI and returns traffic statistics.
@@ -51,6 +51,8 @@ char source_file[20] = "pivot-server.c";
 
 int main(int argc, char *argv[])
 {
+   char event_filename[PV_PATH_MAX_LENGTH];
+   int mode = 0;
    int res = open_log_file(argv[0]);
 
    if (res < 0)
@@ -60,7 +62,57 @@ int main(int argc, char *argv[])
    }
    print_log_entry("pivot-server.c main() <INFO> Starting Pivotal Server 1.0\n");
 
-   init_server_socket(PV_SERVER_PORT, sensor_connection_handler);
+   if (argc > 1)
+   {
+      memset(event_filename, 0, PV_PATH_MAX_LENGTH);
+      if ((mode = parse_command_line_args(argc, argv, event_filename)) < 0)
+         mode = 0;
+   }
+
+   /* -L checks the owner caches with a local table and exits. */
+   if (mode & PV_CHECK_LOOKUPS)
+   {
+      res = check_ip_enrichment();
+      close_log_file();
+      exit((res < 0) ? 1 : 0);
+   }
+
+   /* Sensors started with -U send datagrams to the same port number. */
+   if (start_udp_receiver(PV_SERVER_PORT) < 0)
+   {
+      print_log_entry("pivot-server.c main() <WARNING> Could not start the UDP receiver.\n");
+   }
+
+   /* Owners of the remote addresses are looked up in the background, never by the shards. The
+      lookups send the addresses to the whois server and the DNS, so they are only made when asked. */
+   if ((mode & PV_IP_LOOKUPS) && (start_ip_enrichment(PV_WHOIS_CACHE_FILE, PV_WHOIS_WORKERS) < 0))
+   {
+      print_log_entry("pivot-server.c main() <WARNING> Could not start the whois lookups.\n");
+   }
+
+   if ((mode & PV_GUI_OUT) && (start_gui_service(PV_GUI_PORT) < 0))
+   {
+      print_log_entry("pivot-server.c main() <WARNING> Could not start the GUI query service.\n");
+   }
+
+   if (start_server_shards(PV_SERVER_PORT, 0) < 0)
+   {
+      print_log_entry("pivot-server.c main() <ERROR> Could not start the server shards.\n");
+      close_log_file();
+      exit(1);
+   }
+
+   /* The shards serve the sensors, the main thread reports the merged counts and the sensor statistics. */
+   while (1)
+   {
+      sleep(PV_SERVER_STATS_INTERVAL);
+      log_server_stats();
+      sample_sensor_registry();
+      log_sensor_registry();
+      save_connection_maps(PV_CONNECTION_STATS_FILE);
+      save_ip_stats(PV_IP_STATS_FILE);
+      log_ip_owner_stats();
+   }
 
    close_log_file();
 
@@ -116,7 +168,15 @@ int parse_command_line_args(int argc, char *argv[], char *event_filename)
          }
          else if (strncmp(argv[i], "-g", 2) == 0)
          {
-            retval = retval | PV_GUI_OUT; /* Send event records to Pivotal server */
+            retval = retval | PV_GUI_OUT; /* Answer the statistics queries of the GUI, see pvgui.c */
+         }
+         else if (strncmp(argv[i], "-l", 2) == 0)
+         {
+            retval = retval | PV_IP_LOOKUPS; /* Look up the owners and host names of remote addresses, see pvwhois.c */
+         }
+         else if (strncmp(argv[i], "-L", 2) == 0)
+         {
+            retval = retval | PV_CHECK_LOOKUPS; /* Check the owner caches with a local resolver and exit */
          }
          else if (strncmp(argv[i], "-b", 2) == 0)
          {
@@ -196,6 +256,9 @@ int show_server_help()
    printf("Specify network interface                         : -i INTERFACE\n");
    printf("Specify a server IP address                       : -a 192.168.1.10\n");
    printf("Specify filter file                               : -f FILENAME\n");
+   printf("Answer GUI statistics queries                     : -g\n");
+   printf("Look up remote address owners and host names      : -l\n");
+   printf("Check the owner lookup caches and exit            : -L\n");
    printf("\n");
    printf("Input and output files are optional. For sending events to the server\n");
    printf("-a <IPaddress> is mandatory. Minimal command line is:\n\n");
@@ -204,6 +267,8 @@ int show_server_help()
    printf("a default fineline event file: fineline-events-YYYYMMDD-HHMMSS.fle\n");
    printf("An optional BPF filter list can be included, the default filter\n");
    printf("file is pv-filter-list.txt\n");
+   printf("Owner and host name lookups (-l) are off by default, they send every\n");
+   printf("remote address to whois.cymru.com and to the DNS resolver.\n");
 
    return(0);
 }
@@ -50,8 +50,301 @@
 #include <netinet/udp.h>
 #include <netinet/ip_icmp.h>
 #include <ifaddrs.h>
+#include <pthread.h>
 #include <pcap.h>
 
+#define PV_SERVER_STATS_INTERVAL 60 /* seconds between the connection and datagram counts in the log */
+#define PV_MAX_SERVER_SHARDS 64 /* reactors, one per core, see pvreactor.c */
+#define PV_SHARD_WORKERS 1 /* threads logging the frames of each shard's sensor connections */
+#define PV_REACTOR_EVENTS 256 /* socket events per epoll_wait() */
+#define PV_REACTOR_QUEUE_MAX (1 << 24) /* bytes waiting for a worker before the reactor stops reading */
+#define PV_URING_ENTRIES 1024         /* submission entries of a shard's io_uring */
+#define PV_URING_BUFFERS 1024         /* receive buffers of a shard, a power of two */
+#define PV_URING_BUFFER_SIZE 16384
+#define PV_URING_WRITE_ENTRIES 256    /* submission entries of a log worker's io_uring */
+#define PV_URING_WRITE_MAX (1 << 20)  /* longest single log append */
+#define PV_SENSOR_MAP_FLOWS 196608   /* most flows in the statistics of each sensor */
+#define PV_SENSOR_MAP_MIN_FLOWS 48   /* flows a new sensor map has room for, the map grows as they arrive */
+#define PV_SENSOR_MAP_IDLE 3600      /* seconds a flow stays in the statistics after its last event */
+#define PV_SENSOR_MAP_ACTIVE 31536000 /* seconds before a flow that never goes idle is counted afresh */
+#define PV_SENSOR_ID_STR 16
+#define PV_CONNECTION_STATS_FILE "pivotal-sensor-stats.xml" /* rewritten every PV_SERVER_STATS_INTERVAL */
+#define PV_IP_STATS_SHARDS (PV_MAX_SERVER_SHARDS * PV_SHARD_WORKERS + 2) /* a shard per log worker, the UDP receiver and one more */
+#define PV_IP_STATS_ADDRESSES 196608 /* most remote addresses in each shard */
+#define PV_IP_STATS_MIN_ADDRESSES 3072 /* addresses a new shard has room for, the shard grows as they arrive */
+#define PV_IP_STATS_IDLE 86400       /* seconds an address stays in the statistics after its last event */
+#define PV_IP_STATS_ACTIVE 31536000  /* seconds before an address that never goes idle is counted afresh */
+#define PV_IP_STATS_FILE "pivotal-ip-stats.xml"
+#define PV_IP_STATS_TOP 256          /* addresses in the top index of each shard */
+#define PV_IP_STATS_WINDOW_KEYS 128  /* addresses each shard keeps of an interval in each order, see pvtopwindow.c */
+#define PV_IP_STATS_WINDOW_FLOWS 3072 /* addresses each shard counts in the open interval */
+#define PV_IP_STATS_OWNER_BATCH 256  /* addresses an export looks up in the whois cache at a time */
+#define PV_SENSOR_MAP_TOP 256        /* flows in the top index of each sensor */
+#define PV_SENSOR_MAP_WINDOW_KEYS 128 /* flows each sensor keeps of an interval in each order */
+#define PV_SENSOR_MAP_WINDOW_FLOWS 3072 /* flows each sensor counts in the open interval */
+#define PV_TOP_WINDOW_KEYS(keys, flows) (PV_TOP_INTERVALS * PV_TOP_ORDERS * (keys) + (flows)) /* most keys one top window adds to a query */
+#define PV_GUI_TOP_MAX 256           /* most records a GUI query returns */
+#define PV_GUI_TOP_DEFAULT 10
+#define PV_GUI_TOP_BYTES   0         /* <top> of a GUI query, see pvgui.c */
+#define PV_GUI_TOP_PACKETS 1
+#define PV_GUI_TOP_SENSORS 2
+#define PV_GUI_TAG_STR 64
+#define PV_GUI_QUERY_SIZE 4096       /* receive ring of a GUI connection */
+#define PV_GUI_QUERY_MAX 1024        /* longest GUI query frame, a longer one closes the connection */
+#define PV_GUI_CONNECTIONS 8         /* GUI connections served at once, more are refused */
+#define PV_GUI_ANSWER_SIZE (PV_GUI_TOP_MAX * 1024)
+#define PV_MAX_SENSOR_NUMBER 10000 /* SENSOR0000 to SENSOR9999 */
+#define PV_WHOIS_WORKERS 4           /* threads looking up the owners of remote addresses, see pvwhois.c */
+#define PV_WHOIS_CACHE_SIZE 65536    /* owners and prefixes kept in memory */
+#define PV_WHOIS_QUEUE_MAX 16384     /* addresses waiting for a lookup */
+#define PV_WHOIS_TTL (7 * 86400)     /* seconds an owner or host name is kept */
+#define PV_WHOIS_NEGATIVE_TTL 3600   /* seconds a failed lookup is kept */
+#define PV_WHOIS_CACHE_FILE "pivotal-whois.cache"
+#define PV_WHOIS_FILE_SLOTS 65536    /* entries in the cache file, a power of two */
+#define PV_WHOIS_FILE_PROBES 16      /* slots searched for an entry */
+#define PV_WHOIS_FILE_HEADER 4096
+#define PV_WHOIS_MAGIC "PVWHOIS1"
+#define PV_WHOIS_SERVER "whois.cymru.com"
+#define PV_WHOIS_PORT 43
+#define PV_WHOIS_TIMEOUT 10          /* seconds to wait for the whois server */
+#define PV_WHOIS_REPLY_SIZE 2048
+#define PV_WHOIS_BATCH 64            /* addresses sent to the whois server in one bulk query */
+#define PV_OWNER_NAME_STR 64
+#define PV_HOST_NAME_STR 128
+#define PV_OWNER_FOUND    0x01
+#define PV_HOST_FOUND     0x02
+#define PV_OWNER_NEGATIVE 0x04        /* looked up and nothing found */
+#define PV_RESOLVE_ERROR  (-2)        /* resolver result, the lookup could not be made */
+#define PV_CONNECTION_OPEN    0
+#define PV_CONNECTION_CLOSING 1       /* shut down, waiting for the last io_uring receive */
+
+
+/*
+   Counts of the sensor connections merged over the shards, see
+   get_server_stats().
+*/
+struct pv_server_stats
+{
+   int shards;
+   unsigned long active_connections;
+   unsigned long max_shard_connections; /* the busiest shard */
+   unsigned long total_connections;
+   unsigned long frames;
+   unsigned long event_frames;
+   unsigned long alert_frames;
+   unsigned long long bytes;
+};
+
+typedef struct pv_server_stats pv_server_stats_t;
+
+/*
+   The traffic statistics of one sensor, see pvsensormap.c.
+*/
+struct pv_connection_map
+{
+   char sensor_id[PV_SENSOR_ID_STR]; /* key */
+   pthread_mutex_t lock;
+   pv_flow_table_t table;
+   unsigned long frames;
+   unsigned long events; /* event records, decoded or, for Fineline text, counted by line */
+   time_t newest_event;  /* packet time of the newest event */
+   UT_hash_handle hh;
+};
+
+typedef struct pv_connection_map pv_connection_map_t;
+
+/*
+   The counts of a sensor at one sample, see sample_sensor_registry().
+*/
+struct pv_sensor_sample
+{
+   time_t time;              /* 0 if unused */
+   unsigned long long bytes;
+   unsigned long events;
+};
+
+typedef struct pv_sensor_sample pv_sensor_sample_t;
+
+/*
+   A sensor in the registry, see pvregistry.c. The counts are those of
+   the connections that have closed, the open ones keep their own.
+*/
+struct pv_sensor_record
+{
+   int number;
+   char sensor_id[PV_SENSOR_ID_STR];
+   pthread_mutex_t lock;                 /* the connection list and the counts */
+   pv_sensor_connection_t *connections;  /* open TCP connections */
+   pv_connection_map_t *connection_map;
+   unsigned long active_connections;
+   unsigned long total_connections;
+   unsigned long frames;
+   unsigned long event_frames;
+   unsigned long alert_frames;
+   unsigned long invalid;
+   unsigned long long bytes;
+   volatile unsigned long datagrams;     /* written by the UDP receiver only */
+   volatile unsigned long datagrams_lost;
+   volatile unsigned long long datagram_bytes;
+   time_t first_seen;
+   time_t last_seen;
+   /* the rates of the last sample */
+   time_t sample_time;
+   unsigned long long sample_bytes;
+   unsigned long sample_events;
+   unsigned long long bytes_per_second;
+   unsigned long events_per_second;
+   /* the counts at the last PV_TOP_INTERVALS samples, for the windows of get_top_sensors() */
+   pv_sensor_sample_t samples[PV_TOP_INTERVALS];
+   int sample_next;
+   struct pv_sensor_record *next;
+};
+
+typedef struct pv_sensor_record pv_sensor_record_t;
+
+/*
+   The counts of a sensor, see get_sensor_stats().
+*/
+struct pv_sensor_stats
+{
+   int number;
+   char sensor_id[PV_SENSOR_ID_STR];
+   unsigned long active_connections;
+   unsigned long total_connections;
+   unsigned long frames;
+   unsigned long event_frames;
+   unsigned long alert_frames;
+   unsigned long events;    /* event records, see pv_connection_map_t */
+   unsigned long invalid;
+   unsigned long long bytes;
+   unsigned long datagrams;
+   unsigned long dropped;   /* corrupt frames and lost datagrams seen by the server, not what the sensor dropped itself */
+   unsigned long long bytes_per_second;
+   unsigned long events_per_second; /* event records */
+   long lag;                /* seconds since the packet time of the newest event, -1 if none */
+   time_t first_seen;
+   time_t last_seen;
+};
+
+typedef struct pv_sensor_stats pv_sensor_stats_t;
+
+/*
+   One shard of the remote IP statistics, see pvipstats.c.
+*/
+struct pv_ip_stats
+{
+   pthread_mutex_t lock;
+   pv_flow_table_t table; /* keyed by the address alone */
+} __attribute__((aligned(PV_CACHE_LINE_SIZE)));
+
+typedef struct pv_ip_stats pv_ip_stats_t;
+
+/*
+   The owner and host name of a remote address, or of a network prefix,
+   see pvwhois.c. The family, prefix length and address are the key.
+*/
+struct pv_ip_owner
+{
+   uint8_t family;
+   uint8_t prefix_len;      /* the address bits in the key, all of them for an address */
+   uint8_t addr[16];
+   uint8_t flags;           /* PV_OWNER_FOUND, PV_HOST_FOUND or PV_OWNER_NEGATIVE */
+   uint32_t asn;
+   char country[4];
+   char owner[PV_OWNER_NAME_STR];
+   char host_name[PV_HOST_NAME_STR];
+};
+
+typedef struct pv_ip_owner pv_ip_owner_t;
+
+/*
+   Looks up the owner and host name of an address, see resolve_ip_owner().
+   Sets the owner's network prefix in addr and prefix_len if it knows it.
+   Returns 0 if anything was found, -1 if the servers answered that there
+   is nothing to find, PV_RESOLVE_ERROR if they could not be asked. Only
+   the first two are cached.
+*/
+typedef int (*pv_resolver_func)(void *user, int family, const uint8_t *addr, int wanted, pv_ip_owner_t *owner);
+
+struct pv_owner_stats
+{
+   unsigned long hits;
+   unsigned long file_hits;     /* hits read back from the cache file */
+   unsigned long prefix_hits;
+   unsigned long negative_hits;
+   unsigned long misses;
+   unsigned long queued;
+   unsigned long queue_full;    /* misses not queued */
+   unsigned long lookups;
+   unsigned long failures;      /* lookups that found nothing, cached as negative */
+   unsigned long errors;        /* lookups that could not be made, not cached */
+   unsigned long cached;
+   unsigned long waiting;
+};
+
+typedef struct pv_owner_stats pv_owner_stats_t;
+
+#ifdef PV_IO_URING
+
+#include <linux/io_uring.h>
+
+/*
+   An io_uring made straight on the system calls, see pvuring.c.
+*/
+struct pv_uring
+{
+   int fd;
+   void *ring_map;
+   size_t ring_size;
+   struct io_uring_sqe *sqes;
+   size_t sqes_size;
+   unsigned int *sq_head;
+   unsigned int *sq_tail;
+   unsigned int *sq_array;
+   unsigned int sq_mask;
+   unsigned int sq_entries;
+   unsigned int sqe_tail;   /* entries taken, published by submit_uring() */
+   unsigned int *cq_head;
+   unsigned int *cq_tail;
+   unsigned int cq_mask;
+   struct io_uring_cqe *cqes;
+};
+
+typedef struct pv_uring pv_uring_t;
+
+/*
+   Receive buffers the kernel picks from.
+*/
+struct pv_uring_buffers
+{
+   struct io_uring_buf_ring *ring;
+   size_t map_size;
+   char *data;
+   unsigned int count;
+   unsigned int size;
+   int group;
+   uint16_t tail;
+};
+
+typedef struct pv_uring_buffers pv_uring_buffers_t;
+
+/* pvuring.c */
+
+int init_uring(pv_uring_t *ring, unsigned int entries);
+void free_uring(pv_uring_t *ring);
+struct io_uring_sqe *get_uring_sqe(pv_uring_t *ring);
+unsigned int get_uring_space(pv_uring_t *ring);
+int submit_uring(pv_uring_t *ring, unsigned int wait);
+struct io_uring_cqe *peek_uring_cqe(pv_uring_t *ring);
+void seen_uring_cqe(pv_uring_t *ring);
+void prep_uring_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void prep_uring_recv(struct io_uring_sqe *sqe, int fd, int group, uint64_t user_data);
+void prep_uring_write(struct io_uring_sqe *sqe, int fd, const void *buffer, unsigned int length, uint64_t user_data, int link);
+int init_uring_buffers(pv_uring_t *ring, pv_uring_buffers_t *buffers, int group, unsigned int count, unsigned int size);
+char *get_uring_buffer(pv_uring_buffers_t *buffers, unsigned int id);
+void return_uring_buffer(pv_uring_buffers_t *buffers, unsigned int id);
+
+#endif
 
 /* pivot-server.c */
 
@@ -60,7 +353,70 @@ int show_server_help();
 
 /* pvconnection.c */
 
-void *sensor_connection_handler(void *socket_desc);
-void get_sensor_id(char *msg, char *sid);
+FILE *open_sensor_event_log(const char *payload, int length);
+int answer_sensor_hello(int sock, const char *payload, int length);
+int get_sensor_frame_text(pv_frame_t *frame, char **text, char **render_buffer, int *render_size, pv_connection_map_t *map);
+int log_sensor_frame(FILE *sensor_log, pv_frame_t *frame, char **render_buffer, int *render_size, pv_connection_map_t *map);
+void get_sensor_id(const char *msg, int length, char *sid);
+
+/* pvreactor.c */
+
+int start_server_shards(int port_number, int count);
+void get_server_stats(pv_server_stats_t *stats);
+void log_server_stats();
+
+/* pvgui.c */
+
+int start_gui_service(int port_number);
+
+/* pvipstats.c */
+
+pv_ip_stats_t *lock_ip_stats();
+void unlock_ip_stats(pv_ip_stats_t *stats);
+void add_ip_stats(pv_ip_stats_t *stats, const pv_event_t *event);
+int find_ip_stats(int family, const uint8_t *addr, pv_ip_record_t *out);
+int get_ip_stats_snapshot(pv_flow_table_t *snapshot);
+int get_ip_stats_top(int order, time_t since, time_t until, pv_ip_record_t *records, int max);
+void get_ip_stats_counts(unsigned long *addresses, unsigned long *expired, unsigned long *unrecorded);
+int write_ip_stats(FILE *outfile);
+int save_ip_stats(const char *file_name);
+
+/* pvregistry.c */
+
+int get_sensor_number(const char *payload, int length);
+pv_sensor_record_t *get_sensor_record(int number);
+pv_sensor_record_t *find_sensor_record(int number);
+int register_sensor_connection(pv_sensor_connection_t *connection, const char *payload, int length);
+void unregister_sensor_connection(pv_sensor_connection_t *connection);
+void add_sensor_datagrams(pv_sensor_record_t *record, unsigned long datagrams, unsigned long long bytes, long lost);
+int get_sensor_stats(int number, pv_sensor_stats_t *stats);
+void sample_sensor_registry();
+int get_top_sensors(int order, time_t since, time_t until, pv_sensor_stats_t *top, int max);
+void log_sensor_registry();
+
+/* pvsensormap.c */
+
+pv_connection_map_t *get_connection_map(const char *payload, int length);
+void lock_connection_map(pv_connection_map_t *map);
+void unlock_connection_map(pv_connection_map_t *map);
+int get_connection_map_records(const char *sensor_id, pv_ip_record_t *records, int max);
+int get_connection_map_top(const char *sensor_id, int order, time_t since, time_t until, pv_ip_record_t *records, int max);
+void write_connection_maps(FILE *outfile);
+int save_connection_maps(const char *file_name);
+
+/* pvudp.c */
+
+int start_udp_receiver(int port_number);
+
+/* pvwhois.c */
+
+int find_ip_owner(int family, const uint8_t *addr, pv_ip_owner_t *owner);
+int find_ip_owners(const pv_ip_record_t *records, int count, pv_ip_owner_t *owners);
+int start_ip_enrichment(const char *cache_file, int workers);
+void set_ip_resolver(pv_resolver_func func, void *user);
+int check_ip_enrichment();
+int resolve_ip_owner(void *user, int family, const uint8_t *addr, int wanted, pv_ip_owner_t *owner);
+void get_ip_owner_stats(pv_owner_stats_t *stats);
+void log_ip_owner_stats();
 
 #endif
@@ -24,10 +24,9 @@
    Date  : 06/07/2014
 
    Purpose: Implements functions for handling packets sent by sensors.
-            For each connection from a sensor a posix thread is spawned to process
-            event packets sent by the sensor. The connection handler logs all
-            messages received from the sensor and updates the statistics hashmap
-            for traffic to remote IP addresses.
+            The reactor shards (see pvreactor.c) and the UDP receiver (see
+            pvudp.c) use these to answer the sensor hello, open the sensor
+            log files and log the records received from the sensors.
 
 
    Status : EXPERIMENTAL - not for use in production networks.
@@ -41,126 +40,225 @@
 char pvconnection_source_file[20] = "pvconnection.c";
 
 /*
-   Function: sensor_connection_handler
-   Purpose : Called by the posix thread, opens sensor log file then
-             loops on the socket recv command, logs messages received
-             from the sensor and updates the IP statistics hash map.
-   Input   : Socket descriptor.
-   Return  : returns NULL.
-*/
-void *sensor_connection_handler(void *socket_desc)
-{
-   int sock = *(int*)socket_desc;
-   int read_size, tlen;
-   char timestr[100];
-   char sensor_id[100];
-   char sensor_message[PV_MAX_INPUT_STR];
-   char event_filename[PV_MAX_INPUT_STR];
-   FILE *sensor_log;
-   /* TODO: pv_ip_record_t *connection_map = NULL;  the hash map head record */
-
-   print_log_entry("sensor_connection_handler() <INFO> Connection handler starting.\n");
-
-   /* !!!CLEAR THE BUFFERS!!! */
-   memset(sensor_message, 0, PV_MAX_INPUT_STR);
-   memset(event_filename, 0, PV_MAX_INPUT_STR);
-   memset(sensor_id, 0, 100);
-   memset(timestr, 0, 100);
-
-   /*
-      Read the first message from the sensor, extract the sensor ID from the message
-      and open the log file. A separate log file is maintained for each sensor.
-      The file format is plain text Fineline Event format ->
-
-      https://code.google.com/p/fineline-computer-forensics-timeline-tools/
-
-      The log file name format is: SID0000-YYYYMMDD-HHMMSS.fle
-
-   */
-
-   if ((read_size = recv(sock, sensor_message, PV_MAX_INPUT_STR, 0)) > 0)
+   Function: open_sensor_event_log
+   Purpose : Opens the log file of a sensor, named after the sensor ID
+             found in the first records received from the sensor. Also
+             used by the UDP receiver, see pvudp.c.
+   Input   : Frame payload and length.
+   Return  : Log file pointer or NULL on error.
+*/
+FILE *open_sensor_event_log(const char *payload, int length)
+{
+   int tlen;
+   char timestr[100];
+   char sensor_id[100];
+   char event_filename[PV_MAX_INPUT_STR];
+   FILE *sensor_log;
+
+   /* !!!CLEAR THE BUFFERS!!! */
+   memset(event_filename, 0, PV_MAX_INPUT_STR);
+   memset(sensor_id, 0, 100);
+   memset(timestr, 0, 100);
+
+   get_sensor_id(payload, length, sensor_id);
+   strncpy(event_filename, sensor_id, strlen(sensor_id));
+   tlen = get_time_string(timestr, 100);
+
+   if (tlen > 0) /* Build the default event log filename, SENSOR0000-YYYYMMDD-HHMMSS.fle */
    {
-
-      get_sensor_id(sensor_message, sensor_id);
-      strncpy(event_filename, sensor_id, strlen(sensor_id));
-      tlen = get_time_string(timestr, 100);
+      strncat(event_filename, timestr, tlen);
+   }
+   else
+   {
+      strncat(event_filename, "-YYYYMMDD-HHMMSS", 16);
+      print_log_entry("open_sensor_event_log() <WARNING> Invalid time string.\n");
+   }
+   strncat(event_filename, EVENT_FILE_EXT, 4);
+
+   sensor_log = open_sensor_log_file(event_filename);
+   if (sensor_log == NULL)
+   {
+      print_log_entry("open_sensor_event_log() <ERROR> Could not open sensor log file.\n");
+      return(NULL);
+   }
+   write_project_header(sensor_log, "Pivotal Sensor Log");
+
+   return(sensor_log);
+}
+
+/*
+   Function: answer_sensor_hello
+   Purpose : Accepts the event encoding and the compression a sensor
+             asks for in its hello. Binary records are turned back into
+             Fineline text as they are logged, see render_event_records(),
+             compressed frames are inflated as they arrive.
+   Input   : Socket, hello payload and length.
+   Return  : The accepted encoding.
+*/
+int answer_sensor_hello(int sock, const char *payload, int length)
+{
+   char reply[PV_MAX_INPUT_STR];
+   int encoding = PV_ENCODING_TEXT;
+   int compressed = 0;
+
+   if (memmem(payload, length, PV_CONTROL_BINARY, sizeof(PV_CONTROL_BINARY) - 1) != NULL)
+   {
+      print_log_entry("answer_sensor_hello() <INFO> Sensor sends binary event records.\n");
+      encoding = PV_ENCODING_BINARY;
+   }
+   if (memmem(payload, length, PV_CONTROL_ZLIB, sizeof(PV_CONTROL_ZLIB) - 1) != NULL)
+   {
+      print_log_entry("answer_sensor_hello() <INFO> Sensor compresses frames.\n");
+      compressed = 1;
+   }
+
+   length = sprintf(reply, "%s%s%s</control>", PV_CONTROL_ACCEPT, (encoding == PV_ENCODING_BINARY) ? PV_CONTROL_BINARY : PV_CONTROL_TEXT,
+                    compressed ? PV_CONTROL_ZLIB : "");
+   send_frame(sock, PV_FRAME_CONTROL, 0, reply, length);
+
+   return(encoding);
+}
+
+/* Where the events of a frame are counted, see count_sensor_event(). */
+struct pv_event_counts
+{
+   pv_connection_map_t *map;
+   pv_ip_stats_t *ip_stats;
+};
+
+typedef struct pv_event_counts pv_event_counts_t;
+
+/* Adds a rendered event to the sensor's connection map and the remote IP statistics, both locked by the caller. */
+static void count_sensor_event(void *user, const pv_event_t *event)
+{
+   pv_event_counts_t *counts = (pv_event_counts_t *)user;
+
+   if (counts->map != NULL)
+   {
+      counts->map->events++;
+      update_flow_event(&counts->map->table, event);
+      if (event->ts.tv_sec > counts->map->newest_event)
+         counts->map->newest_event = event->ts.tv_sec;
+   }
+   if (counts->ip_stats != NULL)
+      add_ip_stats(counts->ip_stats, event);
+}
+
+/* The Fineline text records of a frame, one per line. */
+static unsigned long count_text_records(const char *payload, uint32_t length)
+{
+   const char *end = payload + length;
+   unsigned long count = 0;
+
+   while ((payload < end) && ((payload = memchr(payload, '\n', end - payload)) != NULL))
+   {
+      payload++;
+      count++;
+   }
+
+   return(count);
+}
+
+/*
+   Function: get_sensor_frame_text
+   Purpose : Gets the Fineline text of a frame for the sensor log,
+             inflating a compressed frame and rendering binary records
+             first. The events rendered are added to the sensor's
+             connection map and to the remote IP statistics, the events
+             of a text frame are only counted.
+   Input   : Frame, pointer that receives the text, the render buffer
+             and its size, grown as needed, and the sensor's connection
+             map, NULL for none.
+   Return  : Length of the text, -1 if the frame is corrupt.
+*/
+int get_sensor_frame_text(pv_frame_t *frame, char **text, char **render_buffer, int *render_size, pv_connection_map_t *map)
+{
+   pv_event_counts_t counts;
+   int length;
+
+   if ((frame->flags & PV_FRAME_ZLIB) && (decompress_frame(frame) < 0))
+      return(-1);
+
+   if ((frame->type == PV_FRAME_EVENT) && (frame->flags & PV_FRAME_BINARY))
+   {
+      /* Both are locked once per frame, the IP statistics first. */
+      counts.map = map;
+      counts.ip_stats = lock_ip_stats();
+      if (map != NULL)
+         lock_connection_map(map);
 
-      if (tlen > 0) /* Build the default event log filename, SENSOR0000-YYYYMMDD-HHMMSS.fle */
+      length = render_event_records(frame->payload, frame->length, render_buffer, render_size, count_sensor_event, &counts);
+
+      if (map != NULL)
       {
-         strncat(event_filename, timestr, tlen);
-      }
-      else
-      {
-         strncat(event_filename, "-YYYYMMDD-HHMMSS", 16);
-         print_log_entry("sensor_connection_handler() <WARNING> Invalid time string.\n");
+         map->frames++;
+         unlock_connection_map(map);
       }
-      strncat(event_filename, EVENT_FILE_EXT, 4);
-
-      sensor_log = open_sensor_log_file(event_filename);
-      if (sensor_log == NULL)
-      {
-         print_log_entry("sensor_connection_handler() <ERROR> Could not open sensor log file.\n");
-         return(NULL);
-      }
-      /* TODO: update statistics hashmap */
-      write_project_header(sensor_log, "Pivotal Sensor Log");
-      write_sensor_log_record(sensor_log, sensor_message);
-   }
-   else
-   {
-      print_log_entry("sensor_connection_handler() <ERROR> Sensor receive failed.\n");
-      return(NULL);
-   }
-
-   /*
-      Start the receive loop, only exit receive on error or sensor disconnect.
-   */
-
-   while((read_size = recv(sock, sensor_message, PV_MAX_INPUT_STR, 0)) > 0 )
-   {
-      if (strncmp(sensor_message, "<event>", 7) == 0)
-      {
-         /* TODO: update connections statistics map */
-         write_sensor_log_record(sensor_log, sensor_message);
-         memset(sensor_message, 0, PV_MAX_INPUT_STR);
-      }
-      else /* We have a control message from the sensor. */
-      {
-         /* TODO: check for disconnect, alarm or error message. */
-         break;
-      }
-   }
-
-   print_log_entry("sensor_connection_handler() <INFO> Sensor disconnected.\n");
-
-   close_sensor_log_file(sensor_log);
-   free(socket_desc);
-
-   return(NULL);
+      if (counts.ip_stats != NULL)
+         unlock_ip_stats(counts.ip_stats);
+
+      if (length < 0)
+         return(-1);
+      *text = *render_buffer;
+      return(length);
+   }
+
+   if (map != NULL)
+   {
+      lock_connection_map(map);
+      map->frames++;
+      if (frame->type == PV_FRAME_EVENT)
+         map->events += count_text_records(frame->payload, frame->length);
+      unlock_connection_map(map);
+   }
+
+   *text = frame->payload;
+
+   return((int)frame->length);
+}
+
+/*
+   Function: log_sensor_frame
+   Purpose : Writes the records of a frame to the sensor log.
+   Input   : Sensor log, frame, the render buffer and its size, grown
+             as needed, and the sensor's connection map, NULL for none.
+   Return  : 0 on success, -1 if the frame is corrupt.
+*/
+int log_sensor_frame(FILE *sensor_log, pv_frame_t *frame, char **render_buffer, int *render_size, pv_connection_map_t *map)
+{
+   char *text;
+   int length;
+
+   if ((length = get_sensor_frame_text(frame, &text, render_buffer, render_size, map)) < 0)
+      return(-1);
+
+   write_sensor_log_buffer(sensor_log, text, length);
+
+   return(0);
+}
+
+void get_sensor_id(const char *msg, int length, char *sid)
+{
+   const char *ptr;
+
+   ptr = memmem(msg, length, "SENSOR", 6);
+
+   /*
+      Each message from a sensor contains an ID field with the following format:
+      <id>SENSORXXXX</id>
+      Were XXXX is a user specified 4 digit number. Each sensor id should be
+      unique to assist in forensic backtracking and prevent confusion of the
+      message sources and log files.
+   */
+
+   if ((ptr != NULL) && (msg + length - ptr >= 10))
+   {
+      strncpy(sid, ptr, 10);
+   }
+   else
+   {
+      strncpy(sid, "SENSORXXXX", 10); /* Unknown sensor ID. */
+   }
+
+   return;
 }
-
-void get_sensor_id(char *msg, char *sid)
-{
-   char *ptr;
-
-   ptr = strstr(msg, "SENSOR");
-
-   /*
-      Each message from a sensor contains an ID field with the following format:
-      <id>SENSORXXXX</id>
-      Were XXXX is a user specified 4 digit number. Each sensor id should be
-      unique to assist in forensic backtracking and prevent confusion of the
-      message sources and log files.
-   */
-
-   if (ptr != NULL)
-   {
-      strncpy(sid, ptr, 10);
-   }
-   else
-   {
-      strncpy(sid, "SENSORXXXX", 10); /* Unknown sensor ID. */
-   }
-
-   return;
-}
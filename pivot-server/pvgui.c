@@ -0,0 +1,484 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvgui.c
+
+   Title : Pivotal NST Server GUI Queries
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Answers the statistics queries of the GUI, started by the -g
+            option. The GUI connects to PV_GUI_PORT and sends each query
+            as a control frame (see pvframe.c), the answer comes back as
+            a stats frame. A query is one line of tags:
+
+            <query><top>bytes</top><count>10</count><since>1404600000</since>
+            <until>1404603600</until><sensor>SENSOR0042</sensor></query>
+
+            top is bytes, packets or sensors. count is the number of
+            records wanted, at most PV_GUI_TOP_MAX. With a sensor, the
+            top flows of that sensor are returned instead of the top
+            remote addresses. The records are ordered by the top asked
+            for, an <order>bytes</order> or <order>packets</order> tag
+            orders them otherwise, e.g. sensors by events (packets)
+            instead of the default bytes.
+
+            since and until are seconds since the epoch, either can be
+            left out. Without them the counts are the totals since each
+            address, flow or sensor was first seen. With them the counts
+            are those of the window, kept a minute at a time for the
+            last hour (PV_TOP_INTERVALS of PV_TOP_INTERVAL seconds): the
+            window is rounded out to whole minutes, any part of it older
+            than the hour is not counted, and the first and last seen
+            times of an address or flow are those of the first and last
+            minutes it was counted in. The bytes and events of a sensor
+            are counted in the window, its other counts are totals.
+            Addresses and flows go by packet time, sensors by the server
+            clock.
+
+            A sensor in the answer of a sensors query has its frames, its
+            event frames and its events, the records in those frames.
+            Its drops are the corrupt frames and lost datagrams the
+            server saw, batches the sensor dropped itself are not known
+            to the server.
+
+            The answers come from the top indexes and top windows kept as
+            the events are counted (see pvtopindex.c and pvtopwindow.c),
+            so a GUI refresh reads a few hundred records per shard, or
+            per shard and minute, and never walks the statistics.
+            The remote addresses are given with their owners and host
+            names if the whois cache knows them (see pvwhois.c).
+
+            The GUI is served by one thread per connection, see
+            init_server_socket(). At most PV_GUI_CONNECTIONS are served
+            at once, a GUI connecting past that is disconnected straight
+            away, and a query frame longer than PV_GUI_QUERY_MAX closes
+            its connection.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+/*
+   A parsed GUI query.
+*/
+struct pv_gui_query
+{
+   int top;                           /* PV_GUI_TOP_BYTES, PV_GUI_TOP_PACKETS or PV_GUI_TOP_SENSORS */
+   int order;                         /* PV_TOP_BYTES or PV_TOP_PACKETS (events of a sensor) */
+   int count;
+   time_t since;
+   time_t until;
+   char sensor_id[PV_SENSOR_ID_STR];  /* empty for all the sensors */
+};
+
+typedef struct pv_gui_query pv_gui_query_t;
+
+static const char *gui_top_names[] = { "bytes", "packets", "sensors" };
+
+static volatile int gui_connections = 0; /* connections being served */
+
+/*
+   Function: get_query_field
+   Purpose : Copies the text between <tag> and </tag> in a query.
+   Input   : Query, length, tag name, output string and its size.
+   Return  : Length of the text, -1 if the tag is not in the query.
+*/
+static int get_query_field(const char *query, int length, const char *tag, char *out, int size)
+{
+   char open_tag[PV_GUI_TAG_STR], close_tag[PV_GUI_TAG_STR];
+   const char *start, *end;
+   int n;
+
+   n = sprintf(open_tag, "<%s>", tag);
+   if ((start = memmem(query, length, open_tag, n)) == NULL)
+      return(-1);
+   start += n;
+
+   n = sprintf(close_tag, "</%s>", tag);
+   if ((end = memmem(start, query + length - start, close_tag, n)) == NULL)
+      return(-1);
+
+   n = (int)(end - start);
+   if (n >= size)
+      n = size - 1;
+   memcpy(out, start, n);
+   out[n] = 0;
+
+   return(n);
+}
+
+/*
+   Function: parse_gui_query
+   Purpose : Reads the fields of a query, a field left out keeps its
+             default.
+   Input   : Query payload, length and the query to fill in.
+   Return  : 0 on success, -1 if the query is invalid.
+*/
+static int parse_gui_query(const char *payload, int length, pv_gui_query_t *query)
+{
+   char field[PV_GUI_TAG_STR];
+   int i;
+
+   memset(query, 0, sizeof(pv_gui_query_t));
+   query->top = -1;
+   query->count = PV_GUI_TOP_DEFAULT;
+
+   if (get_query_field(payload, length, "top", field, PV_GUI_TAG_STR) < 0)
+      return(-1);
+   for (i = 0; i <= PV_GUI_TOP_SENSORS; i++)
+   {
+      if (strcmp(trim(field), gui_top_names[i]) == 0)
+         query->top = i;
+   }
+   if (query->top < 0)
+      return(-1);
+
+   query->order = (query->top == PV_GUI_TOP_PACKETS) ? PV_TOP_PACKETS : PV_TOP_BYTES;
+   if (get_query_field(payload, length, "order", field, PV_GUI_TAG_STR) >= 0)
+   {
+      if (strcmp(trim(field), gui_top_names[PV_GUI_TOP_PACKETS]) == 0)
+         query->order = PV_TOP_PACKETS;
+      else if (strcmp(trim(field), gui_top_names[PV_GUI_TOP_BYTES]) == 0)
+         query->order = PV_TOP_BYTES;
+      else
+         return(-1);
+   }
+
+   if (get_query_field(payload, length, "count", field, PV_GUI_TAG_STR) > 0)
+      query->count = atoi(field);
+   if ((query->count <= 0) || (query->count > PV_GUI_TOP_MAX))
+      query->count = PV_GUI_TOP_MAX;
+   if (get_query_field(payload, length, "since", field, PV_GUI_TAG_STR) > 0)
+      query->since = (time_t)atol(field);
+   if (get_query_field(payload, length, "until", field, PV_GUI_TAG_STR) > 0)
+      query->until = (time_t)atol(field);
+   if (get_query_field(payload, length, "sensor", field, PV_GUI_TAG_STR) > 0)
+      get_sensor_id(field, strlen(field), query->sensor_id);
+
+   return(0);
+}
+
+/* Appends text from outside the server, e.g. a whois owner name, with the markup characters escaped. */
+static void append_gui_text(pv_format_buffer_t *fb, const char *text)
+{
+   for (; *text != 0; text++)
+   {
+      if (*text == '<')
+         PV_APPEND_LITERAL(fb, "&lt;");
+      else if (*text == '>')
+         PV_APPEND_LITERAL(fb, "&gt;");
+      else if (*text == '&')
+         PV_APPEND_LITERAL(fb, "&amp;");
+      else
+         append_char(fb, *text);
+   }
+}
+
+static void append_gui_field(pv_format_buffer_t *fb, const char *tag, unsigned long value)
+{
+   append_char(fb, '<');
+   append_cstring(fb, tag);
+   append_char(fb, '>');
+   append_uint(fb, value);
+   PV_APPEND_LITERAL(fb, "</");
+   append_cstring(fb, tag);
+   append_char(fb, '>');
+}
+
+/* Appends the counts and times of an address or flow record. */
+static void append_gui_record(pv_format_buffer_t *fb, const pv_ip_record_t *record)
+{
+   append_gui_field(fb, "packets", (unsigned long)record->packet_count);
+   append_gui_field(fb, "bytes", (unsigned long)record->data_size);
+   append_gui_field(fb, "firstseen", (unsigned long)record->first_seen.tv_sec);
+   append_gui_field(fb, "lastseen", (unsigned long)record->last_seen.tv_sec);
+}
+
+/* Appends a remote address with its owner and host name if they are known. */
+static void append_gui_talker(pv_format_buffer_t *fb, const pv_ip_record_t *record)
+{
+   pv_ip_owner_t owner;
+   char ip_str[INET6_ADDRSTRLEN];
+
+   inet_ntop((record->key.family == PV_FLOW_IPV6) ? AF_INET6 : AF_INET, record->key.src_addr, ip_str, sizeof(ip_str));
+   PV_APPEND_LITERAL(fb, "<talker><ip>");
+   append_cstring(fb, ip_str);
+   PV_APPEND_LITERAL(fb, "</ip>");
+   append_gui_record(fb, record);
+
+   if (find_ip_owner(record->key.family, record->key.src_addr, &owner) == 0)
+   {
+      if (owner.flags & PV_OWNER_FOUND)
+      {
+         PV_APPEND_LITERAL(fb, "<owner>");
+         append_gui_text(fb, owner.owner);
+         PV_APPEND_LITERAL(fb, "</owner>");
+         append_gui_field(fb, "asn", owner.asn);
+         PV_APPEND_LITERAL(fb, "<country>");
+         append_gui_text(fb, owner.country);
+         PV_APPEND_LITERAL(fb, "</country>");
+      }
+      if (owner.flags & PV_HOST_FOUND)
+      {
+         PV_APPEND_LITERAL(fb, "<host>");
+         append_gui_text(fb, owner.host_name);
+         PV_APPEND_LITERAL(fb, "</host>");
+      }
+   }
+
+   PV_APPEND_LITERAL(fb, "</talker>\n");
+}
+
+/* Appends a flow of one sensor. */
+static void append_gui_flow(pv_format_buffer_t *fb, const pv_ip_record_t *record)
+{
+   char key_str[PV_FLOW_KEY_STR];
+
+   format_flow_key(&record->key, key_str, PV_FLOW_KEY_STR);
+   PV_APPEND_LITERAL(fb, "<flow><key>");
+   append_gui_text(fb, trim(key_str));
+   PV_APPEND_LITERAL(fb, "</key>");
+   append_gui_record(fb, record);
+   PV_APPEND_LITERAL(fb, "</flow>\n");
+}
+
+static void append_gui_sensor(pv_format_buffer_t *fb, const pv_sensor_stats_t *stats)
+{
+   PV_APPEND_LITERAL(fb, "<sensor><id>");
+   append_cstring(fb, stats->sensor_id);
+   PV_APPEND_LITERAL(fb, "</id>");
+   append_gui_field(fb, "connections", stats->active_connections);
+   append_gui_field(fb, "frames", stats->frames);
+   append_gui_field(fb, "eventframes", stats->event_frames);
+   append_gui_field(fb, "events", stats->events);
+   append_gui_field(fb, "bytes", (unsigned long)stats->bytes);
+   append_gui_field(fb, "bytespersecond", (unsigned long)stats->bytes_per_second);
+   append_gui_field(fb, "dropped", stats->dropped);
+   PV_APPEND_LITERAL(fb, "<lag>");
+   append_int(fb, stats->lag);
+   PV_APPEND_LITERAL(fb, "</lag>");
+   append_gui_field(fb, "firstseen", (unsigned long)stats->first_seen);
+   append_gui_field(fb, "lastseen", (unsigned long)stats->last_seen);
+   PV_APPEND_LITERAL(fb, "</sensor>\n");
+}
+
+/*
+   Function: answer_gui_query
+   Purpose : Runs a query and writes the answer:
+             <topstatistics><top>bytes</top><order>bytes</order><count>2</count>
+             <talker>...</talker> or <flow>...</flow> or <sensor>...</sensor>
+             </topstatistics>
+             or <topstatistics><error>...</error></topstatistics>.
+   Input   : Query payload, length, answer buffer and the records and
+             sensor stats to work in, PV_GUI_TOP_MAX of each.
+   Return  : Length of the answer.
+*/
+static int answer_gui_query(const char *payload, int length, pv_format_buffer_t *fb, pv_ip_record_t *records, pv_sensor_stats_t *sensors)
+{
+   pv_gui_query_t query;
+   int i, count;
+
+   fb->length = 0;
+   PV_APPEND_LITERAL(fb, "<topstatistics>");
+
+   if (parse_gui_query(payload, length, &query) < 0)
+   {
+      PV_APPEND_LITERAL(fb, "<error>invalid query</error></topstatistics>\n");
+      return(fb->length);
+   }
+
+   if (query.top == PV_GUI_TOP_SENSORS)
+      count = get_top_sensors(query.order, query.since, query.until, sensors, query.count);
+   else if (query.sensor_id[0] != 0)
+      count = get_connection_map_top(query.sensor_id, query.order, query.since, query.until, records, query.count);
+   else
+      count = get_ip_stats_top(query.order, query.since, query.until, records, query.count);
+
+   if (count < 0)
+   {
+      PV_APPEND_LITERAL(fb, "<error>no statistics</error></topstatistics>\n");
+      return(fb->length);
+   }
+
+   PV_APPEND_LITERAL(fb, "<top>");
+   append_cstring(fb, gui_top_names[query.top]);
+   PV_APPEND_LITERAL(fb, "</top><order>");
+   append_cstring(fb, gui_top_names[(query.order == PV_TOP_PACKETS) ? PV_GUI_TOP_PACKETS : PV_GUI_TOP_BYTES]);
+   PV_APPEND_LITERAL(fb, "</order>");
+   if (query.sensor_id[0] != 0)
+   {
+      PV_APPEND_LITERAL(fb, "<sensor>");
+      append_cstring(fb, query.sensor_id);
+      PV_APPEND_LITERAL(fb, "</sensor>");
+   }
+   append_gui_field(fb, "count", count);
+   append_char(fb, '\n');
+
+   for (i = 0; i < count; i++)
+   {
+      if (query.top == PV_GUI_TOP_SENSORS)
+         append_gui_sensor(fb, &sensors[i]);
+      else if (query.sensor_id[0] != 0)
+         append_gui_flow(fb, &records[i]);
+      else
+         append_gui_talker(fb, &records[i]);
+   }
+
+   PV_APPEND_LITERAL(fb, "</topstatistics>\n");
+
+   return(fb->length);
+}
+
+/*
+   Function: gui_connection_handler
+   Purpose : Called by the posix thread, answers the queries of a GUI
+             until it disconnects.
+   Input   : Socket descriptor.
+   Return  : returns NULL.
+*/
+static void *gui_connection_handler(void *socket_desc)
+{
+   int sock = *(int*)socket_desc;
+   int res = 0;
+   int connected = 1;
+   int length;
+   pv_frame_reader_t reader;
+   pv_frame_t frame;
+   pv_format_buffer_t fb;
+   char *answer;
+   pv_ip_record_t *records;
+   pv_sensor_stats_t *sensors;
+
+   free(socket_desc);
+
+   if (__sync_add_and_fetch(&gui_connections, 1) > PV_GUI_CONNECTIONS)
+   {
+      print_log_entry("gui_connection_handler() <WARNING> Too many GUI connections, connection refused.\n");
+      __sync_sub_and_fetch(&gui_connections, 1);
+      close_socket(sock);
+      return(NULL);
+   }
+
+   print_log_entry("gui_connection_handler() <INFO> GUI connected.\n");
+
+   if (init_frame_reader(&reader, PV_GUI_QUERY_SIZE) < 0)
+   {
+      __sync_sub_and_fetch(&gui_connections, 1);
+      close_socket(sock);
+      return(NULL);
+   }
+   set_frame_reader_limit(&reader, PV_GUI_QUERY_MAX);
+   answer = xmalloc(PV_GUI_ANSWER_SIZE);
+   init_format_buffer(&fb, answer, PV_GUI_ANSWER_SIZE);
+   records = xmalloc(PV_GUI_TOP_MAX * sizeof(pv_ip_record_t));
+   sensors = xmalloc(PV_GUI_TOP_MAX * sizeof(pv_sensor_stats_t));
+
+   while (connected && (read_frames(&reader, sock) > 0))
+   {
+      while ((res = next_frame(&reader, &frame)) > 0)
+      {
+         /* A compressed query is held to the same limit once inflated. */
+         if ((frame.flags & PV_FRAME_ZLIB) && ((decompress_frame(&frame) < 0) || (frame.length > PV_GUI_QUERY_MAX)))
+         {
+            res = -1;
+            break;
+         }
+
+         if (frame.type != PV_FRAME_CONTROL)
+            continue;
+
+         if ((frame.length >= sizeof(PV_CONTROL_DISCONNECT) - 1) &&
+             (memcmp(frame.payload, PV_CONTROL_DISCONNECT, sizeof(PV_CONTROL_DISCONNECT) - 1) == 0))
+         {
+            connected = 0;
+            break;
+         }
+         if ((frame.length >= sizeof(PV_CONTROL_QUERY) - 1) &&
+             (memcmp(frame.payload, PV_CONTROL_QUERY, sizeof(PV_CONTROL_QUERY) - 1) == 0))
+         {
+            length = answer_gui_query(frame.payload, frame.length, &fb, records, sensors);
+            if (send_frame(sock, PV_FRAME_STATS, 0, answer, length) < 0)
+            {
+               connected = 0;
+               break;
+            }
+         }
+      }
+
+      if (res < 0)
+      {
+         print_log_entry("gui_connection_handler() <ERROR> Invalid frame received from GUI.\n");
+         break;
+      }
+   }
+
+   print_log_entry("gui_connection_handler() <INFO> GUI disconnected.\n");
+
+   free(sensors);
+   free(records);
+   free(answer);
+   free_frame_reader(&reader);
+   close_socket(sock);
+   __sync_sub_and_fetch(&gui_connections, 1);
+
+   return(NULL);
+}
+
+static void *gui_listen_thread(void *arg)
+{
+   if (init_server_socket(*(int *)arg, gui_connection_handler) < 0)
+      print_log_entry("gui_listen_thread() <ERROR> GUI query service stopped.\n");
+
+   free(arg);
+
+   return(NULL);
+}
+
+/*
+   Function: start_gui_service
+   Purpose : Starts a thread listening for GUI connections.
+   Input   : TCP port number.
+   Return  : 0 on success, -1 on error.
+*/
+int start_gui_service(int port_number)
+{
+   pthread_t thread;
+   int *port = xmalloc(sizeof(int));
+
+   *port = port_number;
+
+   if (pthread_create(&thread, NULL, gui_listen_thread, port) != 0)
+   {
+      print_log_entry("start_gui_service() <ERROR> Could not create GUI thread.\n");
+      free(port);
+      return(-1);
+   }
+   pthread_detach(thread);
+
+   iprint_log_entry("start_gui_service() <INFO> Answering GUI queries on port", port_number);
+
+   return(0);
+}
@@ -0,0 +1,559 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvipstats.c
+
+   Title : Pivotal NST Server Remote IP Statistics
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Keeps the traffic statistics of every remote IP address over
+            all the sensors. An address is remote unless it is private,
+            loopback, link local, shared (CGN), multicast or unspecified,
+            an event between two remote addresses counts for both.
+
+            The statistics are split into PV_IP_STATS_SHARDS flow tables
+            (see pvflowtable.c) keyed by address. Every thread that logs
+            sensor records is given one shard the first time it counts an
+            event, round robin, and only adds to that shard. The log
+            workers of the server shards each get a shard of their own, so
+            they never wait for each other, however hot an address is. A
+            shard is locked once per frame by its writer and only
+            contended by readers or, with more writers than shards, by
+            the threads sharing it. The table of a shard is allocated on
+            first use.
+
+            A shard starts with room for PV_IP_STATS_MIN_ADDRESSES and
+            grows with the traffic up to PV_IP_STATS_ADDRESSES. The event
+            times age the addresses on a timer wheel (see
+            pvtimerwheel.c), an address without events for
+            PV_IP_STATS_IDLE seconds leaves the shard, so the shards hold
+            the addresses still in use. An address that finds its shard
+            full is counted as unrecorded, the count is written with the
+            statistics (see get_ip_stats_counts()).
+
+            Queries merge the counts of an address over the shards and
+            hold one shard lock at a time. A snapshot
+            (get_ip_stats_snapshot()) copies each shard under its lock and
+            merges the copies into a table of its own for the exports, so
+            the shards are copied one after the other while the writers
+            go on, and the snapshot is not taken at one frame boundary.
+            Each shard keeps a top index (see pvtopindex.c) of its
+            addresses with the most bytes and packets, so the top talkers
+            (get_ip_stats_top()) are found from the indexes of the shards
+            without walking the tables. Each shard also keeps a top
+            window (see pvtopwindow.c) of its largest addresses in each
+            recent minute, for the top talkers of a time window.
+
+            The exports add the owner and host name of each address from
+            the whois cache (see pvwhois.c), an address not in the cache
+            yet is looked up for the next export.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+static pv_ip_stats_t ip_stats[PV_IP_STATS_SHARDS];
+static pthread_once_t ip_stats_once = PTHREAD_ONCE_INIT;
+static int ip_stats_next = 0;
+static __thread pv_ip_stats_t *thread_ip_stats = NULL;
+
+/* Idle addresses just leave the shard, the wheel counts them. */
+static void expire_ip_stats(void *user, pv_ip_record_t *record, int reason)
+{
+}
+
+static void init_ip_stats_locks()
+{
+   int i;
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+      pthread_mutex_init(&ip_stats[i].lock, NULL);
+}
+
+/*
+   Function: lock_ip_stats
+   Purpose : Locks the calling thread's shard, giving the thread a shard
+             the first time and allocating its table.
+   Return  : The shard, NULL if its table could not be allocated.
+*/
+pv_ip_stats_t *lock_ip_stats()
+{
+   pv_ip_stats_t *stats;
+
+   pthread_once(&ip_stats_once, init_ip_stats_locks);
+
+   if (thread_ip_stats == NULL)
+      thread_ip_stats = &ip_stats[__sync_fetch_and_add(&ip_stats_next, 1) % PV_IP_STATS_SHARDS];
+   stats = thread_ip_stats;
+
+   pthread_mutex_lock(&stats->lock);
+
+   if ((stats->table.buckets == NULL) &&
+       ((init_growing_flow_table(&stats->table, PV_IP_STATS_MIN_ADDRESSES, PV_IP_STATS_ADDRESSES) < 0) ||
+        (init_flow_timers(&stats->table, PV_IP_STATS_IDLE, PV_IP_STATS_ACTIVE, expire_ip_stats, stats) < 0) ||
+        (init_flow_top(&stats->table, PV_IP_STATS_TOP) < 0) ||
+        (init_flow_window(&stats->table, PV_IP_STATS_WINDOW_KEYS, PV_IP_STATS_WINDOW_FLOWS) < 0)))
+   {
+      free_flow_table(&stats->table);
+      pthread_mutex_unlock(&stats->lock);
+      return(NULL);
+   }
+
+   return(stats);
+}
+
+void unlock_ip_stats(pv_ip_stats_t *stats)
+{
+   pthread_mutex_unlock(&stats->lock);
+}
+
+/* Addresses of the monitored networks and addresses that are not hosts. */
+static int is_local_address(int family, const uint8_t *addr)
+{
+   if (family == PV_FLOW_IPV6)
+   {
+      if ((addr[0] == 0xff) || ((addr[0] & 0xfe) == 0xfc) || ((addr[0] == 0xfe) && ((addr[1] & 0xc0) == 0x80)))
+         return(1);
+      /* :: and ::1 */
+      return((memcmp(addr, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 15) == 0) && (addr[15] <= 1));
+   }
+
+   return((addr[0] == 0) || (addr[0] == 10) || (addr[0] == 127) || (addr[0] >= 224) ||
+          ((addr[0] == 172) && ((addr[1] & 0xf0) == 16)) ||
+          ((addr[0] == 192) && (addr[1] == 168)) ||
+          ((addr[0] == 169) && (addr[1] == 254)) ||
+          ((addr[0] == 100) && ((addr[1] & 0xc0) == 64)));
+}
+
+/* Sets the key of an address in the statistics, the address alone. */
+static void set_ip_stats_key(pv_flow_key_t *key, int family, const uint8_t *addr)
+{
+   memset(key, 0, sizeof(pv_flow_key_t));
+   key->family = family;
+   memcpy(key->src_addr, addr, (family == PV_FLOW_IPV6) ? 16 : 4);
+}
+
+/*
+   Function: add_ip_stats
+   Purpose : Adds an event to the statistics of its remote addresses.
+   Input   : Shard locked by lock_ip_stats() and the event.
+*/
+void add_ip_stats(pv_ip_stats_t *stats, const pv_event_t *event)
+{
+   pv_event_t remote = *event;
+
+   if (!is_local_address(event->key.family, event->key.src_addr))
+   {
+      set_ip_stats_key(&remote.key, event->key.family, event->key.src_addr);
+      update_flow_event(&stats->table, &remote);
+   }
+   if (!is_local_address(event->key.family, event->key.dst_addr))
+   {
+      set_ip_stats_key(&remote.key, event->key.family, event->key.dst_addr);
+      update_flow_event(&stats->table, &remote);
+   }
+}
+
+/* Adds the counts of one record to another for the same address. */
+static void merge_ip_record(pv_ip_record_t *into, const pv_ip_record_t *record)
+{
+   if ((into->packet_count == 0) || timercmp(&record->first_seen, &into->first_seen, <))
+      into->first_seen = record->first_seen;
+   if (timercmp(&record->last_seen, &into->last_seen, >))
+      into->last_seen = record->last_seen;
+   into->packet_count += record->packet_count;
+   into->data_size += record->data_size;
+   into->tcp_flags |= record->tcp_flags;
+}
+
+/*
+   Function: find_ip_stats
+   Purpose : Merges the counts of an address over the shards, one shard
+             locked at a time.
+   Input   : Address family, address and the record to fill in.
+   Return  : 0 if any sensor has seen the address, -1 if not.
+*/
+int find_ip_stats(int family, const uint8_t *addr, pv_ip_record_t *out)
+{
+   pv_ip_record_t *record;
+   pv_flow_key_t key;
+   uint32_t hash;
+   int i, found = -1;
+
+   pthread_once(&ip_stats_once, init_ip_stats_locks);
+
+   set_ip_stats_key(&key, family, addr);
+   hash = hash_flow_key(&key);
+   memset(out, 0, sizeof(pv_ip_record_t));
+   out->key = key;
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      pthread_mutex_lock(&ip_stats[i].lock);
+      if ((ip_stats[i].table.buckets != NULL) && ((record = find_flow(&ip_stats[i].table, &key, hash)) != NULL))
+      {
+         merge_ip_record(out, record);
+         found = 0;
+      }
+      pthread_mutex_unlock(&ip_stats[i].lock);
+   }
+
+   return(found);
+}
+
+/* Copies the records of a shard under its lock, the caller frees the copy. */
+static pv_ip_record_t *copy_ip_shard(pv_ip_stats_t *stats, uint32_t *count)
+{
+   pv_ip_record_t *copy = NULL;
+   pv_ip_record_t *record;
+
+   *count = 0;
+
+   pthread_mutex_lock(&stats->lock);
+   if ((stats->table.buckets != NULL) && (stats->table.count > 0))
+   {
+      copy = xmalloc(stats->table.count * sizeof(pv_ip_record_t));
+      for (record = get_next_flow(&stats->table, NULL); record != NULL; record = get_next_flow(&stats->table, record))
+         copy[(*count)++] = *record;
+   }
+   pthread_mutex_unlock(&stats->lock);
+
+   return(copy);
+}
+
+/*
+   Function: get_ip_stats_snapshot
+   Purpose : Merges all the shards into a new table. Each shard is copied
+             under its own lock, one shard at a time, and the copies are
+             merged once every shard has been copied, so a writer only
+             waits while its own shard is copied.
+   Input   : Table to create, the caller frees it with free_flow_table().
+   Return  : Number of addresses, -1 on error.
+*/
+int get_ip_stats_snapshot(pv_flow_table_t *snapshot)
+{
+   pv_ip_record_t *copies[PV_IP_STATS_SHARDS];
+   uint32_t counts[PV_IP_STATS_SHARDS];
+   pv_ip_record_t *merged;
+   uint32_t total = 0, j;
+   int i, res = 0;
+
+   pthread_once(&ip_stats_once, init_ip_stats_locks);
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      copies[i] = copy_ip_shard(&ip_stats[i], &counts[i]);
+      total += counts[i];
+   }
+
+   if (init_flow_table(snapshot, total + 64) < 0)
+   {
+      res = -1;
+   }
+   else
+   {
+      for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+      {
+         for (j = 0; j < counts[i]; j++)
+         {
+            if ((merged = insert_flow(snapshot, &copies[i][j].key, copies[i][j].hash)) != NULL)
+               merge_ip_record(merged, &copies[i][j]);
+         }
+      }
+   }
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+      free(copies[i]);
+
+   if (res < 0)
+      return(-1);
+
+   if (snapshot->full_count > 0)
+      iprint_log_entry("get_ip_stats_snapshot() <WARNING> Addresses left out of the snapshot", (int)snapshot->full_count);
+
+   return((int)snapshot->count);
+}
+
+/*
+   Function: get_ip_stats_window
+   Purpose : Adds up the counts of a time window from the top windows of
+             the shards, one shard locked at a time, and keeps the
+             largest addresses.
+   Input   : Order, window in seconds, array for the records and its
+             length.
+   Return  : Number of records, largest first, -1 on error.
+*/
+static int get_ip_stats_window(int order, time_t since, time_t until, pv_ip_record_t *records, int max)
+{
+   pv_flow_table_t merged;
+   pv_ip_record_t *record, *all;
+   uint32_t shards = 1;
+   int i, count = 0;
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      if (ip_stats[i].table.buckets != NULL)
+         shards++;
+   }
+
+   if (init_growing_flow_table(&merged, PV_IP_STATS_WINDOW_FLOWS, shards * PV_TOP_WINDOW_KEYS(PV_IP_STATS_WINDOW_KEYS, PV_IP_STATS_WINDOW_FLOWS)) < 0)
+      return(-1);
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      pthread_mutex_lock(&ip_stats[i].lock);
+      if (ip_stats[i].table.buckets != NULL)
+         get_flow_window(&ip_stats[i].table, since, until, &merged);
+      pthread_mutex_unlock(&ip_stats[i].lock);
+   }
+
+   all = xmalloc((merged.count + 1) * sizeof(pv_ip_record_t));
+   for (record = get_next_flow(&merged, NULL); record != NULL; record = get_next_flow(&merged, record))
+      all[count++] = *record;
+   free_flow_table(&merged);
+
+   count = select_top_records(all, count, order, max);
+   memcpy(records, all, count * sizeof(pv_ip_record_t));
+   free(all);
+
+   return(count);
+}
+
+/*
+   Function: get_ip_stats_top
+   Purpose : Finds the remote addresses with the most bytes or packets.
+             Without a window the counts are those since the address was
+             first seen. The candidates are the addresses in the top
+             index of any shard, with their counts then merged over all
+             the shards, one shard locked at a time, so a query reads a
+             few hundred records per shard however many addresses there
+             are. An address whose traffic
+             is spread thinly over many shards can be missed.
+             With a window the counts are those of the minutes the window
+             overlaps, from the top windows of the shards, see
+             get_ip_stats_window().
+   Input   : Order (PV_TOP_BYTES or PV_TOP_PACKETS), window in seconds
+             (0 for no limit), array for the records and its length.
+   Return  : Number of records, largest first, -1 on error.
+*/
+int get_ip_stats_top(int order, time_t since, time_t until, pv_ip_record_t *records, int max)
+{
+   pv_flow_table_t candidates;
+   pv_ip_record_t *indexed, *merged, *record, *all;
+   uint32_t estimate = 64;
+   int i, j, n, count = 0;
+
+   pthread_once(&ip_stats_once, init_ip_stats_locks);
+
+   if ((since > 0) || (until > 0))
+      return(get_ip_stats_window(order, since, until, records, max));
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      if (ip_stats[i].table.buckets != NULL)
+         estimate += PV_IP_STATS_TOP * 2;
+   }
+
+   if (init_flow_table(&candidates, estimate) < 0)
+      return(-1);
+   indexed = xmalloc(PV_IP_STATS_TOP * sizeof(pv_ip_record_t));
+
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      pthread_mutex_lock(&ip_stats[i].lock);
+      n = (ip_stats[i].table.buckets != NULL) ? get_flow_top(&ip_stats[i].table, order, indexed, PV_IP_STATS_TOP) : 0;
+      pthread_mutex_unlock(&ip_stats[i].lock);
+      for (j = 0; j < n; j++)
+         insert_flow(&candidates, &indexed[j].key, indexed[j].hash);
+   }
+
+   /* The counts of the candidates over all the shards. */
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      pthread_mutex_lock(&ip_stats[i].lock);
+      if (ip_stats[i].table.buckets != NULL)
+      {
+         for (merged = get_next_flow(&candidates, NULL); merged != NULL; merged = get_next_flow(&candidates, merged))
+         {
+            if ((record = find_flow(&ip_stats[i].table, &merged->key, merged->hash)) != NULL)
+               merge_ip_record(merged, record);
+         }
+      }
+      pthread_mutex_unlock(&ip_stats[i].lock);
+   }
+
+   all = xmalloc((candidates.count + 1) * sizeof(pv_ip_record_t));
+   for (merged = get_next_flow(&candidates, NULL); merged != NULL; merged = get_next_flow(&candidates, merged))
+      all[count++] = *merged;
+   free_flow_table(&candidates);
+   free(indexed);
+
+   count = select_top_records(all, count, order, max);
+   memcpy(records, all, count * sizeof(pv_ip_record_t));
+   free(all);
+
+   return(count);
+}
+
+/*
+   Function: get_ip_stats_counts
+   Purpose : Totals the address counts of the shards, one shard locked
+             at a time.
+   Input   : Pointers that receive the addresses held, the addresses
+             that went idle and left and the new addresses not recorded
+             because their shard was full.
+*/
+void get_ip_stats_counts(unsigned long *addresses, unsigned long *expired, unsigned long *unrecorded)
+{
+   int i;
+
+   pthread_once(&ip_stats_once, init_ip_stats_locks);
+
+   *addresses = 0;
+   *expired = 0;
+   *unrecorded = 0;
+   for (i = 0; i < PV_IP_STATS_SHARDS; i++)
+   {
+      pthread_mutex_lock(&ip_stats[i].lock);
+      if (ip_stats[i].table.buckets != NULL)
+      {
+         *addresses += ip_stats[i].table.count;
+         *expired += ip_stats[i].table.timers->expired_count;
+         *unrecorded += ip_stats[i].table.full_count;
+      }
+      pthread_mutex_unlock(&ip_stats[i].lock);
+   }
+}
+
+/* Writes a batch of addresses with the owners found for the batch in one cache lookup. */
+static void write_ip_stats_batch(FILE *outfile, const pv_ip_record_t *batch, int count, pv_ip_owner_t *owners)
+{
+   const pv_ip_record_t *s;
+   pv_ip_owner_t *owner;
+   char out_str[PV_MAX_INPUT_STR];
+   char ip_str[INET6_ADDRSTRLEN];
+   int length, i;
+
+   find_ip_owners(batch, count, owners);
+
+   for (i = 0; i < count; i++)
+   {
+      s = &batch[i];
+      owner = &owners[i];
+      inet_ntop((s->key.family == PV_FLOW_IPV6) ? AF_INET6 : AF_INET, s->key.src_addr, ip_str, sizeof(ip_str));
+      length = sprintf(out_str, "%s Packet Count %ld Data Size %ld First Seen %ld Last Seen %ld", ip_str, s->packet_count, s->data_size,
+                       (long)s->first_seen.tv_sec, (long)s->last_seen.tv_sec);
+      if (owner->flags & PV_OWNER_FOUND)
+         length += sprintf(out_str + length, " Owner %s AS %u Country %s", owner->owner, owner->asn, owner->country);
+      if (owner->flags & PV_HOST_FOUND)
+         length += sprintf(out_str + length, " Host %s", owner->host_name);
+      strcpy(out_str + length, "\n");
+      fputs(out_str, outfile);
+   }
+}
+
+/*
+   Function: write_ip_stats
+   Purpose : Writes a snapshot of the remote IP statistics, with the
+             owners and host names known so far, after the address
+             counts of the shards. The owners are looked up
+             PV_IP_STATS_OWNER_BATCH addresses at a time.
+   Input   : Output file.
+   Return  : 0 on success, -1 on error.
+*/
+int write_ip_stats(FILE *outfile)
+{
+   pv_flow_table_t snapshot;
+   pv_ip_record_t *s, *batch;
+   pv_ip_owner_t *owners;
+   char out_str[PV_MAX_INPUT_STR];
+   unsigned long addresses, expired, unrecorded;
+   int count = 0;
+
+   get_ip_stats_counts(&addresses, &expired, &unrecorded);
+
+   if (get_ip_stats_snapshot(&snapshot) < 0)
+      return(-1);
+
+   fputs("<ipstatistics>\n", outfile);
+   sprintf(out_str, "<addresses>%lu</addresses><expired>%lu</expired><unrecorded>%lu</unrecorded>\n", addresses, expired, unrecorded);
+   fputs(out_str, outfile);
+   batch = xmalloc(PV_IP_STATS_OWNER_BATCH * sizeof(pv_ip_record_t));
+   owners = xmalloc(PV_IP_STATS_OWNER_BATCH * sizeof(pv_ip_owner_t));
+   for (s = get_next_flow(&snapshot, NULL); s != NULL; s = get_next_flow(&snapshot, s))
+   {
+      batch[count++] = *s;
+      if (count == PV_IP_STATS_OWNER_BATCH)
+      {
+         write_ip_stats_batch(outfile, batch, count, owners);
+         count = 0;
+      }
+   }
+   if (count > 0)
+      write_ip_stats_batch(outfile, batch, count, owners);
+   fputs("</ipstatistics>\n", outfile);
+
+   free(owners);
+   free(batch);
+   free_flow_table(&snapshot);
+
+   return(0);
+}
+
+/*
+   Function: save_ip_stats
+   Purpose : Replaces the statistics file with a new snapshot, readers
+             never see a half written file.
+   Input   : File name.
+   Return  : 0 on success, -1 on error.
+*/
+int save_ip_stats(const char *file_name)
+{
+   char temp_name[PV_PATH_MAX_LENGTH];
+   FILE *outfile;
+
+   snprintf(temp_name, PV_PATH_MAX_LENGTH, "%s.tmp", file_name);
+
+   if ((outfile = fopen(temp_name, "w")) == NULL)
+   {
+      sprint_log_entry("save_ip_stats() <ERROR> Could not open statistics file", temp_name);
+      return(-1);
+   }
+
+   if (write_ip_stats(outfile) < 0)
+   {
+      fclose(outfile);
+      return(-1);
+   }
+
+   if ((fclose(outfile) != 0) || (rename(temp_name, file_name) != 0))
+   {
+      iprint_log_entry("save_ip_stats() <ERROR> Could not write statistics file, errno", errno);
+      return(-1);
+   }
+
+   return(0);
+}
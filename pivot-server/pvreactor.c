@@ -0,0 +1,941 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvreactor.c
+
+   Title : Pivotal NST Server Connection Reactor
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Serves the sensor connections with one shard per core
+            instead of a thread per connection. Every shard has its own
+            listening socket on the server port, opened with SO_REUSEPORT
+            so the kernel spreads the incoming connections over the
+            shards, its own epoll instance and reactor thread, pinned to
+            its core, and its own log workers. A connection stays in the
+            shard that accepted it, and nothing a shard uses while
+            receiving is shared with another shard, so there are no locks
+            between shards and ingestion scales with the cores.
+
+            The reactor owns the listening socket and the sensor sockets
+            of its shard, all non-blocking. When a socket is readable the
+            reactor reads it into the connection's frame reader (see
+            pvframe.c) and takes the complete frames out.
+
+            Control frames are answered by the reactor. The other frames
+            are copied into work items and handed to the shard's log
+            workers, which inflate them, render binary records and write
+            them to the sensor logs. Every connection is given to one
+            worker when it is accepted, so the frames of a sensor are
+            logged in order and only that worker touches its log file.
+
+            The items of one epoll round are collected per worker and
+            queued with one lock and one wakeup. When the items waiting
+            for a worker pass PV_REACTOR_QUEUE_MAX bytes the reactor
+            waits for the worker, which stops reading the sockets and
+            lets TCP slow the sensors down.
+
+            Each shard counts its own connections and traffic, written
+            only by its reactor. Global queries merge the counts of all
+            the shards, see get_server_stats().
+
+            The receive rings start small and only grow for connections
+            that send large frames, so idle sensors cost little memory.
+
+            Built with -DPV_IO_URING a shard receives through io_uring
+            instead of epoll (see pvuring.c). One multishot accept and one
+            multishot receive per connection stay armed, the kernel puts
+            the data in buffers from the shard's buffer ring and the
+            reactor only makes a system call when it has nothing left to
+            do. The log workers then collect the rendered records of each
+            connection over a whole batch of items and append them with
+            one write per sensor log, all of them submitted and completed
+            in one system call. If the kernel has no io_uring the server
+            falls back to epoll and stdio.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+#define PV_WORK_OPEN  1 /* hello of a new sensor, opens the log */
+#define PV_WORK_FRAME 2
+#define PV_WORK_CLOSE 3 /* the connection has ended, closes the log */
+
+struct pv_sensor_work
+{
+   int kind;
+   pv_sensor_connection_t *connection;
+   pv_frame_t frame;          /* the payload follows the item */
+   struct pv_sensor_work *next;
+};
+
+typedef struct pv_sensor_work pv_sensor_work_t;
+
+struct pv_work_queue
+{
+   pthread_mutex_t lock;
+   pthread_cond_t ready;
+   pthread_cond_t space;
+   pv_sensor_work_t *head;
+   pv_sensor_work_t *tail;
+   size_t bytes;
+   pthread_t thread;
+   /* items of the current epoll round, only used by the reactor */
+   pv_sensor_work_t *pending_head;
+   pv_sensor_work_t *pending_tail;
+   size_t pending_bytes;
+   unsigned long frames;
+};
+
+typedef struct pv_work_queue pv_work_queue_t;
+
+struct pv_server_shard
+{
+   int id;
+   int uring;           /* receiving through io_uring, not epoll */
+#ifdef PV_IO_URING
+   pv_uring_t ring;
+   pv_uring_buffers_t buffers;
+#endif
+   int epoll_fd;
+   int listen_fd;
+   pthread_t thread;
+   int next_worker;
+   pv_sensor_connection_t *connections; /* hash map keyed by socket */
+   pv_work_queue_t queues[PV_SHARD_WORKERS];
+   /* written by the shard's reactor only, read by get_server_stats() */
+   volatile unsigned long active_connections;
+   volatile unsigned long total_connections;
+   volatile unsigned long frames;
+   volatile unsigned long event_frames;
+   volatile unsigned long alert_frames;
+   volatile unsigned long long bytes;
+} __attribute__((aligned(PV_CACHE_LINE_SIZE)));
+
+typedef struct pv_server_shard pv_server_shard_t;
+
+static pv_server_shard_t *server_shards = NULL;
+static int server_shard_count = 0;
+
+/*
+   Function: add_sensor_work
+   Purpose : Adds an item for a connection's worker to the items of the
+             current epoll round.
+   Input   : Item kind, connection and the frame to copy, NULL for none.
+*/
+static void add_sensor_work(int kind, pv_sensor_connection_t *connection, pv_frame_t *frame)
+{
+   pv_work_queue_t *queue = &server_shards[connection->shard].queues[connection->worker];
+   uint32_t length = (frame != NULL) ? frame->length : 0;
+   pv_sensor_work_t *work = xmalloc(sizeof(pv_sensor_work_t) + length);
+
+   work->kind = kind;
+   work->connection = connection;
+   work->next = NULL;
+   memset(&work->frame, 0, sizeof(pv_frame_t));
+   if (frame != NULL)
+   {
+      work->frame = *frame;
+      work->frame.payload = (char *)(work + 1);
+      memcpy(work->frame.payload, frame->payload, length);
+   }
+
+   if (queue->pending_tail != NULL)
+      queue->pending_tail->next = work;
+   else
+      queue->pending_head = work;
+   queue->pending_tail = work;
+   queue->pending_bytes += sizeof(pv_sensor_work_t) + length;
+}
+
+/*
+   Function: queue_sensor_work
+   Purpose : Hands the items of the epoll round to the shard's workers,
+             one lock and one wakeup per worker. Waits while a worker is
+             more than PV_REACTOR_QUEUE_MAX bytes behind.
+   Input   : Shard.
+*/
+static void queue_sensor_work(pv_server_shard_t *shard)
+{
+   pv_work_queue_t *queue;
+   int i;
+
+   for (i = 0; i < PV_SHARD_WORKERS; i++)
+   {
+      queue = &shard->queues[i];
+      if (queue->pending_head == NULL)
+         continue;
+
+      pthread_mutex_lock(&queue->lock);
+      while (queue->bytes > PV_REACTOR_QUEUE_MAX)
+         pthread_cond_wait(&queue->space, &queue->lock);
+
+      if (queue->tail != NULL)
+         queue->tail->next = queue->pending_head;
+      else
+         queue->head = queue->pending_head;
+      queue->tail = queue->pending_tail;
+      queue->bytes += queue->pending_bytes;
+      pthread_cond_signal(&queue->ready);
+      pthread_mutex_unlock(&queue->lock);
+
+      queue->pending_head = NULL;
+      queue->pending_tail = NULL;
+      queue->pending_bytes = 0;
+   }
+}
+
+/*
+   Function: do_sensor_work
+   Purpose : Logs one item in the worker that owns the connection.
+   Input   : Item and the worker's render buffer and its size.
+*/
+static void do_sensor_work(pv_sensor_work_t *work, char **render_buffer, int *render_size)
+{
+   pv_sensor_connection_t *connection = work->connection;
+
+   if (work->kind == PV_WORK_CLOSE)
+   {
+      if (connection->sensor_log != NULL)
+         close_sensor_log_file(connection->sensor_log);
+      free(connection);
+      return;
+   }
+
+   /* The sensor ID is in the hello, or in the first records of sensors that send none. */
+   if (connection->sensor_log == NULL)
+   {
+      connection->sensor_log = open_sensor_event_log(work->frame.payload, work->frame.length);
+      connection->connection_map = get_connection_map(work->frame.payload, work->frame.length);
+   }
+
+   if ((work->kind == PV_WORK_FRAME) && (connection->sensor_log != NULL) &&
+       (log_sensor_frame(connection->sensor_log, &work->frame, render_buffer, render_size, connection->connection_map) < 0))
+   {
+      print_log_entry("do_sensor_work() <ERROR> Invalid frame received from sensor.\n");
+   }
+}
+
+#ifdef PV_IO_URING
+
+/*
+   Function: wait_log_writes
+   Purpose : Submits the queued log writes and waits for all of them.
+   Input   : Worker's ring and number of writes queued.
+*/
+static void wait_log_writes(pv_uring_t *ring, unsigned int count)
+{
+   struct io_uring_cqe *cqe;
+
+   if (count == 0)
+      return;
+
+   if (submit_uring(ring, count) < 0)
+      return;
+
+   while (count > 0)
+   {
+      while ((cqe = peek_uring_cqe(ring)) == NULL)
+      {
+         if (submit_uring(ring, 1) < 0)
+            return;
+      }
+      if (cqe->res < 0)
+         iprint_log_entry("wait_log_writes() <ERROR> Sensor log write failed, errno", -cqe->res);
+      seen_uring_cqe(ring);
+      count--;
+   }
+}
+
+/*
+   Function: write_sensor_work
+   Purpose : Logs a batch of items with io_uring. The records of each
+             connection are collected in its pending buffer, then every
+             buffer is appended to its log with linked writes, so the
+             chunks of one log land in order, and the whole batch is
+             submitted and waited for in one system call. The logs of the
+             connections that ended are closed after the writes.
+   Input   : Worker's ring, the items, batch number and the worker's
+             render buffer and its size.
+*/
+static void write_sensor_work(pv_uring_t *ring, pv_sensor_work_t *work, unsigned long batch, char **render_buffer, int *render_size)
+{
+   pv_sensor_work_t *item;
+   pv_sensor_connection_t *connection;
+   struct io_uring_sqe *sqe;
+   unsigned int queued = 0;
+   char *text;
+   int length, offset, chunk;
+
+   for (item = work; item != NULL; item = item->next)
+   {
+      connection = item->connection;
+      if (item->kind == PV_WORK_CLOSE)
+         continue;
+
+      if (connection->sensor_log == NULL)
+      {
+         if ((connection->sensor_log = open_sensor_event_log(item->frame.payload, item->frame.length)) == NULL)
+            continue;
+         fflush(connection->sensor_log); /* the header goes before the records written past stdio */
+         connection->connection_map = get_connection_map(item->frame.payload, item->frame.length);
+      }
+
+      if ((item->kind != PV_WORK_FRAME) || (connection->sensor_log == NULL))
+         continue;
+
+      if ((length = get_sensor_frame_text(&item->frame, &text, render_buffer, render_size, connection->connection_map)) < 0)
+      {
+         print_log_entry("write_sensor_work() <ERROR> Invalid frame received from sensor.\n");
+         continue;
+      }
+
+      if (connection->log_batch != batch)
+      {
+         connection->log_batch = batch;
+         connection->log_pending_length = 0;
+      }
+      if (connection->log_pending_length + length > connection->log_pending_size)
+      {
+         connection->log_pending_size = (connection->log_pending_length + length) * 2;
+         connection->log_pending = xrealloc(connection->log_pending, connection->log_pending_size);
+      }
+      memcpy(connection->log_pending + connection->log_pending_length, text, length);
+      connection->log_pending_length += length;
+   }
+
+   for (item = work; item != NULL; item = item->next)
+   {
+      connection = item->connection;
+      if ((item->kind == PV_WORK_CLOSE) || (connection->log_batch != batch) || (connection->log_pending_length == 0))
+         continue;
+
+      for (offset = 0; offset < connection->log_pending_length; offset += chunk)
+      {
+         chunk = connection->log_pending_length - offset;
+         if (chunk > PV_URING_WRITE_MAX)
+            chunk = PV_URING_WRITE_MAX;
+
+         if ((sqe = get_uring_sqe(ring)) == NULL)
+         {
+            /* The ring is full, what is in it completes before the rest is written. */
+            wait_log_writes(ring, queued);
+            queued = 0;
+            sqe = get_uring_sqe(ring);
+         }
+         prep_uring_write(sqe, fileno(connection->sensor_log), connection->log_pending + offset, chunk,
+                          (uint64_t)(uintptr_t)connection, offset + chunk < connection->log_pending_length);
+         queued++;
+      }
+      connection->log_pending_length = 0; /* written once, however many items it had */
+   }
+
+   wait_log_writes(ring, queued);
+
+   for (item = work; item != NULL; item = item->next)
+   {
+      if (item->kind == PV_WORK_CLOSE)
+      {
+         free(item->connection->log_pending);
+         do_sensor_work(item, render_buffer, render_size);
+      }
+   }
+}
+
+#endif
+
+static void *sensor_work_thread(void *arg)
+{
+   pv_work_queue_t *queue = (pv_work_queue_t *)arg;
+   pv_sensor_work_t *work, *next;
+   char *render_buffer = NULL;
+   int render_size = 0;
+#ifdef PV_IO_URING
+   pv_uring_t ring;
+   unsigned long batch = 0;
+   int uring = (init_uring(&ring, PV_URING_WRITE_ENTRIES) == 0);
+#endif
+
+   while (1)
+   {
+      pthread_mutex_lock(&queue->lock);
+      while (queue->head == NULL)
+         pthread_cond_wait(&queue->ready, &queue->lock);
+      work = queue->head;
+      queue->head = NULL;
+      queue->tail = NULL;
+      queue->bytes = 0;
+      pthread_cond_signal(&queue->space);
+      pthread_mutex_unlock(&queue->lock);
+
+#ifdef PV_IO_URING
+      if (uring)
+      {
+         write_sensor_work(&ring, work, ++batch, &render_buffer, &render_size);
+         for ( ; work != NULL; work = next)
+         {
+            next = work->next;
+            free(work);
+         }
+         continue;
+      }
+#endif
+
+      for ( ; work != NULL; work = next)
+      {
+         next = work->next;
+         do_sensor_work(work, &render_buffer, &render_size);
+         free(work);
+      }
+   }
+
+   return(NULL);
+}
+
+/* Takes a connection off the shard, its worker closes the log and frees it. */
+static void close_sensor_connection(pv_server_shard_t *shard, pv_sensor_connection_t *connection)
+{
+   if (!shard->uring)
+      epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, connection->sockfd, NULL);
+   HASH_DEL(shard->connections, connection);
+   unregister_sensor_connection(connection);
+   close_socket(connection->sockfd);
+   free_frame_reader(&connection->reader);
+   add_sensor_work(PV_WORK_CLOSE, connection, NULL);
+   shard->active_connections--;
+}
+
+/*
+   Function: add_sensor_connection
+   Purpose : Adds an accepted socket to the shard, registered with the
+             shard's epoll instance unless the shard uses io_uring.
+   Input   : Shard and socket.
+   Return  : The connection, NULL on error.
+*/
+static pv_sensor_connection_t *add_sensor_connection(pv_server_shard_t *shard, int sockfd)
+{
+   pv_sensor_connection_t *connection;
+   struct epoll_event event;
+
+   connection = xcalloc(sizeof(pv_sensor_connection_t));
+   connection->sockfd = sockfd;
+   connection->shard = shard->id;
+   connection->worker = shard->next_worker;
+   shard->next_worker = (shard->next_worker + 1) % PV_SHARD_WORKERS;
+
+   if (init_frame_reader(&connection->reader, PV_FRAME_RING_SIZE) < 0)
+   {
+      close_socket(sockfd);
+      free(connection);
+      return(NULL);
+   }
+
+   if (!shard->uring)
+   {
+      event.events = EPOLLIN;
+      event.data.ptr = connection;
+      if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, sockfd, &event) < 0)
+      {
+         print_log_entry("add_sensor_connection() <ERROR> Could not add connection.\n");
+         free_frame_reader(&connection->reader);
+         close_socket(sockfd);
+         free(connection);
+         return(NULL);
+      }
+   }
+
+   HASH_ADD_INT(shard->connections, sockfd, connection);
+   shard->active_connections++;
+   shard->total_connections++;
+
+   return(connection);
+}
+
+/*
+   Function: accept_sensor_connections
+   Purpose : Accepts every connection waiting on the shard's listening
+             socket and registers it with the shard's reactor.
+   Input   : Shard.
+*/
+static void accept_sensor_connections(pv_server_shard_t *shard)
+{
+   int sockfd;
+
+   while ((sockfd = accept4(shard->listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+      add_sensor_connection(shard, sockfd);
+
+   if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+      print_log_entry("accept_sensor_connections() <ERROR> Accept failed.\n");
+}
+
+/*
+   Function: handle_sensor_frames
+   Purpose : Passes on the complete frames received from a sensor.
+   Input   : Shard and connection.
+   Return  : 0 if the connection stays open, -1 if the sensor sent a
+             corrupt frame or said it is disconnecting.
+*/
+static int handle_sensor_frames(pv_server_shard_t *shard, pv_sensor_connection_t *connection)
+{
+   pv_frame_t frame;
+   int res;
+
+   while ((res = next_frame(&connection->reader, &frame)) > 0)
+   {
+      if (frame.type == PV_FRAME_CONTROL)
+      {
+         if ((frame.length >= sizeof(PV_CONTROL_DISCONNECT) - 1) &&
+             (memcmp(frame.payload, PV_CONTROL_DISCONNECT, sizeof(PV_CONTROL_DISCONNECT) - 1) == 0))
+         {
+            return(-1);
+         }
+         if ((frame.length >= sizeof(PV_CONTROL_HELLO) - 1) &&
+             (memcmp(frame.payload, PV_CONTROL_HELLO, sizeof(PV_CONTROL_HELLO) - 1) == 0))
+         {
+            /* The reply is short and the first thing written, it fits in the socket buffer. */
+            answer_sensor_hello(connection->sockfd, frame.payload, frame.length);
+            register_sensor_connection(connection, frame.payload, frame.length);
+            add_sensor_work(PV_WORK_OPEN, connection, &frame);
+         }
+         /* TODO: check for alarm or error message. */
+         continue;
+      }
+
+      add_sensor_work(PV_WORK_FRAME, connection, &frame);
+      shard->frames++;
+      if (frame.type == PV_FRAME_ALERT)
+      {
+         connection->alert_count++;
+         shard->alert_frames++;
+      }
+      else if (frame.type == PV_FRAME_EVENT)
+      {
+         connection->event_count++;
+         shard->event_frames++;
+      }
+   }
+
+   if (res < 0)
+   {
+      connection->invalid_count++;
+      print_log_entry("handle_sensor_frames() <ERROR> Invalid frame received from sensor.\n");
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+   Function: read_sensor_connection
+   Purpose : Reads what a sensor has sent and passes on the complete
+             frames. The connection ends when the sensor closes it, sends
+             a corrupt frame or says it is disconnecting.
+   Input   : Shard and connection.
+*/
+static void read_sensor_connection(pv_server_shard_t *shard, pv_sensor_connection_t *connection)
+{
+   int res;
+
+   res = read_frames(&connection->reader, connection->sockfd);
+   if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      return;
+   if (res <= 0)
+   {
+      close_sensor_connection(shard, connection);
+      return;
+   }
+   shard->bytes += res;
+
+   if (handle_sensor_frames(shard, connection) < 0)
+      close_sensor_connection(shard, connection);
+}
+
+#ifdef PV_IO_URING
+
+#define PV_URING_ACCEPT 0 /* user data of the accept, a receive carries its connection */
+#define PV_URING_GROUP  0 /* the shard's receive buffers */
+
+/* The next submission entry of a shard, submitting what is queued if the ring is full. */
+static struct io_uring_sqe *get_shard_sqe(pv_server_shard_t *shard)
+{
+   struct io_uring_sqe *sqe;
+
+   if ((sqe = get_uring_sqe(&shard->ring)) == NULL)
+   {
+      submit_uring(&shard->ring, 0);
+      if ((sqe = get_uring_sqe(&shard->ring)) == NULL)
+         print_log_entry("get_shard_sqe() <ERROR> io_uring submission queue full.\n");
+   }
+
+   return(sqe);
+}
+
+/* Ends a connection that is still receiving, its last receive completes with 0. */
+static void end_sensor_connection(pv_sensor_connection_t *connection)
+{
+   connection->status = PV_CONNECTION_CLOSING;
+   shutdown(connection->sockfd, SHUT_RDWR);
+}
+
+/*
+   Function: accept_uring_connection
+   Purpose : Adds a connection accepted by the shard's multishot accept
+             and arms its multishot receive.
+   Input   : Shard and the accept completion.
+*/
+static void accept_uring_connection(pv_server_shard_t *shard, struct io_uring_cqe *cqe)
+{
+   pv_sensor_connection_t *connection;
+   struct io_uring_sqe *sqe;
+
+   if (cqe->res >= 0)
+   {
+      if (((connection = add_sensor_connection(shard, cqe->res)) != NULL) && ((sqe = get_shard_sqe(shard)) != NULL))
+         prep_uring_recv(sqe, connection->sockfd, PV_URING_GROUP, (uint64_t)(uintptr_t)connection);
+      else if (connection != NULL)
+         close_sensor_connection(shard, connection);
+   }
+   else if (cqe->res != -EINTR)
+   {
+      iprint_log_entry("accept_uring_connection() <ERROR> Accept failed, errno", -cqe->res);
+   }
+
+   /* The kernel ends a multishot accept on errors, arm it again. */
+   if (!(cqe->flags & IORING_CQE_F_MORE) && ((sqe = get_shard_sqe(shard)) != NULL))
+      prep_uring_accept(sqe, shard->listen_fd, PV_URING_ACCEPT);
+}
+
+/*
+   Function: receive_uring_data
+   Purpose : Passes on the frames in a receive buffer and gives the
+             buffer back. The connection is closed once its receive has
+             ended, the receive is armed again if the kernel ended it
+             while the connection is open, e.g. when the buffers ran out.
+   Input   : Shard, connection and the receive completion.
+*/
+static void receive_uring_data(pv_server_shard_t *shard, pv_sensor_connection_t *connection, struct io_uring_cqe *cqe)
+{
+   struct io_uring_sqe *sqe;
+   unsigned int id;
+   uint32_t length, fed;
+   char *data;
+
+   if (cqe->flags & IORING_CQE_F_BUFFER)
+   {
+      id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if ((cqe->res > 0) && (connection->status == PV_CONNECTION_OPEN))
+      {
+         data = get_uring_buffer(&shard->buffers, id);
+         length = (uint32_t)cqe->res;
+         shard->bytes += length;
+
+         /* A frame bigger than the ring grows the ring in next_frame(), so every pass feeds some. */
+         while (length > 0)
+         {
+            fed = feed_frames(&connection->reader, data, length);
+            data += fed;
+            length -= fed;
+            if (handle_sensor_frames(shard, connection) < 0)
+            {
+               end_sensor_connection(connection);
+               break;
+            }
+         }
+      }
+      return_uring_buffer(&shard->buffers, id);
+   }
+
+   if (cqe->flags & IORING_CQE_F_MORE)
+      return;
+
+   if ((connection->status == PV_CONNECTION_OPEN) && ((cqe->res > 0) || (cqe->res == -ENOBUFS)) &&
+       ((sqe = get_shard_sqe(shard)) != NULL))
+   {
+      prep_uring_recv(sqe, connection->sockfd, PV_URING_GROUP, (uint64_t)(uintptr_t)connection);
+      return;
+   }
+
+   close_sensor_connection(shard, connection);
+}
+
+/*
+   Function: run_uring_shard
+   Purpose : The reactor of a shard that receives through io_uring. Each
+             round submits the new requests and waits for completions in
+             one system call, then handles every completion and queues
+             the round's items for the workers.
+   Input   : Shard.
+*/
+static void run_uring_shard(pv_server_shard_t *shard)
+{
+   struct io_uring_cqe *cqe;
+   struct io_uring_sqe *sqe;
+
+   if ((sqe = get_shard_sqe(shard)) == NULL)
+      return;
+   prep_uring_accept(sqe, shard->listen_fd, PV_URING_ACCEPT);
+
+   while (submit_uring(&shard->ring, 1) >= 0)
+   {
+      while ((cqe = peek_uring_cqe(&shard->ring)) != NULL)
+      {
+         if (cqe->user_data == PV_URING_ACCEPT)
+            accept_uring_connection(shard, cqe);
+         else
+            receive_uring_data(shard, (pv_sensor_connection_t *)(uintptr_t)cqe->user_data, cqe);
+         seen_uring_cqe(&shard->ring);
+      }
+
+      queue_sensor_work(shard);
+   }
+
+   iprint_log_entry("run_uring_shard() <ERROR> io_uring failed in shard", shard->id);
+}
+
+/* Sets up the shard's ring and receive buffers, 0 on success, -1 to use epoll. */
+static int init_shard_uring(pv_server_shard_t *shard)
+{
+   if (init_uring(&shard->ring, PV_URING_ENTRIES) < 0)
+      return(-1);
+
+   if (init_uring_buffers(&shard->ring, &shard->buffers, PV_URING_GROUP, PV_URING_BUFFERS, PV_URING_BUFFER_SIZE) < 0)
+   {
+      free_uring(&shard->ring);
+      return(-1);
+   }
+
+   return(0);
+}
+
+#endif
+
+/*
+   Function: server_shard_thread
+   Purpose : The reactor of a shard, pinned to the shard's core.
+   Input   : Shard.
+*/
+static void *server_shard_thread(void *arg)
+{
+   pv_server_shard_t *shard = (pv_server_shard_t *)arg;
+   struct epoll_event events[PV_REACTOR_EVENTS];
+   cpu_set_t cpus;
+   int i, count;
+
+   CPU_ZERO(&cpus);
+   CPU_SET(shard->id, &cpus);
+   pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+
+#ifdef PV_IO_URING
+   if (shard->uring)
+   {
+      run_uring_shard(shard);
+      return(NULL);
+   }
+#endif
+
+   while (1)
+   {
+      if ((count = epoll_wait(shard->epoll_fd, events, PV_REACTOR_EVENTS, -1)) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         iprint_log_entry("server_shard_thread() <ERROR> epoll_wait failed in shard", shard->id);
+         break;
+      }
+
+      for (i = 0; i < count; i++)
+      {
+         if (events[i].data.ptr == NULL)
+            accept_sensor_connections(shard);
+         else
+            read_sensor_connection(shard, (pv_sensor_connection_t *)events[i].data.ptr);
+      }
+
+      queue_sensor_work(shard);
+   }
+
+   return(NULL);
+}
+
+/*
+   Function: init_server_shard
+   Purpose : Opens the shard's listening socket and its io_uring or
+             epoll instance and starts its log workers.
+   Input   : Shard and TCP port number.
+   Return  : 0 on success, -1 on error.
+*/
+static int init_server_shard(pv_server_shard_t *shard, int port_number)
+{
+   struct epoll_event event;
+   int i;
+
+   if ((shard->listen_fd = init_listen_socket(port_number, 1)) < 0)
+      return(-1);
+
+#ifdef PV_IO_URING
+   if (init_shard_uring(shard) == 0)
+      shard->uring = 1;
+   else
+      iprint_log_entry("init_server_shard() <WARNING> Using epoll in shard", shard->id);
+#endif
+
+   if (!shard->uring)
+   {
+      if ((shard->epoll_fd = epoll_create1(0)) < 0)
+      {
+         print_log_entry("init_server_shard() <ERROR> Could not create epoll instance.\n");
+         return(-1);
+      }
+
+      event.events = EPOLLIN;
+      event.data.ptr = NULL; /* the listening socket */
+      if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &event) < 0)
+      {
+         print_log_entry("init_server_shard() <ERROR> Could not add listening socket.\n");
+         return(-1);
+      }
+   }
+
+   for (i = 0; i < PV_SHARD_WORKERS; i++)
+   {
+      pthread_mutex_init(&shard->queues[i].lock, NULL);
+      pthread_cond_init(&shard->queues[i].ready, NULL);
+      pthread_cond_init(&shard->queues[i].space, NULL);
+      if (pthread_create(&shard->queues[i].thread, NULL, sensor_work_thread, &shard->queues[i]) != 0)
+      {
+         print_log_entry("init_server_shard() <ERROR> Could not create worker thread.\n");
+         return(-1);
+      }
+   }
+
+   return(0);
+}
+
+/* Lets the server hold as many sockets as the hard limit allows. */
+static void raise_file_limit()
+{
+   struct rlimit limit;
+
+   if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur < limit.rlim_max))
+   {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+   }
+}
+
+/*
+   Function: start_server_shards
+   Purpose : Starts the shards that serve the sensor connections on a
+             TCP port, one per core unless a count is given.
+   Input   : TCP port number and number of shards, 0 = one per core.
+   Return  : Number of shards started, -1 on error.
+*/
+int start_server_shards(int port_number, int count)
+{
+   int i;
+
+   if (count <= 0)
+      count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (count <= 0)
+      count = 1;
+   if (count > PV_MAX_SERVER_SHARDS)
+      count = PV_MAX_SERVER_SHARDS;
+
+   raise_file_limit();
+
+   if (posix_memalign((void **)&server_shards, PV_CACHE_LINE_SIZE, count * sizeof(pv_server_shard_t)) != 0)
+   {
+      print_log_entry("start_server_shards() <ERROR> Could not allocate shards.\n");
+      return(-1);
+   }
+   memset(server_shards, 0, count * sizeof(pv_server_shard_t));
+
+   /* Open every listener before accepting, so no shard takes the whole port for a while. */
+   for (i = 0; i < count; i++)
+   {
+      server_shards[i].id = i;
+      if (init_server_shard(&server_shards[i], port_number) < 0)
+         return(-1);
+   }
+   server_shard_count = count;
+
+   for (i = 0; i < count; i++)
+   {
+      if (pthread_create(&server_shards[i].thread, NULL, server_shard_thread, &server_shards[i]) != 0)
+      {
+         print_log_entry("start_server_shards() <ERROR> Could not create shard thread.\n");
+         return(-1);
+      }
+   }
+
+   iprint_log_entry("start_server_shards() <INFO> Waiting for incoming connections, shards", count);
+
+   return(count);
+}
+
+/*
+   Function: get_server_stats
+   Purpose : Merges the counts of all the shards. Each count is read
+             without stopping its shard, so the totals are a moment
+             apart but never torn.
+   Input   : Stats to fill in.
+*/
+void get_server_stats(pv_server_stats_t *stats)
+{
+   pv_server_shard_t *shard;
+   int i;
+
+   memset(stats, 0, sizeof(pv_server_stats_t));
+   stats->shards = server_shard_count;
+
+   for (i = 0; i < server_shard_count; i++)
+   {
+      shard = &server_shards[i];
+      stats->active_connections += shard->active_connections;
+      stats->total_connections += shard->total_connections;
+      stats->frames += shard->frames;
+      stats->event_frames += shard->event_frames;
+      stats->alert_frames += shard->alert_frames;
+      stats->bytes += shard->bytes;
+      if (shard->active_connections > stats->max_shard_connections)
+         stats->max_shard_connections = shard->active_connections;
+   }
+}
+
+/* Logs the merged counts of the shards, the busiest shard shows how evenly the kernel spreads the sensors. */
+void log_server_stats()
+{
+   pv_server_stats_t stats;
+   char msg[PV_MAX_INPUT_STR];
+
+   get_server_stats(&stats);
+
+   sprintf(msg, "log_server_stats() <INFO> %lu sensors connected (at most %lu in one of %d shards), %lu connections accepted, %lu frames, %llu bytes received.\n",
+           stats.active_connections, stats.max_shard_connections, stats.shards, stats.total_connections, stats.frames, stats.bytes);
+   print_log_entry(msg);
+}
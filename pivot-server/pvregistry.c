@@ -0,0 +1,441 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvregistry.c
+
+   Title : Pivotal NST Server Sensor Registry
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Keeps a record of every sensor that has connected, found by
+            the number in its sensor ID (SENSOR0042 is sensor 42) with one
+            array lookup. A TCP sensor is registered by its hello, a UDP
+            sensor by its first datagram. The records are kept for the
+            life of the server, so a sensor that reconnects adds to its
+            old counts.
+
+            The live counts of a TCP connection stay in the connection
+            (see pv_sensor_connection_t), written only by the reactor of
+            its shard, so counting never takes a lock or shares a cache
+            line with another shard. The record links the sensor's open
+            connections and adds their counts to its own when they close,
+            a query adds up the record and the open connections. The
+            connection list has a lock, taken when a connection opens or
+            closes and by queries, never per frame.
+
+            The reactors count frames, the events are the records in
+            them, counted by the log workers in the sensor's connection
+            map as they log the frames. The lag of a sensor is the age of
+            the newest event it sent, by the server clock, from the same
+            map. The drops are the corrupt frames and the lost datagrams
+            the server has seen. Batches a sensor drops itself, when its
+            send ring or spool is full, never reach the server and are
+            only in the sensor's own log. The rates are worked out every
+            PV_SERVER_STATS_INTERVAL by sample_sensor_registry(), which
+            also keeps the counts of the last PV_TOP_INTERVALS samples,
+            so the top sensors of a time window are ranked by what they
+            sent in the window.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+static pv_sensor_record_t *sensor_records[PV_MAX_SENSOR_NUMBER];
+static pv_sensor_record_t *sensor_record_list = NULL; /* in the order the sensors registered */
+static pthread_mutex_t sensor_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+   Function: get_sensor_number
+   Purpose : Reads the sensor number from the ID in a hello or record.
+   Input   : Payload and length.
+   Return  : Sensor number, -1 if the payload has no valid sensor ID.
+*/
+int get_sensor_number(const char *payload, int length)
+{
+   char sensor_id[PV_SENSOR_ID_STR];
+   int i, number = 0;
+
+   memset(sensor_id, 0, PV_SENSOR_ID_STR);
+   get_sensor_id(payload, length, sensor_id);
+
+   for (i = 6; i < 10; i++)
+   {
+      if ((sensor_id[i] < '0') || (sensor_id[i] > '9'))
+         return(-1);
+      number = number * 10 + (sensor_id[i] - '0');
+   }
+
+   return(number);
+}
+
+/*
+   Function: get_sensor_record
+   Purpose : Finds the record of a sensor, adding it if the sensor is new.
+   Input   : Sensor number.
+   Return  : The record, NULL if the number is out of range.
+*/
+pv_sensor_record_t *get_sensor_record(int number)
+{
+   pv_sensor_record_t *record;
+   char sensor_id[PV_MAX_INPUT_STR];
+
+   if ((number < 0) || (number >= PV_MAX_SENSOR_NUMBER))
+      return(NULL);
+
+   if ((record = sensor_records[number]) != NULL)
+      return(record);
+
+   pthread_mutex_lock(&sensor_registry_lock);
+
+   if ((record = sensor_records[number]) == NULL)
+   {
+      record = xcalloc(sizeof(pv_sensor_record_t));
+      record->number = number;
+      sprintf(record->sensor_id, "SENSOR%04d", number);
+      pthread_mutex_init(&record->lock, NULL);
+      sprintf(sensor_id, "<id>%s</id>", record->sensor_id);
+      record->connection_map = get_connection_map(sensor_id, strlen(sensor_id));
+      record->first_seen = time(NULL);
+      record->sample_time = record->first_seen;
+
+      record->next = sensor_record_list;
+      __sync_synchronize(); /* The record is complete before other threads find it. */
+      sensor_record_list = record;
+      sensor_records[number] = record;
+
+      sprint_log_entry("get_sensor_record() <INFO> Registered sensor", record->sensor_id);
+   }
+
+   pthread_mutex_unlock(&sensor_registry_lock);
+
+   return(record);
+}
+
+/* The record of a sensor, NULL if the sensor has never connected. */
+pv_sensor_record_t *find_sensor_record(int number)
+{
+   if ((number < 0) || (number >= PV_MAX_SENSOR_NUMBER))
+      return(NULL);
+
+   return(sensor_records[number]);
+}
+
+/*
+   Function: register_sensor_connection
+   Purpose : Adds a connection to the record of the sensor named in its
+             hello.
+   Input   : Connection and hello payload and length.
+   Return  : 0 on success, -1 if the hello has no valid sensor ID.
+*/
+int register_sensor_connection(pv_sensor_connection_t *connection, const char *payload, int length)
+{
+   pv_sensor_record_t *record;
+
+   if (connection->sensor != NULL)
+      return(0);
+
+   if ((record = get_sensor_record(get_sensor_number(payload, length))) == NULL)
+   {
+      print_log_entry("register_sensor_connection() <WARNING> Hello without a valid sensor ID.\n");
+      return(-1);
+   }
+
+   connection->sensor_id = record->number;
+   connection->sensor = record;
+
+   pthread_mutex_lock(&record->lock);
+   connection->sensor_prev = NULL;
+   connection->sensor_next = record->connections;
+   if (record->connections != NULL)
+      record->connections->sensor_prev = connection;
+   record->connections = connection;
+   record->active_connections++;
+   record->total_connections++;
+   record->last_seen = time(NULL);
+   pthread_mutex_unlock(&record->lock);
+
+   return(0);
+}
+
+/*
+   Function: unregister_sensor_connection
+   Purpose : Takes a closing connection off its sensor's record and adds
+             its counts to the record.
+   Input   : Connection.
+*/
+void unregister_sensor_connection(pv_sensor_connection_t *connection)
+{
+   pv_sensor_record_t *record = connection->sensor;
+
+   if (record == NULL)
+      return;
+
+   pthread_mutex_lock(&record->lock);
+   if (connection->sensor_prev != NULL)
+      connection->sensor_prev->sensor_next = connection->sensor_next;
+   else
+      record->connections = connection->sensor_next;
+   if (connection->sensor_next != NULL)
+      connection->sensor_next->sensor_prev = connection->sensor_prev;
+   record->active_connections--;
+   record->frames += connection->reader.frame_count;
+   record->bytes += connection->reader.byte_count;
+   record->event_frames += connection->event_count;
+   record->alert_frames += connection->alert_count;
+   record->invalid += connection->invalid_count;
+   record->last_seen = time(NULL);
+   pthread_mutex_unlock(&record->lock);
+
+   connection->sensor = NULL;
+}
+
+/*
+   Function: add_sensor_datagrams
+   Purpose : Adds to the datagram counts of a UDP sensor, only called by
+             the UDP receiver. Several sources may send with the same
+             sensor number.
+   Input   : Record, datagrams and bytes received and the change in the
+             datagrams lost, less than 0 when a late datagram arrives.
+*/
+void add_sensor_datagrams(pv_sensor_record_t *record, unsigned long datagrams, unsigned long long bytes, long lost)
+{
+   record->datagrams += datagrams;
+   record->datagram_bytes += bytes;
+   record->datagrams_lost += lost;
+}
+
+/* Adds up the counts of a record and of its open connections, the record locked by the caller. */
+static void sum_sensor_counts(pv_sensor_record_t *record, pv_sensor_stats_t *stats)
+{
+   pv_sensor_connection_t *connection;
+
+   stats->frames = record->frames;
+   stats->bytes = record->bytes;
+   stats->event_frames = record->event_frames;
+   stats->alert_frames = record->alert_frames;
+   stats->invalid = record->invalid;
+
+   for (connection = record->connections; connection != NULL; connection = connection->sensor_next)
+   {
+      stats->frames += connection->reader.frame_count;
+      stats->bytes += connection->reader.byte_count;
+      stats->event_frames += connection->event_count;
+      stats->alert_frames += connection->alert_count;
+      stats->invalid += connection->invalid_count;
+   }
+
+   stats->bytes += record->datagram_bytes;
+
+   /* Written by the log workers under the map lock, one word read without it. */
+   if (record->connection_map != NULL)
+      stats->events = record->connection_map->events;
+}
+
+/*
+   Function: get_sensor_stats
+   Purpose : Gets the counts, rates, lag and drops of one sensor.
+   Input   : Sensor number and the stats to fill in.
+   Return  : 0 on success, -1 if the sensor has never connected.
+*/
+int get_sensor_stats(int number, pv_sensor_stats_t *stats)
+{
+   pv_sensor_record_t *record;
+   time_t newest;
+
+   memset(stats, 0, sizeof(pv_sensor_stats_t));
+
+   if ((record = find_sensor_record(number)) == NULL)
+      return(-1);
+
+   stats->number = record->number;
+   strcpy(stats->sensor_id, record->sensor_id);
+
+   pthread_mutex_lock(&record->lock);
+   sum_sensor_counts(record, stats);
+   stats->active_connections = record->active_connections;
+   stats->total_connections = record->total_connections;
+   stats->first_seen = record->first_seen;
+   stats->last_seen = record->last_seen;
+   stats->bytes_per_second = record->bytes_per_second;
+   stats->events_per_second = record->events_per_second;
+   pthread_mutex_unlock(&record->lock);
+
+   stats->datagrams = record->datagrams;
+   stats->dropped = stats->invalid + record->datagrams_lost;
+
+   stats->lag = -1;
+   if ((record->connection_map != NULL) && ((newest = record->connection_map->newest_event) > 0))
+      stats->lag = (long)(time(NULL) - newest);
+
+   return(0);
+}
+
+/*
+   Function: sample_sensor_registry
+   Purpose : Works out the byte and event rates of every sensor since the
+             last sample.
+*/
+void sample_sensor_registry()
+{
+   pv_sensor_record_t *record;
+   pv_sensor_stats_t stats;
+   time_t now = time(NULL);
+   long elapsed;
+
+   for (record = sensor_record_list; record != NULL; record = record->next)
+   {
+      pthread_mutex_lock(&record->lock);
+      memset(&stats, 0, sizeof(pv_sensor_stats_t));
+      sum_sensor_counts(record, &stats);
+      if ((elapsed = (long)(now - record->sample_time)) > 0)
+      {
+         record->bytes_per_second = (stats.bytes - record->sample_bytes) / elapsed;
+         record->events_per_second = (stats.events - record->sample_events) / elapsed;
+         record->sample_bytes = stats.bytes;
+         record->sample_events = stats.events;
+         record->sample_time = now;
+      }
+      record->samples[record->sample_next].time = now;
+      record->samples[record->sample_next].bytes = stats.bytes;
+      record->samples[record->sample_next].events = stats.events;
+      record->sample_next = (record->sample_next + 1) % PV_TOP_INTERVALS;
+      pthread_mutex_unlock(&record->lock);
+   }
+}
+
+/*
+   Function: get_sensor_counts_at
+   Purpose : Gets the counts of a sensor at a time from its samples, the
+             newest sample at or before the time. A time before the
+             oldest sample kept has the counts of the oldest sample, a
+             sensor not sampled yet has no counts.
+   Input   : Record, time and the counts to fill in.
+*/
+static void get_sensor_counts_at(pv_sensor_record_t *record, time_t when, pv_sensor_sample_t *counts)
+{
+   pv_sensor_sample_t *sample, *found = NULL, *oldest = NULL;
+   int i;
+
+   memset(counts, 0, sizeof(pv_sensor_sample_t));
+
+   pthread_mutex_lock(&record->lock);
+   for (i = 0; i < PV_TOP_INTERVALS; i++)
+   {
+      sample = &record->samples[i];
+      if (sample->time == 0)
+         continue;
+      if ((sample->time <= when) && ((found == NULL) || (sample->time > found->time)))
+         found = sample;
+      if ((oldest == NULL) || (sample->time < oldest->time))
+         oldest = sample;
+   }
+   if (found == NULL)
+      found = oldest;
+   if (found != NULL)
+      *counts = *found;
+   pthread_mutex_unlock(&record->lock);
+}
+
+/*
+   Function: get_top_sensors
+   Purpose : Finds the sensors that sent the most bytes or events and
+             were connected in a time window. The registry holds one
+             record per sensor, the counts are read from the records.
+             With a window the bytes and events of a sensor are those
+             sent in the window, from the samples at its ends, so the
+             window is rounded to PV_SERVER_STATS_INTERVAL and reaches
+             back PV_TOP_INTERVALS samples at most. The other counts are
+             those since the sensor first connected.
+   Input   : Order (PV_TOP_BYTES, or PV_TOP_PACKETS for events), window in
+             seconds (0 for no limit), array for the stats and its
+             length.
+   Return  : Number of sensors, largest first.
+*/
+int get_top_sensors(int order, time_t since, time_t until, pv_sensor_stats_t *top, int max)
+{
+   pv_sensor_record_t *record;
+   pv_sensor_stats_t stats;
+   pv_sensor_sample_t start, end;
+   unsigned long long value;
+   time_t now = time(NULL);
+   int i, count = 0;
+
+   for (record = sensor_record_list; record != NULL; record = record->next)
+   {
+      if (get_sensor_stats(record->number, &stats) < 0)
+         continue;
+      if (((since > 0) && (stats.last_seen < since) && (stats.active_connections == 0)) || ((until > 0) && (stats.first_seen > until)))
+         continue;
+
+      if ((until > 0) && (until < now))
+      {
+         get_sensor_counts_at(record, until, &end);
+         stats.bytes = end.bytes;
+         stats.events = end.events;
+      }
+      if ((since > 0) && (since > stats.first_seen))
+      {
+         get_sensor_counts_at(record, since, &start);
+         stats.bytes = (stats.bytes > start.bytes) ? stats.bytes - start.bytes : 0;
+         stats.events = (stats.events > start.events) ? stats.events - start.events : 0;
+      }
+
+      /* Insert into the sorted list, dropping the smallest when it is full. */
+      value = (order == PV_TOP_PACKETS) ? stats.events : stats.bytes;
+      for (i = count; i > 0; i--)
+      {
+         if (((order == PV_TOP_PACKETS) ? top[i - 1].events : top[i - 1].bytes) >= value)
+            break;
+         if (i < max)
+            top[i] = top[i - 1];
+      }
+      if (i < max)
+      {
+         top[i] = stats;
+         if (count < max)
+            count++;
+      }
+   }
+
+   return(count);
+}
+
+/* Logs the counts of every sensor that has connected. */
+void log_sensor_registry()
+{
+   pv_sensor_record_t *record;
+   pv_sensor_stats_t stats;
+   char msg[PV_MAX_INPUT_STR];
+
+   for (record = sensor_record_list; record != NULL; record = record->next)
+   {
+      if (get_sensor_stats(record->number, &stats) < 0)
+         continue;
+      sprintf(msg, "log_sensor_registry() <INFO> %s: %lu connected, %lu frames (%lu event, %lu alert), %lu events, %llu bytes, %llu bytes/s, %lu events/s, lag %ld s, %lu dropped by the server.\n",
+              stats.sensor_id, stats.active_connections, stats.frames, stats.event_frames, stats.alert_frames, stats.events, stats.bytes,
+              stats.bytes_per_second, stats.events_per_second, stats.lag, stats.dropped);
+      print_log_entry(msg);
+   }
+}
@@ -0,0 +1,264 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvsensormap.c
+
+   Title : Pivotal NST Server Sensor Connection Maps
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Keeps the traffic statistics reported by each sensor, one
+            flow table (see pvconnectionmap.c) per sensor ID. The map of
+            a sensor is made when its first connection opens its log and
+            is kept when the sensor disconnects, so a sensor that
+            reconnects, or has several connections, adds to one map.
+
+            The maps are updated as the binary event records are rendered
+            for the sensor log (see render_event_records()), from the
+            decoded events, so the Fineline text is never parsed again.
+            Sensors that send Fineline text only have their frames
+            counted.
+
+            Each map has its own lock, held by a log worker while it
+            renders a frame and by a query while it reads the map, so the
+            maps can be read while the sensors are sending. The list of
+            maps has a lock of its own, taken only to find or add a map
+            and to walk the list, always before a map lock.
+
+            Each map keeps a top index of its flows (see pvtopindex.c)
+            and a top window of its largest flows in each recent minute
+            (see pvtopwindow.c) for the top talker queries of the GUI.
+
+            A map starts with room for PV_SENSOR_MAP_MIN_FLOWS and grows
+            with the traffic up to PV_SENSOR_MAP_FLOWS, so the maps of
+            quiet sensors stay small. The event times age the flows on a
+            timer wheel (see pvtimerwheel.c), a flow without events for
+            PV_SENSOR_MAP_IDLE seconds leaves the map and its top index,
+            so a busy sensor's map holds its recent flows and does not
+            fill up with old ones.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+static pv_connection_map_t *connection_maps = NULL; /* hash map keyed by sensor ID */
+static pthread_mutex_t connection_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Idle flows just leave the map, the wheel counts them. */
+static void expire_connection_flow(void *user, pv_ip_record_t *record, int reason)
+{
+}
+
+/*
+   Function: get_connection_map
+   Purpose : Finds the map of the sensor named in a hello or in the first
+             records of a sensor, making it if the sensor is new.
+   Input   : Payload and length.
+   Return  : The map, NULL if it could not be allocated.
+*/
+pv_connection_map_t *get_connection_map(const char *payload, int length)
+{
+   pv_connection_map_t *map;
+   char sensor_id[PV_SENSOR_ID_STR];
+
+   memset(sensor_id, 0, PV_SENSOR_ID_STR);
+   get_sensor_id(payload, length, sensor_id);
+
+   pthread_mutex_lock(&connection_maps_lock);
+
+   HASH_FIND_STR(connection_maps, sensor_id, map);
+   if (map == NULL)
+   {
+      map = xcalloc(sizeof(pv_connection_map_t));
+      if ((init_growing_flow_table(&map->table, PV_SENSOR_MAP_MIN_FLOWS, PV_SENSOR_MAP_FLOWS) < 0) ||
+          (init_flow_timers(&map->table, PV_SENSOR_MAP_IDLE, PV_SENSOR_MAP_ACTIVE, expire_connection_flow, map) < 0) ||
+          (init_flow_top(&map->table, PV_SENSOR_MAP_TOP) < 0) ||
+          (init_flow_window(&map->table, PV_SENSOR_MAP_WINDOW_KEYS, PV_SENSOR_MAP_WINDOW_FLOWS) < 0))
+      {
+         free_flow_table(&map->table);
+         pthread_mutex_unlock(&connection_maps_lock);
+         free(map);
+         return(NULL);
+      }
+      strcpy(map->sensor_id, sensor_id);
+      pthread_mutex_init(&map->lock, NULL);
+      HASH_ADD_STR(connection_maps, sensor_id, map);
+      sprint_log_entry("get_connection_map() <INFO> New connection map for sensor", sensor_id);
+   }
+
+   pthread_mutex_unlock(&connection_maps_lock);
+
+   return(map);
+}
+
+void lock_connection_map(pv_connection_map_t *map)
+{
+   pthread_mutex_lock(&map->lock);
+}
+
+void unlock_connection_map(pv_connection_map_t *map)
+{
+   pthread_mutex_unlock(&map->lock);
+}
+
+/*
+   Function: get_connection_map_records
+   Purpose : Copies the flow records of a sensor while it keeps sending.
+   Input   : Sensor ID, array for the records and its length.
+   Return  : Number of records copied, -1 if the sensor has no map.
+*/
+int get_connection_map_records(const char *sensor_id, pv_ip_record_t *records, int max)
+{
+   pv_connection_map_t *map;
+   pv_ip_record_t *record;
+   int count = 0;
+
+   pthread_mutex_lock(&connection_maps_lock);
+   HASH_FIND_STR(connection_maps, sensor_id, map);
+   pthread_mutex_unlock(&connection_maps_lock);
+
+   if (map == NULL)
+      return(-1);
+
+   lock_connection_map(map);
+   for (record = get_first_connection_record(&map->table); (record != NULL) && (count < max);
+        record = get_next_connection_record(&map->table, record))
+   {
+      records[count++] = *record;
+   }
+   unlock_connection_map(map);
+
+   return(count);
+}
+
+/*
+   Function: get_connection_map_top
+   Purpose : Finds the flows of a sensor with the most bytes or packets.
+             Without a window the counts are those since the flow was
+             first seen, from the map's top index. With a window they are
+             those of the minutes the window overlaps, from the map's top
+             window.
+   Input   : Sensor ID, order (PV_TOP_BYTES or PV_TOP_PACKETS), window in
+             seconds (0 for no limit), array for the records and its
+             length.
+   Return  : Number of records, largest first, -1 if the sensor has no
+             map or on error.
+*/
+int get_connection_map_top(const char *sensor_id, int order, time_t since, time_t until, pv_ip_record_t *records, int max)
+{
+   pv_connection_map_t *map;
+   pv_flow_table_t merged;
+   pv_ip_record_t *all, *record;
+   int count = 0;
+
+   pthread_mutex_lock(&connection_maps_lock);
+   HASH_FIND_STR(connection_maps, sensor_id, map);
+   pthread_mutex_unlock(&connection_maps_lock);
+
+   if (map == NULL)
+      return(-1);
+
+   if ((since > 0) || (until > 0))
+   {
+      if (init_growing_flow_table(&merged, PV_SENSOR_MAP_WINDOW_FLOWS, PV_TOP_WINDOW_KEYS(PV_SENSOR_MAP_WINDOW_KEYS, PV_SENSOR_MAP_WINDOW_FLOWS)) < 0)
+         return(-1);
+      lock_connection_map(map);
+      get_flow_window(&map->table, since, until, &merged);
+      unlock_connection_map(map);
+
+      all = xmalloc((merged.count + 1) * sizeof(pv_ip_record_t));
+      for (record = get_next_flow(&merged, NULL); record != NULL; record = get_next_flow(&merged, record))
+         all[count++] = *record;
+      free_flow_table(&merged);
+   }
+   else
+   {
+      all = xmalloc(PV_SENSOR_MAP_TOP * sizeof(pv_ip_record_t));
+      lock_connection_map(map);
+      count = get_flow_top(&map->table, order, all, PV_SENSOR_MAP_TOP);
+      unlock_connection_map(map);
+   }
+
+   count = select_top_records(all, count, order, max);
+   memcpy(records, all, count * sizeof(pv_ip_record_t));
+   free(all);
+
+   return(count);
+}
+
+/*
+   Function: write_connection_maps
+   Purpose : Writes the statistics of every sensor, one map at a time so
+             a sensor is only held up while its own map is written.
+   Input   : Output file.
+*/
+void write_connection_maps(FILE *outfile)
+{
+   pv_connection_map_t *map;
+   char out_str[PV_MAX_INPUT_STR];
+
+   pthread_mutex_lock(&connection_maps_lock);
+   for (map = connection_maps; map != NULL; map = map->hh.next)
+   {
+      lock_connection_map(map);
+      sprintf(out_str, "<sensor><id>%s</id><frames>%lu</frames><flows>%u</flows><expired>%lu</expired><unrecorded>%lu</unrecorded></sensor>\n",
+              map->sensor_id, map->frames, map->table.count, map->table.timers->expired_count, map->table.full_count);
+      fputs(out_str, outfile);
+      write_connection_map(&map->table, outfile);
+      unlock_connection_map(map);
+   }
+   pthread_mutex_unlock(&connection_maps_lock);
+}
+
+/*
+   Function: save_connection_maps
+   Purpose : Replaces the statistics file with the current statistics of
+             every sensor, readers never see a half written file.
+   Input   : File name.
+   Return  : 0 on success, -1 on error.
+*/
+int save_connection_maps(const char *file_name)
+{
+   char temp_name[PV_PATH_MAX_LENGTH];
+   FILE *outfile;
+
+   snprintf(temp_name, PV_PATH_MAX_LENGTH, "%s.tmp", file_name);
+
+   if ((outfile = fopen(temp_name, "w")) == NULL)
+   {
+      sprint_log_entry("save_connection_maps() <ERROR> Could not open statistics file", temp_name);
+      return(-1);
+   }
+
+   write_connection_maps(outfile);
+
+   if ((fclose(outfile) != 0) || (rename(temp_name, file_name) != 0))
+   {
+      iprint_log_entry("save_connection_maps() <ERROR> Could not write statistics file, errno", errno);
+      return(-1);
+   }
+
+   return(0);
+}
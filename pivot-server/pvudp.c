@@ -0,0 +1,390 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvudp.c
+
+   Title : Pivotal NST Server UDP Receiver
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Receives the datagrams of sensors started with -U on the
+            server port. One thread reads up to PV_DATAGRAM_BATCH
+            datagrams per recvmmsg() call and logs the records of each
+            one, rendering binary records to Fineline text, in the log
+            file of the sensor that sent it.
+
+            Each datagram carries the sensor number and a sequence number
+            (see pvframe.c). Sensors are not required to have distinct
+            numbers, so the receiver keeps the next expected number of
+            every source, the sensor number with the address and port the
+            datagram came from, and counts a jump forward as lost
+            datagrams. A bitmap of the last PV_DATAGRAM_REORDER sequence
+            numbers marks the ones counted lost: a datagram from that
+            window that is marked arrived late and is taken off the lost
+            count, one that is not is a duplicate and its records are
+            not logged again. A datagram from further back means the
+            sensor has restarted. The counts are
+            logged every PV_SERVER_STATS_INTERVAL seconds, a source that
+            has been quiet for PV_UDP_SOURCE_IDLE seconds is forgotten.
+
+            The sources of one sensor number share its log file,
+            connection map and registry record. If the log file cannot
+            be opened the datagrams of the sensor are dropped and the
+            open is tried again after PV_SERVER_STATS_INTERVAL seconds.
+
+            Only the receiver thread uses the source and sensor maps.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+#define PV_UDP_SOURCE_IDLE 3600 /* seconds before a quiet source is forgotten */
+
+struct pv_udp_sensor
+{
+   uint32_t sensor;         /* key */
+   FILE *sensor_log;        /* NULL until the log file opens */
+   time_t next_open;        /* when to try opening it again */
+   pv_connection_map_t *connection_map;
+   pv_sensor_record_t *record;
+   UT_hash_handle hh;
+};
+
+typedef struct pv_udp_sensor pv_udp_sensor_t;
+
+struct pv_udp_source_key
+{
+   uint32_t sensor;
+   uint32_t address;        /* network order */
+   uint32_t port;           /* network order */
+};
+
+typedef struct pv_udp_source_key pv_udp_source_key_t;
+
+struct pv_udp_source
+{
+   pv_udp_source_key_t key;
+   uint32_t expected;       /* next sequence number */
+   uint32_t missing[PV_DATAGRAM_REORDER / 32]; /* bit set if the sequence number counted lost */
+   unsigned long datagrams;
+   unsigned long lost;
+   unsigned long late;
+   unsigned long duplicates;
+   unsigned long restarts;
+   time_t last_seen;
+   pv_udp_sensor_t *sensor;
+   UT_hash_handle hh;
+};
+
+typedef struct pv_udp_source pv_udp_source_t;
+
+static pv_udp_sensor_t *udp_sensors = NULL;
+static pv_udp_source_t *udp_sources = NULL;
+static pthread_t udp_thread;
+static int udp_sockfd = -1;
+static char *render_buffer = NULL;
+static int render_size = 0;
+
+/*
+   Function: get_udp_sensor
+   Purpose : Finds the state of a sensor number, the first datagram with
+             a new number opens its log file. A failed open is not tried
+             again for PV_SERVER_STATS_INTERVAL seconds.
+   Input   : Sensor number and the current time.
+   Return  : Sensor state or NULL if its log file is not open.
+*/
+static pv_udp_sensor_t *get_udp_sensor(uint32_t sensor, time_t now)
+{
+   pv_udp_sensor_t *state;
+   char sensor_id[32];
+
+   HASH_FIND(hh, udp_sensors, &sensor, sizeof(uint32_t), state);
+   if ((state != NULL) && (state->sensor_log != NULL))
+      return(state);
+
+   if (state == NULL)
+   {
+      state = xcalloc(sizeof(pv_udp_sensor_t));
+      state->sensor = sensor;
+      HASH_ADD(hh, udp_sensors, sensor, sizeof(uint32_t), state);
+   }
+   else if (now < state->next_open)
+   {
+      return(NULL);
+   }
+
+   sprintf(sensor_id, "<id>SENSOR%04u</id>", sensor);
+   if ((state->sensor_log = open_sensor_event_log(sensor_id, strlen(sensor_id))) == NULL)
+   {
+      iprint_log_entry("get_udp_sensor() <ERROR> Dropping datagrams until the log file opens, sensor", (int)sensor);
+      state->next_open = now + PV_SERVER_STATS_INTERVAL;
+      return(NULL);
+   }
+   state->connection_map = get_connection_map(sensor_id, strlen(sensor_id));
+   state->record = get_sensor_record((int)sensor);
+
+   iprint_log_entry("get_udp_sensor() <INFO> Receiving datagrams from sensor", (int)sensor);
+
+   return(state);
+}
+
+/*
+   Function: get_udp_source
+   Purpose : Finds the sequence state of a source, adding it if the
+             source is new.
+   Input   : Sensor number, address the datagram came from, sequence
+             number of the datagram and the current time.
+   Return  : Source state or NULL on error.
+*/
+static pv_udp_source_t *get_udp_source(uint32_t sensor, const struct sockaddr_in *from, uint32_t sequence, time_t now)
+{
+   pv_udp_source_t *source;
+   pv_udp_source_key_t key;
+   pv_udp_sensor_t *state;
+   char msg[PV_MAX_INPUT_STR];
+   char address[INET_ADDRSTRLEN];
+
+   memset(&key, 0, sizeof(key));
+   key.sensor = sensor;
+   key.address = from->sin_addr.s_addr;
+   key.port = from->sin_port;
+
+   HASH_FIND(hh, udp_sources, &key, sizeof(pv_udp_source_key_t), source);
+   if (source != NULL)
+      return(source);
+
+   if ((state = get_udp_sensor(sensor, now)) == NULL)
+      return(NULL);
+
+   source = xcalloc(sizeof(pv_udp_source_t));
+   source->key = key;
+   source->expected = sequence;
+   source->sensor = state;
+   HASH_ADD(hh, udp_sources, key, sizeof(pv_udp_source_key_t), source);
+
+   inet_ntop(AF_INET, &from->sin_addr, address, sizeof(address));
+   sprintf(msg, "get_udp_source() <INFO> Sensor %04u sending from %s:%u.\n", sensor, address, ntohs(from->sin_port));
+   print_log_entry(msg);
+
+   return(source);
+}
+
+#define PV_MISSING_WORD(s) ((s) % PV_DATAGRAM_REORDER / 32)
+#define PV_MISSING_BIT(s)  (1U << ((s) % 32))
+
+/*
+   Function: check_sequence
+   Purpose : Counts the datagrams lost, late or repeated from the
+             sequence number.
+   Input   : Source state, sequence number of the datagram and where to
+             put the change in the lost count.
+   Return  : 0 if the datagram is new, -1 if it is a duplicate.
+*/
+static int check_sequence(pv_udp_source_t *source, uint32_t sequence, long *lost)
+{
+   int32_t gap = (int32_t)(sequence - source->expected);
+   uint32_t s, marked;
+
+   source->datagrams++;
+   *lost = 0;
+
+   if (gap >= 0)
+   {
+      /* Mark the numbers skipped, their slots drop the numbers that leave the window. */
+      marked = (gap < PV_DATAGRAM_REORDER) ? (uint32_t)gap : PV_DATAGRAM_REORDER;
+      for (s = sequence - marked; s != sequence; s++)
+         source->missing[PV_MISSING_WORD(s)] |= PV_MISSING_BIT(s);
+      source->missing[PV_MISSING_WORD(sequence)] &= ~PV_MISSING_BIT(sequence);
+      source->lost += gap;
+      source->expected = sequence + 1;
+      *lost = gap;
+      return(0);
+   }
+
+   if (gap >= -PV_DATAGRAM_REORDER)
+   {
+      if ((source->missing[PV_MISSING_WORD(sequence)] & PV_MISSING_BIT(sequence)) == 0)
+      {
+         source->duplicates++;
+         return(-1);
+      }
+      source->missing[PV_MISSING_WORD(sequence)] &= ~PV_MISSING_BIT(sequence);
+      source->late++;
+      source->lost--;
+      *lost = -1;
+      return(0);
+   }
+
+   source->restarts++;
+   memset(source->missing, 0, sizeof(source->missing));
+   source->expected = sequence + 1;
+
+   return(0);
+}
+
+/*
+   Function: log_datagram
+   Purpose : Checks a datagram and writes its records to the sensor log.
+   Input   : Datagram, length, the address it came from and the current
+             time.
+   Return  : 0 on success, -1 if the datagram was dropped.
+*/
+static int log_datagram(const unsigned char *datagram, int length, const struct sockaddr_in *from, time_t now)
+{
+   pv_udp_source_t *source;
+   pv_udp_sensor_t *state;
+   pv_frame_t frame;
+   uint32_t sensor, sequence;
+   long lost;
+   int duplicate;
+
+   if (parse_datagram(datagram, length, &sensor, &sequence, &frame) < 0)
+      return(-1);
+
+   if ((source = get_udp_source(sensor, from, sequence, now)) == NULL)
+      return(-1);
+
+   duplicate = check_sequence(source, sequence, &lost);
+   source->last_seen = now;
+   state = source->sensor;
+   if (state->record != NULL)
+      add_sensor_datagrams(state->record, 1, length, lost);
+
+   if ((duplicate < 0) || (frame.type == PV_FRAME_CONTROL))
+      return(0);
+
+   return(log_sensor_frame(state->sensor_log, &frame, &render_buffer, &render_size, state->connection_map));
+}
+
+/* Logs the datagram counts of every source and forgets the ones that have gone quiet. */
+static void log_udp_stats(time_t now)
+{
+   pv_udp_source_t *source, *next;
+   struct in_addr addr;
+   char msg[PV_MAX_INPUT_STR];
+   char address[INET_ADDRSTRLEN];
+
+   for (source = udp_sources; source != NULL; source = next)
+   {
+      next = source->hh.next;
+      addr.s_addr = source->key.address;
+      inet_ntop(AF_INET, &addr, address, sizeof(address));
+      sprintf(msg, "log_udp_stats() <INFO> Sensor %04u at %s:%u: %lu datagrams, %lu lost, %lu late, %lu duplicates, %lu restarts.\n",
+              source->key.sensor, address, ntohs((uint16_t)source->key.port), source->datagrams, source->lost, source->late,
+              source->duplicates, source->restarts);
+      print_log_entry(msg);
+
+      if (now - source->last_seen > PV_UDP_SOURCE_IDLE)
+      {
+         HASH_DEL(udp_sources, source);
+         free(source);
+      }
+   }
+}
+
+static void *udp_receiver_thread(void *arg)
+{
+   struct mmsghdr msgs[PV_DATAGRAM_BATCH];
+   struct iovec iov[PV_DATAGRAM_BATCH];
+   struct sockaddr_in from[PV_DATAGRAM_BATCH];
+   unsigned char *buffers;
+   unsigned long invalid = 0;
+   time_t now;
+   time_t next_stats = time(NULL) + PV_SERVER_STATS_INTERVAL;
+   int i, count;
+
+   buffers = xmalloc(PV_DATAGRAM_BATCH * PV_DATAGRAM_MAX_SIZE);
+   memset(msgs, 0, sizeof(msgs));
+   for (i = 0; i < PV_DATAGRAM_BATCH; i++)
+   {
+      iov[i].iov_base = buffers + i * PV_DATAGRAM_MAX_SIZE;
+      iov[i].iov_len = PV_DATAGRAM_MAX_SIZE;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &from[i];
+   }
+
+   print_log_entry("udp_receiver_thread() <INFO> Waiting for datagrams...\n");
+
+   while (1)
+   {
+      for (i = 0; i < PV_DATAGRAM_BATCH; i++)
+         msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+      /* The socket times out, so the stats are logged while the sensors are quiet. */
+      count = recvmmsg(udp_sockfd, msgs, PV_DATAGRAM_BATCH, MSG_WAITFORONE, NULL);
+      if ((count < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+      {
+         print_log_entry("udp_receiver_thread() <ERROR> Could not receive datagrams.\n");
+         break;
+      }
+
+      now = time(NULL);
+      for (i = 0; i < count; i++)
+      {
+         if (log_datagram(buffers + i * PV_DATAGRAM_MAX_SIZE, msgs[i].msg_len, &from[i], now) < 0)
+            invalid++;
+      }
+
+      if (now >= next_stats)
+      {
+         log_udp_stats(now);
+         if (invalid > 0)
+            iprint_log_entry("udp_receiver_thread() <WARNING> Invalid datagrams received", (int)invalid);
+         invalid = 0;
+         next_stats = now + PV_SERVER_STATS_INTERVAL;
+      }
+   }
+
+   free(buffers);
+
+   return(NULL);
+}
+
+/*
+   Function: start_udp_receiver
+   Purpose : Opens the UDP port and starts the receiver thread.
+   Input   : UDP port number.
+   Return  : 0 on success, -1 on error.
+*/
+int start_udp_receiver(int port_number)
+{
+   if ((udp_sockfd = init_udp_server_socket(port_number, PV_SERVER_STATS_INTERVAL * 1000)) < 0)
+      return(-1);
+
+   if (pthread_create(&udp_thread, NULL, udp_receiver_thread, NULL) != 0)
+   {
+      print_log_entry("start_udp_receiver() <ERROR> Could not create receiver thread.\n");
+      close(udp_sockfd);
+      udp_sockfd = -1;
+      return(-1);
+   }
+
+   return(0);
+}
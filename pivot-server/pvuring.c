@@ -0,0 +1,325 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvuring.c
+
+   Title : Pivotal NST Server io_uring Interface
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: A small io_uring interface for the server, made straight on
+            the system calls so the server does not need liburing. Only
+            built with -DPV_IO_URING (make URING=-DPV_IO_URING), needs
+            Linux 6.0 or later for multishot receives.
+
+            A ring is set up with init_uring(), requests are added with
+            get_uring_sqe() and one of the prep functions, submit_uring()
+            hands everything added so far to the kernel in one
+            io_uring_enter() call and can wait for completions in the
+            same call. Completions are read with peek_uring_cqe() and
+            seen_uring_cqe().
+
+            A provided buffer ring (init_uring_buffers()) lets multishot
+            receives pick their own buffers, so one receive request keeps
+            delivering data for a connection without a system call per
+            read. A buffer is given back to the kernel with
+            return_uring_buffer() once its data has been copied out.
+
+            Each ring is used by one thread only.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#ifdef PV_IO_URING
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+   return((int)syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+   return((int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+   return((int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+/*
+   Function: init_uring
+   Purpose : Creates a ring and maps its submission and completion
+             queues.
+   Input   : Ring and number of submission entries.
+   Return  : 0 on success, -1 if io_uring is not available.
+*/
+int init_uring(pv_uring_t *ring, unsigned int entries)
+{
+   struct io_uring_params params;
+   unsigned char *sq, *cq;
+
+   memset(ring, 0, sizeof(pv_uring_t));
+   memset(&params, 0, sizeof(params));
+
+   if ((ring->fd = io_uring_setup(entries, &params)) < 0)
+   {
+      iprint_log_entry("init_uring() <WARNING> io_uring is not available, errno", errno);
+      return(-1);
+   }
+
+   if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+   {
+      print_log_entry("init_uring() <WARNING> Kernel io_uring is too old.\n");
+      close(ring->fd);
+      return(-1);
+   }
+
+   /* The submission and completion rings share one mapping. */
+   ring->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+   if (ring->ring_size < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+      ring->ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+   ring->ring_map = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if (ring->ring_map == MAP_FAILED)
+   {
+      print_log_entry("init_uring() <ERROR> Could not map io_uring.\n");
+      close(ring->fd);
+      return(-1);
+   }
+
+   ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED)
+   {
+      print_log_entry("init_uring() <ERROR> Could not map io_uring entries.\n");
+      munmap(ring->ring_map, ring->ring_size);
+      close(ring->fd);
+      return(-1);
+   }
+
+   sq = (unsigned char *)ring->ring_map;
+   cq = (unsigned char *)ring->ring_map;
+   ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+   ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+   ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+   ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+   ring->sq_entries = params.sq_entries;
+   ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+   ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+   ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+   ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+   ring->sqe_tail = *ring->sq_tail;
+
+   return(0);
+}
+
+void free_uring(pv_uring_t *ring)
+{
+   munmap(ring->sqes, ring->sqes_size);
+   munmap(ring->ring_map, ring->ring_size);
+   close(ring->fd);
+}
+
+/*
+   Function: get_uring_sqe
+   Purpose : Takes the next free submission entry, cleared.
+   Input   : Ring.
+   Return  : Entry, or NULL if the queue is full and has to be submitted
+             first.
+*/
+struct io_uring_sqe *get_uring_sqe(pv_uring_t *ring)
+{
+   struct io_uring_sqe *sqe;
+   unsigned int head = *(volatile unsigned int *)ring->sq_head;
+   unsigned int index;
+
+   if (ring->sqe_tail - head >= ring->sq_entries)
+      return(NULL);
+
+   index = ring->sqe_tail & ring->sq_mask;
+   sqe = &ring->sqes[index];
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+   ring->sq_array[index] = index;
+   ring->sqe_tail++;
+
+   return(sqe);
+}
+
+/* Space left in the submission queue. */
+unsigned int get_uring_space(pv_uring_t *ring)
+{
+   return(ring->sq_entries - (ring->sqe_tail - *(volatile unsigned int *)ring->sq_head));
+}
+
+/*
+   Function: submit_uring
+   Purpose : Publishes the entries taken so far and submits them, and
+             waits for completions in the same system call.
+   Input   : Ring and number of completions to wait for, 0 for none.
+   Return  : Number of entries submitted, -1 on error.
+*/
+int submit_uring(pv_uring_t *ring, unsigned int wait)
+{
+   unsigned int to_submit = ring->sqe_tail - *ring->sq_tail;
+   int res;
+
+   __sync_synchronize(); /* The entries are written before the kernel sees the tail. */
+   *(volatile unsigned int *)ring->sq_tail = ring->sqe_tail;
+   __sync_synchronize();
+
+   do
+   {
+      res = io_uring_enter(ring->fd, to_submit, wait, (wait > 0) ? IORING_ENTER_GETEVENTS : 0);
+   } while ((res < 0) && (errno == EINTR));
+
+   if (res < 0)
+   {
+      iprint_log_entry("submit_uring() <ERROR> io_uring_enter failed, errno", errno);
+      return(-1);
+   }
+
+   return(res);
+}
+
+/* The next completion, NULL if there is none. */
+struct io_uring_cqe *peek_uring_cqe(pv_uring_t *ring)
+{
+   unsigned int head = *ring->cq_head;
+
+   if (head == *(volatile unsigned int *)ring->cq_tail)
+      return(NULL);
+
+   __sync_synchronize(); /* Read the entry only after seeing the tail. */
+
+   return(&ring->cqes[head & ring->cq_mask]);
+}
+
+/* Gives the completion returned by peek_uring_cqe() back to the kernel. */
+void seen_uring_cqe(pv_uring_t *ring)
+{
+   __sync_synchronize();
+   *(volatile unsigned int *)ring->cq_head = *ring->cq_head + 1;
+}
+
+void prep_uring_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = fd;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_NONBLOCK;
+   sqe->user_data = user_data;
+}
+
+void prep_uring_recv(struct io_uring_sqe *sqe, int fd, int group, uint64_t user_data)
+{
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = fd;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = group;
+   sqe->user_data = user_data;
+}
+
+/* An append to a file opened with O_APPEND, linked to the next entry if link is set. */
+void prep_uring_write(struct io_uring_sqe *sqe, int fd, const void *buffer, unsigned int length, uint64_t user_data, int link)
+{
+   sqe->opcode = IORING_OP_WRITE;
+   sqe->fd = fd;
+   sqe->off = (uint64_t)-1; /* the file position */
+   sqe->addr = (uint64_t)(uintptr_t)buffer;
+   sqe->len = length;
+   sqe->user_data = user_data;
+   if (link)
+      sqe->flags = IOSQE_IO_LINK;
+}
+
+/*
+   Function: init_uring_buffers
+   Purpose : Registers a ring of receive buffers the kernel picks from.
+   Input   : Ring, buffers, buffer group, number of buffers (a power of
+             two) and size of each buffer.
+   Return  : 0 on success, -1 on error.
+*/
+int init_uring_buffers(pv_uring_t *ring, pv_uring_buffers_t *buffers, int group, unsigned int count, unsigned int size)
+{
+   struct io_uring_buf_reg reg;
+   unsigned int i;
+
+   memset(buffers, 0, sizeof(pv_uring_buffers_t));
+   buffers->map_size = count * sizeof(struct io_uring_buf);
+   buffers->ring = mmap(NULL, buffers->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (buffers->ring == MAP_FAILED)
+   {
+      print_log_entry("init_uring_buffers() <ERROR> Could not map buffer ring.\n");
+      return(-1);
+   }
+
+   buffers->data = xmalloc((size_t)count * size);
+   buffers->count = count;
+   buffers->size = size;
+   buffers->group = group;
+
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uint64_t)(uintptr_t)buffers->ring;
+   reg.ring_entries = count;
+   reg.bgid = group;
+   if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+   {
+      iprint_log_entry("init_uring_buffers() <WARNING> Could not register buffer ring, errno", errno);
+      munmap(buffers->ring, buffers->map_size);
+      free(buffers->data);
+      return(-1);
+   }
+
+   for (i = 0; i < count; i++)
+      return_uring_buffer(buffers, i);
+
+   return(0);
+}
+
+/* The data of a buffer picked by the kernel. */
+char *get_uring_buffer(pv_uring_buffers_t *buffers, unsigned int id)
+{
+   return(buffers->data + (size_t)id * buffers->size);
+}
+
+/* Gives a buffer back to the kernel once its data has been used. */
+void return_uring_buffer(pv_uring_buffers_t *buffers, unsigned int id)
+{
+   struct io_uring_buf *buf = &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+
+   buf->addr = (uint64_t)(uintptr_t)get_uring_buffer(buffers, id);
+   buf->len = buffers->size;
+   buf->bid = id;
+   buffers->tail++;
+
+   __sync_synchronize(); /* The buffer is set before the kernel sees the tail. */
+   *(volatile uint16_t *)&buffers->ring->tail = buffers->tail;
+}
+
+#endif
@@ -0,0 +1,1232 @@
+/*  Copyright 2014 Derek Chadwick
+
+    This file is part of the Pivotal Network Security Tools.
+
+    Pivotal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Pivotal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Pivotal.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   pvwhois.c
+
+   Title : Pivotal NST Server Remote IP Owners
+   Author: Derek Chadwick
+   Date  : 06/07/2014
+
+   Purpose: Finds the owner (whois) and host name (reverse DNS) of the
+            remote IP addresses. find_ip_owner() only looks in the caches
+            and never waits for the network, an address it does not know
+            is queued for the lookup workers and is known by a later call.
+            The exports of the remote IP statistics ask for the owners,
+            the ingest path never does.
+
+            The results are cached three ways:
+
+            1. An LRU of PV_WHOIS_CACHE_SIZE entries in memory.
+            2. The network prefix (CIDR block) the owner was found for,
+               so every other address in the block has its owner without
+               a lookup. Only the prefix lengths that have been seen are
+               probed, longest first.
+            3. A cache file mapped into memory, found again by the next
+               server that opens it. It is a fixed table of slots with
+               short probe runs, a full run gives up its oldest slot.
+
+            A lookup that finds nothing is cached too, for a shorter time
+            (PV_WHOIS_NEGATIVE_TTL), so unknown addresses are not looked
+            up again and again.
+
+            The lookups are made by a resolver function, the default
+            (resolve_ip_owner()) asks the DNS for the host name and the
+            Team Cymru whois server, which gives the AS, the BGP prefix,
+            the country and the AS name in one line, for the owner. The
+            DNS is queried through the resolver library (res_nquery()),
+            not getaddrinfo() or getnameinfo(), so the statically linked
+            server needs no NSS modules at run time. set_ip_resolver()
+            puts in another resolver, check_ip_enrichment() (-L) uses a
+            local table to check the caches. With the default resolver a
+            worker takes up to PV_WHOIS_BATCH queued addresses at a time
+            and asks for all their owners in one bulk query on one
+            connection.
+
+            Only an answer is cached. A lookup that could not be made,
+            because the DNS or the whois server could not be reached,
+            is dropped and made again the next time the address is
+            asked for.
+
+            The lookups disclose the remote addresses to the whois server
+            and the DNS, the server only starts them when asked (-l).
+
+            The caches have one lock, held for memory lookups only, the
+            resolvers run without it.
+
+   Status : EXPERIMENTAL - not for use in production networks.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <time.h>
+#include <arpa/nameser.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "pvcommon.h"
+#include "pivot-server.h"
+
+#define PV_OWNER_KEY_SIZE 18 /* family, prefix length and address at the start of pv_ip_owner_t */
+
+struct pv_owner_entry
+{
+   pv_ip_owner_t owner;    /* starts with the key */
+   time_t expires;
+   struct pv_owner_entry *lru_prev; /* most recently used first */
+   struct pv_owner_entry *lru_next;
+   UT_hash_handle hh;
+};
+
+typedef struct pv_owner_entry pv_owner_entry_t;
+
+struct pv_owner_request
+{
+   pv_ip_owner_t key;      /* only the key is set */
+   int wanted;             /* PV_OWNER_FOUND and PV_HOST_FOUND */
+   struct pv_owner_request *next;
+   UT_hash_handle hh;
+};
+
+typedef struct pv_owner_request pv_owner_request_t;
+
+struct pv_owner_slot
+{
+   uint32_t hash;
+   uint32_t state;         /* 0 empty, 1 in use */
+   int64_t expires;
+   pv_ip_owner_t owner;
+};
+
+typedef struct pv_owner_slot pv_owner_slot_t;
+
+struct pv_owner_file_header
+{
+   char magic[8];
+   uint32_t slots;
+   uint32_t slot_size;
+   uint8_t prefix_lengths[2][129]; /* prefix lengths in the file, IPv4 and IPv6 */
+};
+
+typedef struct pv_owner_file_header pv_owner_file_header_t;
+
+static pthread_mutex_t owner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t owner_ready = PTHREAD_COND_INITIALIZER;
+static int owner_started = 0;
+
+static pv_owner_entry_t *owner_cache = NULL;     /* exact addresses and prefixes */
+static pv_owner_entry_t *owner_lru_head = NULL;
+static pv_owner_entry_t *owner_lru_tail = NULL;
+static unsigned int owner_cache_count = 0;
+static unsigned int owner_prefix_count[2][129];  /* prefixes in the LRU by length */
+
+static __thread struct __res_state dns_state;    /* each lookup worker has its own DNS resolver */
+static __thread int dns_ready = 0;
+
+static pv_owner_request_t *owner_pending = NULL; /* queued or being looked up */
+static pv_owner_request_t *owner_queue_head = NULL;
+static pv_owner_request_t *owner_queue_tail = NULL;
+static unsigned int owner_queue_count = 0;
+
+static int owner_fd = -1;
+static unsigned char *owner_map = NULL;
+static size_t owner_map_size = 0;
+static pv_owner_file_header_t *owner_header = NULL;
+static pv_owner_slot_t *owner_slots = NULL;
+
+static pv_resolver_func owner_resolver = resolve_ip_owner;
+static void *owner_resolver_user = NULL;
+
+static pv_owner_stats_t owner_stats;
+
+/* Address length in bytes and bits. */
+static int get_address_bytes(int family)
+{
+   return((family == PV_FLOW_IPV6) ? 16 : 4);
+}
+
+static int get_address_bits(int family)
+{
+   return((family == PV_FLOW_IPV6) ? 128 : 32);
+}
+
+/* Sets a key to the first prefix_len bits of an address. */
+static void set_owner_key(pv_ip_owner_t *key, int family, const uint8_t *addr, int prefix_len)
+{
+   int i;
+
+   memset(key, 0, PV_OWNER_KEY_SIZE);
+   key->family = family;
+   key->prefix_len = prefix_len;
+   memcpy(key->addr, addr, get_address_bytes(family));
+
+   for (i = prefix_len; i < get_address_bits(family); i++)
+      key->addr[i >> 3] &= ~(0x80 >> (i & 7));
+}
+
+/* FNV-1a over the key. */
+static uint32_t hash_owner_key(const pv_ip_owner_t *key)
+{
+   const uint8_t *p = (const uint8_t *)key;
+   uint32_t hash = 2166136261U;
+   int i;
+
+   for (i = 0; i < PV_OWNER_KEY_SIZE; i++)
+   {
+      hash ^= p[i];
+      hash *= 16777619U;
+   }
+
+   return(hash);
+}
+
+/*
+   Function: open_owner_file
+   Purpose : Opens or creates the cache file and maps it. A file made
+             for another number of slots is emptied.
+   Input   : File name.
+   Return  : 0 on success, -1 on error.
+*/
+static int open_owner_file(const char *file_name)
+{
+   int res;
+
+   if ((owner_fd = open(file_name, O_RDWR | O_CREAT, 0600)) < 0)
+   {
+      sprint_log_entry("open_owner_file() <ERROR> Could not open whois cache file", (char *)file_name);
+      return(-1);
+   }
+
+   owner_map_size = PV_WHOIS_FILE_HEADER + (size_t)PV_WHOIS_FILE_SLOTS * sizeof(pv_owner_slot_t);
+
+   /* Allocate the blocks now, a full disk would otherwise fault the mapping. */
+   if ((res = posix_fallocate(owner_fd, 0, owner_map_size)) != 0)
+   {
+      iprint_log_entry("open_owner_file() <ERROR> Could not allocate whois cache file", res);
+      close(owner_fd);
+      owner_fd = -1;
+      return(-1);
+   }
+
+   owner_map = mmap(NULL, owner_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, owner_fd, 0);
+   if (owner_map == MAP_FAILED)
+   {
+      print_log_entry("open_owner_file() <ERROR> Could not map whois cache file.\n");
+      owner_map = NULL;
+      close(owner_fd);
+      owner_fd = -1;
+      return(-1);
+   }
+
+   owner_header = (pv_owner_file_header_t *)owner_map;
+   owner_slots = (pv_owner_slot_t *)(owner_map + PV_WHOIS_FILE_HEADER);
+
+   if ((memcmp(owner_header->magic, PV_WHOIS_MAGIC, 8) != 0) || (owner_header->slots != PV_WHOIS_FILE_SLOTS) ||
+       (owner_header->slot_size != sizeof(pv_owner_slot_t)))
+   {
+      memset(owner_map, 0, owner_map_size);
+      memcpy(owner_header->magic, PV_WHOIS_MAGIC, 8);
+      owner_header->slots = PV_WHOIS_FILE_SLOTS;
+      owner_header->slot_size = sizeof(pv_owner_slot_t);
+   }
+
+   return(0);
+}
+
+/* Finds a key in the cache file, NULL if it is not there or has expired. */
+static pv_owner_slot_t *find_owner_slot(const pv_ip_owner_t *key, time_t now)
+{
+   pv_owner_slot_t *slot;
+   uint32_t hash = hash_owner_key(key);
+   int i;
+
+   if (owner_slots == NULL)
+      return(NULL);
+
+   for (i = 0; i < PV_WHOIS_FILE_PROBES; i++)
+   {
+      slot = &owner_slots[(hash + i) & (PV_WHOIS_FILE_SLOTS - 1)];
+      if (slot->state == 0)
+         return(NULL);
+      if ((slot->hash == hash) && (memcmp(&slot->owner, key, PV_OWNER_KEY_SIZE) == 0))
+         return((slot->expires > (int64_t)now) ? slot : NULL);
+   }
+
+   return(NULL);
+}
+
+/* Writes an entry to the cache file, in its own slot, a free or expired slot or the oldest slot of its run. */
+static void store_owner_slot(const pv_owner_entry_t *entry, time_t now)
+{
+   pv_owner_slot_t *slot, *oldest = NULL;
+   uint32_t hash = hash_owner_key(&entry->owner);
+   int i;
+
+   if (owner_slots == NULL)
+      return;
+
+   for (i = 0; i < PV_WHOIS_FILE_PROBES; i++)
+   {
+      slot = &owner_slots[(hash + i) & (PV_WHOIS_FILE_SLOTS - 1)];
+      if ((slot->state == 0) || ((slot->hash == hash) && (memcmp(&slot->owner, &entry->owner, PV_OWNER_KEY_SIZE) == 0)))
+      {
+         oldest = slot;
+         break;
+      }
+      if ((oldest == NULL) || (slot->expires < oldest->expires))
+         oldest = slot;
+   }
+
+   oldest->hash = hash;
+   oldest->expires = (int64_t)entry->expires;
+   oldest->owner = entry->owner;
+   oldest->state = 1;
+
+   owner_header->prefix_lengths[entry->owner.family == PV_FLOW_IPV6][entry->owner.prefix_len] = 1;
+}
+
+/* Takes an entry out of the LRU list. */
+static void unlink_owner_entry(pv_owner_entry_t *entry)
+{
+   if (entry->lru_prev != NULL)
+      entry->lru_prev->lru_next = entry->lru_next;
+   else
+      owner_lru_head = entry->lru_next;
+   if (entry->lru_next != NULL)
+      entry->lru_next->lru_prev = entry->lru_prev;
+   else
+      owner_lru_tail = entry->lru_prev;
+}
+
+/* Puts an entry at the head of the LRU list. */
+static void push_owner_entry(pv_owner_entry_t *entry)
+{
+   entry->lru_prev = NULL;
+   entry->lru_next = owner_lru_head;
+   if (owner_lru_head != NULL)
+      owner_lru_head->lru_prev = entry;
+   else
+      owner_lru_tail = entry;
+   owner_lru_head = entry;
+}
+
+static void delete_owner_entry(pv_owner_entry_t *entry)
+{
+   unlink_owner_entry(entry);
+   HASH_DEL(owner_cache, entry);
+   if (entry->owner.prefix_len < get_address_bits(entry->owner.family))
+      owner_prefix_count[entry->owner.family == PV_FLOW_IPV6][entry->owner.prefix_len]--;
+   owner_cache_count--;
+   free(entry);
+}
+
+/*
+   Function: add_owner_entry
+   Purpose : Adds or replaces an entry in the LRU, the least recently
+             used entry goes when the LRU is full.
+   Input   : Owner, starting with its key, and expiry time.
+   Return  : The entry.
+*/
+static pv_owner_entry_t *add_owner_entry(const pv_ip_owner_t *owner, time_t expires)
+{
+   pv_owner_entry_t *entry;
+
+   HASH_FIND(hh, owner_cache, owner, PV_OWNER_KEY_SIZE, entry);
+   if (entry != NULL)
+   {
+      entry->owner = *owner;
+      entry->expires = expires;
+      unlink_owner_entry(entry);
+      push_owner_entry(entry);
+      return(entry);
+   }
+
+   if ((owner_cache_count >= PV_WHOIS_CACHE_SIZE) && (owner_lru_tail != NULL))
+      delete_owner_entry(owner_lru_tail);
+
+   entry = xcalloc(sizeof(pv_owner_entry_t));
+   entry->owner = *owner;
+   entry->expires = expires;
+   HASH_ADD_KEYPTR(hh, owner_cache, &entry->owner, PV_OWNER_KEY_SIZE, entry);
+   push_owner_entry(entry);
+   if (owner->prefix_len < get_address_bits(owner->family))
+      owner_prefix_count[owner->family == PV_FLOW_IPV6][owner->prefix_len]++;
+   owner_cache_count++;
+
+   return(entry);
+}
+
+/*
+   Function: find_owner_entry
+   Purpose : Finds a key in the LRU, then in the cache file, moving a
+             file entry into the LRU. Expired entries are dropped.
+   Input   : Key and the time now.
+   Return  : The entry or NULL.
+*/
+static pv_owner_entry_t *find_owner_entry(const pv_ip_owner_t *key, time_t now)
+{
+   pv_owner_entry_t *entry;
+   pv_owner_slot_t *slot;
+
+   HASH_FIND(hh, owner_cache, key, PV_OWNER_KEY_SIZE, entry);
+   if (entry != NULL)
+   {
+      if (entry->expires > now)
+      {
+         unlink_owner_entry(entry);
+         push_owner_entry(entry);
+         return(entry);
+      }
+      delete_owner_entry(entry);
+   }
+
+   if ((slot = find_owner_slot(key, now)) != NULL)
+   {
+      owner_stats.file_hits++;
+      return(add_owner_entry(&slot->owner, (time_t)slot->expires));
+   }
+
+   return(NULL);
+}
+
+/* Finds the longest cached prefix holding an address, in the LRU or the file. */
+static pv_owner_entry_t *find_owner_prefix(int family, const uint8_t *addr, time_t now)
+{
+   pv_owner_entry_t *entry;
+   pv_ip_owner_t key;
+   int v6 = (family == PV_FLOW_IPV6);
+   int len;
+
+   for (len = get_address_bits(family) - 1; len >= 0; len--)
+   {
+      if ((owner_prefix_count[v6][len] == 0) && ((owner_header == NULL) || (owner_header->prefix_lengths[v6][len] == 0)))
+         continue;
+
+      set_owner_key(&key, family, addr, len);
+      if ((entry = find_owner_entry(&key, now)) != NULL)
+         return(entry);
+   }
+
+   return(NULL);
+}
+
+/* Queues a lookup unless the address is already waiting, the owner lock held. */
+static void queue_owner_request(int family, const uint8_t *addr, int wanted)
+{
+   pv_owner_request_t *request;
+   pv_ip_owner_t key;
+
+   set_owner_key(&key, family, addr, get_address_bits(family));
+
+   HASH_FIND(hh, owner_pending, &key, PV_OWNER_KEY_SIZE, request);
+   if (request != NULL)
+      return;
+
+   if (owner_queue_count >= PV_WHOIS_QUEUE_MAX)
+   {
+      owner_stats.queue_full++;
+      return;
+   }
+
+   request = xcalloc(sizeof(pv_owner_request_t));
+   request->key = key;
+   request->wanted = wanted;
+   HASH_ADD_KEYPTR(hh, owner_pending, &request->key, PV_OWNER_KEY_SIZE, request);
+
+   if (owner_queue_tail != NULL)
+      owner_queue_tail->next = request;
+   else
+      owner_queue_head = request;
+   owner_queue_tail = request;
+   owner_queue_count++;
+   owner_stats.queued++;
+
+   pthread_cond_signal(&owner_ready);
+}
+
+/*
+   Function: find_cached_owner
+   Purpose : Gets the owner and host name of an address from the caches.
+             An address the caches do not have is queued for a lookup,
+             an address in a known prefix gets the owner of the prefix
+             straight away and is queued for its host name.
+   Input   : Address family, address, the owner to fill in and the
+             current time, the owner lock held.
+   Return  : 0 if the owner or host name is known, -1 if not (yet).
+*/
+static int find_cached_owner(int family, const uint8_t *addr, pv_ip_owner_t *owner, time_t now)
+{
+   pv_owner_entry_t *entry;
+   pv_ip_owner_t key;
+   int res = -1;
+
+   memset(owner, 0, sizeof(pv_ip_owner_t));
+   set_owner_key(&key, family, addr, get_address_bits(family));
+
+   if ((entry = find_owner_entry(&key, now)) != NULL)
+   {
+      *owner = entry->owner;
+      if (owner->flags & PV_OWNER_NEGATIVE)
+         owner_stats.negative_hits++;
+      else
+         owner_stats.hits++;
+      res = (owner->flags & (PV_OWNER_FOUND | PV_HOST_FOUND)) ? 0 : -1;
+   }
+   else if (((entry = find_owner_prefix(family, addr, now)) != NULL) && (entry->owner.flags & PV_OWNER_FOUND))
+   {
+      *owner = entry->owner;
+      owner_stats.prefix_hits++;
+      queue_owner_request(family, addr, PV_HOST_FOUND);
+      res = 0;
+   }
+   else
+   {
+      owner_stats.misses++;
+      queue_owner_request(family, addr, PV_OWNER_FOUND | PV_HOST_FOUND);
+   }
+
+   return(res);
+}
+
+/*
+   Function: find_ip_owner
+   Purpose : Gets the owner and host name of an address from the caches,
+             see find_cached_owner().
+   Input   : Address family, address and the owner to fill in.
+   Return  : 0 if the owner or host name is known, -1 if not (yet).
+*/
+int find_ip_owner(int family, const uint8_t *addr, pv_ip_owner_t *owner)
+{
+   int res;
+
+   memset(owner, 0, sizeof(pv_ip_owner_t));
+
+   if (!owner_started)
+      return(-1);
+
+   pthread_mutex_lock(&owner_lock);
+   res = find_cached_owner(family, addr, owner, time(NULL));
+   pthread_mutex_unlock(&owner_lock);
+
+   return(res);
+}
+
+/*
+   Function: find_ip_owners
+   Purpose : Gets the owners of the addresses of several records from the
+             caches under one hold of the owner lock, for the exports.
+   Input   : Records keyed by address, their number and an array for the
+             owners, an owner not known (yet) is left empty.
+   Return  : Number of owners or host names known.
+*/
+int find_ip_owners(const pv_ip_record_t *records, int count, pv_ip_owner_t *owners)
+{
+   time_t now = time(NULL);
+   int i, known = 0;
+
+   memset(owners, 0, count * sizeof(pv_ip_owner_t));
+
+   if (!owner_started)
+      return(0);
+
+   pthread_mutex_lock(&owner_lock);
+   for (i = 0; i < count; i++)
+   {
+      if (find_cached_owner(records[i].key.family, records[i].key.src_addr, &owners[i], now) == 0)
+         known++;
+   }
+   pthread_mutex_unlock(&owner_lock);
+
+   return(known);
+}
+
+/*
+   Function: store_ip_owner
+   Purpose : Caches the result of a lookup, the address and, when the
+             resolver found it, the prefix of the owner. A lookup that
+             found nothing is cached as a negative entry, one that could
+             not be made (PV_RESOLVE_ERROR) is not cached.
+   Input   : Request, the owner found and the resolver result.
+*/
+static void store_ip_owner(pv_owner_request_t *request, pv_ip_owner_t *found, int res)
+{
+   pv_owner_entry_t *entry, *prefix;
+   pv_ip_owner_t owner;
+   time_t now = time(NULL);
+   int bits = get_address_bits(request->key.family);
+
+   memset(&owner, 0, sizeof(pv_ip_owner_t));
+
+   pthread_mutex_lock(&owner_lock);
+
+   /* Nothing was learnt, the address is looked up again when it is next asked for. */
+   if (res == PV_RESOLVE_ERROR)
+   {
+      owner_stats.errors++;
+      HASH_DEL(owner_pending, request);
+      pthread_mutex_unlock(&owner_lock);
+      free(request);
+      return;
+   }
+
+   if ((request->wanted & PV_OWNER_FOUND) && (res == 0) && (found->flags & PV_OWNER_FOUND))
+   {
+      owner.asn = found->asn;
+      strcpy(owner.country, found->country);
+      strcpy(owner.owner, found->owner);
+      owner.flags = PV_OWNER_FOUND;
+
+      /* The prefix of the owner, for the other addresses in it. */
+      if ((found->prefix_len > 0) && (found->prefix_len < bits))
+      {
+         set_owner_key(&owner, request->key.family, found->addr, found->prefix_len);
+         prefix = add_owner_entry(&owner, now + PV_WHOIS_TTL);
+         store_owner_slot(prefix, now);
+      }
+   }
+   else if (!(request->wanted & PV_OWNER_FOUND))
+   {
+      /* A host name lookup, the owner is that of the prefix. */
+      prefix = find_owner_prefix(request->key.family, request->key.addr, now);
+      if ((prefix != NULL) && (prefix->owner.flags & PV_OWNER_FOUND))
+         owner = prefix->owner;
+   }
+
+   if ((res == 0) && (found->flags & PV_HOST_FOUND))
+   {
+      strcpy(owner.host_name, found->host_name);
+      owner.flags |= PV_HOST_FOUND;
+   }
+
+   set_owner_key(&owner, request->key.family, request->key.addr, bits);
+
+   if (owner.flags == 0)
+   {
+      owner.flags = PV_OWNER_NEGATIVE;
+      entry = add_owner_entry(&owner, now + PV_WHOIS_NEGATIVE_TTL);
+      owner_stats.failures++;
+   }
+   else
+   {
+      entry = add_owner_entry(&owner, now + PV_WHOIS_TTL);
+   }
+   store_owner_slot(entry, now);
+   owner_stats.lookups++;
+
+   HASH_DEL(owner_pending, request);
+
+   pthread_mutex_unlock(&owner_lock);
+
+   free(request);
+}
+
+/* Copies a whois field, trimmed, into a string. */
+static void copy_whois_field(char *out, int size, char *field)
+{
+   field = trim(field);
+   strncpy(out, field, size - 1);
+   out[size - 1] = 0;
+}
+
+/*
+   Function: parse_whois_line
+   Purpose : Fills in the owner of the address a verbose whois line is
+             for, "AS | IP | BGP Prefix | CC | Registry | Allocated |
+             AS Name". Other lines, e.g. the bulk mode header, and
+             addresses with no AS are skipped.
+   Input   : Line, the addresses asked for, their owners and how many.
+*/
+static void parse_whois_line(char *line, pv_ip_owner_t **keys, pv_ip_owner_t **owners, int count)
+{
+   pv_ip_owner_t *owner = NULL;
+   char *fields[7], *slash;
+   uint8_t addr[16];
+   uint32_t asn;
+   int family, i;
+
+   fields[0] = line;
+   for (i = 1; i < 7; i++)
+   {
+      if ((fields[i] = strchr(fields[i - 1], '|')) == NULL)
+         return;
+      *fields[i]++ = 0;
+   }
+
+   fields[1] = trim(fields[1]);
+   family = (strchr(fields[1], ':') != NULL) ? PV_FLOW_IPV6 : PV_FLOW_IPV4;
+   if ((asn = (uint32_t)strtoul(trim(fields[0]), NULL, 10)) == 0)
+      return;
+   if (inet_pton((family == PV_FLOW_IPV6) ? AF_INET6 : AF_INET, fields[1], addr) != 1)
+      return;
+
+   for (i = 0; i < count; i++)
+   {
+      if ((keys[i]->family == family) && (memcmp(keys[i]->addr, addr, get_address_bytes(family)) == 0) &&
+          !(owners[i]->flags & PV_OWNER_FOUND))
+      {
+         owner = owners[i];
+         break;
+      }
+   }
+   if (owner == NULL)
+      return;
+
+   owner->asn = asn;
+   copy_whois_field(owner->country, sizeof(owner->country), fields[3]);
+   copy_whois_field(owner->owner, sizeof(owner->owner), fields[6]);
+
+   fields[2] = trim(fields[2]);
+   if ((slash = strchr(fields[2], '/')) != NULL)
+   {
+      *slash++ = 0;
+      if (inet_pton((family == PV_FLOW_IPV6) ? AF_INET6 : AF_INET, fields[2], addr) == 1)
+      {
+         memcpy(owner->addr, addr, get_address_bytes(family));
+         owner->prefix_len = atoi(slash);
+      }
+   }
+
+   owner->flags |= PV_OWNER_FOUND;
+}
+
+/*
+   Function: read_whois_reply
+   Purpose : Reads a whois reply up to the end of the connection, a line
+             at a time, and fills in the owners of the addresses found.
+   Input   : Socket, the addresses asked for, their owners and how many.
+   Return  : 0 on success, -1 on error.
+*/
+static int read_whois_reply(int sockfd, pv_ip_owner_t **keys, pv_ip_owner_t **owners, int count)
+{
+   char buffer[PV_WHOIS_REPLY_SIZE];
+   char *line, *end;
+   int length = 0;
+   int n;
+
+   while (1)
+   {
+      if ((n = recv(sockfd, buffer + length, sizeof(buffer) - 1 - length, 0)) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return(-1);
+      }
+      if (n == 0)
+         break;
+      length += n;
+      buffer[length] = 0;
+
+      for (line = buffer; (end = strchr(line, '\n')) != NULL; line = end + 1)
+      {
+         *end = 0;
+         parse_whois_line(line, keys, owners, count);
+      }
+      length -= (int)(line - buffer);
+      memmove(buffer, line, length);
+
+      /* A line longer than the buffer is no reply line, drop it. */
+      if (length == sizeof(buffer) - 1)
+         length = 0;
+   }
+   if (length > 0)
+   {
+      buffer[length] = 0;
+      parse_whois_line(buffer, keys, owners, count);
+   }
+
+   return(0);
+}
+
+/* The calling thread's DNS resolver, set up from /etc/resolv.conf the first time. */
+static res_state get_dns_state()
+{
+   if (!dns_ready)
+   {
+      memset(&dns_state, 0, sizeof(dns_state));
+      if (res_ninit(&dns_state) < 0)
+         return(NULL);
+      dns_ready = 1;
+   }
+
+   return(&dns_state);
+}
+
+/*
+   Function: query_dns
+   Purpose : Asks the DNS for the records of a type for a name.
+   Input   : Name, record type, buffer for the answer and its size.
+   Return  : Length of the answer, 0 if the DNS answered that there are
+             no such records, -1 if the DNS could not be asked.
+*/
+static int query_dns(const char *name, int type, unsigned char *answer, int size)
+{
+   res_state state;
+   int length;
+
+   if ((state = get_dns_state()) == NULL)
+      return(-1);
+
+   if ((length = res_nquery(state, name, ns_c_in, type, answer, size)) > 0)
+      return(length);
+
+   return(((state->res_h_errno == HOST_NOT_FOUND) || (state->res_h_errno == NO_DATA)) ? 0 : -1);
+}
+
+/*
+   Function: find_whois_server
+   Purpose : Looks up the address of the whois server, IPv4 first.
+   Input   : Socket address to fill in and a pointer for its length.
+   Return  : 0 on success, -1 if the DNS could not be asked or has no
+             address.
+*/
+static int find_whois_server(struct sockaddr_storage *sa, socklen_t *sa_len)
+{
+   unsigned char answer[NS_PACKETSZ];
+   ns_msg msg;
+   ns_rr rr;
+   int types[2] = { ns_t_a, ns_t_aaaa };
+   int length, i, t;
+
+   memset(sa, 0, sizeof(struct sockaddr_storage));
+
+   for (t = 0; t < 2; t++)
+   {
+      if ((length = query_dns(PV_WHOIS_SERVER, types[t], answer, sizeof(answer))) <= 0)
+         continue;
+      if (ns_initparse(answer, length, &msg) < 0)
+         continue;
+      for (i = 0; i < ns_msg_count(msg, ns_s_an); i++)
+      {
+         if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+            break;
+         if ((ns_rr_type(rr) == ns_t_a) && (ns_rr_rdlen(rr) == 4))
+         {
+            ((struct sockaddr_in *)sa)->sin_family = AF_INET;
+            ((struct sockaddr_in *)sa)->sin_port = htons(PV_WHOIS_PORT);
+            memcpy(&((struct sockaddr_in *)sa)->sin_addr, ns_rr_rdata(rr), 4);
+            *sa_len = sizeof(struct sockaddr_in);
+            return(0);
+         }
+         if ((ns_rr_type(rr) == ns_t_aaaa) && (ns_rr_rdlen(rr) == 16))
+         {
+            ((struct sockaddr_in6 *)sa)->sin6_family = AF_INET6;
+            ((struct sockaddr_in6 *)sa)->sin6_port = htons(PV_WHOIS_PORT);
+            memcpy(&((struct sockaddr_in6 *)sa)->sin6_addr, ns_rr_rdata(rr), 16);
+            *sa_len = sizeof(struct sockaddr_in6);
+            return(0);
+         }
+      }
+   }
+
+   return(-1);
+}
+
+/*
+   Function: query_whois_owners
+   Purpose : Asks the Team Cymru whois server for the AS, BGP prefix,
+             country and AS name of a batch of addresses, in bulk mode on
+             one connection: "begin", "verbose", one address per line,
+             "end". The reply is a header line then one line per address.
+   Input   : The addresses (keys), the owners to fill in and how many.
+   Return  : 0 if the server answered, -1 if it could not be asked or
+             the answer was cut short.
+*/
+static int query_whois_owners(pv_ip_owner_t **keys, pv_ip_owner_t **owners, int count)
+{
+   struct sockaddr_storage sa;
+   socklen_t sa_len;
+   struct timeval tv;
+   char request[16 + PV_WHOIS_BATCH * (INET6_ADDRSTRLEN + 1)];
+   int sockfd = -1;
+   int length, res, i;
+
+   if (count > PV_WHOIS_BATCH)
+      count = PV_WHOIS_BATCH;
+
+   length = sprintf(request, "begin\nverbose\n");
+   for (i = 0; i < count; i++)
+   {
+      inet_ntop((keys[i]->family == PV_FLOW_IPV6) ? AF_INET6 : AF_INET, keys[i]->addr, request + length, INET6_ADDRSTRLEN);
+      length += strlen(request + length);
+      request[length++] = '\n';
+   }
+   length += sprintf(request + length, "end\n");
+
+   if ((find_whois_server(&sa, &sa_len) < 0) || ((sockfd = socket(sa.ss_family, SOCK_STREAM, 0)) < 0))
+      return(-1);
+
+   tv.tv_sec = PV_WHOIS_TIMEOUT;
+   tv.tv_usec = 0;
+   setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+   if (connect(sockfd, (struct sockaddr *)&sa, sa_len) != 0)
+   {
+      close(sockfd);
+      return(-1);
+   }
+
+   if (send(sockfd, request, length, MSG_NOSIGNAL) != length)
+      res = -1;
+   else
+      res = read_whois_reply(sockfd, keys, owners, count);
+   close(sockfd);
+
+   return(res);
+}
+
+/*
+   Function: find_host_name
+   Purpose : Asks the DNS for the PTR record of an address, the host name
+             is set in the owner if there is one that fits.
+   Input   : Address family, address and the owner to fill in.
+   Return  : 0 if the DNS answered, -1 if it could not be asked.
+*/
+static int find_host_name(int family, const uint8_t *addr, pv_ip_owner_t *owner)
+{
+   unsigned char answer[PV_WHOIS_REPLY_SIZE];
+   char name[NS_MAXDNAME];
+   ns_msg msg;
+   ns_rr rr;
+   int length = 0;
+   int i;
+
+   if (family == PV_FLOW_IPV6)
+   {
+      for (i = 15; i >= 0; i--)
+         length += sprintf(name + length, "%x.%x.", addr[i] & 0x0f, addr[i] >> 4);
+      strcpy(name + length, "ip6.arpa");
+   }
+   else
+   {
+      sprintf(name, "%u.%u.%u.%u.in-addr.arpa", addr[3], addr[2], addr[1], addr[0]);
+   }
+
+   if ((length = query_dns(name, ns_t_ptr, answer, sizeof(answer))) <= 0)
+      return(length);
+   if (ns_initparse(answer, length, &msg) < 0)
+      return(0);
+
+   for (i = 0; i < ns_msg_count(msg, ns_s_an); i++)
+   {
+      if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+         break;
+      if ((ns_rr_type(rr) == ns_t_ptr) && (dn_expand(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr), name, sizeof(name)) >= 0) &&
+          (strlen(name) < PV_HOST_NAME_STR))
+      {
+         strcpy(owner->host_name, name);
+         owner->flags |= PV_HOST_FOUND;
+         break;
+      }
+   }
+
+   return(0);
+}
+
+/*
+   Function: owner_lookup_thread
+   Purpose : A lookup worker. Takes up to PV_WHOIS_BATCH queued requests
+             at a time, the default resolver looks up all their owners in
+             one bulk whois query, another resolver is called for each.
+*/
+static void *owner_lookup_thread(void *arg)
+{
+   pv_owner_request_t *requests[PV_WHOIS_BATCH];
+   pv_owner_request_t *request;
+   pv_owner_entry_t *prefix;
+   pv_ip_owner_t found[PV_WHOIS_BATCH];
+   pv_ip_owner_t *keys[PV_WHOIS_BATCH];
+   pv_ip_owner_t *owners[PV_WHOIS_BATCH];
+   int errors[PV_WHOIS_BATCH];
+   int count, wanted, i;
+   time_t now;
+
+   while (1)
+   {
+      pthread_mutex_lock(&owner_lock);
+      while (owner_queue_head == NULL)
+         pthread_cond_wait(&owner_ready, &owner_lock);
+      now = time(NULL);
+      for (count = 0; (count < PV_WHOIS_BATCH) && (owner_queue_head != NULL); count++)
+      {
+         request = owner_queue_head;
+         owner_queue_head = request->next;
+         owner_queue_count--;
+         /* A lookup queued before the prefix of its owner was found only needs the host name. */
+         if ((request->wanted & PV_OWNER_FOUND) && ((prefix = find_owner_prefix(request->key.family, request->key.addr, now)) != NULL) &&
+             (prefix->owner.flags & PV_OWNER_FOUND))
+         {
+            request->wanted &= ~PV_OWNER_FOUND;
+         }
+         requests[count] = request;
+      }
+      if (owner_queue_head == NULL)
+         owner_queue_tail = NULL;
+      pthread_mutex_unlock(&owner_lock);
+
+      memset(found, 0, count * sizeof(pv_ip_owner_t));
+      memset(errors, 0, sizeof(errors));
+
+      if (owner_resolver == resolve_ip_owner)
+      {
+         for (i = 0, wanted = 0; i < count; i++)
+         {
+            if ((requests[i]->wanted & PV_HOST_FOUND) && (find_host_name(requests[i]->key.family, requests[i]->key.addr, &found[i]) < 0))
+               errors[i] = 1;
+            if (requests[i]->wanted & PV_OWNER_FOUND)
+            {
+               keys[wanted] = &requests[i]->key;
+               owners[wanted++] = &found[i];
+            }
+         }
+         /* The whois server could not be asked, none of the owners in the batch are known to be missing. */
+         if ((wanted > 0) && (query_whois_owners(keys, owners, wanted) < 0))
+         {
+            for (i = 0; i < count; i++)
+            {
+               if (requests[i]->wanted & PV_OWNER_FOUND)
+                  errors[i] = 1;
+            }
+         }
+         for (i = 0; i < count; i++)
+         {
+            if (errors[i])
+               store_ip_owner(requests[i], &found[i], PV_RESOLVE_ERROR);
+            else
+               store_ip_owner(requests[i], &found[i], (found[i].flags & (PV_OWNER_FOUND | PV_HOST_FOUND)) ? 0 : -1);
+         }
+      }
+      else
+      {
+         for (i = 0; i < count; i++)
+            store_ip_owner(requests[i], &found[i],
+                           owner_resolver(owner_resolver_user, requests[i]->key.family, requests[i]->key.addr, requests[i]->wanted, &found[i]));
+      }
+   }
+
+   return(NULL);
+}
+
+/*
+   Function: start_ip_enrichment
+   Purpose : Opens the cache file and starts the lookup workers.
+   Input   : Cache file name, NULL for a memory cache only, and the
+             number of workers.
+   Return  : 0 on success, -1 on error.
+*/
+int start_ip_enrichment(const char *cache_file, int workers)
+{
+   pthread_t thread;
+   int i;
+
+   if ((cache_file != NULL) && (open_owner_file(cache_file) < 0))
+      print_log_entry("start_ip_enrichment() <WARNING> Whois cache kept in memory only.\n");
+
+   for (i = 0; i < workers; i++)
+   {
+      if (pthread_create(&thread, NULL, owner_lookup_thread, NULL) != 0)
+      {
+         print_log_entry("start_ip_enrichment() <ERROR> Could not create lookup thread.\n");
+         return(-1);
+      }
+      pthread_detach(thread);
+   }
+
+   owner_started = 1;
+
+   return(0);
+}
+
+/* Puts in the resolver the workers use, NULL for the default. Call before start_ip_enrichment(). */
+void set_ip_resolver(pv_resolver_func func, void *user)
+{
+   owner_resolver = (func != NULL) ? func : resolve_ip_owner;
+   owner_resolver_user = user;
+}
+
+void get_ip_owner_stats(pv_owner_stats_t *stats)
+{
+   pthread_mutex_lock(&owner_lock);
+   *stats = owner_stats;
+   stats->cached = owner_cache_count;
+   stats->waiting = owner_queue_count;
+   pthread_mutex_unlock(&owner_lock);
+}
+
+/* Logs the cache counts, nothing if the lookups were never started. */
+void log_ip_owner_stats()
+{
+   pv_owner_stats_t stats;
+   char msg[PV_MAX_INPUT_STR];
+
+   if (!owner_started)
+      return;
+
+   get_ip_owner_stats(&stats);
+   sprintf(msg, "log_ip_owner_stats() <INFO> Owners: %lu hits (%lu from file), %lu prefix hits, %lu negative hits, %lu misses, %lu lookups (%lu found nothing, %lu could not be made), %lu cached, %lu waiting, %lu not queued.\n",
+           stats.hits, stats.file_hits, stats.prefix_hits, stats.negative_hits, stats.misses, stats.lookups, stats.failures,
+           stats.errors, stats.cached, stats.waiting, stats.queue_full);
+   print_log_entry(msg);
+}
+
+/*
+   Function: resolve_ip_owner
+   Purpose : The default resolver, the host name from the DNS and the
+             owner from the whois server.
+   Input   : Unused, address family, address, what is wanted
+             (PV_OWNER_FOUND and PV_HOST_FOUND) and the owner to fill in,
+             with the owner's prefix in addr and prefix_len if known.
+   Return  : 0 if anything was found, -1 if not, PV_RESOLVE_ERROR if the
+             DNS or the whois server could not be asked.
+*/
+int resolve_ip_owner(void *user, int family, const uint8_t *addr, int wanted, pv_ip_owner_t *owner)
+{
+   pv_ip_owner_t key;
+   pv_ip_owner_t *keys[1];
+
+   if ((wanted & PV_HOST_FOUND) && (find_host_name(family, addr, owner) < 0))
+      return(PV_RESOLVE_ERROR);
+
+   if (wanted & PV_OWNER_FOUND)
+   {
+      set_owner_key(&key, family, addr, get_address_bits(family));
+      keys[0] = &key;
+      if (query_whois_owners(keys, &owner, 1) < 0)
+         return(PV_RESOLVE_ERROR);
+   }
+
+   return((owner->flags & (PV_OWNER_FOUND | PV_HOST_FOUND)) ? 0 : -1);
+}
+
+/*
+   Function: check_resolver
+   Purpose : The table resolver of check_ip_enrichment(). 192.0.2.0/24
+             belongs to AS 64496 and 192.0.2.1 is check.example.net,
+             198.51.100.0/24 has no owner and 203.0.113.0/24 cannot be
+             looked up.
+*/
+static int check_resolver(void *user, int family, const uint8_t *addr, int wanted, pv_ip_owner_t *owner)
+{
+   if ((family != PV_FLOW_IPV4) || (addr[0] == 198))
+      return(-1);
+   if (addr[0] == 203)
+      return(PV_RESOLVE_ERROR);
+
+   if (wanted & PV_OWNER_FOUND)
+   {
+      owner->asn = 64496;
+      strcpy(owner->country, "ZZ");
+      strcpy(owner->owner, "PIVOTAL-CHECK");
+      memcpy(owner->addr, addr, 3);
+      owner->prefix_len = 24;
+      owner->flags |= PV_OWNER_FOUND;
+   }
+   if ((wanted & PV_HOST_FOUND) && (addr[3] == 1))
+   {
+      strcpy(owner->host_name, "check.example.net");
+      owner->flags |= PV_HOST_FOUND;
+   }
+
+   return(owner->flags ? 0 : -1);
+}
+
+/* Waits for the lookup workers to have made and failed a number of lookups, -1 after PV_WHOIS_TIMEOUT seconds. */
+static int wait_owner_lookups(unsigned long lookups, unsigned long errors)
+{
+   pv_owner_stats_t stats;
+   struct timespec pause;
+   int i;
+
+   pause.tv_sec = 0;
+   pause.tv_nsec = 10000000L;
+
+   for (i = 0; i < PV_WHOIS_TIMEOUT * 100; i++)
+   {
+      get_ip_owner_stats(&stats);
+      if ((stats.lookups >= lookups) && (stats.errors >= errors))
+         return(0);
+      nanosleep(&pause, NULL);
+   }
+
+   return(-1);
+}
+
+/* Prints and logs the result of one check. */
+static int report_owner_check(const char *check, int passed)
+{
+   printf("IP owner check: %-40s %s\n", check, passed ? "ok" : "FAILED");
+   if (!passed)
+      sprint_log_entry("check_ip_enrichment() <ERROR> Check failed", (char *)check);
+
+   return(passed ? 0 : -1);
+}
+
+/*
+   Function: check_ip_enrichment
+   Purpose : Checks the owner caches with the table resolver
+             check_resolver() put in by set_ip_resolver(), without the
+             network or a cache file: an owner found is cached with its
+             prefix, an address without an owner is cached as negative
+             and a lookup that could not be made is not cached. Call
+             instead of start_ip_enrichment(), the lookups stay started.
+   Return  : 0 if every check passed, -1 if not.
+*/
+int check_ip_enrichment()
+{
+   static const uint8_t known[4] = { 192, 0, 2, 1 };
+   static const uint8_t in_prefix[4] = { 192, 0, 2, 77 };
+   static const uint8_t unknown[4] = { 198, 51, 100, 1 };
+   static const uint8_t failing[4] = { 203, 0, 113, 1 };
+   pv_ip_owner_t owner;
+   pv_owner_stats_t before, after;
+   int res = 0;
+
+   set_ip_resolver(check_resolver, NULL);
+   if (start_ip_enrichment(NULL, 1) < 0)
+      return(-1);
+
+   find_ip_owner(PV_FLOW_IPV4, known, &owner);
+   find_ip_owner(PV_FLOW_IPV4, unknown, &owner);
+   find_ip_owner(PV_FLOW_IPV4, failing, &owner);
+   if (report_owner_check("lookups made", wait_owner_lookups(2, 1) == 0) < 0)
+      return(-1);
+
+   res |= report_owner_check("owner and host name cached",
+                             (find_ip_owner(PV_FLOW_IPV4, known, &owner) == 0) && (owner.asn == 64496) &&
+                             (owner.flags & PV_HOST_FOUND) && (strcmp(owner.host_name, "check.example.net") == 0));
+
+   res |= report_owner_check("owner prefix cached",
+                             (find_ip_owner(PV_FLOW_IPV4, in_prefix, &owner) == 0) && (owner.flags & PV_OWNER_FOUND) &&
+                             (strcmp(owner.owner, "PIVOTAL-CHECK") == 0));
+
+   get_ip_owner_stats(&before);
+   find_ip_owner(PV_FLOW_IPV4, unknown, &owner);
+   get_ip_owner_stats(&after);
+   res |= report_owner_check("missing owner cached as negative",
+                             (owner.flags == PV_OWNER_NEGATIVE) && (after.negative_hits == before.negative_hits + 1));
+
+   /* Not cached, so asking again queues a second lookup. */
+   res |= report_owner_check("failed lookup not cached",
+                             (find_ip_owner(PV_FLOW_IPV4, failing, &owner) < 0) && (owner.flags == 0) && (wait_owner_lookups(0, 2) == 0));
+
+   return(res);
+}